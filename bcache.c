@@ -0,0 +1,659 @@
+#include "bcache.h"
+#include "fiber.h"
+
+//a sequential reader: the block it is expected to read next and how far ahead of it we have read
+struct stream
+{
+    bool used;
+    uint32_t dev;
+    uint32_t next;              // block that continues the sequence
+    uint32_t ra_end;            // last block already requested by read-ahead
+    uint32_t window;            // read-ahead window in blocks, 0 until the stream is sequential
+    uint32_t last_use;          // for replacing the least recently used stream
+};
+
+static struct buf *hash_table[BCACHE_HASH_SIZE];
+static struct buf *lru_head;        // most recently used
+static struct buf *lru_tail;        // eviction candidates are taken from this end
+static struct buf *buf_pool;        // unused buf structs, chained through hash_next
+static struct wait_queue free_wq;   // tasks waiting for a buffer to become reusable
+static struct stream streams[BCACHE_STREAMS];
+static uint32_t stream_clock;
+static uint32_t limit = BCACHE_DEFAULT_BUFS;
+static struct bcache_stats stats;
+
+static uint32_t hash(uint32_t dev, uint32_t blockno)
+{
+    return (blockno * 2654435761u + dev) & (BCACHE_HASH_SIZE - 1);
+}
+
+static struct buf *lookup(uint32_t dev, uint32_t blockno)
+{
+    for(struct buf *b = hash_table[hash(dev, blockno)]; b; b = b->hash_next)
+    {
+        if(b->dev == dev && b->blockno == blockno)
+        {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static void hash_insert(struct buf *b)
+{
+    uint32_t h = hash(b->dev, b->blockno);
+    b->hash_next = hash_table[h];
+    hash_table[h] = b;
+}
+
+//unlink b from its bucket, if it is hashed at all
+static void hash_remove(struct buf *b)
+{
+    struct buf **pp = &hash_table[hash(b->dev, b->blockno)];
+    while(*pp && *pp != b)
+    {
+        pp = &(*pp)->hash_next;
+    }
+    if(*pp)
+    {
+        *pp = b->hash_next;
+    }
+    b->hash_next = NULL;
+}
+
+static void lru_unlink(struct buf *b)
+{
+    if(b->lru_prev)
+    {
+        b->lru_prev->lru_next = b->lru_next;
+    }
+    else
+    {
+        lru_head = b->lru_next;
+    }
+    if(b->lru_next)
+    {
+        b->lru_next->lru_prev = b->lru_prev;
+    }
+    else
+    {
+        lru_tail = b->lru_prev;
+    }
+    b->lru_prev = b->lru_next = NULL;
+}
+
+static void lru_push_front(struct buf *b)
+{
+    b->lru_prev = NULL;
+    b->lru_next = lru_head;
+    if(lru_head)
+    {
+        lru_head->lru_prev = b;
+    }
+    else
+    {
+        lru_tail = b;
+    }
+    lru_head = b;
+}
+
+static void lru_push_back(struct buf *b)
+{
+    b->lru_next = NULL;
+    b->lru_prev = lru_tail;
+    if(lru_tail)
+    {
+        lru_tail->lru_next = b;
+    }
+    else
+    {
+        lru_head = b;
+    }
+    lru_tail = b;
+}
+
+//allocate a new buffer with its data page, NULL if the page allocator has nothing left
+static struct buf *new_buf(void)
+{
+    if(!buf_pool)
+    {
+        uint8_t *page = alloc_pages(1);
+        if(!page)
+        {
+            return NULL;
+        }
+        for(uint32_t off = 0; off + sizeof(struct buf) <= PAGE_SIZE; off += sizeof(struct buf))
+        {
+            struct buf *b = (struct buf *)(page + off);
+            b->hash_next = buf_pool;
+            buf_pool = b;
+        }
+    }
+
+    uint8_t *data = alloc_pages(1);
+    if(!data)
+    {
+        return NULL;
+    }
+    struct buf *b = buf_pool;
+    buf_pool = b->hash_next;
+    memset(b, 0, sizeof(*b));
+    b->data = data;
+    stats.nbufs++;
+    return b;
+}
+
+//take an idle, clean buffer out of the cache, or allocate one while under the limit. Never sleeps.
+static struct buf *get_free_buf_nowait(void)
+{
+    if(stats.nbufs < limit)
+    {
+        struct buf *b = new_buf();
+        if(b)
+        {
+            return b;
+        }
+    }
+
+    for(struct buf *b = lru_tail; b; b = b->lru_prev)
+    {
+        if(b->refcnt == 0 && !(b->flags & (BUF_IO | BUF_DIRTY)))
+        {
+            if(b->flags & BUF_READAHEAD)
+            {
+                stats.ra_wasted++;
+            }
+            hash_remove(b);
+            lru_unlink(b);
+            b->flags = 0;
+            stats.evictions++;
+            return b;
+        }
+    }
+    return NULL;
+}
+
+//interrupt context: a read or write-back of a buffer finished
+static void bcache_io_done(struct blk_request *req)
+{
+    struct buf *b = req->private;
+    if(req->type == BLK_READ)
+    {
+        if(req->status == BLK_OK)
+        {
+            b->flags |= BUF_VALID;
+        }
+        else
+        {
+            //forget the block so the next bread() of it reads it again, and reuse the buffer first
+            hash_remove(b);
+            lru_unlink(b);
+            lru_push_back(b);
+        }
+    }
+    else if(req->status == BLK_OK)
+    {
+        b->flags &= ~BUF_DIRTY;
+        stats.writebacks++;
+    }
+    b->flags &= ~BUF_IO;
+    wait_queue_wake_all(&b->wq);
+    wait_queue_wake_all(&free_wq);
+}
+
+static void prepare_io(struct buf *b, uint32_t type)
+{
+    struct blk_request *req = &b->req;
+    memset(req, 0, sizeof(*req));
+    req->type = type;
+    req->sector = (uint64_t)b->blockno * BCACHE_SECTORS;
+    req->sg[0].addr = b->data;
+    req->sg[0].len = BCACHE_BLOCK_SIZE;
+    req->nsg = 1;
+    req->complete = bcache_io_done;
+    req->private = b;
+    b->flags |= BUF_IO;
+}
+
+/*
+    Start writing back up to max dirty buffers, oldest first, as one batch (one doorbell).
+    Parameters:
+        int max: largest batch
+        bool busy_too: also write buffers that are still referenced
+    returns:
+        int: number of buffers submitted
+*/
+static int submit_writeback(int max, bool busy_too)
+{
+    struct blk_request *batch[BCACHE_WB_BATCH];
+    int n = 0;
+    if(max > BCACHE_WB_BATCH)
+    {
+        max = BCACHE_WB_BATCH;
+    }
+
+    for(struct buf *b = lru_tail; b && n < max; b = b->lru_prev)
+    {
+        if((b->flags & BUF_DIRTY) && !(b->flags & BUF_IO) && (busy_too || b->refcnt == 0))
+        {
+            prepare_io(b, BLK_WRITE);
+            batch[n++] = &b->req;
+        }
+    }
+
+    if(n)
+    {
+        stats.wb_batches++;
+        blk_submit(batch, n);
+    }
+    return n;
+}
+
+//get a buffer for a new block, writing back dirty buffers or sleeping until one is released if needed
+static struct buf *get_free_buf(void)
+{
+    while(1)
+    {
+        struct buf *b = get_free_buf_nowait();
+        if(b)
+        {
+            return b;
+        }
+        //every idle buffer is dirty: clean a batch of them. Either way wait for I/O or a brelse().
+        submit_writeback(BCACHE_WB_BATCH, false);
+        wait_queue_sleep(&free_wq);
+    }
+}
+
+//give b the identity (dev, blockno) and queue a read for it
+static struct blk_request *start_read(struct buf *b, uint32_t dev, uint32_t blockno)
+{
+    b->dev = dev;
+    b->blockno = blockno;
+    b->flags = 0;
+    hash_insert(b);
+    lru_push_front(b);
+    prepare_io(b, BLK_READ);
+    return &b->req;
+}
+
+/*
+    Track sequential streams and queue read-ahead for them. A read of the block that follows the
+    previous read of a stream doubles the stream's window (BCACHE_RA_MIN up to BCACHE_RA_MAX);
+    anything else starts a new stream without read-ahead.
+    Parameters:
+        uint32_t dev, blockno: the block being read
+        struct blk_request **batch: read-ahead requests are appended here
+        int n: requests already in batch
+    returns:
+        int: requests in batch
+*/
+static int readahead(uint32_t dev, uint32_t blockno, struct blk_request **batch, int n)
+{
+    struct stream *s = NULL;
+    struct stream *victim = &streams[0];
+    for(int i = 0; i < BCACHE_STREAMS; i++)
+    {
+        struct stream *t = &streams[i];
+        if(t->used && t->dev == dev && t->next == blockno)
+        {
+            s = t;
+            break;
+        }
+        if(!t->used || t->last_use < victim->last_use)
+        {
+            victim = t;
+        }
+    }
+
+    if(s)
+    {
+        s->window = s->window ? s->window * 2 : BCACHE_RA_MIN;
+        if(s->window > BCACHE_RA_MAX)
+        {
+            s->window = BCACHE_RA_MAX;
+        }
+    }
+    else
+    {
+        s = victim;
+        s->used = true;
+        s->dev = dev;
+        s->window = 0;
+        s->ra_end = blockno;
+    }
+    s->next = blockno + 1;
+    s->last_use = ++stream_clock;
+    if(!s->window)
+    {
+        return n;
+    }
+
+    uint32_t nblocks = blk_capacity() / BCACHE_SECTORS;
+    if(nblocks == 0)
+    {
+        return n;
+    }
+    uint32_t start = s->ra_end >= blockno ? s->ra_end + 1 : blockno + 1;
+    uint32_t end = blockno + s->window;
+    if(end >= nblocks)
+    {
+        end = nblocks - 1;
+    }
+
+    for(uint32_t blk = start; blk <= end; blk++)
+    {
+        if(!lookup(dev, blk))
+        {
+            struct buf *b = get_free_buf_nowait();
+            if(!b)
+            {
+                break;      // no idle buffer: do not evict on behalf of read-ahead
+            }
+            batch[n++] = start_read(b, dev, blk);
+            b->flags |= BUF_READAHEAD;
+            stats.ra_issued++;
+        }
+        s->ra_end = blk;
+    }
+    return n;
+}
+
+/*
+    Return a referenced buffer holding block blockno of dev, reading it from the disk if needed.
+    The read of a missing block and the read-ahead it triggers go to the device as one batch.
+    Parameters:
+        uint32_t dev: device number (there is a single virtio-blk disk, device 0)
+        uint32_t blockno: block number, in BCACHE_BLOCK_SIZE units
+    returns:
+        struct buf *: the buffer, to be released with brelse(); NULL on an I/O error
+*/
+struct buf *bread(uint32_t dev, uint32_t blockno)
+{
+    struct blk_request *batch[1 + BCACHE_RA_MAX];
+    int n = 0;
+    uint32_t sie = irq_save();
+
+    struct buf *b = lookup(dev, blockno);
+    if(!b)
+    {
+        struct buf *fresh = get_free_buf();
+        //get_free_buf() may have slept while another task brought the block in
+        b = lookup(dev, blockno);
+        if(b)
+        {
+            lru_push_back(fresh);   // unhashed and idle: first to be reused
+            stats.hits++;
+        }
+        else
+        {
+            b = fresh;
+            batch[n++] = start_read(b, dev, blockno);
+            stats.misses++;
+        }
+    }
+    else
+    {
+        lru_unlink(b);
+        lru_push_front(b);
+        stats.hits++;
+        if(b->flags & BUF_READAHEAD)
+        {
+            stats.ra_hits++;
+        }
+    }
+    if(!(b->flags & (BUF_VALID | BUF_IO)))
+    {
+        prepare_io(b, BLK_READ);    // from bget() and released before it was filled
+        batch[n++] = &b->req;
+    }
+    b->flags &= ~BUF_READAHEAD;
+    b->refcnt++;
+
+    n = readahead(dev, blockno, batch, n);
+    if(n)
+    {
+        blk_submit(batch, n);
+    }
+
+    while(b->flags & BUF_IO)
+    {
+        wait_queue_sleep(&b->wq);
+    }
+    if(!(b->flags & BUF_VALID))
+    {
+        b->refcnt--;
+        irq_restore(sie);
+        return NULL;
+    }
+    irq_restore(sie);
+    return b;
+}
+
+/*
+    Return a referenced buffer for block blockno of dev without reading it, for a caller that overwrites the whole
+    block. The data is undefined until the caller fills it and calls bwrite() or bcache_give_page(); it must not
+    sleep in between, and a buffer released unfilled is read from the disk by the next bread().
+    returns:
+        struct buf *: the buffer, to be released with brelse()
+*/
+struct buf *bget(uint32_t dev, uint32_t blockno)
+{
+    uint32_t sie = irq_save();
+    struct buf *b = lookup(dev, blockno);
+    if(!b)
+    {
+        struct buf *fresh = get_free_buf();
+        b = lookup(dev, blockno);
+        if(b)
+        {
+            lru_push_back(fresh);
+        }
+        else
+        {
+            b = fresh;
+            b->dev = dev;
+            b->blockno = blockno;
+            b->flags = 0;
+            hash_insert(b);
+            lru_push_front(b);
+        }
+    }
+    if(b->lru_prev)
+    {
+        lru_unlink(b);
+        lru_push_front(b);
+    }
+    b->flags &= ~BUF_READAHEAD;
+    b->refcnt++;
+    while(b->flags & BUF_IO)
+    {
+        wait_queue_sleep(&b->wq);   // a read completing later would overwrite what the caller puts in
+    }
+    irq_restore(sie);
+    return b;
+}
+
+//mark a buffer modified. It is written back in a batch on eviction or bcache_sync().
+void bwrite(struct buf *b)
+{
+    uint32_t sie = irq_save();
+    while(b->flags & BUF_IO)
+    {
+        wait_queue_sleep(&b->wq);   // a write-back in flight would clear BUF_DIRTY when it completes
+    }
+    b->flags |= BUF_DIRTY | BUF_VALID;
+    irq_restore(sie);
+}
+
+/*
+    Make a whole page of new contents the data of b without copying it, and mark b modified. The old page is
+    freed, so this needs the only reference to b and no I/O in flight on it.
+    returns:
+        bool: false if b is shared or busy, the caller copies instead
+*/
+bool bcache_give_page(struct buf *b, uint8_t *page)
+{
+    if(b->refcnt != 1 || (b->flags & BUF_IO))
+    {
+        return false;
+    }
+    free(b->data);
+    b->data = page;
+    b->flags |= BUF_DIRTY | BUF_VALID;
+    return true;
+}
+
+//drop a reference taken by bread()
+void brelse(struct buf *b)
+{
+    uint32_t sie = irq_save();
+    b->refcnt--;
+    if(b->refcnt == 0)
+    {
+        wait_queue_wake_all(&free_wq);
+    }
+    irq_restore(sie);
+}
+
+//write every dirty buffer back in batches and wait until all of them are on the disk
+void bcache_sync(void)
+{
+    uint32_t sie = irq_save();
+    while(submit_writeback(BCACHE_WB_BATCH, true))
+    {
+    }
+
+restart:
+    for(struct buf *b = lru_head; b; b = b->lru_next)
+    {
+        if(b->flags & BUF_IO)
+        {
+            wait_queue_sleep(&b->wq);
+            goto restart;   // the list may have changed while we slept
+        }
+    }
+    irq_restore(sie);
+}
+
+/*
+    Give idle clean buffers back to the page allocator, least recently used first.
+    Parameters:
+        uint32_t nbufs: buffers to release
+    returns:
+        uint32_t: buffers actually released
+*/
+uint32_t bcache_shrink(uint32_t nbufs)
+{
+    uint32_t freed = 0;
+    uint32_t sie = irq_save();
+    struct buf *b = lru_tail;
+    while(b && freed < nbufs)
+    {
+        struct buf *prev = b->lru_prev;
+        if(b->refcnt == 0 && !(b->flags & (BUF_IO | BUF_DIRTY)))
+        {
+            hash_remove(b);
+            lru_unlink(b);
+            free(b->data);
+            b->hash_next = buf_pool;
+            buf_pool = b;
+            stats.nbufs--;
+            freed++;
+        }
+        b = prev;
+    }
+    irq_restore(sie);
+    return freed;
+}
+
+//set the maximum cache size in blocks, shrinking the cache if it is above it
+void bcache_set_limit(uint32_t nbufs)
+{
+    limit = nbufs;
+    if(stats.nbufs > limit)
+    {
+        bcache_shrink(stats.nbufs - limit);
+    }
+}
+
+void bcache_get_stats(struct bcache_stats *out)
+{
+    uint32_t sie = irq_save();
+    *out = stats;
+    out->limit = limit;
+    irq_restore(sie);
+}
+
+void bcache_dump_stats(void)
+{
+    struct bcache_stats s;
+    bcache_get_stats(&s);
+    printf("bcache: %d/%d buffers (%d KB)\n", s.nbufs, s.limit, s.nbufs * (BCACHE_BLOCK_SIZE / 1024));
+    printf("  hits=%d misses=%d evictions=%d\n", s.hits, s.misses, s.evictions);
+    printf("  readahead: issued=%d hits=%d wasted=%d\n", s.ra_issued, s.ra_hits, s.ra_wasted);
+    printf("  writeback: blocks=%d batches=%d\n", s.writebacks, s.wb_batches);
+}
+
+#ifdef BENCHMARK
+static uint32_t bench_nblocks;
+
+//a fiber of the concurrent pass: every BCACHE_BENCH_FIBERS-th block from its own first one
+static void bench_reader(void *arg)
+{
+    for(uint32_t blk = (uint32_t)arg; blk < bench_nblocks; blk += BCACHE_BENCH_FIBERS)
+    {
+        struct buf *b = bread(0, blk);
+        if(!b)
+        {
+            PANIC("bcache bench: read error at block %d", blk);
+        }
+        brelse(b);
+    }
+}
+
+//read the first blocks of the disk sequentially through the cache, cold then warm, then cold again from fibers
+void bcache_bench(void)
+{
+    uint32_t nblocks = blk_capacity() / BCACHE_SECTORS;
+    if(nblocks > limit)
+    {
+        nblocks = limit;
+    }
+
+    for(int pass = 0; pass < 2; pass++)
+    {
+        uint64_t start = read_time();
+        for(uint32_t blk = 0; blk < nblocks; blk++)
+        {
+            struct buf *b = bread(0, blk);
+            if(!b)
+            {
+                PANIC("bcache bench: read error at block %d", blk);
+            }
+            brelse(b);
+        }
+        uint32_t ms = (uint32_t)(read_time() - start) / (timebase_freq / 1000);
+        printf("bcache bench: %s pass, %d blocks in %d ms\n", pass ? "warm" : "cold", nblocks, ms);
+    }
+
+    //cold again, from one task running fibers: each sleeps in bread() on its own block, so several reads are in flight
+    bcache_shrink(stats.nbufs);
+    bench_nblocks = nblocks;
+    struct fiber_sched sched;
+    fiber_sched_init(&sched);
+    uint64_t start = read_time();
+    for(uint32_t i = 0; i < BCACHE_BENCH_FIBERS; i++)
+    {
+        if(!fiber_create(bench_reader, (void *)i))
+        {
+            PANIC("bcache bench: no fiber stack");
+        }
+    }
+    fiber_join_all();
+    fiber_sched_exit();
+    uint32_t ms = (uint32_t)(read_time() - start) / (timebase_freq / 1000);
+    printf("bcache bench: cold pass with %d fibers, %d blocks in %d ms\n", BCACHE_BENCH_FIBERS, nblocks, ms);
+    bcache_dump_stats();
+}
+#endif
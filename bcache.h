@@ -0,0 +1,66 @@
+#pragma once
+#include "kernel.h"
+#include "virtio.h"
+
+/*
+    Block buffer cache. Blocks are PAGE_SIZE bytes and each cached block owns one page from alloc_pages().
+    Buffers are found through a hash table keyed by (device, block) and recycled in LRU order.
+    Dirty buffers are written back in batches, and sequential readers get an adaptive read-ahead window.
+*/
+#define BCACHE_BLOCK_SIZE   PAGE_SIZE
+#define BCACHE_SECTORS      (BCACHE_BLOCK_SIZE / SECTOR_SIZE)  // sectors per block
+#define BCACHE_HASH_SIZE    256         // hash buckets, power of 2
+#define BCACHE_DEFAULT_BUFS 1024        // default cache size in blocks (4MB of the free RAM)
+#define BCACHE_WB_BATCH     16          // dirty buffers written back per doorbell
+#define BCACHE_STREAMS      8           // sequential streams tracked for read-ahead
+#define BCACHE_RA_MIN       4           // read-ahead window once a stream is detected, in blocks
+#define BCACHE_RA_MAX       64          // largest read-ahead window
+#define BCACHE_BENCH_FIBERS 8           // concurrent readers in the fiber pass of bcache_bench()
+
+#define BUF_VALID           (1 << 0)    // data matches the disk or is newer
+#define BUF_DIRTY           (1 << 1)    // data must be written back before the buffer is reused
+#define BUF_IO              (1 << 2)    // a read or write-back is in flight
+#define BUF_READAHEAD       (1 << 3)    // brought in by read-ahead and not used yet
+
+struct buf
+{
+    uint32_t dev;
+    uint32_t blockno;
+    int flags;                  // BUF_*
+    int refcnt;                 // bread() references not yet released with brelse()
+    uint8_t *data;              // BCACHE_BLOCK_SIZE bytes
+    struct buf *hash_next;      // bucket chain
+    struct buf *lru_prev;       // LRU list, most recently used first
+    struct buf *lru_next;
+    struct wait_queue wq;       // tasks waiting for BUF_IO to clear
+    struct blk_request req;     // request used for this buffer's I/O
+};
+
+//counters for sizing the cache against the free RAM budget
+struct bcache_stats
+{
+    uint32_t hits;              // bread() found a valid buffer
+    uint32_t misses;            // bread() had to go to the device
+    uint32_t ra_issued;         // blocks requested by read-ahead
+    uint32_t ra_hits;           // read-ahead blocks that were later read
+    uint32_t ra_wasted;         // read-ahead blocks evicted without being read
+    uint32_t evictions;         // buffers recycled for another block
+    uint32_t writebacks;        // dirty blocks written
+    uint32_t wb_batches;        // write-back batches submitted
+    uint32_t nbufs;             // buffers currently allocated
+    uint32_t limit;             // maximum number of buffers
+};
+
+struct buf *bread(uint32_t dev, uint32_t blockno);
+struct buf *bget(uint32_t dev, uint32_t blockno);
+void bwrite(struct buf *b);
+void brelse(struct buf *b);
+bool bcache_give_page(struct buf *b, uint8_t *page);
+void bcache_sync(void);
+void bcache_set_limit(uint32_t nbufs);
+uint32_t bcache_shrink(uint32_t nbufs);
+void bcache_get_stats(struct bcache_stats *stats);
+void bcache_dump_stats(void);
+#ifdef BENCHMARK
+void bcache_bench(void);
+#endif
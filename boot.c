@@ -0,0 +1,79 @@
+#include "boot.h"
+
+void sbi_putchar(char ch);
+
+static struct boot_mark marks[BOOT_MARKS_MAX];
+static int nmarks;
+static bool booted;                     // boot_complete() has run
+
+//deferred console output; kept out of .bss so boot does not pay for clearing it
+__attribute__((section(".noinit"))) static char console_buf[BOOT_CONSOLE_SIZE];
+static uint32_t console_len;
+
+void boot_mark_at(const char *name, uint32_t time)
+{
+    if(nmarks < BOOT_MARKS_MAX)
+    {
+        marks[nmarks].name = name;
+        marks[nmarks].time = time;
+        nmarks++;
+    }
+}
+
+//record the end of a boot phase
+void boot_mark(const char *name)
+{
+    if(!booted)
+    {
+        boot_mark_at(name, READ_CSR(time));
+    }
+}
+
+//buffer a character while booting. returns true if it was buffered, false if it should be printed now
+bool boot_console_put(char ch)
+{
+    if(booted)
+    {
+        return false;
+    }
+    if(console_len == BOOT_CONSOLE_SIZE)
+    {
+        boot_console_flush();   // a chatty boot gives up on buffering rather than lose output
+        return false;
+    }
+    console_buf[console_len++] = ch;
+    return true;
+}
+
+//print everything buffered so far and stop buffering, used by boot_complete() and PANIC()
+void boot_console_flush(void)
+{
+    booted = true;
+    for(uint32_t i = 0; i < console_len; i++)
+    {
+        sbi_putchar(console_buf[i]);
+    }
+    console_len = 0;
+}
+
+/*
+    The first user task is about to run: record the final mark, then print the timeline and the output that was held back.
+    Only the first call does anything.
+*/
+void boot_complete(void)
+{
+    if(booted)
+    {
+        return;
+    }
+    boot_mark("first user task");
+    boot_console_flush();
+
+    uint32_t freq_us = ticks_per_us();
+    printf("boot timeline (us since reset, +us for the phase):\n");
+    for(int i = 0; i < nmarks; i++)
+    {
+        uint32_t phase = i ? marks[i].time - marks[i - 1].time : 0;
+        printf("  %d\t+%d\t%s\n", marks[i].time / freq_us, phase / freq_us, marks[i].name);
+    }
+}
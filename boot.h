@@ -0,0 +1,22 @@
+#pragma once
+#include "kernel.h"
+
+/*
+    Boot timeline. boot_mark() timestamps the end of a boot phase; boot_complete() adds the final mark when the
+    first user task is about to run and prints the table. Until then console output is kept in a buffer instead
+    of going out one SBI call per character, and is flushed after the table.
+*/
+#define BOOT_MARKS_MAX      24
+#define BOOT_CONSOLE_SIZE   4096        // bytes of deferred console output, buffering stops when it is full
+
+struct boot_mark
+{
+    const char *name;
+    uint32_t time;                      // low half of the time CSR, boot takes far less than 2^32 ticks
+};
+
+void boot_mark_at(const char *name, uint32_t time);
+void boot_mark(const char *name);
+void boot_complete(void);
+bool boot_console_put(char ch);
+void boot_console_flush(void);
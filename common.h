@@ -28,8 +28,51 @@ typedef uint32_t vaddr_t; // A type representing virtual memory addresses.
 #define va_arg      __builtin_va_arg
 #define PAGE_SIZE 4096
 
+//system call numbers, shared by the kernel and the user library. a7 = number, a0..a3 = arguments, a0 = result
+#define SYS_PUTCHAR     1
+#define SYS_EXIT        2
+#define SYS_YIELD       3
+#define SYS_GETPID      4
+#define SYS_OPEN        5
+#define SYS_READ        6
+#define SYS_CLOSE       7
+#define SYS_MMAP        8
+#define SYS_MUNMAP      9
+#define SYS_URING_SETUP 10
+#define SYS_URING_ENTER 11
+#define SYS_SBRK        12
+#define SYS_WRITE       13
+#define SYS_PIPE        14
+#define SYS_SPLICE      15
+#define SYS_EPOLL_CREATE 16
+#define SYS_EPOLL_CTL   17
+#define SYS_EPOLL_WAIT  18
+#define SYS_PROC_STAT   19
+
+//open flags
+#define O_RDONLY        0
+#define O_WRONLY        1           // pipes and devices only, the ramfs is read-only
+
+//mmap protection
+#define PROT_READ       (1 << 0)
+#define PROT_WRITE      (1 << 1)    // private copy, writes never reach the initrd
+#define PROT_EXEC       (1 << 2)
+#define MAP_ANON        (-1)        // mmap() descriptor for zero filled memory that is not backed by a file
+
+//SYS_PROC_STAT: scheduler view of a process
+struct proc_stat
+{
+    int pid;
+    uint32_t cpu;                   // hart the process runs on, or ran on last
+    int nice;
+    uint32_t blocked;               // 1 while it sleeps
+    uint64_t runtime;               // CPU time in time CSR ticks
+};
+
 void *memset(void *buf, char c, size_t n);
 void *memcpy(void *dst, const void *src, size_t n);
 char *strcpy(char *dst, const char *src);
 int strcmp(const char *s1, const char *s2);
+int memcmp(const void *s1, const void *s2, size_t n);
+size_t strlen(const char *s);
 void printf(const char *fmt, ...);
\ No newline at end of file
@@ -0,0 +1,119 @@
+#include "elf.h"
+#include "ramfs.h"
+#include "vm.h"
+#include "boot.h"
+#include "uring.h"
+
+//check the ELF header of a file in the initrd, NULL if it is not a RISC-V ELF32 executable
+static const Elf32_Ehdr *elf_header(const struct ramfs_file *f)
+{
+    if(f->size < sizeof(Elf32_Ehdr))
+    {
+        return NULL;
+    }
+    const Elf32_Ehdr *eh = (const Elf32_Ehdr *)f->data;
+    if(memcmp(eh->e_ident, "\177ELF", 4) != 0 || eh->e_ident[EI_CLASS] != ELFCLASS32
+        || eh->e_ident[EI_DATA] != ELFDATA2LSB || eh->e_type != ET_EXEC || eh->e_machine != EM_RISCV
+        || eh->e_phentsize != sizeof(Elf32_Phdr) || eh->e_phoff > f->size
+        || (uint32_t)eh->e_phnum * sizeof(Elf32_Phdr) > f->size - eh->e_phoff)
+    {
+        return NULL;
+    }
+    return eh;
+}
+
+/*
+    Replace the address space of the calling process with the program at path and jump to it in user mode.
+    Nothing is copied here: the segments are only recorded, so start-up cost follows the pages the program
+    touches rather than the size of the binary.
+    returns:
+        int: -1 if path is not a loadable program (the caller's address space is left alone), does not return otherwise
+*/
+int exec(const char *path)
+{
+    struct ramfs_file *f = ramfs_lookup(path);
+    const Elf32_Ehdr *eh = f ? elf_header(f) : NULL;
+    if(!eh)
+    {
+        return -1;
+    }
+
+    //build the new regions aside so a bad binary does not destroy the caller
+    struct vm_area vmas[PROC_VMAS];
+    memset(vmas, 0, sizeof(vmas));
+    int n = 0;
+    const Elf32_Phdr *ph = (const Elf32_Phdr *)(f->data + eh->e_phoff);
+    for(int i = 0; i < eh->e_phnum; i++, ph++)
+    {
+        if(ph->p_type != PT_LOAD || ph->p_memsz == 0)
+        {
+            continue;
+        }
+
+        vaddr_t start = ph->p_vaddr & ~(PAGE_SIZE - 1);
+        vaddr_t end = ph->p_vaddr + ph->p_memsz;
+        if(ph->p_filesz > ph->p_memsz || ph->p_offset > f->size || ph->p_filesz > f->size - ph->p_offset
+            || start < USER_BASE || end < ph->p_vaddr || end > MMAP_BASE || n == PROC_VMAS - 1
+            || !user_range_ok((void *)start, end - start))     // a device megapage inside the user range
+        {
+            return -1;
+        }
+        end = align_up(end, PAGE_SIZE);
+        for(int j = 0; j < n; j++)
+        {
+            if(start < vmas[j].end && vmas[j].start < end)
+            {
+                return -1;  // segments sharing a page are not supported
+            }
+        }
+
+        vmas[n].start = start;
+        vmas[n].end = end;
+        vmas[n].flags = ((ph->p_flags & PF_R) ? PAGE_R : 0) | ((ph->p_flags & PF_W) ? PAGE_W : 0)
+            | ((ph->p_flags & PF_X) ? PAGE_X : 0);
+        vmas[n].file_start = ph->p_vaddr;
+        vmas[n].file_size = ph->p_filesz;
+        vmas[n].file_data = f->data + ph->p_offset;
+        n++;
+    }
+    if(n == 0)
+    {
+        return -1;
+    }
+
+    //anonymous stack below the top of user space
+    vmas[n].start = USER_STACK_TOP - USER_STACK_SIZE;
+    vmas[n].end = USER_STACK_TOP;
+    vmas[n].flags = PAGE_R | PAGE_W;
+
+    uring_exit(current_proc);
+    vm_free(current_proc);
+    memcpy(current_proc->vmas, vmas, sizeof(vmas));
+    vm_table_of(current_proc);
+    enter_user(eh->e_entry, USER_STACK_TOP);
+}
+
+//first code of a process created by spawn()
+static void spawn_entry(void)
+{
+    if(exec(current_proc->exec_path) < 0)
+    {
+        boot_complete();
+        printf("exec %s: not a valid program\n", current_proc->exec_path);
+    }
+    process_exit();
+}
+
+/*
+    Create a process running the program at path. A bad program is reported when the process starts.
+    returns:
+        struct process *: the new process
+*/
+struct process *spawn(const char *path)
+{
+    uint32_t sie = irq_save();      // exec_path must be set before the new process can run
+    struct process *proc = create_process(spawn_entry);
+    proc->exec_path = path;
+    irq_restore(sie);
+    return proc;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "kernel.h"
+
+/*
+    ELF32 program loader. exec() only validates the program headers and records each PT_LOAD segment as a
+    vm_area; the pages are filled in by vm_fault() when the program first touches them.
+*/
+#define EI_NIDENT           16
+#define EI_CLASS            4
+#define EI_DATA             5
+#define ELFCLASS32          1
+#define ELFDATA2LSB         1
+#define ET_EXEC             2
+#define EM_RISCV            243
+#define PT_LOAD             1
+#define PF_X                (1 << 0)
+#define PF_W                (1 << 1)
+#define PF_R                (1 << 2)
+
+typedef struct
+{
+    uint8_t e_ident[EI_NIDENT];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint32_t e_entry;
+    uint32_t e_phoff;
+    uint32_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+} __attribute__((packed)) Elf32_Ehdr;
+
+typedef struct
+{
+    uint32_t p_type;
+    uint32_t p_offset;
+    uint32_t p_vaddr;
+    uint32_t p_paddr;
+    uint32_t p_filesz;
+    uint32_t p_memsz;
+    uint32_t p_flags;
+    uint32_t p_align;
+} __attribute__((packed)) Elf32_Phdr;
+
+int exec(const char *path);
+struct process *spawn(const char *path);
@@ -0,0 +1,303 @@
+#include "epoll.h"
+#include "kernel.h"
+#include "pipe.h"
+#include "ramfs.h"
+
+//a descriptor on the interest list of an epoll
+struct epoll_item
+{
+    struct epoll *ep;
+    struct open_file *of;           // the watched descriptor, of the process that owns ep
+    uint32_t events;                // EPOLL* asked for, EPOLLET included
+    uint32_t data;
+    uint32_t seen;                  // events that held when last looked at, EPOLLET queues only on new ones
+    struct epoll_item *of_next;     // next item watching the same descriptor
+    struct epoll_item *src_next;    // next item watching the same pipe
+    struct epoll_item *ready_next;  // ready list, linked both ways so an item leaves it in O(1)
+    struct epoll_item *ready_prev;
+    bool ready;                     // on the ready list
+    bool used;
+};
+
+struct epoll
+{
+    struct epoll_item *ready_head;
+    struct epoll_item *ready_tail;
+    uint32_t nitems;
+    bool used;
+    struct wait_queue wq;           // the task in epoll_collect()
+};
+
+static struct epoll epolls[EPOLL_MAX];
+static struct epoll_item items[EPOLL_ITEMS_MAX];
+
+//the list of items a pipe notifies, NULL for descriptors that never block
+static struct epoll_item **source_of(struct open_file *of)
+{
+    return of->type == FD_PIPE_READ || of->type == FD_PIPE_WRITE ? &of->pipe->watchers : NULL;
+}
+
+//the events of the item that hold right now
+static uint32_t item_events(struct epoll_item *it)
+{
+    return fs_poll(it->of) & (it->events | EPOLLERR | EPOLLHUP);
+}
+
+static void ready_add(struct epoll_item *it)
+{
+    struct epoll *ep = it->ep;
+    it->ready = true;
+    it->ready_next = NULL;
+    it->ready_prev = ep->ready_tail;
+    if(ep->ready_tail)
+    {
+        ep->ready_tail->ready_next = it;
+    }
+    else
+    {
+        ep->ready_head = it;
+    }
+    ep->ready_tail = it;
+}
+
+static void ready_remove(struct epoll_item *it)
+{
+    struct epoll *ep = it->ep;
+    if(it->ready_prev)
+    {
+        it->ready_prev->ready_next = it->ready_next;
+    }
+    else
+    {
+        ep->ready_head = it->ready_next;
+    }
+    if(it->ready_next)
+    {
+        it->ready_next->ready_prev = it->ready_prev;
+    }
+    else
+    {
+        ep->ready_tail = it->ready_prev;
+    }
+    it->ready = false;
+}
+
+/*
+    Put the item on the ready list if its events hold and it is not there yet, waking the task waiting on its epoll.
+    An edge triggered item is queued only for events that did not hold the last time, so a pipe that stays ready,
+    say after a partial read, does not report it again.
+*/
+static void queue(struct epoll_item *it)
+{
+    uint32_t ev = item_events(it);
+    uint32_t rising = ev & ~it->seen;
+    it->seen = ev;
+    if(!it->ready && ((it->events & EPOLLET) ? rising : ev))
+    {
+        ready_add(it);
+        wait_queue_wake_all(&it->ep->wq);
+    }
+}
+
+//take the item off its epoll and its pipe; the caller has unlinked it from the descriptor
+static void item_free(struct epoll_item *it)
+{
+    if(it->ready)
+    {
+        ready_remove(it);
+    }
+    struct epoll_item **src = source_of(it->of);
+    if(src)
+    {
+        while(*src != it)
+        {
+            src = &(*src)->src_next;
+        }
+        *src = it->src_next;
+    }
+    it->ep->nitems--;
+    it->used = false;
+}
+
+//a new epoll with an empty interest list, NULL if all are taken
+struct epoll *epoll_alloc(void)
+{
+    for(int i = 0; i < EPOLL_MAX; i++)
+    {
+        if(!epolls[i].used)
+        {
+            memset(&epolls[i], 0, sizeof(epolls[i]));
+            epolls[i].used = true;
+            return &epolls[i];
+        }
+    }
+    return NULL;
+}
+
+//drop the interest list and free the epoll. Closing an epoll is rare, so its items are found by a scan of the pool.
+void epoll_release(struct epoll *ep)
+{
+    for(int i = 0; i < EPOLL_ITEMS_MAX && ep->nitems; i++)
+    {
+        struct epoll_item *it = &items[i];
+        if(it->used && it->ep == ep)
+        {
+            struct epoll_item **pp = &it->of->watchers;
+            while(*pp != it)
+            {
+                pp = &(*pp)->of_next;
+            }
+            *pp = it->of_next;
+            item_free(it);
+        }
+    }
+    ep->used = false;
+}
+
+/*
+    Add a descriptor to the interest list of ep, change what it is watched for, or remove it.
+    Parameters:
+        int op: EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL
+        const struct epoll_event *ev: events and data for ADD and MOD, not used by DEL
+    returns:
+        int: 0, -1 if of is an epoll, already watched by ep (ADD), not watched by ep (MOD, DEL) or all items are taken
+*/
+int epoll_modify(struct epoll *ep, int op, struct open_file *of, const struct epoll_event *ev)
+{
+    if(of->type == FD_EPOLL)
+    {
+        return -1;
+    }
+    struct epoll_item **pp = &of->watchers;
+    while(*pp && (*pp)->ep != ep)
+    {
+        pp = &(*pp)->of_next;
+    }
+    struct epoll_item *it = *pp;
+    if(op == EPOLL_CTL_DEL && it)
+    {
+        *pp = it->of_next;
+        item_free(it);
+        return 0;
+    }
+    if(op == EPOLL_CTL_MOD && it)
+    {
+        it->events = ev->events;
+        it->data = ev->data;
+        it->seen = 0;       // rearmed: an edge triggered item reports what holds now once more
+        queue(it);
+        return 0;
+    }
+    if(op != EPOLL_CTL_ADD || it)
+    {
+        return -1;
+    }
+
+    for(int i = 0; i < EPOLL_ITEMS_MAX && !it; i++)
+    {
+        if(!items[i].used)
+        {
+            it = &items[i];
+        }
+    }
+    if(!it)
+    {
+        return -1;
+    }
+    memset(it, 0, sizeof(*it));
+    it->used = true;
+    it->ep = ep;
+    it->of = of;
+    it->events = ev->events;
+    it->data = ev->data;
+    it->of_next = of->watchers;
+    of->watchers = it;
+    struct epoll_item **src = source_of(of);
+    if(src)
+    {
+        it->src_next = *src;
+        *src = it;
+    }
+    ep->nitems++;
+    queue(it);      // files and devices are ready right away and stay on the list
+    return 0;
+}
+
+/*
+    Move up to max events off the ready list, looking at each item queued on entry once. Items that are still
+    ready go back to the end of the list unless they are edge triggered, items that are not any more are dropped.
+*/
+static int harvest(struct epoll *ep, struct epoll_event *events, int max)
+{
+    struct epoll_item *last = ep->ready_tail;
+    int n = 0;
+    while(n < max && ep->ready_head)
+    {
+        struct epoll_item *it = ep->ready_head;
+        ready_remove(it);
+        uint32_t ev = item_events(it);
+        it->seen = ev;
+        if(ev)
+        {
+            //a user page, the fault may sleep and let a pipe queue the item again meanwhile
+            events[n].events = ev;
+            events[n].data = it->data;
+            n++;
+            if(!(it->events & EPOLLET) && !it->ready)
+            {
+                ready_add(it);
+            }
+        }
+        if(it == last)
+        {
+            break;
+        }
+    }
+    return n;
+}
+
+/*
+    Sleep until a descriptor watched by ep is ready, then return the events of up to max ready descriptors.
+    Parameters:
+        struct epoll_event *events: receives the events
+        int flags: EPOLL_NOWAIT to return at once when nothing is ready
+    returns:
+        int: events stored, 0 only with EPOLL_NOWAIT
+*/
+int epoll_collect(struct epoll *ep, struct epoll_event *events, int max, int flags)
+{
+    for(;;)
+    {
+        int n = harvest(ep, events, max);
+        if(n || (flags & EPOLL_NOWAIT))
+        {
+            return n;
+        }
+        uint32_t sie = irq_save();
+        while(!ep->ready_head)
+        {
+            wait_queue_sleep(&ep->wq);
+        }
+        irq_restore(sie);
+    }
+}
+
+//a pipe changed state: queue the items watching it whose events hold now
+void epoll_notify(struct epoll_item *watchers)
+{
+    for(struct epoll_item *it = watchers; it; it = it->src_next)
+    {
+        queue(it);
+    }
+}
+
+//a descriptor is being closed: take it off every interest list
+void epoll_forget(struct open_file *of)
+{
+    while(of->watchers)
+    {
+        struct epoll_item *it = of->watchers;
+        of->watchers = it->of_next;
+        item_free(it);
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include "common.h"
+
+/*
+    Readiness multiplexing (SYS_EPOLL_CREATE / SYS_EPOLL_CTL / SYS_EPOLL_WAIT). An epoll descriptor keeps an interest
+    list of descriptors that stays registered between waits. A pipe puts the items watching it on the ready list of
+    their epoll when it wakes its own sleepers and the item's events hold, so epoll_wait() only walks the ready list:
+    a wait costs O(ready), however many descriptors are watched. Readiness is checked again when the events are
+    collected and items that stopped being ready on the way are dropped. Events are level triggered, an item that
+    is still ready stays on the list and is reported by the next wait too, unless it was added with EPOLLET.
+    Files and devices never block, they are ready from the moment they are added.
+*/
+#define EPOLLIN         (1 << 0)    // read() does not block
+#define EPOLLOUT        (1 << 2)    // write() does not block
+#define EPOLLERR        (1 << 3)    // write end of a pipe without readers, reported whether asked for or not
+#define EPOLLHUP        (1 << 4)    // read end of a pipe without writers, reported whether asked for or not
+#define EPOLLET         (1u << 31)  // edge triggered: reported once each time the pipe becomes ready
+
+#define EPOLL_CTL_ADD   1
+#define EPOLL_CTL_DEL   2
+#define EPOLL_CTL_MOD   3
+
+#define EPOLL_NOWAIT    (1 << 0)    // epoll_wait() returns 0 instead of sleeping when nothing is ready
+
+struct epoll_event
+{
+    uint32_t events;                // EPOLL* asked for in epoll_ctl(), the ones that hold from epoll_wait()
+    uint32_t data;                  // handed back as it was given
+};
+
+//kernel side, epoll.c
+#define EPOLL_MAX       16          // epoll instances in the system
+#define EPOLL_ITEMS_MAX 512         // watched descriptors, all instances together
+
+struct open_file;
+struct epoll;
+struct epoll_item;
+struct epoll *epoll_alloc(void);
+void epoll_release(struct epoll *ep);
+int epoll_modify(struct epoll *ep, int op, struct open_file *of, const struct epoll_event *ev);
+int epoll_collect(struct epoll *ep, struct epoll_event *events, int max, int flags);
+void epoll_notify(struct epoll_item *watchers);
+void epoll_forget(struct open_file *of);
@@ -0,0 +1,463 @@
+#include "fdt.h"
+
+static const uint8_t *fdt = NULL;   // the device tree blob, NULL if none was passed
+
+//read a big-endian 32-bit value
+uint32_t fdt_be32(const void *p)
+{
+    const uint8_t *b = p;
+    return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+}
+
+//read a value of ncells 32-bit cells (1 or 2, as given by #address-cells / #size-cells)
+uint64_t fdt_read_cells(const void *p, uint32_t ncells)
+{
+    uint64_t v = 0;
+    for(uint32_t i = 0; i < ncells; i++)
+    {
+        v = (v << 32) | fdt_be32((const uint8_t *)p + 4 * i);
+    }
+    return v;
+}
+
+/*
+    Remember the device tree blob handed over by the firmware.
+    returns:
+        int: 0 if dtb points to a valid blob, -1 otherwise
+*/
+int fdt_init(paddr_t dtb)
+{
+    if(!dtb || fdt_be32((const void *)dtb) != FDT_MAGIC)
+    {
+        fdt = NULL;
+        return -1;
+    }
+    fdt = (const uint8_t *)dtb;
+    return 0;
+}
+
+//a node name matches a path component if it is equal, or equal up to its "@unit-address"
+static bool name_matches(const char *comp, uint32_t comp_len, const char *node)
+{
+    for(uint32_t i = 0; i < comp_len; i++)
+    {
+        if(node[i] != comp[i])
+        {
+            return false;
+        }
+    }
+    return node[comp_len] == '\0' || node[comp_len] == '@';
+}
+
+/*
+    Look up a property by node path, e.g. fdt_getprop("/chosen", "linux,initrd-start", &len).
+    Parameters:
+        const char *path: absolute node path, components may omit the unit address
+        const char *name: property name
+        uint32_t *len: set to the property length in bytes, may be NULL
+    returns:
+        const void *: the property value inside the blob, NULL if not found
+*/
+const void *fdt_getprop(const char *path, const char *name, uint32_t *len)
+{
+    if(!fdt)
+    {
+        return NULL;
+    }
+
+    //split the path into components, without copying it
+    const char *comp[8];
+    uint32_t comp_len[8];
+    uint32_t ncomp = 0;
+    for(const char *p = path; *p; )
+    {
+        while(*p == '/')
+        {
+            p++;
+        }
+        if(!*p)
+        {
+            break;
+        }
+        if(ncomp == 8)
+        {
+            return NULL;
+        }
+        comp[ncomp] = p;
+        while(*p && *p != '/')
+        {
+            p++;
+        }
+        comp_len[ncomp] = p - comp[ncomp];
+        ncomp++;
+    }
+
+    const struct fdt_header *hdr = (const struct fdt_header *)fdt;
+    const uint8_t *p = fdt + fdt_be32(&hdr->off_dt_struct);
+    const char *strings = (const char *)fdt + fdt_be32(&hdr->off_dt_strings);
+    uint32_t depth = 0;     // open nodes, the root node is depth 1
+    uint32_t matched = 0;   // path components matched by the open nodes
+
+    while(1)
+    {
+        uint32_t token = fdt_be32(p);
+        p += 4;
+        switch(token)
+        {
+            case FDT_BEGIN_NODE:
+            {
+                const char *node = (const char *)p;
+                depth++;
+                //the node at depth d stands for path component d - 2
+                if(depth >= 2 && matched == depth - 2 && matched < ncomp
+                    && name_matches(comp[matched], comp_len[matched], node))
+                {
+                    matched++;
+                }
+                uint32_t n = 0;
+                while(node[n])
+                {
+                    n++;
+                }
+                p += align_up(n + 1, 4);
+                break;
+            }
+            case FDT_END_NODE:
+            {
+                if(depth >= 2 && matched >= depth - 1)
+                {
+                    matched = depth - 2;
+                }
+                depth--;
+                break;
+            }
+            case FDT_PROP:
+            {
+                uint32_t plen = fdt_be32(p);
+                const char *pname = strings + fdt_be32(p + 4);
+                const uint8_t *value = p + 8;
+                if(matched == ncomp && depth == ncomp + 1 && strcmp(pname, name) == 0)
+                {
+                    if(len)
+                    {
+                        *len = plen;
+                    }
+                    return value;
+                }
+                p = value + align_up(plen, 4);
+                break;
+            }
+            case FDT_NOP:
+            {
+                break;
+            }
+            default:
+            {
+                return NULL;    // FDT_END or a corrupt blob
+            }
+        }
+    }
+}
+
+//QEMU virt machine, used for whatever the device tree does not describe
+#define VIRT_TIMEBASE_FREQ  10000000
+#define VIRT_RAM_BASE       0x80000000
+#define VIRT_RAM_SIZE       (128 * 1024 * 1024)     // QEMU's default -m
+#define VIRT_PLIC_BASE      0x0c000000
+#define VIRT_PLIC_SIZE      0x600000
+#define VIRT_PLIC_NDEV      95
+#define VIRT_UART_BASE      0x10000000
+#define VIRT_UART_IRQ       10
+#define VIRT_VIRTIO_BASE    0x10001000
+#define VIRT_VIRTIO_IRQ     1                       // slot n raises interrupt n + 1
+
+struct platform platform;
+
+//properties of an open node that fdt_probe() looks at. Properties come before subnodes in the blob.
+struct fdt_node
+{
+    const char *name;
+    const char *device_type;
+    const char *compatible;             // string list
+    uint32_t compatible_len;
+    const uint8_t *reg;
+    uint32_t reg_len;
+    const uint8_t *interrupts;
+    const char *isa;
+    const char *status;
+    const uint8_t *timebase;
+    const uint8_t *ndev;
+    uint32_t address_cells;             // for the children of this node
+    uint32_t size_cells;
+};
+
+static bool compatible_with(const struct fdt_node *n, const char *compat)
+{
+    for(uint32_t i = 0; i < n->compatible_len; i += strlen(n->compatible + i) + 1)
+    {
+        if(strcmp(n->compatible + i, compat) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+//first reg entry of node n, parent gives the cell sizes
+static struct fdt_device node_device(const struct fdt_node *n, const struct fdt_node *parent)
+{
+    struct fdt_device d = {0, 0, 0};
+    uint32_t cells = parent->address_cells + parent->size_cells;
+    if(n->reg && n->reg_len >= 4 * cells)
+    {
+        uint64_t base = fdt_read_cells(n->reg, parent->address_cells);
+        if(base >> 32 == 0)
+        {
+            d.base = (paddr_t)base;
+            d.size = (uint32_t)fdt_read_cells(n->reg + 4 * parent->address_cells, parent->size_cells);
+        }
+    }
+    if(n->interrupts)
+    {
+        d.irq = fdt_be32(n->interrupts);
+    }
+    return d;
+}
+
+//record a node of interest once all its properties have been seen
+static void probe_node(const struct fdt_node *n, const struct fdt_node *parent)
+{
+    if(n->status && strcmp(n->status, "okay") != 0 && strcmp(n->status, "ok") != 0)
+    {
+        return;
+    }
+    if(n->timebase && (strcmp(n->name, "cpus") == 0 || (n->device_type && strcmp(n->device_type, "cpu") == 0)))
+    {
+        platform.timebase_freq = fdt_be32(n->timebase);
+    }
+
+    if(n->device_type && strcmp(n->device_type, "memory") == 0)
+    {
+        uint32_t cells = parent->address_cells + parent->size_cells;
+        for(uint32_t off = 0; n->reg && off + 4 * cells <= n->reg_len && platform.nr_memory < FDT_MAX_MEMORY; off += 4 * cells)
+        {
+            uint64_t base = fdt_read_cells(n->reg + off, parent->address_cells);
+            uint64_t end = base + fdt_read_cells(n->reg + off + 4 * parent->address_cells, parent->size_cells);
+            if(base >> 32)
+            {
+                continue;
+            }
+            if(end >> 32)
+            {
+                end = 0x100000000ull - PAGE_SIZE;
+            }
+            platform.memory[platform.nr_memory].base = (paddr_t)base;
+            platform.memory[platform.nr_memory].end = (paddr_t)end;
+            platform.nr_memory++;
+        }
+    }
+    else if(n->device_type && strcmp(n->device_type, "cpu") == 0)
+    {
+        if(n->reg && platform.nr_harts < FDT_MAX_HARTS)
+        {
+            platform.harts[platform.nr_harts].hartid = fdt_be32(n->reg);
+            platform.harts[platform.nr_harts].isa = n->isa ? n->isa : "?";
+            platform.nr_harts++;
+        }
+    }
+    else if(compatible_with(n, "riscv,plic0") || compatible_with(n, "sifive,plic-1.0.0"))
+    {
+        platform.plic = node_device(n, parent);
+        platform.plic_ndev = n->ndev ? fdt_be32(n->ndev) : VIRT_PLIC_NDEV;
+    }
+    else if(compatible_with(n, "ns16550a") && !platform.uart.base)
+    {
+        platform.uart = node_device(n, parent);
+    }
+    else if(compatible_with(n, "virtio,mmio") && platform.nr_virtio < FDT_MAX_VIRTIO)
+    {
+        platform.virtio[platform.nr_virtio++] = node_device(n, parent);
+    }
+}
+
+//fill in the QEMU virt layout for everything the device tree did not provide
+static void probe_defaults(void)
+{
+    if(!platform.timebase_freq)
+    {
+        platform.timebase_freq = VIRT_TIMEBASE_FREQ;
+    }
+    if(!platform.nr_memory)
+    {
+        platform.memory[0].base = VIRT_RAM_BASE;
+        platform.memory[0].end = VIRT_RAM_BASE + VIRT_RAM_SIZE;
+        platform.nr_memory = 1;
+    }
+    if(!platform.plic.base)
+    {
+        platform.plic.base = VIRT_PLIC_BASE;
+        platform.plic.size = VIRT_PLIC_SIZE;
+        platform.plic_ndev = VIRT_PLIC_NDEV;
+    }
+    if(!platform.uart.base)
+    {
+        platform.uart.base = VIRT_UART_BASE;
+        platform.uart.size = PAGE_SIZE;
+        platform.uart.irq = VIRT_UART_IRQ;
+    }
+    if(!fdt)
+    {
+        for(uint32_t i = 0; i < FDT_MAX_VIRTIO; i++)
+        {
+            platform.virtio[i].base = VIRT_VIRTIO_BASE + i * PAGE_SIZE;
+            platform.virtio[i].size = PAGE_SIZE;
+            platform.virtio[i].irq = VIRT_VIRTIO_IRQ + i;
+        }
+        platform.nr_virtio = FDT_MAX_VIRTIO;
+    }
+}
+
+/*
+    Walk the whole tree once and record RAM, harts, the timebase and the devices the kernel drives in platform.
+    Works in place like fdt_getprop(); anything missing is taken from the QEMU virt layout.
+*/
+void fdt_probe(void)
+{
+    memset(&platform, 0, sizeof(platform));
+    if(!fdt)
+    {
+        probe_defaults();
+        return;
+    }
+
+    const struct fdt_header *hdr = (const struct fdt_header *)fdt;
+    const uint8_t *p = fdt + fdt_be32(&hdr->off_dt_struct);
+    const char *strings = (const char *)fdt + fdt_be32(&hdr->off_dt_strings);
+    //nodes[d] is the open node at depth d; nodes[0] stands in as the root's parent with the default cell sizes
+    struct fdt_node nodes[FDT_MAX_DEPTH + 1];
+    memset(&nodes[0], 0, sizeof(nodes[0]));
+    nodes[0].address_cells = 2;
+    nodes[0].size_cells = 1;
+    uint32_t depth = 0;
+    bool done = false;
+
+    while(!done)
+    {
+        uint32_t token = fdt_be32(p);
+        p += 4;
+        switch(token)
+        {
+            case FDT_BEGIN_NODE:
+            {
+                const char *name = (const char *)p;
+                p += align_up(strlen(name) + 1, 4);
+                if(++depth > FDT_MAX_DEPTH)
+                {
+                    break;  // too deep to matter, skipped until the matching FDT_END_NODE
+                }
+                struct fdt_node *n = &nodes[depth];
+                memset(n, 0, sizeof(*n));
+                n->name = name;
+                n->address_cells = 2;
+                n->size_cells = 1;
+                break;
+            }
+            case FDT_END_NODE:
+            {
+                if(depth == 0)
+                {
+                    done = true;
+                    break;
+                }
+                if(depth <= FDT_MAX_DEPTH)
+                {
+                    probe_node(&nodes[depth], &nodes[depth - 1]);
+                }
+                depth--;
+                break;
+            }
+            case FDT_PROP:
+            {
+                uint32_t len = fdt_be32(p);
+                const char *name = strings + fdt_be32(p + 4);
+                const uint8_t *value = p + 8;
+                p = value + align_up(len, 4);
+                if(depth == 0 || depth > FDT_MAX_DEPTH)
+                {
+                    break;
+                }
+                struct fdt_node *n = &nodes[depth];
+                if(strcmp(name, "device_type") == 0)
+                {
+                    n->device_type = (const char *)value;
+                }
+                else if(strcmp(name, "compatible") == 0)
+                {
+                    n->compatible = (const char *)value;
+                    n->compatible_len = len;
+                }
+                else if(strcmp(name, "reg") == 0)
+                {
+                    n->reg = value;
+                    n->reg_len = len;
+                }
+                else if(strcmp(name, "interrupts") == 0 && len >= 4)
+                {
+                    n->interrupts = value;
+                }
+                else if(strcmp(name, "riscv,isa") == 0)
+                {
+                    n->isa = (const char *)value;
+                }
+                else if(strcmp(name, "status") == 0)
+                {
+                    n->status = (const char *)value;
+                }
+                else if(strcmp(name, "timebase-frequency") == 0 && len >= 4)
+                {
+                    n->timebase = value;
+                }
+                else if(strcmp(name, "riscv,ndev") == 0 && len >= 4)
+                {
+                    n->ndev = value;
+                }
+                else if(strcmp(name, "#address-cells") == 0 && len >= 4)
+                {
+                    n->address_cells = fdt_be32(value);
+                }
+                else if(strcmp(name, "#size-cells") == 0 && len >= 4)
+                {
+                    n->size_cells = fdt_be32(value);
+                }
+                break;
+            }
+            case FDT_NOP:
+            {
+                break;
+            }
+            default:
+            {
+                done = true;    // FDT_END or a corrupt blob
+                break;
+            }
+        }
+    }
+    probe_defaults();
+}
+
+//print what fdt_probe() found
+void fdt_dump(void)
+{
+    printf("platform: timebase %d Hz, %d hart(s)\n", platform.timebase_freq, platform.nr_harts);
+    for(uint32_t i = 0; i < platform.nr_harts; i++)
+    {
+        printf("  hart %d: %s\n", platform.harts[i].hartid, platform.harts[i].isa);
+    }
+    for(uint32_t i = 0; i < platform.nr_memory; i++)
+    {
+        printf("  memory %x-%x (%d MB)\n", platform.memory[i].base, platform.memory[i].end,
+            (platform.memory[i].end - platform.memory[i].base) >> 20);
+    }
+    printf("  plic %x (%d irqs), uart %x irq %d, %d virtio-mmio\n", platform.plic.base, platform.plic_ndev,
+        platform.uart.base, platform.uart.irq, platform.nr_virtio);
+}
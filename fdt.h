@@ -0,0 +1,73 @@
+#pragma once
+#include "kernel.h"
+
+/*
+    Flattened device tree passed by OpenSBI in a1. The parser works in place on the blob and never allocates.
+    All values in the blob are big-endian.
+*/
+#define FDT_MAGIC           0xd00dfeed
+#define FDT_BEGIN_NODE      1
+#define FDT_END_NODE        2
+#define FDT_PROP            3
+#define FDT_NOP             4
+#define FDT_END             9
+#define FDT_MAX_DEPTH       8           // node nesting fdt_probe() follows
+#define FDT_MAX_MEMORY      4           // /memory ranges recorded
+#define FDT_MAX_HARTS       8
+#define FDT_MAX_VIRTIO      8           // virtio-mmio transports recorded
+
+struct fdt_header
+{
+    uint32_t magic;
+    uint32_t totalsize;
+    uint32_t off_dt_struct;
+    uint32_t off_dt_strings;
+    uint32_t off_mem_rsvmap;
+    uint32_t version;
+    uint32_t last_comp_version;
+    uint32_t boot_cpuid_phys;
+    uint32_t size_dt_strings;
+    uint32_t size_dt_struct;
+};
+
+//an MMIO device found in the tree
+struct fdt_device
+{
+    paddr_t base;                       // 0 if the device is not present
+    uint32_t size;
+    uint32_t irq;                       // PLIC interrupt number, 0 if none
+};
+
+struct fdt_hart
+{
+    uint32_t hartid;
+    const char *isa;                    // riscv,isa string inside the blob, e.g. "rv32imafdc_zicsr"
+};
+
+//what fdt_probe() found, or the QEMU virt layout if there is no device tree
+struct platform
+{
+    uint32_t timebase_freq;             // time CSR ticks per second
+    uint32_t nr_memory;
+    struct
+    {
+        paddr_t base;
+        paddr_t end;                    // clipped below 4GB, the kernel identity maps RAM with 32-bit addresses
+    } memory[FDT_MAX_MEMORY];
+    uint32_t nr_harts;
+    struct fdt_hart harts[FDT_MAX_HARTS];
+    struct fdt_device plic;
+    uint32_t plic_ndev;                 // highest interrupt number the PLIC implements
+    struct fdt_device uart;
+    uint32_t nr_virtio;
+    struct fdt_device virtio[FDT_MAX_VIRTIO];
+};
+
+extern struct platform platform;
+
+int fdt_init(paddr_t dtb);
+void fdt_probe(void);
+void fdt_dump(void);
+const void *fdt_getprop(const char *path, const char *name, uint32_t *len);
+uint32_t fdt_be32(const void *p);
+uint64_t fdt_read_cells(const void *p, uint32_t ncells);
@@ -0,0 +1,281 @@
+#include "fiber.h"
+
+//free fiber stacks shared by all tasks. Stacks are carved out of whole pages and never returned to the page allocator.
+static struct fiber *stack_pool = NULL;
+
+//fetch a FIBER_STACK_SIZE stack from the pool, refilling the pool with one page when it runs dry
+static struct fiber *stack_pool_get(void)
+{
+    uint32_t sie = irq_save();
+    if(!stack_pool)
+    {
+        uint8_t *page = alloc_pages(1);
+        if(!page)
+        {
+            irq_restore(sie);
+            return NULL;
+        }
+        for(uint32_t off = 0; off + FIBER_STACK_SIZE <= PAGE_SIZE; off += FIBER_STACK_SIZE)
+        {
+            struct fiber *f = (struct fiber *)(page + off);
+            f->next = stack_pool;
+            stack_pool = f;
+        }
+    }
+
+    struct fiber *f = stack_pool;
+    stack_pool = f->next;
+    irq_restore(sie);
+    return f;
+}
+
+static void stack_pool_put(struct fiber *f)
+{
+    uint32_t sie = irq_save();
+    f->next = stack_pool;
+    stack_pool = f;
+    irq_restore(sie);
+}
+
+static void run_queue_push(struct fiber_sched *sched, struct fiber *f)
+{
+    f->state = FIBER_READY;
+    f->next = NULL;
+    if(sched->run_tail)
+    {
+        sched->run_tail->next = f;
+    }
+    else
+    {
+        sched->run_head = f;
+    }
+    sched->run_tail = f;
+}
+
+static struct fiber *run_queue_pop(struct fiber_sched *sched)
+{
+    struct fiber *f = sched->run_head;
+    if(f)
+    {
+        sched->run_head = f->next;
+        if(!sched->run_head)
+        {
+            sched->run_tail = NULL;
+        }
+    }
+    return f;
+}
+
+//release the stacks of fibers that exited. This runs on the stack of the fiber that was switched to, never on a dead one.
+static void fiber_reap(struct fiber_sched *sched)
+{
+    while(sched->dead)
+    {
+        struct fiber *f = sched->dead;
+        sched->dead = f->next;
+        stack_pool_put(f);
+    }
+}
+
+/*
+    Switch from the current fiber to the next ready one. Called with interrupts masked.
+    If no fiber of this task is ready, the whole task sleeps until fiber_wake() makes one ready.
+*/
+static void fiber_schedule(struct fiber_sched *sched)
+{
+    struct fiber *prev = sched->current;
+    if(prev->canary != FIBER_STACK_CANARY)
+    {
+        PANIC("fiber stack overflow (fiber %x)", (uint32_t)prev);
+    }
+
+    struct fiber *next;
+    while(!(next = run_queue_pop(sched)))
+    {
+        //every fiber of this task is blocked: park the task itself, fiber_wake() will wake it
+        sched->idle = true;
+        current_proc->state = PROC_BLOCKED;
+        yield();
+    }
+
+    next->state = FIBER_RUNNING;
+    sched->current = next;
+    if(next != prev)
+    {
+        switch_context(&prev->sp, &next->sp);
+    }
+    fiber_reap(sched);
+}
+
+//first code run by a new fiber: fiber_schedule() "returns" here through the ra pushed by fiber_create()
+static void fiber_start(void)
+{
+    struct fiber_sched *sched = current_proc->fibers;
+    fiber_reap(sched);
+    irq_restore(SSTATUS_SIE);   // fiber_schedule() switched to us with interrupts masked
+
+    struct fiber *self = sched->current;
+    self->entry(self->arg);
+    fiber_exit();
+}
+
+/*
+    Turn the calling task into a fiber scheduler. The task's own context becomes the "main" fiber.
+    Parameters:
+        struct fiber_sched *sched: scheduler storage, usually on the task's stack; must outlive all fibers
+*/
+void fiber_sched_init(struct fiber_sched *sched)
+{
+    memset(sched, 0, sizeof(*sched));
+    sched->main.state = FIBER_RUNNING;
+    sched->main.sched = sched;
+    sched->main.canary = FIBER_STACK_CANARY;
+    sched->current = &sched->main;
+    sched->owner = current_proc;
+    current_proc->fibers = sched;
+}
+
+/*
+    Create a fiber in the calling task and put it at the end of the task's run queue.
+    Parameters:
+        void (*entry)(void *arg): fiber function, the fiber exits when it returns
+        void *arg: argument passed to entry
+    returns:
+        struct fiber *: the new fiber, NULL if no stack could be allocated
+*/
+struct fiber *fiber_create(void (*entry)(void *arg), void *arg)
+{
+    struct fiber_sched *sched = current_proc->fibers;
+    if(!sched)
+    {
+        PANIC("fiber_create called before fiber_sched_init");
+    }
+
+    struct fiber *f = stack_pool_get();
+    if(!f)
+    {
+        return NULL;
+    }
+
+    f->entry = entry;
+    f->arg = arg;
+    f->sched = sched;
+    f->canary = FIBER_STACK_CANARY;
+
+    //same initial frame as create_process(): ra followed by s0-s11, popped by switch_context()
+    uint32_t *sp = (uint32_t *)(((uint32_t)f + FIBER_STACK_SIZE) & ~0xf);
+    for(int i = 0; i < 12; i++)
+    {
+        *--sp = 0;                  // s11 ... s0
+    }
+    *--sp = (uint32_t) fiber_start; // ra
+    f->sp = (uint32_t) sp;
+
+    uint32_t sie = irq_save();
+    sched->nr_fibers++;
+    run_queue_push(sched, f);
+    irq_restore(sie);
+    return f;
+}
+
+//the fiber running in the current task, NULL if the task does not run fibers
+struct fiber *fiber_current(void)
+{
+    struct fiber_sched *sched = current_proc->fibers;
+    return sched ? sched->current : NULL;
+}
+
+//let the other ready fibers of this task run. Returns immediately if there are none.
+void fiber_yield(void)
+{
+    struct fiber_sched *sched = current_proc->fibers;
+    uint32_t sie = irq_save();
+    if(sched->run_head)
+    {
+        run_queue_push(sched, sched->current);
+        fiber_schedule(sched);
+    }
+    irq_restore(sie);
+}
+
+/*
+    Park the current fiber until fiber_wake(). The caller must have recorded the fiber somewhere a waker
+    will find it (e.g. a wait queue) and must call this with interrupts masked.
+*/
+void fiber_block(void)
+{
+    struct fiber_sched *sched = current_proc->fibers;
+    sched->current->state = FIBER_BLOCKED;
+    fiber_schedule(sched);
+}
+
+/*
+    Make a blocked fiber ready again. Safe to call from interrupt handlers and from other tasks.
+    If the owning task was asleep because none of its fibers were ready, the task is woken as well.
+*/
+void fiber_wake(struct fiber *f)
+{
+    uint32_t sie = irq_save();
+    if(f->state == FIBER_BLOCKED)
+    {
+        struct fiber_sched *sched = f->sched;
+        run_queue_push(sched, f);
+        if(sched->idle)
+        {
+            sched->idle = false;
+            wake_process(sched->owner);
+        }
+    }
+    irq_restore(sie);
+}
+
+//terminate the current fiber. Its stack goes back to the pool once the next fiber runs.
+void fiber_exit(void)
+{
+    struct fiber_sched *sched = current_proc->fibers;
+    struct fiber *self = sched->current;
+    if(self == &sched->main)
+    {
+        PANIC("the main fiber cannot exit");
+    }
+
+    irq_save();
+    self->state = FIBER_DEAD;
+    self->next = sched->dead;
+    sched->dead = self;
+
+    sched->nr_fibers--;
+    if(sched->nr_fibers == 0 && sched->join_waiting)
+    {
+        sched->join_waiting = false;
+        fiber_wake(&sched->main);
+    }
+
+    fiber_schedule(sched);
+    PANIC("dead fiber was scheduled");
+}
+
+//run the task's fibers until all of them have exited. Only the main fiber may call this.
+void fiber_join_all(void)
+{
+    struct fiber_sched *sched = current_proc->fibers;
+    uint32_t sie = irq_save();
+    while(sched->nr_fibers > 0)
+    {
+        sched->join_waiting = true;
+        fiber_block();
+    }
+    irq_restore(sie);
+}
+
+//stop running fibers in the calling task once fiber_join_all() returned; the fiber_sched may go out of scope after this
+void fiber_sched_exit(void)
+{
+    struct fiber_sched *sched = current_proc->fibers;
+    if(sched->nr_fibers || sched->current != &sched->main)
+    {
+        PANIC("fiber_sched_exit with fibers left");
+    }
+    fiber_reap(sched);
+    current_proc->fibers = NULL;
+}
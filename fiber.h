@@ -0,0 +1,52 @@
+#pragma once
+#include "kernel.h"
+
+/*
+    Fibers are stackful coroutines that live inside one kernel task. They switch with the same
+    callee-saved register frame as switch_context() but never go through yield() or a trap:
+    a fiber switch is a pair of stack pointer swaps plus 13 loads and 13 stores.
+    Each task that runs fibers owns a fiber_sched with its own cooperative run queue.
+*/
+
+#define FIBER_STACK_SIZE    1024        // stack size of a fiber (the fiber struct sits at the bottom of it)
+#define FIBER_STACK_CANARY  0xdeadbeef  // written just above the fiber struct to catch stack overflows
+
+#define FIBER_READY         1           // on the run queue
+#define FIBER_RUNNING       2           // currently executing
+#define FIBER_BLOCKED       3           // parked on a wait queue
+#define FIBER_DEAD          4           // returned from its entry function, stack not yet released
+
+struct fiber
+{
+    vaddr_t sp;                 // saved stack pointer (callee-saved registers are on the stack)
+    int state;                  // FIBER_READY, FIBER_RUNNING, FIBER_BLOCKED or FIBER_DEAD
+    void (*entry)(void *arg);   // fiber function
+    void *arg;                  // argument passed to entry
+    struct fiber_sched *sched;  // the task-local scheduler this fiber belongs to
+    struct fiber *next;         // run queue / dead list / stack pool link
+    uint32_t canary;            // FIBER_STACK_CANARY, overwritten if the stack overflowed
+};
+
+//per-task fiber scheduler
+struct fiber_sched
+{
+    struct fiber main;          // the task's own stack, scheduled like any other fiber
+    struct fiber *current;      // fiber currently running in this task
+    struct fiber *run_head;     // FIFO of ready fibers
+    struct fiber *run_tail;
+    struct fiber *dead;         // exited fibers whose stacks are released by the next fiber to run
+    struct process *owner;      // task running these fibers
+    int nr_fibers;              // fibers created and not yet exited (main excluded)
+    int idle;                   // set while the owner task sleeps because no fiber is ready
+    bool join_waiting;          // main is parked in fiber_join_all()
+};
+
+void fiber_sched_init(struct fiber_sched *sched);
+struct fiber *fiber_create(void (*entry)(void *arg), void *arg);
+struct fiber *fiber_current(void);
+void fiber_yield(void);
+void fiber_block(void);
+void fiber_wake(struct fiber *f);
+void fiber_exit(void);
+void fiber_join_all(void);
+void fiber_sched_exit(void);
@@ -0,0 +1,173 @@
+#include "heap.h"
+#include "pcache.h"
+#include "zram.h"
+
+extern void *global_base;
+uint32_t sbrk_pages_left(uint32_t *largest);
+uint32_t sbrk_pages_total(void);
+
+//alloc_pages() calls by size, counted per hart so the allocation fast path writes nothing shared
+struct heap_cpu
+{
+    uint32_t alloc_hist[HEAP_HIST_BUCKETS];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct heap_cpu heap_cpus[HARTS_MAX];
+
+//histogram bucket of an n page block: floor(log2(n)), capped
+static int hist_bucket(uint32_t n)
+{
+    int b = 0;
+    while(n > 1 && b < HEAP_HIST_BUCKETS - 1)
+    {
+        n >>= 1;
+        b++;
+    }
+    return b;
+}
+
+//called by alloc_pages() for every request
+void heap_count_alloc(uint32_t n)
+{
+    heap_cpus[this_hart()].alloc_hist[hist_bucket(n)]++;
+}
+
+/*
+    Walk the block list. Blocks are appended in address order and are never split or merged, so a free block can
+    only serve requests up to its own size.
+    Parameters:
+        struct heap_stats *s: filled in
+*/
+void heap_stats(struct heap_stats *s)
+{
+    memset(s, 0, sizeof(*s));
+    uint32_t sie = irq_save();
+    for(page_meta *b = global_base; b; b = b->next)
+    {
+        uint32_t pages = b->size / PAGE_SIZE;
+        if(b->free == PAGE_META_CACHED)
+        {
+            s->cached_pages += pages;
+        }
+        else if(b->free)
+        {
+            s->free_pages += pages;
+            s->free_blocks++;
+            if(pages > s->largest_free_pages)
+            {
+                s->largest_free_pages = pages;
+            }
+        }
+        else
+        {
+            s->used_pages += pages;
+            s->live_hist[hist_bucket(pages)]++;
+        }
+    }
+    uint32_t largest_untouched;
+    s->untouched_pages = sbrk_pages_left(&largest_untouched);
+    s->total_pages = sbrk_pages_total();
+    for(uint32_t hart = 0; hart < HARTS_MAX; hart++)
+    {
+        for(int b = 0; b < HEAP_HIST_BUCKETS; b++)
+        {
+            s->alloc_hist[b] += heap_cpus[hart].alloc_hist[b];
+        }
+    }
+    irq_restore(sie);
+
+    s->free_pages += s->untouched_pages + s->cached_pages;
+    if(largest_untouched > s->largest_free_pages)
+    {
+        s->largest_free_pages = largest_untouched;
+    }
+    s->fragmentation_permille = s->free_pages ? 1000 - s->largest_free_pages * 1000 / s->free_pages : 0;
+}
+
+#ifdef HEAP_DEBUG
+struct heap_site
+{
+    uint32_t caller;
+    uint32_t blocks;
+    uint32_t pages;
+};
+
+//live blocks and pages per alloc_pages() call site, biggest first
+static void dump_sites(void)
+{
+    struct heap_site sites[HEAP_MAX_SITES];
+    int nsites = 0;
+    uint32_t other = 0;
+
+    uint32_t sie = irq_save();
+    for(page_meta *b = global_base; b; b = b->next)
+    {
+        if(b->free)
+        {
+            continue;
+        }
+        int i;
+        for(i = 0; i < nsites && sites[i].caller != b->caller; i++)
+            ;
+        if(i == nsites)
+        {
+            if(nsites == HEAP_MAX_SITES)
+            {
+                other += b->size / PAGE_SIZE;
+                continue;
+            }
+            sites[nsites].caller = b->caller;
+            sites[nsites].blocks = 0;
+            sites[nsites].pages = 0;
+            nsites++;
+        }
+        sites[i].blocks++;
+        sites[i].pages += b->size / PAGE_SIZE;
+    }
+    irq_restore(sie);
+
+    //insertion sort by live pages, there are few sites
+    for(int i = 1; i < nsites; i++)
+    {
+        struct heap_site t = sites[i];
+        int j = i;
+        for(; j > 0 && sites[j - 1].pages < t.pages; j--)
+        {
+            sites[j] = sites[j - 1];
+        }
+        sites[j] = t;
+    }
+
+    printf("heap: live allocations by call site (llvm-addr2line -e kernel.elf <caller>)\n");
+    for(int i = 0; i < nsites; i++)
+    {
+        printf("  %x\t%d blocks\t%d KB\n", sites[i].caller, sites[i].blocks, sites[i].pages * (PAGE_SIZE / 1024));
+    }
+    if(other)
+    {
+        printf("  other\t\t%d KB\n", other * (PAGE_SIZE / 1024));
+    }
+}
+#endif
+
+//print heap_stats() and, in debug builds, the live pages per call site
+void heap_dump(void)
+{
+    struct heap_stats s;
+    heap_stats(&s);
+    printf("heap: %d/%d pages used, %d free (%d never used, %d in %d freed blocks, %d cached on harts)\n",
+        s.used_pages, s.total_pages, s.free_pages, s.untouched_pages,
+        s.free_pages - s.untouched_pages - s.cached_pages, s.free_blocks, s.cached_pages);
+    printf("heap: largest free extent %d pages, fragmentation %d.%d%%\n", s.largest_free_pages,
+        s.fragmentation_permille / 10, s.fragmentation_permille % 10);
+    printf("heap: pages   allocs  live\n");
+    for(int b = 0; b < HEAP_HIST_BUCKETS; b++)
+    {
+        printf("heap: %s%d\t%d\t%d\n", b == HEAP_HIST_BUCKETS - 1 ? ">=" : "", 1 << b, s.alloc_hist[b], s.live_hist[b]);
+    }
+    pcache_dump();
+    zram_dump();
+#ifdef HEAP_DEBUG
+    dump_sites();
+#endif
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include "kernel.h"
+
+/*
+    Introspection of the page allocator (alloc_pages()/free() in kernel.c). heap_stats() walks the page_meta list and
+    reports how much is free, the largest free extent and how fragmented the free memory is; heap_dump() prints it.
+    Built with -DHEAP_DEBUG (./run.sh heapdebug) every block also records the return address of its alloc_pages()
+    call, and heap_dump() adds the live pages per call site, so a leak shows up as a call site that keeps growing.
+*/
+#define HEAP_HIST_BUCKETS   8           // allocation sizes 1, 2, 4, ... 64, >= 128 pages
+#define HEAP_MAX_SITES      32          // call sites reported in debug mode, the rest are counted as "other"
+#define HEAP_LOW_WATER      16          // warn when less than 1/16 of the free RAM is left
+
+struct heap_stats
+{
+    uint32_t total_pages;               // pages the allocator manages, page_meta table and reserved pages excluded
+    uint32_t used_pages;                // in blocks that are allocated
+    uint32_t free_pages;                // in freed blocks plus the part sbrk() has not handed out yet
+    uint32_t cached_pages;              // free pages held in the page caches of the harts, part of free_pages
+    uint32_t untouched_pages;           // not handed out by sbrk() yet
+    uint32_t free_blocks;
+    uint32_t largest_free_pages;        // largest request that can be served right now
+    uint32_t fragmentation_permille;    // 1 - largest free extent / free pages, in 1/1000
+    uint32_t alloc_hist[HEAP_HIST_BUCKETS]; // alloc_pages() calls since boot by size
+    uint32_t live_hist[HEAP_HIST_BUCKETS];  // allocated blocks by size
+};
+
+void heap_count_alloc(uint32_t n);
+void heap_stats(struct heap_stats *s);
+void heap_dump(void);
@@ -0,0 +1,147 @@
+#include "user.h"
+
+//sparse array, only the pages that are written get a frame
+static uint8_t big[1024 * 1024];
+
+int main(void)
+{
+    printf("hello from user space, pid %d\n", getpid());
+    struct proc_stat st;
+    if(proc_stat(getpid(), &st) == 0)
+    {
+        printf("proc_stat: pid %d on cpu %d, nice %d\n", st.pid, st.cpu, st.nice);
+    }
+
+    int fd = open("/motd.txt", O_RDONLY);
+    if(fd < 0)
+    {
+        printf("hello: cannot open /motd.txt\n");
+        exit();
+    }
+    char *motd = mmap(fd, 0, 4096, PROT_READ);
+    if(motd)
+    {
+        printf("motd: %s", motd);
+    }
+    close(fd);
+
+    //the same file again through the rings: a batch of reads and a timeout, submitted with one system call
+    struct uring_shared *ring = uring_setup(0);
+    if(ring)
+    {
+        static char buf[4][8];
+        fd = open("/motd.txt", O_RDONLY);
+        uint32_t n = 0;
+        for(; n < 4; n++)
+        {
+            struct uring_sqe *sqe = uring_sqe_next(ring, n);
+            sqe->opcode = URING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = (uint32_t)buf[n];
+            sqe->len = sizeof(buf[n]);
+            sqe->user_data = n;
+        }
+        struct uring_sqe *sqe = uring_sqe_next(ring, n);
+        sqe->opcode = URING_OP_TIMEOUT;
+        sqe->off = 1000;
+        sqe->user_data = n++;
+        uring_sq_push(ring, n);
+        uring_enter(n, n);
+
+        struct uring_cqe *cqe;
+        while((cqe = uring_cqe_peek(ring)))
+        {
+            printf("uring: op %d -> %d\n", cqe->user_data, cqe->res);
+            uring_cq_advance(ring);
+        }
+        close(fd);
+    }
+
+    big[0] = 1;
+    big[sizeof(big) - 1] = 1;
+    printf("touched 2 of %d bss pages\n", (int)(sizeof(big) / PAGE_SIZE));
+
+    //small objects come from the thread cache, the big one gets a mapping of its own
+    static void *objs[256];
+    uint64_t t0 = uptime_us();
+    for(int round = 0; round < 100; round++)
+    {
+        for(int i = 0; i < 256; i++)
+        {
+            objs[i] = malloc(16 + (i % 32) * 24);
+        }
+        for(int i = 0; i < 256; i++)
+        {
+            free(objs[i]);
+        }
+    }
+    uint32_t us = (uint32_t)(uptime_us() - t0);
+    char *large = malloc(100 * 1024);
+    large[100 * 1024 - 1] = 1;
+    struct malloc_stats ms;
+    malloc_stats(&ms);
+    printf("malloc: 25600 pairs in %d us, heap %d bytes resident, large %d bytes\n", us, ms.resident_bytes,
+        ms.large_bytes);
+    free(large);
+
+    //a pipe: written with a copy, then spliced to the console, and the motd spliced through it without any copy
+    int fds[2];
+    int con = open("/dev/console", O_WRONLY);
+    if(con >= 0 && pipe(fds) == 0)
+    {
+        const char msg[] = "pipe: hello through a pipe\n";
+        write(fds[1], msg, sizeof(msg) - 1);
+        splice(fds[0], con, sizeof(msg) - 1);
+        fd = open("/motd.txt", O_RDONLY);
+        int n;
+        while((n = splice(fd, fds[1], PAGE_SIZE)) > 0)
+        {
+            splice(fds[0], con, n);
+        }
+        close(fd);
+        close(fds[0]);
+        close(fds[1]);
+    }
+    if(con >= 0)
+    {
+        close(con);
+    }
+
+    //one epoll over the read ends of 8 pipes: a single wait returns the two that have data
+    static int ends[8][2];
+    int ep = epoll_create();
+    int npipes = 0;
+    for(; ep >= 0 && npipes < 8 && pipe(ends[npipes]) == 0; npipes++)
+    {
+        struct epoll_event ev = {EPOLLIN, npipes};
+        epoll_ctl(ep, EPOLL_CTL_ADD, ends[npipes][0], &ev);
+    }
+    if(npipes == 8)
+    {
+        write(ends[2][1], "x", 1);
+        write(ends[5][1], "y", 1);
+        struct epoll_event events[8];
+        int n = epoll_wait(ep, events, 8, 0);
+        for(int i = 0; i < n; i++)
+        {
+            char ch;
+            read(ends[events[i].data][0], &ch, 1);
+            printf("epoll: pipe %d readable, got %c\n", events[i].data, ch);
+        }
+        printf("epoll: %d ready after reading\n", epoll_wait(ep, events, 8, EPOLL_NOWAIT));
+    }
+    for(int i = 0; i < npipes; i++)
+    {
+        close(ends[i][0]);
+        close(ends[i][1]);
+    }
+    if(ep >= 0)
+    {
+        close(ep);
+    }
+
+    //clock and scheduler state from the vDSO page, no system calls
+    printf("uptime %d us, cpu time %d us, switched in %d times\n", (int)uptime_us(), (int)cpu_time_us(),
+        vdso_page->switches);
+    return 0;
+}
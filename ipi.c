@@ -0,0 +1,158 @@
+#include "ipi.h"
+#include "softirq.h"
+
+//inbox and statistics of one hart, written by every hart that sends to it
+struct ipi_cpu
+{
+    struct ipi_call *inbox;             // remote calls, newest first
+    uint32_t pending;                   // an IPI is on its way and has not been handled yet
+    uint32_t need_resched;              // another hart asked this one to reschedule
+    uint64_t sent_at;                   // time the IPI in flight was sent
+    uint32_t sent;                      // IPIs sent to this hart
+    uint32_t coalesced;                 // requests that found an IPI already on its way
+    uint32_t received;
+    uint32_t max_latency;               // time CSR ticks from sending an IPI to handling it
+    uint64_t total_latency;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct ipi_cpu ipi_cpus[HARTS_MAX];
+
+//enable the supervisor software interrupt on this hart
+void ipi_init_hart(void)
+{
+    __asm__ __volatile__("csrs sie, %0" :: "r"(SIE_SSIE));
+}
+
+//raise the software interrupt of hart unless one is pending there already
+static void kick(uint32_t hart)
+{
+    struct ipi_cpu *t = &ipi_cpus[hart];
+    //sequentially consistent: a request queued after the target cleared pending must not be missed by it
+    if(__atomic_exchange_n(&t->pending, 1, __ATOMIC_SEQ_CST))
+    {
+        __atomic_fetch_add(&t->coalesced, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    t->sent_at = read_time();
+    __atomic_fetch_add(&t->sent, 1, __ATOMIC_RELAXED);
+    if(hart == this_hart())
+    {
+        __asm__ __volatile__("csrs sip, %0" :: "r"(SIP_SSIP));
+        return;
+    }
+    struct sbiret ret = sbi_call(1, cpus[hart].hartid, 0, 0, 0, 0, SBI_IPI_SEND, SBI_EXT_IPI);
+    if(ret.error)
+    {
+        PANIC("sbi send_ipi to hart %d failed: %d", cpus[hart].hartid, ret.error);
+    }
+}
+
+//ask hart to run the scheduler now, e.g. because a process was queued there while it idles
+void ipi_resched(uint32_t hart)
+{
+    __atomic_store_n(&ipi_cpus[hart].need_resched, 1, __ATOMIC_SEQ_CST);
+    kick(hart);
+}
+
+/*
+    Run c->fn(c->arg) on hart from its software interrupt handler. Returns at once; c must stay valid until
+    c->done is set. Callable with interrupts masked and from interrupt handlers.
+*/
+void ipi_call_async(uint32_t hart, struct ipi_call *c)
+{
+    struct ipi_cpu *t = &ipi_cpus[hart];
+    c->done = 0;
+    struct ipi_call *head = __atomic_load_n(&t->inbox, __ATOMIC_RELAXED);
+    do
+    {
+        c->next = head;
+    } while(!__atomic_compare_exchange_n(&t->inbox, &head, c, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    kick(hart);
+}
+
+/*
+    Run fn(arg) on hart and wait for it to return. The target needs the kernel lock to run the call, so the
+    caller lets go of it while waiting and must not rely on it across the call.
+*/
+void ipi_call(uint32_t hart, void (*fn)(void *arg), void *arg)
+{
+    if(hart == this_hart())
+    {
+        fn(arg);
+        return;
+    }
+    struct ipi_call c;
+    c.fn = fn;
+    c.arg = arg;
+    ipi_call_async(hart, &c);
+
+    kernel_unlock();
+    while(!__atomic_load_n(&c.done, __ATOMIC_ACQUIRE))
+    {
+        __asm__ __volatile__("nop");
+    }
+    kernel_lock();
+}
+
+//supervisor software interrupt: run the calls in the inbox in the order they were queued, then reschedule if asked to
+void handle_soft_trap(struct trap_frame *f)
+{
+    (void)f;
+    struct ipi_cpu *c = &ipi_cpus[this_hart()];
+    __asm__ __volatile__("csrc sip, %0" :: "r"(SIP_SSIP));
+
+    uint32_t latency = (uint32_t)(read_time() - c->sent_at);
+    c->received++;
+    c->total_latency += latency;
+    if(latency > c->max_latency)
+    {
+        c->max_latency = latency;
+    }
+    //cleared before the inbox is taken: whatever is queued from now on comes with a new IPI
+    __atomic_exchange_n(&c->pending, 0, __ATOMIC_SEQ_CST);
+
+    struct ipi_call *call = __atomic_exchange_n(&c->inbox, NULL, __ATOMIC_SEQ_CST);
+    struct ipi_call *fifo = NULL;
+    while(call)
+    {
+        struct ipi_call *next = call->next;
+        call->next = fifo;
+        fifo = call;
+        call = next;
+    }
+    while(fifo)
+    {
+        struct ipi_call *next = fifo->next;     // read first, the caller may reuse the call once done is set
+        fifo->fn(fifo->arg);
+        __atomic_store_n(&fifo->done, 1, __ATOMIC_RELEASE);
+        fifo = next;
+    }
+
+    if(__atomic_exchange_n(&c->need_resched, 0, __ATOMIC_SEQ_CST))
+    {
+        if(softirq_active())
+        {
+            softirq_request_resched();  // bottom halves are not preempted, softirq_exit() yields when they are done
+            return;
+        }
+        if(this_cpu()->rcu_nesting)
+        {
+            this_cpu()->rcu_resched = true; // neither are RCU readers, rcu_read_unlock() yields
+            return;
+        }
+        yield();
+    }
+}
+
+//print the IPI counts and delivery latency of every hart
+void ipi_dump(void)
+{
+    uint32_t div = ticks_per_us();
+    for(uint32_t hart = 0; hart < nr_cpus; hart++)
+    {
+        struct ipi_cpu *c = &ipi_cpus[hart];
+        uint32_t avg = scaled_div(c->total_latency, c->received) / div;
+        printf("ipi: cpu %d: %d sent, %d coalesced, %d received, latency avg %d us max %d us\n", hart, c->sent,
+            c->coalesced, c->received, avg, c->max_latency / div);
+    }
+}
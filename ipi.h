@@ -0,0 +1,31 @@
+#pragma once
+#include "kernel.h"
+
+/*
+    Inter-processor interrupts. Every hart has a lock-free multi-producer/single-consumer inbox of remote function
+    calls and a reschedule flag. A sender queues its request and then raises a supervisor software interrupt on the
+    target with the SBI IPI extension, unless one is already on its way: a burst of requests costs one interrupt.
+    The target drains its inbox in handle_soft_trap() and reschedules if asked to.
+    Wakeups need no message: the waker queues the process on its hart's run queue under the kernel lock and
+    sends a reschedule request (see sched_enqueue()).
+*/
+#define SBI_EXT_IPI         0x735049
+#define SBI_IPI_SEND        0
+#define SIE_SSIE            (1u << 1)       // supervisor software interrupt enable
+#define SIP_SSIP            (1u << 1)       // supervisor software interrupt pending
+
+//a function to run on another hart; owned by the caller until done is set
+struct ipi_call
+{
+    struct ipi_call *next;
+    void (*fn)(void *arg);
+    void *arg;
+    uint32_t done;                      // set by the target after fn returned
+};
+
+void ipi_init_hart(void);
+void ipi_resched(uint32_t hart);
+void ipi_call_async(uint32_t hart, struct ipi_call *c);
+void ipi_call(uint32_t hart, void (*fn)(void *arg), void *arg);
+void handle_soft_trap(struct trap_frame *f);
+void ipi_dump(void);
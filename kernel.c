@@ -1,19 +1,45 @@
 #include "kernel.h"
 #include "common.h"
+#include "fiber.h"
+#include "sched.h"
+#include "plic.h"
+#include "virtio.h"
+#include "bcache.h"
+#include "fdt.h"
+#include "vm.h"
+#include "ramfs.h"
+#include "elf.h"
+#include "prof.h"
+#include "pmu.h"
+#include "boot.h"
+#include "heap.h"
+#include "softirq.h"
+#include "uring.h"
+#include "smp.h"
+#include "pcache.h"
+#include "ipi.h"
+#include "tlb.h"
+#include "rcu.h"
+#include "vdso.h"
+#include "latency.h"
+#include "zram.h"
 
 typedef unsigned char uint8_t;
 typedef unsigned int uint32_t;
 typedef uint32_t size_t;
 
 extern char __bss[], __bss_end[], __stack_top[];
-extern char __free_ram[], __free_ram_end[];
-struct process procs[PROCS_MAX]; // All process control structures.
+extern char __free_ram[];
+//All process control structures. Not cleared at boot: slots below nr_procs have been initialised by create_process()
+__attribute__((section(".noinit"))) struct process procs[PROCS_MAX];
+int nr_procs = 0;   // high-water mark of used slots, loops over procs[] stop here
+struct process *proc_list = NULL;   // live processes, newest first, read under RCU
+static struct process *pid_hash[PID_HASH_SIZE];    // live processes with pid > 0 by pid, read under RCU
+static int next_pid = 1;            // pids are not reused, a stale pid never finds a new process
 struct process *proc_a;
 struct process *proc_b;
-struct process *current_proc; //currently running process
-struct process *idle_proc;  //idle process
+uint32_t timebase_freq = 10000000;  // QEMU virt until kernel_main() reads the device tree
 void* global_base = NULL; //head of the linked list, initalised to NULL
-volatile int switch_task = 0;
 
 //read the RTC counter
 uint32_t read_rtc()
@@ -23,10 +49,24 @@ uint32_t read_rtc()
 }
 
 
-//write to stimecmp
+//read the full 64-bit time CSR. On RV32 the upper half is in timeh, re-read if it changed while reading the lower half
+uint64_t read_time(void)
+{
+    uint32_t hi, lo;
+    do
+    {
+        hi = READ_CSR(timeh);
+        lo = READ_CSR(time);
+    } while(hi != READ_CSR(timeh));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+//write to stimecmp (0x14d) and stimecmph (0x15d)
 void write_to_stimecmp(uint64_t x)
 {
-    WRITE_CSR(0x14d, x);
+    WRITE_CSR(0x14d, 0xffffffff);           // no spurious interrupt while the two halves are inconsistent
+    WRITE_CSR(0x15d, (uint32_t)(x >> 32));
+    WRITE_CSR(0x14d, (uint32_t)x);
 }
 
 //function to clear timer interrupt pending bit 
@@ -64,14 +104,56 @@ struct sbiret sbi_call(long arg0, long arg1, long arg2, long arg3, long arg4,
 }
 
 
-void putchar(char ch){
+void sbi_putchar(char ch){
     sbi_call(ch, 0, 0, 0, 0, 0, 0, 1/* Console Putchar */);
 }
 
+//console output is held back while booting, see boot.c
+void putchar(char ch){
+    if(boot_console_put(ch))
+    {
+        return;
+    }
+    sbi_putchar(ch);
+}
+
+/*
+    Write len bytes to the console. Where the firmware has the SBI debug console extension it reads them straight
+    from memory, one call for the whole buffer instead of one per character; buf must be a kernel address.
+*/
+void console_write(const uint8_t *buf, uint32_t len)
+{
+    static bool no_dbcn = false;
+    //held back byte by byte while booting, see boot.c
+    while(len && boot_console_put(*buf))
+    {
+        buf++;
+        len--;
+    }
+    while(len && !no_dbcn)
+    {
+        struct sbiret ret = sbi_call(len, (paddr_t)buf, 0, 0, 0, 0, SBI_DBCN_WRITE, SBI_EXT_DBCN);
+        if(ret.error || !ret.value)
+        {
+            no_dbcn = true;
+            break;
+        }
+        buf += ret.value;
+        len -= ret.value;
+    }
+    while(len--)
+    {
+        sbi_putchar(*buf++);
+    }
+}
+
 //delay function implements a busy wait to prevent the character output from becoming too fast, which would make your terminal unresponsive
+//The wait touches nothing shared, so the other harts may use the kernel meanwhile.
 void delay(void) {
+    kernel_unlock();
     for (int i = 0; i < 200000000; i++)
         __asm__ __volatile__("nop"); // do nothing
+    kernel_lock();
 }
 
 /*note : The naked attribute tells the compiler not to generate any other code than the inline assembly */
@@ -123,10 +205,83 @@ __attribute__((naked)) void switch_context(uint32_t *prev_sp, uint32_t *next_sp)
     );
 }
 
+/*
+    First code run by a new process. switch_context() "returns" here with the entry point in s0.
+    A process can be switched to for the first time with interrupts masked (from a trap handler or
+    from wait_queue_sleep()), so interrupts are enabled before jumping to the entry point.
+*/
+__attribute__((naked)) void process_entry(void)
+{
+    __asm__ __volatile__(
+        "csrsi sstatus, 2\n"   // set sstatus.SIE
+        "jr s0\n"              // jump to the entry point
+    );
+}
+
+//make a fully initialised process visible to lockless readers; updaters are serialized by the kernel lock
+static void publish_process(struct process *proc)
+{
+    proc->list_next = proc_list;
+    rcu_assign_pointer(proc_list, proc);
+    if(proc->pid > 0)
+    {
+        struct process **bucket = &pid_hash[proc->pid & (PID_HASH_SIZE - 1)];
+        proc->pid_next = *bucket;
+        rcu_assign_pointer(*bucket, proc);
+    }
+}
+
+//unlink proc from the process list and the pid table; readers already on it keep following its next pointers
+static void unpublish_process(struct process *proc)
+{
+    for(struct process **pp = &proc_list; *pp; pp = &(*pp)->list_next)
+    {
+        if(*pp == proc)
+        {
+            rcu_assign_pointer(*pp, proc->list_next);
+            break;
+        }
+    }
+    if(proc->pid > 0)
+    {
+        for(struct process **pp = &pid_hash[proc->pid & (PID_HASH_SIZE - 1)]; *pp; pp = &(*pp)->pid_next)
+        {
+            if(*pp == proc)
+            {
+                rcu_assign_pointer(*pp, proc->pid_next);
+                break;
+            }
+        }
+    }
+}
+
+//RCU callback of an exited process: no reader can reach the slot any more, create_process() may reuse it
+static void release_process(struct rcu_head *head)
+{
+    struct process *proc = (struct process *)((char *)head - offsetof(struct process, rcu));
+    proc->state = PROC_UNUSED;
+}
+
+/*
+    Look up a live process by pid without taking a lock. The caller stays in an RCU read-side critical section,
+    or keeps interrupts masked, for as long as it uses the result.
+    returns:
+        struct process *: the process, NULL if no live process has this pid
+*/
+struct process *find_process(int pid)
+{
+    struct process *proc = rcu_dereference(pid_hash[pid & (PID_HASH_SIZE - 1)]);
+    while(proc && proc->pid != pid)
+    {
+        proc = rcu_dereference(proc->pid_next);
+    }
+    return proc && proc->state != PROC_EXITED ? proc : NULL;
+}
+
 /*
     Process initialisation function
     parameters:
-        uint32_t pc : entry point
+        uint32_t pc : entry point, NULL for the idle process of a hart (pid 0, never queued)
 
     returns:
         struct process *proc: pointer to the created process's struct
@@ -136,7 +291,7 @@ struct process *create_process(void (*entry)(void))
     //find an unused process control strucuture
     struct process *proc = NULL;
     int i;
-    for(i = 0; i < PROCS_MAX; i++)
+    for(i = 0; i < nr_procs; i++)
     {
         if(procs[i].state == PROC_UNUSED)
         {
@@ -147,8 +302,14 @@ struct process *create_process(void (*entry)(void))
 
     if(!proc)
     {
-        PANIC("no free process slots available\n");
+        if(nr_procs == PROCS_MAX)
+        {
+            PANIC("no free process slots available\n");
+        }
+        proc = &procs[nr_procs++];
     }
+    //everything but the stack, which is not read before it is written
+    memset(proc, 0, offsetof(struct process, stack));
 
     // Stack callee-saved registers. These register values will be restored in
     // the first context switch in switch_context.
@@ -168,13 +329,25 @@ struct process *create_process(void (*entry)(void))
     *--sp = 0;                      // s3
     *--sp = 0;                      // s2
     *--sp = 0;                      // s1
-    *--sp = 0;                      // s0
-    *--sp = (uint32_t) *entry;          // ra
+    *--sp = (uint32_t) *entry;      // s0: entry point, jumped to by process_entry
+    *--sp = (uint32_t) process_entry;   // ra
 
     //update the process control block for this process
-    proc->pid = i + 1;
-    proc->state = PROC_RUNNABLE;
+    proc->pid = entry ? next_pid++ : 0;
     proc->sp = (uint32_t) sp;
+    proc->fibers = NULL;
+    proc->page_table = NULL;
+    proc->mmap_next = 0;
+    memset(proc->vmas, 0, sizeof(proc->vmas));
+    proc->exec_path = NULL;
+    fs_close_all(proc);
+
+    //the process becomes visible to the scheduler as soon as it is runnable
+    uint32_t sie = irq_save();
+    proc->state = PROC_RUNNABLE;
+    sched_init_process(proc);
+    publish_process(proc);
+    irq_restore(sie);
     return proc;
 
 
@@ -183,39 +356,170 @@ struct process *create_process(void (*entry)(void))
 //scheduler function
 void yield(void)
 {
-    //search for a runnable process
-    struct process *next = idle_proc;
-    for(int i = 0; i < PROCS_MAX; i++)
-    {
-        struct process *proc = &procs[(current_proc->pid + i)%PROCS_MAX];
-        //this check skips the idle process
-        if(proc->state == PROC_RUNNABLE && proc->pid > 0)
-        {
-            next = proc;
-            break;
-        }
-    }
+    //the caller holds no RCU references across a switch
+    rcu_note_qs();
+
+    //the switch must not be interrupted; the caller's interrupt state is restored when it is switched back in
+    uint32_t sie = irq_save();
+    struct process *next = sched_pick_next();
+
+    //start the time slice of the incoming process and program stimecmp for it
+    sched_switch(current_proc, next);
 
     // If there's no runnable process other than the current one, return and continue processing
     if(next == current_proc)
     {
+        irq_restore(sie);
         return;
     }
 
-    //store a pointer to the bottom of the kernel stack(in stacks, the bottom is the highest memory address)
-    //when allocating registers on the stack, the stack pointer always starts at an element one above so sizeof(next->stack) 
-    __asm__ __volatile__(
-        "csrw sscratch, %[sscratch]\n"
-        :
-        : [sscratch] "r" ((uint32_t) &next->stack[sizeof(next->stack)])
-    );
+     static bool first_switch = true;     // of the boot hart, the other harts come up later
+     if(first_switch)
+     {
+         boot_mark("first task");
+         first_switch = false;
+     }
 
      // Context switch
      struct process *prev = current_proc;
+     pmu_switch(prev);
      current_proc = next;
+     vm_switch(next);
      switch_context(&prev->sp, &next->sp);
 
+     irq_restore(sie);
+}
 
+/*
+    Leave the kernel and start running user code at entry with the stack pointer at user_sp.
+    The kernel stack of the current process is empty from here on; the next trap from user mode starts at its top.
+*/
+void enter_user(vaddr_t entry, vaddr_t user_sp)
+{
+    boot_complete();
+    irq_save();     // no traps until sret, sscratch holds this hart's struct cpu from here on
+    this_cpu()->kernel_sp = (uint32_t)&current_proc->stack[sizeof(current_proc->stack)];
+    kernel_unlock();
+    __asm__ __volatile__(
+        "csrw sepc, %[entry]\n"
+        "csrw sscratch, tp\n"
+        "csrc sstatus, %[spp]\n"       // sret to user mode
+        "csrs sstatus, %[spie]\n"      // with interrupts enabled
+        "mv sp, %[user_sp]\n"
+        "mv tp, zero\n"
+        "sret\n"
+        :
+        : [entry] "r" (entry), [user_sp] "r" (user_sp),
+          [spp] "r" (SSTATUS_SPP), [spie] "r" (SSTATUS_SPIE)
+    );
+    __builtin_unreachable();
+}
+
+/*
+    Terminate the calling process. Its slot can be reused by create_process() after an RCU grace period, which
+    also covers switching away from its kernel stack: this hart passes a quiescent state only after that.
+*/
+void process_exit(void)
+{
+    uring_exit(current_proc);
+    irq_save();
+    fs_close_all(current_proc);
+    vm_free(current_proc);
+    sched_set_normal(current_proc);
+    current_proc->state = PROC_EXITED;
+    unpublish_process(current_proc);
+    call_rcu(&current_proc->rcu, release_process);
+    yield();
+    PANIC("exited process was scheduled");
+}
+
+//make a blocked process runnable again
+void wake_process(struct process *proc)
+{
+    proc->state = PROC_RUNNABLE;
+    sched_enqueue(proc);
+}
+
+/*
+    Put the caller to sleep on wq until wait_queue_wake_one()/wait_queue_wake_all().
+    If the current task runs fibers, only the calling fiber is parked and the task keeps running its other fibers.
+    Interrupts are masked from enqueueing until the switch so a wakeup from an interrupt handler cannot be lost.
+*/
+void wait_queue_sleep(struct wait_queue *wq)
+{
+    uint32_t sie = irq_save();
+
+    //the waiter lives on this stack, which stays untouched until we are woken up
+    struct waiter w;
+    w.proc = current_proc;
+    w.fiber = fiber_current();
+    w.next = NULL;
+    if(wq->tail)
+    {
+        wq->tail->next = &w;
+    }
+    else
+    {
+        wq->head = &w;
+    }
+    wq->tail = &w;
+
+    if(w.fiber)
+    {
+        fiber_block();
+    }
+    else
+    {
+        current_proc->state = PROC_BLOCKED;
+        yield();
+    }
+
+    irq_restore(sie);
+}
+
+/*
+    Wake the oldest sleeper on wq. Safe to call from interrupt handlers.
+    returns:
+        int: 1 if a sleeper was woken, 0 if the queue was empty
+*/
+int wait_queue_wake_one(struct wait_queue *wq)
+{
+    uint32_t sie = irq_save();
+    struct waiter *w = wq->head;
+    if(!w)
+    {
+        irq_restore(sie);
+        return 0;
+    }
+
+    wq->head = w->next;
+    if(!wq->head)
+    {
+        wq->tail = NULL;
+    }
+
+    //the waiter is unlinked before the wakeup, after which its stack frame may disappear
+    if(w->fiber)
+    {
+        fiber_wake(w->fiber);
+    }
+    else
+    {
+        wake_process(w->proc);
+    }
+    irq_restore(sie);
+    return 1;
+}
+
+//Wake every sleeper on wq and return how many were woken
+int wait_queue_wake_all(struct wait_queue *wq)
+{
+    int n = 0;
+    while(wait_queue_wake_one(wq))
+    {
+        n++;
+    }
+    return n;
 }
 
 
@@ -251,6 +555,56 @@ void proc_b_entry(void)
 
 
 
+#ifdef PROFILE
+//profile the system for PROFILE_SECONDS, then print the samples for profsym.py
+#define PROFILE_SECONDS 10
+void prof_entry(void)
+{
+    sched_set_nice(current_proc, 19);
+    uint64_t end = read_time() + (uint64_t)PROFILE_SECONDS * timebase_freq;
+    prof_start(PROF_DEFAULT_HZ);
+    while(read_time() < end)
+    {
+        yield();
+    }
+    prof_stop();
+    prof_dump();
+    pmu_dump();
+    ipi_dump();
+    tlb_dump();
+    rcu_dump();
+    heap_dump();
+    process_exit();
+}
+#endif
+
+#ifdef HEAP_DEBUG
+//print the allocator state every HEAP_DUMP_SECONDS so growing call sites stand out
+#define HEAP_DUMP_SECONDS 5
+void heap_watch_entry(void)
+{
+    sched_set_nice(current_proc, 19);
+    while(1)
+    {
+        uint64_t next = read_time() + (uint64_t)HEAP_DUMP_SECONDS * timebase_freq;
+        while(read_time() < next)
+        {
+            yield();
+        }
+        heap_dump();
+    }
+}
+#endif
+
+#ifdef BENCHMARK
+void blk_bench_entry(void)
+{
+    virtio_blk_bench();
+    bcache_bench();
+    process_exit();
+}
+#endif
+
 /*
  * Function to allocate memory in pages (1 page = 4KB) dynamically. Also knows as bump allocator or linear allocator.
  * This function does not perform deallocation of memory
@@ -264,13 +618,13 @@ void proc_b_entry(void)
  */
 paddr_t bump_allocator(uint32_t n)
 {
-    //__free_ram and __free_ram_end represent the start and end addresses of the free ram
+    //__free_ram and free_ram_end represent the start and end addresses of the free ram
     static paddr_t next_paddr = (paddr_t)__free_ram; //this is a static variable so its retained after function calls
     paddr_t paddr = next_paddr;
     next_paddr += n*PAGE_SIZE; //allocate n pages
 
-    //if it tried to allocate memory beyond __free_ram_end do a PANIC check
-    if(next_paddr > (paddr_t)__free_ram_end)
+    //if it tried to allocate memory beyond free_ram_end do a PANIC check
+    if(next_paddr > free_ram_end)
     {
         PANIC("ran out of memory\n");
     }
@@ -283,25 +637,132 @@ paddr_t bump_allocator(uint32_t n)
 
 
 
+//end of the free RAM: the end of the /memory range the kernel was loaded into, set by kernel_main() from the device tree
+paddr_t free_ram_end = 0;
+
+//pages inside the free RAM that sbrk() steps over, set by reserve_pages() (e.g. the initrd QEMU loaded there)
+static paddr_t reserved_start = 0;
+static paddr_t reserved_end = 0;
+
+//__free_ram and free_ram_end represent the start and end addresses of the free ram
+static paddr_t next_paddr = 0; //first page sbrk() has not handed out, 0 until the page_meta table is set up
+
+//first page after the page_meta table, which has one entry per page of free RAM
+static paddr_t sbrk_first_page(void)
+{
+    uint32_t npages = (free_ram_end - (paddr_t)__free_ram) / PAGE_SIZE;
+    return align_up((paddr_t)__free_ram + npages * META_SIZE, PAGE_SIZE);
+}
+
+/*
+    Keep the allocator away from [start, end), e.g. the initrd QEMU loaded into our free RAM.
+    Must be called before the first allocation. sbrk() skips the range, the RAM above it is still used.
+*/
+void reserve_pages(paddr_t start, paddr_t end)
+{
+    if(end <= (paddr_t)__free_ram || start >= free_ram_end)
+    {
+        return;     // no overlap with the free RAM
+    }
+    if(global_base || start < sbrk_first_page())
+    {
+        PANIC("cannot reserve %x-%x", start, end);
+    }
+    start &= ~(PAGE_SIZE - 1);
+    end = end < free_ram_end ? align_up(end, PAGE_SIZE) : free_ram_end;
+    //a single hole is enough for the boot modules QEMU loads; two reservations become one covering both
+    if(reserved_end)
+    {
+        start = start < reserved_start ? start : reserved_start;
+        end = end > reserved_end ? end : reserved_end;
+    }
+    reserved_start = start;
+    reserved_end = end;
+}
+
+//one page_meta per page of free RAM, indexed by page frame number. The table occupies the first pages of free RAM.
+page_meta *page_metas = NULL;
+
+//page_meta entry describing the block that starts at the page ptr
+page_meta* page_meta_of(void* ptr)
+{
+    return &page_metas[((paddr_t)ptr - (paddr_t)__free_ram) / PAGE_SIZE];
+}
+
+//first page of the block described by a page_meta entry
+void* page_of(page_meta* meta)
+{
+    return (void*)((paddr_t)__free_ram + (uint32_t)(meta - page_metas) * PAGE_SIZE);
+}
+
+//pages sbrk() manages in total (for heap.c)
+uint32_t sbrk_pages_total(void)
+{
+    return (free_ram_end - sbrk_first_page() - (reserved_end - reserved_start)) / PAGE_SIZE;
+}
+
+/*
+    Pages sbrk() has not handed out yet (for heap.c).
+    Parameters:
+        uint32_t *largest: set to the largest request sbrk() can still serve
+*/
+uint32_t sbrk_pages_left(uint32_t *largest)
+{
+    paddr_t next = next_paddr ? next_paddr : sbrk_first_page();
+    uint32_t below = 0, above;
+    if(next < reserved_start)
+    {
+        below = reserved_start - next;
+        above = free_ram_end - reserved_end;
+    }
+    else
+    {
+        above = free_ram_end - next;
+    }
+    *largest = (below > above ? below : above) / PAGE_SIZE;
+    return (below + above) / PAGE_SIZE;
+}
+
 /* 
-    This function is a modification of the bump allocator. this function allocates n pages + META_SIZE
+    This function is a modification of the bump allocator. this function allocates n pages.
+    On the first call the page_meta table is reserved at the start of free RAM.
     Parameters:
         uint32_t n : no. of pages to allocate
     return:
-        void* ptr: pointer to the newly allocated chunk of space
+        void* ptr: pointer to the newly allocated chunk of space, aligned to PAGE_SIZE, (void*)-1 if the RAM is used up
 
 */
 void* sbrk(uint32_t n)
 {
-    //__free_ram and __free_ram_end represent the start and end addresses of the free ram
-    static paddr_t next_paddr = (paddr_t)__free_ram; //this is a static variable so its retained after function calls
+    if(!next_paddr)
+    {
+        page_metas = (page_meta*)__free_ram;
+        next_paddr = sbrk_first_page();
+    }
+
+    //a block never spans the reserved range; the pages below it that are left over stay unused
+    if(next_paddr < reserved_end && n > (reserved_start - next_paddr) / PAGE_SIZE)
+    {
+        next_paddr = reserved_end;
+    }
+
+    //out of memory: alloc_pages() decides whether to panic, after the hart page caches have been drained
+    if(n > (free_ram_end - next_paddr) / PAGE_SIZE)
+    {
+        return (void*)-1;
+    }
+
     paddr_t paddr = next_paddr;
-    next_paddr += (n*PAGE_SIZE) + META_SIZE; //allocate n pages + META_SIZE
+    next_paddr += n*PAGE_SIZE; //allocate n pages
 
-    //if it tried to allocate memory beyond __free_ram_end do a PANIC check
-    if(next_paddr > (paddr_t)__free_ram_end)
+    //say so while there is still time to look, not only when the last page is gone
+    static bool low_water_warned = false;
+    uint32_t largest;
+    if(!low_water_warned && sbrk_pages_left(&largest) < sbrk_pages_total() / HEAP_LOW_WATER)
     {
-        PANIC("ran out of memory\n");
+        low_water_warned = true;
+        printf("heap: less than 1/%d of the free RAM left\n", HEAP_LOW_WATER);
+        heap_dump();
     }
   
     //ensure the allocated memory is initially to zero
@@ -312,14 +773,12 @@ void* sbrk(uint32_t n)
 // If we don't find a free space we request space from the OS using sbrk and add our new block to the end of the linked list
 page_meta *request_space(page_meta *last, uint32_t n)
 {
-    page_meta *current_block; //create a pointer to the reqeuested space
-    current_block = sbrk(0); //set the current pointer
     void* request = sbrk(n); //call sbrk() to allocate n pages
-    //assert((void*)current_block == request);
     if(request == (void*)-1)
     {
         return NULL; //sbrk failed
     }
+    page_meta *current_block = page_meta_of(request); //metadata of the reqeuested space
 
     //if find_free_block() function does not find a free space then the function stores the last block of memory used in the variable pointer "last"
     //last will be NULL when allocating on the heap for the first time
@@ -340,7 +799,7 @@ page_meta *find_free_block(page_meta **last, size_t size)
 {
     page_meta *current = global_base;
     
-    while(current && !(current->free && current->size >= size))
+    while(current && !(current->free == 1 && current->size >= size))
     {
         *last = current;
         current = current->next;
@@ -351,38 +810,34 @@ page_meta *find_free_block(page_meta **last, size_t size)
 
 
 /*
-    Modified memory allocation function. 
+    Take a block of at least n pages from the global block list, growing the heap with sbrk() if none is free.
     Parameters:
         uint32_t n: Number of pages to allocate
     return:
-        void* ptr: Pointer to the newly allocated chunk of space
+        page_meta* block: metadata of the block, marked allocated; NULL if memory is exhausted
 */
-void* alloc_pages(uint32_t n)
+page_meta *alloc_block(uint32_t n)
 {
     page_meta* block;
+    uint32_t sie = irq_save();
 
     //first call
     if(!global_base)
     {
         block = request_space(NULL, n);
-        if(!block)
+        if(block)
         {
-            return NULL;
+            global_base = block;
         }
-        global_base = block;
     }
     else
     {
         page_meta *last = global_base; //update the last pointer
-        block = find_free_block(&last, n); //last gets updated and after the function is done running, last points to the last block that is occupied
+        block = find_free_block(&last, n*PAGE_SIZE); //last gets updated and after the function is done running, last points to the last block that is occupied
         //failed to find a free block
         if(!block)
         {
             block = request_space(last, n);
-            if(!block)
-            {
-                return NULL;
-            }
         }
         //found a free block
         else
@@ -391,15 +846,70 @@ void* alloc_pages(uint32_t n)
         }
     }
 
-    //block points to the header (the metadata) of the allocated block but malloc returns the pointer to start address of the block so we do block+1 (increment by sizeof(block_meta))
-    return (block+1);
+    irq_restore(sie);
+    return block;
+}
+
+//give a block back to the global block list
+void free_block(page_meta *block)
+{
+    block->free = 1;
 }
 
-// this function returns the original page_meta, 
-// -1 moves the ptr from the user_data back to the struct page_meta. Since the ptr points to the original datatype the return type is page_meta
+/*
+    Modified memory allocation function. Blocks of 1, 2 and 4 pages come from the page cache of this hart
+    (pcache.c) and only reach the global block list in batches.
+    Parameters:
+        uint32_t n: Number of pages to allocate
+    return:
+        void* ptr: Pointer to the newly allocated chunk of space
+*/
+static page_meta *try_alloc_block(uint32_t n)
+{
+    page_meta* block = pcache_alloc(n);
+    if(!block)
+    {
+        block = alloc_block(n);
+    }
+    if(!block && pcache_drain_all())
+    {
+        block = alloc_block(n);     // memory pressure: the pages cached on the harts may be enough
+    }
+    return block;
+}
+
+void* alloc_pages(uint32_t n)
+{
+    page_meta* block = try_alloc_block(n);
+    //still nothing: drop idle buffer cache blocks, which cost a disk read at most, until the request fits
+    while(!block && bcache_shrink(n))
+    {
+        block = try_alloc_block(n);
+    }
+    //then swap cold user pages out to zram until the request fits or nothing is left to swap
+    while(!block && zram_reclaim(n))
+    {
+        block = try_alloc_block(n);
+    }
+    if(!block)
+    {
+        heap_dump();
+        PANIC("ran out of memory\n");
+    }
+
+    heap_count_alloc(n);
+#ifdef HEAP_DEBUG
+    block->caller = (uint32_t)__builtin_return_address(0);
+#endif
+
+    //block points to the metadata of the allocated block, return the pages it describes
+    return page_of(block);
+}
+
+// this function returns the original page_meta of an allocated block
 page_meta* get_page_ptr(void* ptr)
 {
-    return (page_meta*)ptr - 1;
+    return page_meta_of(ptr);
 }
 
 
@@ -413,85 +923,129 @@ void free(void *ptr)
 
     page_meta* page_ptr = get_page_ptr(ptr);
     //assert(page_ptr->free == 0);
-    page_ptr->free = 1;
+    if(!pcache_free(page_ptr))
+    {
+        free_block(page_ptr);
+    }
 
 }
 
+#define TRAP_FRAME_SIZE_STR "4 * 36"    // TRAP_FRAME_SIZE as a string for the assembler
+
+/*
+    Trap entry and exit shared by every vector. sscratch is 0 while the hart runs kernel code and holds the hart's
+    struct cpu while it runs user mode, whose kernel_sp is the top of the current process's kernel stack.
+    So a trap from user mode switches to the kernel stack and a trap from the kernel stays on the stack it interrupted;
+    either way tp points to the struct cpu in the kernel.
+    sepc and sstatus are saved in the trap frame, which lets the handler yield() to another process. The process may
+    then come back on another hart, so tp is only restored from the frame when returning to user mode.
+*/
+#define TRAP_HANDLER(handler) \
+    "csrrw tp, sscratch, tp\n"      /* tp = struct cpu if we came from user mode, 0 otherwise */ \
+    "bnez tp, 1f\n" \
+    "csrr tp, sscratch\n"           /* trap from the kernel: tp was the struct cpu already */ \
+    "sw sp, " CPU_TRAP_SP "(tp)\n" \
+    "j 2f\n" \
+    "1:\n" \
+    "sw sp, " CPU_TRAP_SP "(tp)\n" \
+    "lw sp, " CPU_KERNEL_SP "(tp)\n" \
+    "2:\n" \
+    "addi sp, sp, -" TRAP_FRAME_SIZE_STR "\n" \
+    "sw ra,  4 * 0(sp)\n" \
+    "sw gp,  4 * 1(sp)\n" \
+    "sw t0,  4 * 3(sp)\n" \
+    "sw t1,  4 * 4(sp)\n" \
+    "sw t2,  4 * 5(sp)\n" \
+    "sw t3,  4 * 6(sp)\n" \
+    "sw t4,  4 * 7(sp)\n" \
+    "sw t5,  4 * 8(sp)\n" \
+    "sw t6,  4 * 9(sp)\n" \
+    "sw a0,  4 * 10(sp)\n" \
+    "sw a1,  4 * 11(sp)\n" \
+    "sw a2,  4 * 12(sp)\n" \
+    "sw a3,  4 * 13(sp)\n" \
+    "sw a4,  4 * 14(sp)\n" \
+    "sw a5,  4 * 15(sp)\n" \
+    "sw a6,  4 * 16(sp)\n" \
+    "sw a7,  4 * 17(sp)\n" \
+    "sw s0,  4 * 18(sp)\n" \
+    "sw s1,  4 * 19(sp)\n" \
+    "sw s2,  4 * 20(sp)\n" \
+    "sw s3,  4 * 21(sp)\n" \
+    "sw s4,  4 * 22(sp)\n" \
+    "sw s5,  4 * 23(sp)\n" \
+    "sw s6,  4 * 24(sp)\n" \
+    "sw s7,  4 * 25(sp)\n" \
+    "sw s8,  4 * 26(sp)\n" \
+    "sw s9,  4 * 27(sp)\n" \
+    "sw s10, 4 * 28(sp)\n" \
+    "sw s11, 4 * 29(sp)\n" \
+    "csrr a0, sscratch\n"           /* tp of the interrupted code */ \
+    "sw a0,  4 * 2(sp)\n" \
+    "csrw sscratch, zero\n"         /* we are in the kernel now */ \
+    "lw a0, " CPU_TRAP_SP "(tp)\n"  /* stack pointer at the time of the trap */ \
+    "sw a0,  4 * 30(sp)\n" \
+    "csrr a0, sepc\n" \
+    "sw a0,  4 * 31(sp)\n" \
+    "csrr a0, sstatus\n" \
+    "sw a0,  4 * 32(sp)\n" \
+    "call kernel_lock\n" \
+    "sw a0,  4 * 33(sp)\n"          /* trap_return() drops the lock again if this trap took it */ \
+    "mv a0, sp\n" \
+    "call " handler "\n" \
+    "mv a0, sp\n" \
+    "call softirq_exit\n"          /* bottom halves raised by the handler, with interrupts enabled */ \
+    "csrci sstatus, 2\n"            /* no traps while sepc and sstatus are reloaded */ \
+    "mv a0, sp\n" \
+    "call trap_return\n" \
+    "lw a0,  4 * 31(sp)\n" \
+    "csrw sepc, a0\n" \
+    "lw a0,  4 * 32(sp)\n" \
+    "csrw sstatus, a0\n" \
+    "andi a0, a0, 0x100\n"          /* sstatus.SPP */ \
+    "bnez a0, 3f\n" \
+    "addi a0, sp, " TRAP_FRAME_SIZE_STR "\n"   /* returning to user mode: the next trap starts on an empty kernel stack */ \
+    "sw a0, " CPU_KERNEL_SP "(tp)\n" \
+    "csrw sscratch, tp\n" \
+    "lw tp,  4 * 2(sp)\n" \
+    "3:\n" \
+    "lw ra,  4 * 0(sp)\n" \
+    "lw gp,  4 * 1(sp)\n" \
+    "lw t0,  4 * 3(sp)\n" \
+    "lw t1,  4 * 4(sp)\n" \
+    "lw t2,  4 * 5(sp)\n" \
+    "lw t3,  4 * 6(sp)\n" \
+    "lw t4,  4 * 7(sp)\n" \
+    "lw t5,  4 * 8(sp)\n" \
+    "lw t6,  4 * 9(sp)\n" \
+    "lw a0,  4 * 10(sp)\n" \
+    "lw a1,  4 * 11(sp)\n" \
+    "lw a2,  4 * 12(sp)\n" \
+    "lw a3,  4 * 13(sp)\n" \
+    "lw a4,  4 * 14(sp)\n" \
+    "lw a5,  4 * 15(sp)\n" \
+    "lw a6,  4 * 16(sp)\n" \
+    "lw a7,  4 * 17(sp)\n" \
+    "lw s0,  4 * 18(sp)\n" \
+    "lw s1,  4 * 19(sp)\n" \
+    "lw s2,  4 * 20(sp)\n" \
+    "lw s3,  4 * 21(sp)\n" \
+    "lw s4,  4 * 22(sp)\n" \
+    "lw s5,  4 * 23(sp)\n" \
+    "lw s6,  4 * 24(sp)\n" \
+    "lw s7,  4 * 25(sp)\n" \
+    "lw s8,  4 * 26(sp)\n" \
+    "lw s9,  4 * 27(sp)\n" \
+    "lw s10, 4 * 28(sp)\n" \
+    "lw s11, 4 * 29(sp)\n" \
+    "lw sp,  4 * 30(sp)\n" \
+    "sret\n"
+
 __attribute__((naked))
 __attribute__((aligned(4)))
 void kernel_entry(void) {
     __asm__ __volatile__(
-        "csrw sscratch, sp\n"
-        "addi sp, sp, -4 * 31\n"
-        "sw ra,  4 * 0(sp)\n"
-        "sw gp,  4 * 1(sp)\n"
-        "sw tp,  4 * 2(sp)\n"
-        "sw t0,  4 * 3(sp)\n"
-        "sw t1,  4 * 4(sp)\n"
-        "sw t2,  4 * 5(sp)\n"
-        "sw t3,  4 * 6(sp)\n"
-        "sw t4,  4 * 7(sp)\n"
-        "sw t5,  4 * 8(sp)\n"
-        "sw t6,  4 * 9(sp)\n"
-        "sw a0,  4 * 10(sp)\n"
-        "sw a1,  4 * 11(sp)\n"
-        "sw a2,  4 * 12(sp)\n"
-        "sw a3,  4 * 13(sp)\n"
-        "sw a4,  4 * 14(sp)\n"
-        "sw a5,  4 * 15(sp)\n"
-        "sw a6,  4 * 16(sp)\n"
-        "sw a7,  4 * 17(sp)\n"
-        "sw s0,  4 * 18(sp)\n"
-        "sw s1,  4 * 19(sp)\n"
-        "sw s2,  4 * 20(sp)\n"
-        "sw s3,  4 * 21(sp)\n"
-        "sw s4,  4 * 22(sp)\n"
-        "sw s5,  4 * 23(sp)\n"
-        "sw s6,  4 * 24(sp)\n"
-        "sw s7,  4 * 25(sp)\n"
-        "sw s8,  4 * 26(sp)\n"
-        "sw s9,  4 * 27(sp)\n"
-        "sw s10, 4 * 28(sp)\n"
-        "sw s11, 4 * 29(sp)\n"
-
-        "csrr a0, sscratch\n"
-        "sw a0, 4 * 30(sp)\n"
-
-        "mv a0, sp\n"
-        "call handle_exception_trap\n"
-
-        "lw ra,  4 * 0(sp)\n"
-        "lw gp,  4 * 1(sp)\n"
-        "lw tp,  4 * 2(sp)\n"
-        "lw t0,  4 * 3(sp)\n"
-        "lw t1,  4 * 4(sp)\n"
-        "lw t2,  4 * 5(sp)\n"
-        "lw t3,  4 * 6(sp)\n"
-        "lw t4,  4 * 7(sp)\n"
-        "lw t5,  4 * 8(sp)\n"
-        "lw t6,  4 * 9(sp)\n"
-        "lw a0,  4 * 10(sp)\n"
-        "lw a1,  4 * 11(sp)\n"
-        "lw a2,  4 * 12(sp)\n"
-        "lw a3,  4 * 13(sp)\n"
-        "lw a4,  4 * 14(sp)\n"
-        "lw a5,  4 * 15(sp)\n"
-        "lw a6,  4 * 16(sp)\n"
-        "lw a7,  4 * 17(sp)\n"
-        "lw s0,  4 * 18(sp)\n"
-        "lw s1,  4 * 19(sp)\n"
-        "lw s2,  4 * 20(sp)\n"
-        "lw s3,  4 * 21(sp)\n"
-        "lw s4,  4 * 22(sp)\n"
-        "lw s5,  4 * 23(sp)\n"
-        "lw s6,  4 * 24(sp)\n"
-        "lw s7,  4 * 25(sp)\n"
-        "lw s8,  4 * 26(sp)\n"
-        "lw s9,  4 * 27(sp)\n"
-        "lw s10, 4 * 28(sp)\n"
-        "lw s11, 4 * 29(sp)\n"
-        "lw sp,  4 * 30(sp)\n"
-        "sret\n"
+        TRAP_HANDLER("handle_exception_trap")
     );
 }
 
@@ -583,108 +1137,263 @@ void kernel_entry(void) {
 //     );
 // }
 
+//copy a NUL terminated path out of user memory, -1 if it is not valid or too long
+static int copy_path_from_user(char *dst, const char *src)
+{
+    for(uint32_t i = 0; i < RAMFS_NAME_MAX; i++)
+    {
+        if(!user_range_ok(src + i, 1))
+        {
+            return -1;
+        }
+        dst[i] = src[i];
+        if(!dst[i])
+        {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+    SYS_PROC_STAT: the scheduler state of process pid. The lookup runs without the kernel lock, so it does not wait
+    for other harts in the kernel; the RCU read-side critical section keeps the slot from being reused while an
+    exit on another hart unlinks it. The result is copied out with the lock back, a fault on st needs it.
+    returns:
+        int: 0, -1 if no live process has this pid
+*/
+static int sys_proc_stat(int pid, struct proc_stat *st)
+{
+    struct proc_stat s;
+    kernel_unlock();
+    rcu_read_lock();
+    struct process *proc = find_process(pid);
+    if(proc)
+    {
+        s.pid = proc->pid;
+        s.cpu = proc->cpu;
+        s.nice = proc->nice;
+        s.blocked = proc->state == PROC_BLOCKED;
+    }
+    kernel_lock();
+    //64 bits are two loads on RV32, so the runtime is read under the lock charge() runs under; the reader keeps proc alive
+    if(proc)
+    {
+        s.runtime = proc->sum_exec_runtime;
+    }
+    rcu_read_unlock();      // after kernel_lock(): a preemption held back by the reader needs the lock
+    if(!proc)
+    {
+        return -1;
+    }
+    *st = s;
+    return 0;
+}
+
+//Handle an ecall from user mode. The number is in a7, the arguments in a0..a3 and the result goes back in a0.
+void handle_syscall(struct trap_frame *f)
+{
+    //system calls may sleep and may be preempted, the trap frame keeps sepc and sstatus safe
+    __asm__ __volatile__("csrsi sstatus, 2");
+
+    char path[RAMFS_NAME_MAX];
+    switch(f->a7)
+    {
+        case SYS_PUTCHAR:
+            putchar(f->a0);
+            break;
+        case SYS_EXIT:
+            process_exit();
+            break;
+        case SYS_YIELD:
+            yield();
+            break;
+        case SYS_GETPID:
+            f->a0 = current_proc->pid;
+            break;
+        case SYS_OPEN:
+            f->a0 = copy_path_from_user(path, (const char *)f->a0) < 0 ? -1 : fs_open(path, f->a1);
+            break;
+        case SYS_READ:
+            f->a0 = user_range_ok((void *)f->a1, f->a2) ? fs_read(f->a0, (void *)f->a1, f->a2) : -1;
+            break;
+        case SYS_WRITE:
+            f->a0 = user_range_ok((void *)f->a1, f->a2) ? fs_write(f->a0, (void *)f->a1, f->a2) : -1;
+            break;
+        case SYS_PIPE:
+            f->a0 = user_range_ok((void *)f->a0, 2 * sizeof(int)) ? fs_pipe((int *)f->a0) : -1;
+            break;
+        case SYS_SPLICE:
+            f->a0 = fs_splice(f->a0, f->a1, f->a2);
+            break;
+        case SYS_EPOLL_CREATE:
+            f->a0 = fs_epoll_create();
+            break;
+        case SYS_EPOLL_CTL:
+            f->a0 = f->a1 == EPOLL_CTL_DEL || user_range_ok((void *)f->a3, sizeof(struct epoll_event))
+                ? fs_epoll_ctl(f->a0, f->a1, f->a2, (struct epoll_event *)f->a3) : -1;
+            break;
+        case SYS_EPOLL_WAIT:
+            //at least one event and no more than there can be items
+            f->a0 = f->a2 - 1 < EPOLL_ITEMS_MAX && user_range_ok((void *)f->a1, f->a2 * sizeof(struct epoll_event))
+                ? fs_epoll_wait(f->a0, (struct epoll_event *)f->a1, f->a2, f->a3) : -1;
+            break;
+        case SYS_PROC_STAT:
+            f->a0 = user_range_ok((void *)f->a1, sizeof(struct proc_stat))
+                ? sys_proc_stat(f->a0, (struct proc_stat *)f->a1) : -1;
+            break;
+        case SYS_CLOSE:
+            f->a0 = fs_close(f->a0);
+            break;
+        case SYS_MMAP:
+            f->a0 = (int)f->a0 == MAP_ANON ? vm_mmap_anon(current_proc, f->a2, f->a3)
+                : (uint32_t)fs_mmap(f->a0, f->a1, f->a2, f->a3);
+            break;
+        case SYS_MUNMAP:
+            if(user_range_ok((void *)f->a0, f->a1))
+            {
+                fs_munmap((void *)f->a0, f->a1);
+            }
+            break;
+        case SYS_URING_SETUP:
+            f->a0 = uring_sys_setup(f->a0);
+            break;
+        case SYS_URING_ENTER:
+            f->a0 = uring_sys_enter(f->a0, f->a1);
+            break;
+        case SYS_SBRK:
+            f->a0 = vm_sbrk(current_proc, (int)f->a0);
+            break;
+        default:
+            printf("pid %d: unknown system call %d\n", current_proc->pid, f->a7);
+            f->a0 = -1;
+            break;
+    }
+}
+
 //Handle the exception
 void handle_exception_trap(struct trap_frame *f){
-    (void)f; // suppress unused parameter warning
     uint32_t scause = READ_CSR(scause);  //scause - type of exception. The kernel reads this to identify the type of exception
     uint32_t stval = READ_CSR(stval);    //stval - Additional information about the exception (e.g., memory address that caused the exception). Depends on the type of exception.
-    uint32_t user_pc = READ_CSR(sepc);   //sepc - Program counter at the point where the exception occurred.
+    uint32_t user_pc = f->sepc;          //sepc - Program counter at the point where the exception occurred.
+    bool from_user = !(f->sstatus & SSTATUS_SPP);
+
+    if(scause == SCAUSE_ECALL_U)
+    {
+        f->sepc += 4;   // return past the ecall
+        handle_syscall(f);
+        uring_poll(current_proc);
+        return;
+    }
+
+    //pages of user programs are populated on first touch, also when the kernel touches them on the program's behalf
+    if((scause == SCAUSE_INST_PAGE_FAULT || scause == SCAUSE_LOAD_PAGE_FAULT || scause == SCAUSE_STORE_PAGE_FAULT)
+        && stval < USER_END && (from_user || current_proc->page_table))
+    {
+        if(vm_fault(current_proc, stval, scause) == 0)
+        {
+            if(from_user)
+            {
+                uring_poll(current_proc);
+            }
+            return;
+        }
+        from_user = true;   // a bad user pointer passed to a system call kills the program, not the kernel
+    }
 
+    if(from_user)
+    {
+        printf("pid %d killed: scause=%x, stval=%x, sepc=%x\n", current_proc->pid, scause, stval, user_pc);
+        process_exit();
+    }
     PANIC("unexpected trap scause=%x, stval=%x, sepc=%x\n", scause, stval, user_pc);
 }
 
 //Handle the timer interrupt
-void handle_timer_trap()
+//bottom half of the timer interrupt, printing takes one SBI call per character
+static void timer_bottom_half(struct work *w)
+{
+    (void)w;
+    printf("Timer fired\n");
+}
+
+static struct work timer_work = WORK_INIT(timer_bottom_half);
+
+void handle_timer_trap(struct trap_frame *f)
 {
    
     clear_timer_interrupt_pending_flag();
-    printf("Timer fired\n");
-    switch_task = 1;
-    write_to_stimecmp(read_rtc() + 4000000); 
+    //user code holds no RCU references, so a tick that interrupted it is a quiescent state
+    if(!(f->sstatus & SSTATUS_SPP))
+    {
+        rcu_note_qs();
+    }
+    //profiler ticks are frequent, printing on them would swamp the console and the profile
+    if(!prof_tick(f))
+    {
+        softirq_raise(&timer_work);
+    }
+
+    //before sched_tick(), so a process woken by a timeout is runnable when it picks the next one
+    uring_timer_tick();
+
+    //sched_tick() re-arms stimecmp itself when the current process keeps the CPU
+    if(sched_tick())
+    {
+        if(softirq_active())
+        {
+            softirq_request_resched();  // bottom halves are not preempted, softirq_exit() yields when they are done
+            return;
+        }
+        if(this_cpu()->rcu_nesting)
+        {
+            this_cpu()->rcu_resched = true; // neither are RCU readers, rcu_read_unlock() yields
+            return;
+        }
+        //sepc and sstatus of the interrupted code are in the trap frame, restored by the trap exit
+        yield();
+    }
+
+    //submissions of a polled ring are picked up whenever its process is interrupted in user mode
+    if(!(f->sstatus & SSTATUS_SPP))
+    {
+        uring_poll(current_proc);
+    }
 
 }
 
 
-//timer interrupt handler without yield
+//timer interrupt handler, may preempt the interrupted process
 __attribute__((naked))
 __attribute__((aligned(4)))
 void timer_interrupt_handler(void) {
     __asm__ __volatile__(
-        "csrw sscratch, sp\n"
-        "addi sp, sp, -4 * 31\n"
-        "sw ra,  4 * 0(sp)\n"
-        "sw gp,  4 * 1(sp)\n"
-        "sw tp,  4 * 2(sp)\n"
-        "sw t0,  4 * 3(sp)\n"
-        "sw t1,  4 * 4(sp)\n"
-        "sw t2,  4 * 5(sp)\n"
-        "sw t3,  4 * 6(sp)\n"
-        "sw t4,  4 * 7(sp)\n"
-        "sw t5,  4 * 8(sp)\n"
-        "sw t6,  4 * 9(sp)\n"
-        "sw a0,  4 * 10(sp)\n"
-        "sw a1,  4 * 11(sp)\n"
-        "sw a2,  4 * 12(sp)\n"
-        "sw a3,  4 * 13(sp)\n"
-        "sw a4,  4 * 14(sp)\n"
-        "sw a5,  4 * 15(sp)\n"
-        "sw a6,  4 * 16(sp)\n"
-        "sw a7,  4 * 17(sp)\n"
-        "sw s0,  4 * 18(sp)\n"
-        "sw s1,  4 * 19(sp)\n"
-        "sw s2,  4 * 20(sp)\n"
-        "sw s3,  4 * 21(sp)\n"
-        "sw s4,  4 * 22(sp)\n"
-        "sw s5,  4 * 23(sp)\n"
-        "sw s6,  4 * 24(sp)\n"
-        "sw s7,  4 * 25(sp)\n"
-        "sw s8,  4 * 26(sp)\n"
-        "sw s9,  4 * 27(sp)\n"
-        "sw s10, 4 * 28(sp)\n"
-        "sw s11, 4 * 29(sp)\n"
-
-        "csrr a0, sscratch\n"
-        "sw a0, 4 * 30(sp)\n"
-
-        "mv a0, sp\n"
-        "call handle_timer_trap\n"
-
-        "lw ra,  4 * 0(sp)\n"
-        "lw gp,  4 * 1(sp)\n"
-        "lw tp,  4 * 2(sp)\n"
-        "lw t0,  4 * 3(sp)\n"
-        "lw t1,  4 * 4(sp)\n"
-        "lw t2,  4 * 5(sp)\n"
-        "lw t3,  4 * 6(sp)\n"
-        "lw t4,  4 * 7(sp)\n"
-        "lw t5,  4 * 8(sp)\n"
-        "lw t6,  4 * 9(sp)\n"
-        "lw a0,  4 * 10(sp)\n"
-        "lw a1,  4 * 11(sp)\n"
-        "lw a2,  4 * 12(sp)\n"
-        "lw a3,  4 * 13(sp)\n"
-        "lw a4,  4 * 14(sp)\n"
-        "lw a5,  4 * 15(sp)\n"
-        "lw a6,  4 * 16(sp)\n"
-        "lw a7,  4 * 17(sp)\n"
-        "lw s0,  4 * 18(sp)\n"
-        "lw s1,  4 * 19(sp)\n"
-        "lw s2,  4 * 20(sp)\n"
-        "lw s3,  4 * 21(sp)\n"
-        "lw s4,  4 * 22(sp)\n"
-        "lw s5,  4 * 23(sp)\n"
-        "lw s6,  4 * 24(sp)\n"
-        "lw s7,  4 * 25(sp)\n"
-        "lw s8,  4 * 26(sp)\n"
-        "lw s9,  4 * 27(sp)\n"
-        "lw s10, 4 * 28(sp)\n"
-        "lw s11, 4 * 29(sp)\n"
-        "lw sp,  4 * 30(sp)\n"
-        "sret\n"
+        TRAP_HANDLER("handle_timer_trap")
     );
 }
 
 
+//IPI handler, see ipi.c
+__attribute__((naked))
+__attribute__((aligned(4)))
+void software_interrupt_handler(void) {
+    __asm__ __volatile__(
+        TRAP_HANDLER("handle_soft_trap")
+    );
+}
+
+
+//external interrupt handler (PLIC), dispatches device interrupts
+__attribute__((naked))
+__attribute__((aligned(4)))
+void external_interrupt_handler(void) {
+    __asm__ __volatile__(
+        TRAP_HANDLER("handle_external_trap")
+    );
+}
+
+
+
 // __attribute__((naked))
 // __attribute__((aligned(4)))
 // void timer_interrupt_handler(void)
@@ -782,17 +1491,25 @@ void timer_interrupt_handler(void) {
     number. For example, a supervisor-mode timer interrupt (see Table 32) causes the pc to be set to
     BASE+0x14.
 */
-//__attribute__((naked))
-//__attribute__((aligned(4)))
+// Every slot must be exactly 4 bytes, so compressed instructions are disabled: a c.j would shift every following slot.
+__attribute__((naked))
+__attribute__((aligned(4)))
 void vector_table()
 {
     __asm__ __volatile__(
+        ".option push\n"
+        ".option norvc\n"
         "j kernel_entry\n"          // Excption handle stored at Base Address + 0
-        "j kernel_entry\n" 
+        "j software_interrupt_handler\n" // Supervisor software interrupt (IPI from another hart) at Base Address + 0x4
         "j kernel_entry\n" 
         "j kernel_entry\n" 
         "j kernel_entry\n" 
         "j timer_interrupt_handler\n"     // Timer Interrupt Hnadler stored at Base Address + 0x14 (refer Table 32 RISC-V Privileged ISA, the exceptioon code = 5 for timer interrupt)
+        "j kernel_entry\n"
+        "j kernel_entry\n"
+        "j kernel_entry\n"
+        "j external_interrupt_handler\n"  // Supervisor external interrupt (PLIC) at Base Address + 0x24, exception code = 9
+        ".option pop\n"
     );
 }
 
@@ -840,13 +1557,42 @@ void enable_timer_interrupt()
 }
 
 
-void kernel_main(void){
+//OpenSBI enters with the hart ID in a0 and the device tree in a1, boot() adds the time it started in a2
+void kernel_main(uint32_t hartid, paddr_t dtb, uint32_t boot_time){
     
     memset(__bss, 0, (size_t) __bss_end - (size_t) __bss);
-    printf("Entered the kernel");
+    smp_init(hartid);
+    boot_mark_at("kernel entry", boot_time);
+    boot_mark("bss cleared");
+
+    //RAM, timebase and devices come from the device tree; the initrd has to be fenced off before anything is allocated
+    if(fdt_init(dtb) < 0)
+    {
+        printf("no device tree, assuming the QEMU virt layout\n");
+    }
+    fdt_probe();
+    timebase_freq = platform.timebase_freq;
+    vdso_init(boot_time);
+    for(uint32_t i = 0; i < platform.nr_memory; i++)
+    {
+        if(platform.memory[i].base <= (paddr_t)__free_ram && (paddr_t)__free_ram < platform.memory[i].end)
+        {
+            free_ram_end = platform.memory[i].end & ~(PAGE_SIZE - 1);
+        }
+    }
+    if(!free_ram_end)
+    {
+        PANIC("the kernel is not in any /memory range");
+    }
+    fdt_dump();
+    ramfs_reserve();
+    boot_mark("device tree");
     // printf("\n\n");
 
     
+    //sscratch = 0 tells the trap entry that the trap came from the kernel
+    WRITE_CSR(sscratch, 0);
+
     //configure trap handling in vector mode since we are dealing with exceptions and interrupts both
     configure_trap_handling(true);
     //WRITE_CSR(stvec, (uint32_t)timer_interrupt_handler);
@@ -858,12 +1604,38 @@ void kernel_main(void){
     //initialise the timer interrupt for the first time
     
 
-    idle_proc = create_process(NULL);
-    idle_proc->pid = 0; // idle
-    current_proc = idle_proc;
+    idle_init();
+
+    vm_init();
+    boot_mark("page tables");
+    ramfs_init();
+    boot_mark("ramfs");
+    pmu_init();
+    boot_mark("pmu");
+    softirq_init();
 
     proc_a = create_process(proc_a_entry);
     proc_b = create_process(proc_b_entry);
+
+    //device interrupts are routed through the PLIC to this hart
+    plic_init_hart(hartid);
+    ipi_init_hart();
+    boot_mark("plic");
+    virtio_blk_init();
+    boot_mark("virtio-blk");
+#ifdef BENCHMARK
+    create_process(blk_bench_entry);
+#endif
+    spawn("/bin/hello");
+#ifdef PROFILE
+    create_process(prof_entry);
+#endif
+#ifdef HEAP_DEBUG
+    create_process(heap_watch_entry);
+#endif
+#ifdef LATENCY_TEST
+    latency_start();
+#endif
     //yield();
 
    
@@ -872,23 +1644,14 @@ void kernel_main(void){
 
      //Enable the timer interrupt sie.STIE
     enable_timer_interrupt();
-    write_to_stimecmp(read_rtc() + 1000000);
-    // idle_proc = create_process(NULL);
-    // idle_proc->pid = 0; // idle
-    // current_proc = idle_proc;
+    write_to_stimecmp(read_time() + timebase_freq / 10);
+    boot_mark("timer on");
 
-    while(1)
-    {
-        if(switch_task)
-        {
-            printf("switching task...\n");
-            yield();
-            switch_task = 0;
-        }
-        delay();
-        printf("main thread\n");
+    //the other harts wait for the kernel lock, which the boot hart first lets go of in idle_loop()
+    smp_boot();
+    boot_mark("harts");
 
-    }
+    idle_loop();
 
     // proc_a = create_process(&proc_a_entry);
     // proc_b = create_process(&proc_b_entry);
@@ -898,15 +1661,35 @@ void kernel_main(void){
 
 }
 
+//make the caller the idle process of this hart; it runs on the stack the hart booted on
+void idle_init(void)
+{
+    struct process *idle = create_process(NULL);
+    idle->on_cpu = true;
+    idle->cpu = this_hart();
+    idle_proc = idle;
+    current_proc = idle;
+}
+
+//the timer interrupt preempts running processes, the idle process only runs when nothing else is runnable
+void idle_loop(void)
+{
+    while(1)
+    {
+        yield();
+        cpu_idle();
+    }
+}
+
 // The entry of the kernel is the boot function
 __attribute__((section(".text.boot")))
 __attribute__((naked))
 void boot(void){
     __asm__ __volatile__(
-        "mv sp, %[stack_top]\n" //set the stack pointer
+        "csrr a2, time\n"       //boot timeline starts here
+        "la sp, __stack_top\n"  //set the stack pointer, a0 (hart ID) and a1 (device tree) are left untouched
+        "la tp, cpus\n"         //the boot hart is cpus[0]
         "j kernel_main\n"       //jump to the kernel main function
-        :
-        : [stack_top] "r" (__stack_top) // Pass the stack top address as %[stack_top]
     );
 }
 
@@ -1,9 +1,17 @@
 #pragma once
 #include "common.h"
 
-#define PROCS_MAX           8         // Max number of processes
+#define PROCS_MAX           24        // Max number of processes, the idle process and kworker of every hart included
+#define HARTS_MAX           4         // per-hart state is sized for this many harts
+#define CACHE_LINE_SIZE     64        // per-hart data that is written often is aligned to this to avoid false sharing
 #define PROC_UNUSED         0         // Unused process control strucuture
 #define PROC_RUNNABLE       1         // runnable process
+#define PROC_BLOCKED        2         // process sleeping on a wait queue
+#define PROC_EXITED         3         // exited, the slot is reused after an RCU grace period
+#define PID_HASH_SIZE       32        // buckets of the pid lookup table, a power of two
+#define PROC_NOFILE         128       // open files per process, enough for a server watching many pipes
+#define PROC_VMAS           8         // lazily populated regions (ELF segments, user stack) per process
+#define PMU_NR_EVENTS       7         // events counted per process, see pmu.h
 
 //Macros for constructing page tables in SV32
 #define SATP_SV32 (1u << 31)       //SATP_SV32 is a single bit in satp register which indicates enable paging in SV32 mode
@@ -13,8 +21,17 @@
 #define PAGE_X    (1 << 3)         //Executable
 #define PAGE_U    (1 << 4)         //User(accessible in user mode)
 #define SSTATUS_SIE (1u << 1)       //Supervisor Interrupt Enable bit
+#define SSTATUS_SPIE (1u << 5)      //SIE before the trap, restored by sret
+#define SSTATUS_SPP (1u << 8)       //privilege before the trap, 0 = user mode
+#define SCAUSE_ECALL_U      8       //environment call from U-mode
+#define SCAUSE_INST_PAGE_FAULT  12
+#define SCAUSE_LOAD_PAGE_FAULT  13
+#define SCAUSE_STORE_PAGE_FAULT 15
 #define STVEC_VECTORED_MODE (1 << 0)    //Set Mode bit for vectored mode
 
+#define SBI_EXT_DBCN        0x4442434e  // SBI debug console extension ("DBCN")
+#define SBI_DBCN_WRITE      0           // write(num_bytes, base_addr_lo, base_addr_hi)
+
 struct sbiret{
     long error;
     long value;
@@ -53,38 +70,217 @@ struct trap_frame {
     uint32_t s10;
     uint32_t s11;
     uint32_t sp;
+    uint32_t sepc;      // saved so a trap handler can switch to another process
+    uint32_t sstatus;
+    uint32_t locked;    // 1 if this trap took the kernel lock and drops it on the way out
 } __attribute__((packed));
 
+//size of the trap frame on the kernel stack, padded to keep sp 16 byte aligned
+#define TRAP_FRAME_SIZE (4 * 36)
+
 //A linked list to represent a page 
+//The metadata is kept out of line in a table with one entry per page of free RAM, so that
+//allocated blocks start on a page boundary (DMA rings and page tables need aligned pages).
 typedef struct page_meta
 {
     uint32_t size; //size of the block
     struct page_meta *next; //pointer to the next page 
-    int free; //boolean to check if the block is free
+    int free; //1 if the block is free, PAGE_META_CACHED if it is free but held in a hart's page cache (pcache.c)
+#ifdef HEAP_DEBUG
+    uint32_t caller; //return address of the alloc_pages() call, see heap.c
+#endif
 }page_meta;
 
 #define META_SIZE sizeof(page_meta)
+#define PAGE_META_CACHED 2
+
 
 
 
 
+struct fiber;
+struct uring;
+struct fiber_sched;
+struct ramfs_file;
+struct pipe;
+struct epoll;
+struct epoll_item;
+
+//A region of a user address space that is populated page by page on first fault.
+//Bytes in [file_start, file_start + file_size) come from file_data, the rest is zero filled.
+struct vm_area
+{
+    vaddr_t start;              // page aligned, 0 = unused slot
+    vaddr_t end;                // page aligned, exclusive
+    uint32_t flags;             // PAGE_R, PAGE_W, PAGE_X
+    vaddr_t file_start;         // first address backed by file data
+    uint32_t file_size;         // bytes backed by file data
+    const uint8_t *file_data;   // initrd bytes mapped at file_start, NULL for anonymous memory
+};
+
+#define FD_NONE             0         // unused descriptor
+#define FD_FILE             1         // ramfs file
+#define FD_PIPE_READ        2         // read end of a pipe
+#define FD_PIPE_WRITE       3         // write end of a pipe
+#define FD_CONSOLE          4         // /dev/console, write only
+#define FD_BLOCK            5         // /dev/blk, the virtio-blk disk through the buffer cache
+#define FD_EPOLL            6         // epoll instance, see epoll.h
+
+//an open file descriptor
+struct open_file
+{
+    int type;                   // FD_*
+    struct ramfs_file *file;    // FD_FILE
+    struct pipe *pipe;          // FD_PIPE_READ, FD_PIPE_WRITE
+    struct epoll *epoll;        // FD_EPOLL
+    uint32_t offset;            // read position of a file, byte position on the disk
+    struct epoll_item *watchers;    // epoll items watching this descriptor
+};
+
+//Earliest-deadline-first parameters and job state of a SCHED_EDF process. Times are in time CSR ticks.
+struct edf_task
+{
+    uint32_t period;            // time between job releases
+    uint32_t budget;            // CPU time a job may use per period
+    uint32_t deadline;          // deadline relative to the job release
+    uint32_t density;           // budget / min(deadline, period) in 16.16 fixed point, used by admission control
+    uint64_t release;           // release time of the current job
+    uint64_t abs_deadline;      // absolute deadline of the current job
+    uint32_t budget_left;       // budget left to the current job, 0 = throttled until the next release
+    bool job_active;            // the current job has not completed yet
+    bool waiting;               // sleeping in edf_wait_next_period()
+    uint32_t misses;            // number of jobs that completed after their deadline or not at all
+};
 
 //define a process object, also known as a Process Control Block(PCB)
+//a callback deferred until an RCU grace period has passed, embedded in the object it reclaims (see rcu.h)
+struct rcu_head
+{
+    struct rcu_head *next;
+    void (*fn)(struct rcu_head *head);
+};
+
 struct process
 {
     int pid;                // Process ID
-    int state;              // Process state: PROC_UNUSED or PROC_RUNNABLE
+    int state;              // Process state: PROC_UNUSED, PROC_RUNNABLE, PROC_BLOCKED or PROC_EXITED
+    struct process *pid_next;   // next process in the same pid hash bucket
+    struct process *list_next;  // next live process, see for_each_process()
+    struct rcu_head rcu;    // hands the slot back once an exited process can no longer be found
     vaddr_t sp;             // Stack Pointer
+    struct fiber_sched *fibers; // fiber run queue of this task, NULL if the task runs no fibers
+    int sched_class;        // SCHED_NORMAL or SCHED_EDF
+    uint64_t exec_start;    // time CSR value when this process was last charged for its runtime
+    uint64_t sum_exec_runtime;  // total time CSR ticks this process has run
+    uint64_t vruntime;      // SCHED_NORMAL: runtime scaled by the nice weight, the smallest one runs next
+    int nice;               // SCHED_NORMAL: -20 (highest share) to 19 (lowest share)
+    uint32_t weight;        // load weight of nice
+    uint32_t inv_weight;    // 2^32 / weight, avoids a division on every charge
+    bool on_rq;             // queued in the fair run queue of hart cpu
+    int rq_index;           // position in the fair run queue heap
+    bool on_cpu;            // running on a hart right now
+    int cpu;                // hart whose run queue holds the process, or that ran it last
+    uint32_t affinity;      // bit i set: the process may run on cpus[i]
+    struct edf_task edf;    // SCHED_EDF parameters
+    uint32_t *page_table;   // private Sv32 root table, NULL while the process runs on the kernel page table
+    vaddr_t mmap_next;      // next free address of the mmap area
+    struct vm_area *heap;   // sbrk() region in vmas, NULL until the first SYS_SBRK
+    struct vm_area vmas[PROC_VMAS];
+    const char *exec_path;  // program started by spawn()
+    uint64_t pmu[PMU_NR_EVENTS];    // hardware and firmware event counts accumulated while this process ran
+    struct open_file files[PROC_NOFILE];
+    struct uring *uring;    // submission/completion rings, NULL until SYS_URING_SETUP
+    struct vdso_data *vdso; // data page mapped at VDSO_ADDR, NULL while the process has no address space of its own
     uint8_t stack[8192];    // Kernel Stack (8KB size)
 };
 
+//A process or fiber sleeping on a wait queue. The waiter lives on the sleeper's own stack.
+struct waiter
+{
+    struct process *proc;   // sleeping process
+    struct fiber *fiber;    // sleeping fiber, NULL if the whole process sleeps
+    struct waiter *next;
+};
+
+//FIFO of sleepers waiting for an event (I/O completion, a lock, data in a buffer...)
+struct wait_queue
+{
+    struct waiter *head;
+    struct waiter *tail;
+};
+
+extern uint32_t timebase_freq;      // ticks per second of the time CSR, from the device tree
+extern paddr_t free_ram_end;        // end of the RAM the kernel was loaded into, from the device tree
+extern struct process procs[PROCS_MAX];
+extern int nr_procs;
+extern struct process *proc_list;
+
+//walk the live processes; readers must not pass a quiescent state (see rcu.h) on the way
+#define for_each_process(p) \
+    for(struct process *p = __atomic_load_n(&proc_list, __ATOMIC_CONSUME); p; \
+        p = __atomic_load_n(&p->list_next, __ATOMIC_CONSUME))
+
+//time CSR ticks per microsecond, at least 1: below a 1MHz timebase "microseconds" are ticks
+static inline uint32_t ticks_per_us(void)
+{
+    return timebase_freq >= 1000000 ? timebase_freq / 1000000 : 1;
+}
+
+/*
+    num / den without a 64-bit division, which RV32 has no instruction for and we have no libgcc for: both are
+    halved until they fit in 32 bits, so the quotient loses precision only when they do not.
+    returns:
+        uint32_t: the quotient, 0 if den is 0, 0xffffffff if it does not fit in 32 bits
+*/
+static inline uint32_t scaled_div(uint64_t num, uint64_t den)
+{
+    while((num >> 32 || den >> 32) && den > 1)
+    {
+        num >>= 1;
+        den >>= 1;
+    }
+    if(!den)
+    {
+        return 0;
+    }
+    return num >> 32 ? 0xffffffff : (uint32_t)num / (uint32_t)den;
+}
+
+struct sbiret sbi_call(long arg0, long arg1, long arg2, long arg3, long arg4, long arg5, long fid, long eid);
+void console_write(const uint8_t *buf, uint32_t len);
+uint64_t read_time(void);
+void write_to_stimecmp(uint64_t x);
+
+void yield(void);
+void switch_context(uint32_t *prev_sp, uint32_t *next_sp);
+void *alloc_pages(uint32_t n);
+void free(void *ptr);
+void reserve_pages(paddr_t start, paddr_t end);
+struct process *create_process(void (*entry)(void));
+struct process *find_process(int pid);
+void process_exit(void);
+void enter_user(vaddr_t entry, vaddr_t user_sp) __attribute__((noreturn));
+void idle_init(void);
+void idle_loop(void) __attribute__((noreturn));
+void configure_trap_handling(bool trap_mode);
+void enable_supervisor_interrupt(void);
+void enable_timer_interrupt(void);
+int kernel_lock(void);
+void kernel_unlock(void);
+void wake_process(struct process *proc);
+void wait_queue_sleep(struct wait_queue *wq);
+int wait_queue_wake_one(struct wait_queue *wq);
+int wait_queue_wake_all(struct wait_queue *wq);
+
 
 /*
     __FILE__ and __LINE__ are standard C predefined macros and are handled by the C preprocessor phase of compilation
     __VA_ARGS__ is a special identifier that is expanded by the C preprocessor to become all the arguments that are passed to the macro after the last named argument.
 */
+void boot_console_flush(void);  // boot.c, so a panic during boot is not left in the buffer
 #define PANIC(fmt, ...)         \
     do{                            \
+        boot_console_flush();      \
         printf("PANIC: %s:%d: " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__); \
         while(1){} \
     }while(0)
@@ -111,6 +307,62 @@ struct process
         __asm__ __volatile__("csrw " #reg ", %0" ::"r"(__tmp));         \
     }while(0)                                                           
 
+//disable interrupts in s-mode and return the previous sstatus.SIE bit so it can be restored
+static inline uint32_t irq_save(void)
+{
+    uint32_t sstatus;
+    __asm__ __volatile__("csrrci %0, sstatus, 2" : "=r"(sstatus) :: "memory");
+    return sstatus & SSTATUS_SIE;
+}
 
+//restore sstatus.SIE as returned by irq_save()
+static inline void irq_restore(uint32_t sie)
+{
+    if(sie)
+    {
+        __asm__ __volatile__("csrsi sstatus, 2" ::: "memory");
+    }
+}
+
+/*
+    Per-hart state. tp points to the executing hart's entry whenever the hart runs kernel code.
+    The first three members are used by the trap entry and secondary_entry() in assembly, keep them in place.
+*/
+struct cpu
+{
+    vaddr_t kernel_sp;          // top of the kernel stack of the process running in user mode
+    vaddr_t trap_sp;            // scratch for the trap entry: the stack pointer at the time of the trap
+    vaddr_t stack_top;          // stack the hart booted on, the idle process runs on it
+    uint32_t stack_size;
+    uint32_t hartid;            // hart ID as used by SBI and the PLIC
+    uint32_t index;             // position in cpus[], what this_hart() returns
+    bool online;                // the scheduler may place processes on this hart
+    bool kernel_locked;         // this hart holds the kernel lock
+    struct process *proc;       // process running on this hart
+    struct process *idle;       // idle process of this hart
+    uint32_t rcu_nesting;       // depth of RCU read-side critical sections, the timer does not preempt them
+    bool rcu_resched;           // the timer wanted to preempt a reader, rcu_read_unlock() yields
+};
+#define CPU_KERNEL_SP       "0"     // offsets in struct cpu as strings for the assembler
+#define CPU_TRAP_SP         "4"
+#define CPU_STACK_TOP       "8"
+
+extern struct cpu cpus[HARTS_MAX];
+extern uint32_t nr_cpus;
 
+//the executing hart's entry. Read anew on every use: a process may continue on another hart after yield()
+static inline struct cpu *this_cpu(void)
+{
+    struct cpu *c;
+    __asm__ __volatile__("mv %0, tp" : "=r"(c));
+    return c;
+}
+
+//index of the executing hart in per-hart arrays
+static inline uint32_t this_hart(void)
+{
+    return this_cpu()->index;
+}
 
+#define current_proc    (this_cpu()->proc)  // process running on this hart
+#define idle_proc       (this_cpu()->idle)  // idle process of this hart
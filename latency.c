@@ -0,0 +1,177 @@
+#include "latency.h"
+#include "sched.h"
+
+//wakeup latencies of one measuring task, in time CSR ticks
+struct lat_task
+{
+    uint32_t period_us;
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t misses;                    // EDF deadline misses, copied from the process after every wakeup
+    uint32_t hist[LAT_HIST_BUCKETS];
+};
+
+static struct lat_task tasks[LAT_TASKS] = {
+    {.period_us = 1000}, {.period_us = 1500}, {.period_us = 2000}, {.period_us = 3000},
+};
+static int tasks_started;
+static bool lat_done;                   // the run is over, measuring tasks and load generators exit
+
+//histogram bucket of a latency in microseconds
+static int bucket(uint32_t us)
+{
+    int b = 0;
+    while(us && b < LAT_HIST_BUCKETS - 1)
+    {
+        us >>= 1;
+        b++;
+    }
+    return b;
+}
+
+//a measuring task: wait for the next release, note how late we run, repeat
+static void lat_task_entry(void)
+{
+    struct lat_task *t = &tasks[tasks_started++];
+    struct process *proc = current_proc;
+    t->min = 0xffffffffu;
+    uint32_t div = ticks_per_us();
+    if(sched_set_edf(proc, t->period_us * div, LAT_BUDGET_US * div, 0) < 0)
+    {
+        printf("latency: task with period %d us not admitted\n", t->period_us);
+        process_exit();
+    }
+    while(!lat_done)
+    {
+        edf_wait_next_period();
+        //the release is the absolute time we asked to wake up at
+        uint32_t lat = (uint32_t)(read_time() - proc->edf.release);
+        t->count++;
+        t->sum += lat;
+        if(lat < t->min)
+        {
+            t->min = lat;
+        }
+        if(lat > t->max)
+        {
+            t->max = lat;
+        }
+        t->hist[bucket(lat / div)]++;
+        t->misses = sched_edf_misses(proc);
+    }
+    process_exit();
+}
+
+//load: allocate and free blocks of 1 to 8 pages in random order
+static void alloc_storm_entry(void)
+{
+    void *blocks[LAT_STORM_BLOCKS] = {0};
+    uint32_t seed = 12345;
+    while(!lat_done)
+    {
+        seed = seed * 1103515245 + 12345;
+        uint32_t i = (seed >> 16) % LAT_STORM_BLOCKS;
+        if(blocks[i])
+        {
+            free(blocks[i]);
+            blocks[i] = NULL;
+        }
+        else
+        {
+            blocks[i] = alloc_pages(1u << ((seed >> 8) & 3));
+        }
+    }
+    for(int i = 0; i < LAT_STORM_BLOCKS; i++)
+    {
+        if(blocks[i])
+        {
+            free(blocks[i]);
+        }
+    }
+    process_exit();
+}
+
+//load: print as fast as the console takes it
+static void console_spam_entry(void)
+{
+    for(uint32_t n = 0; !lat_done; n++)
+    {
+        printf("latency: console spam %d\n", n);
+    }
+    process_exit();
+}
+
+//microseconds from time CSR ticks
+static uint32_t to_us(uint32_t ticks)
+{
+    return ticks / ticks_per_us();
+}
+
+static void print_report(void)
+{
+    uint32_t hist[LAT_HIST_BUCKETS] = {0};
+    printf("latency: %d s under load, wakeup latency per task\n", LAT_SECONDS);
+    for(int i = 0; i < tasks_started; i++)
+    {
+        struct lat_task *t = &tasks[i];
+        uint32_t avg = scaled_div(t->sum, t->count);
+        printf("latency: period %d us: %d wakeups, min %d us, avg %d us, max %d us, %d deadline misses\n",
+            t->period_us, t->count, t->count ? to_us(t->min) : 0, to_us(avg), to_us(t->max),
+            t->misses);
+        for(int b = 0; b < LAT_HIST_BUCKETS; b++)
+        {
+            hist[b] += t->hist[b];
+        }
+    }
+    printf("latency: histogram of all wakeups\n");
+    for(int b = 0; b < LAT_HIST_BUCKETS; b++)
+    {
+        if(!hist[b])
+        {
+            continue;
+        }
+        uint32_t lo = b ? 1u << (b - 1) : 0;
+        if(b == LAT_HIST_BUCKETS - 1)
+        {
+            printf("  >= %d us: %d\n", lo, hist[b]);
+        }
+        else
+        {
+            printf("  %d..%d us: %d\n", lo, (1u << b) - 1, hist[b]);
+        }
+    }
+}
+
+/*
+    Controller: starts the measuring tasks and the load, sleeps for LAT_SECONDS as an EDF task with a long period
+    so it does not add load itself, then stops everything and prints the report.
+*/
+static void latency_entry(void)
+{
+    for(int i = 0; i < LAT_TASKS; i++)
+    {
+        create_process(lat_task_entry);
+    }
+    create_process(alloc_storm_entry);
+    create_process(console_spam_entry);
+
+    uint32_t period = timebase_freq / 10;
+    sched_set_edf(current_proc, period, LAT_BUDGET_US * ticks_per_us(), 0);
+    uint64_t end = read_time() + (uint64_t)LAT_SECONDS * timebase_freq;
+    while(read_time() < end)
+    {
+        edf_wait_next_period();
+    }
+    lat_done = true;
+    sched_set_normal(current_proc);
+    print_report();
+    process_exit();
+}
+
+//start a latency run; proc_a and proc_b, created by kernel_main(), are the CPU-bound load
+void latency_start(void)
+{
+    create_process(latency_entry);
+}
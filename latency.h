@@ -0,0 +1,17 @@
+#pragma once
+#include "kernel.h"
+
+/*
+    Scheduling latency tester in the style of cyclictest (./run.sh latency). LAT_TASKS periodic EDF processes
+    sleep until their next release, an absolute time, and record by how much they were late waking up: the time
+    from the release to running again. Meanwhile best-effort processes load the system: proc_a/proc_b burn CPU,
+    an allocation storm churns the page allocator and a console spammer prints. After LAT_SECONDS the load stops
+    and the report shows min/avg/max per task and a histogram of all wakeups, the tail being what matters.
+*/
+#define LAT_TASKS           4
+#define LAT_SECONDS         10
+#define LAT_BUDGET_US       100         // CPU time per period of a measuring task, it only takes a timestamp
+#define LAT_HIST_BUCKETS    24          // bucket 0: < 1us, bucket i: [2^(i-1), 2^i) us, the last one is open ended
+#define LAT_STORM_BLOCKS    16          // blocks the allocation storm keeps live at once
+
+void latency_start(void);
@@ -0,0 +1,388 @@
+#include "malloc.h"
+#include "user.h"
+
+//a run of pages of the sbrk heap holding objects of one class, at spans[] of its first page
+struct span
+{
+    void *free;                 // objects given back to the span
+    struct span *next;          // on the list named by list
+    struct span *prev;
+    uint16_t inuse;             // objects out of the span, in the thread cache or with the program
+    uint16_t carved;            // objects handed out at least once, the rest of the span was never touched
+    uint8_t cls;
+    uint8_t pages;
+    uint8_t list;               // SPAN_NONE (all objects out), SPAN_PARTIAL, SPAN_KEPT or SPAN_RELEASED
+};
+
+#define SPAN_NONE       0
+#define SPAN_PARTIAL    1
+#define SPAN_KEPT       2
+#define SPAN_RELEASED   3
+
+struct span_list
+{
+    struct span *head;
+    struct span *tail;
+    uint32_t count;
+};
+
+struct tcache_bin
+{
+    void *head;                 // objects linked through their first word
+    uint32_t count;
+};
+
+struct malloc_tcache
+{
+    struct tcache_bin bins[MALLOC_CLASSES];
+};
+
+//a large object, at the start of its own mapping
+struct large_header
+{
+    uint32_t len;               // bytes mapped
+    uint32_t pad;               // keeps the object 8-byte aligned
+};
+
+//at most 25% apart from 32 bytes on, so rounding wastes at most a fifth of an object
+static const uint16_t class_size[MALLOC_CLASSES] = {
+    8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048, 2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192,
+};
+
+static bool ready;
+static uint8_t size_class[(MALLOC_SMALL_MAX >> 3) + 1];    // class of a request, by (size + 7) / 8
+static uint16_t class_max[MALLOC_CLASSES];                  // thread cache list limit
+static uint8_t class_pages[MALLOC_CLASSES];                 // span length
+static uint16_t class_objs[MALLOC_CLASSES];                 // objects per span
+
+static struct malloc_tcache tcache;
+//bss, populated on demand like the heap itself
+static struct span spans[MALLOC_MAX_PAGES];
+static uint16_t page_span[MALLOC_MAX_PAGES];                // first page of the span a heap page belongs to
+static struct span_list partial[MALLOC_CLASSES];            // spans with objects left to hand out
+static struct span_list kept[MALLOC_SPAN_PAGES + 1];        // free spans by length, most recently freed first
+static struct span_list released[MALLOC_SPAN_PAGES + 1];    // free spans without pages
+static uint32_t released_pages;
+static uint32_t heap_base;
+static uint32_t heap_size;
+static struct malloc_stats stats;
+
+static void malloc_init(void)
+{
+    uint32_t cls = 0;
+    for(uint32_t i = 0; i <= MALLOC_SMALL_MAX >> 3; i++)
+    {
+        if(i << 3 > class_size[cls])
+        {
+            cls++;
+        }
+        size_class[i] = cls;
+    }
+    for(cls = 0; cls < MALLOC_CLASSES; cls++)
+    {
+        uint32_t max = MALLOC_TCACHE_BYTES / class_size[cls];
+        class_max[cls] = max < 4 ? 4 : max > 128 ? 128 : max;
+        //the shortest span whose leftover tail is at most 1/8 of it
+        uint32_t pages = 1;
+        while(pages < MALLOC_SPAN_PAGES && (pages * PAGE_SIZE) % class_size[cls] * 8 > pages * PAGE_SIZE)
+        {
+            pages++;
+        }
+        class_pages[cls] = pages;
+        class_objs[cls] = pages * PAGE_SIZE / class_size[cls];
+    }
+    ready = true;
+}
+
+static void list_push(struct span_list *l, struct span *s, uint8_t list)
+{
+    s->list = list;
+    s->prev = NULL;
+    s->next = l->head;
+    if(l->head)
+    {
+        l->head->prev = s;
+    }
+    else
+    {
+        l->tail = s;
+    }
+    l->head = s;
+    l->count++;
+}
+
+static void list_remove(struct span_list *l, struct span *s)
+{
+    if(s->prev)
+    {
+        s->prev->next = s->next;
+    }
+    else
+    {
+        l->head = s->next;
+    }
+    if(s->next)
+    {
+        s->next->prev = s->prev;
+    }
+    else
+    {
+        l->tail = s->prev;
+    }
+    s->list = SPAN_NONE;
+    l->count--;
+}
+
+static uint32_t span_addr(struct span *s)
+{
+    return heap_base + (uint32_t)(s - spans) * PAGE_SIZE;
+}
+
+static struct span *span_of(void *ptr)
+{
+    return &spans[page_span[((uint32_t)ptr - heap_base) / PAGE_SIZE]];
+}
+
+//a span for class cls: a kept one of its length, else a released one, else new pages from sbrk(); NULL if the heap is full
+static struct span *span_new(uint32_t cls)
+{
+    uint32_t pages = class_pages[cls];
+    struct span *s = kept[pages].head;
+    if(s)
+    {
+        list_remove(&kept[pages], s);
+    }
+    else if((s = released[pages].head))
+    {
+        list_remove(&released[pages], s);
+        released_pages -= pages;
+    }
+    else
+    {
+        uint32_t first = heap_size / PAGE_SIZE;
+        void *p = first + pages <= MALLOC_MAX_PAGES ? sbrk(pages * PAGE_SIZE) : NULL;
+        if(!p || (heap_size && (uint32_t)p != heap_base + heap_size))
+        {
+            return NULL;    // out of memory, or someone else moved the break
+        }
+        if(!heap_size)
+        {
+            heap_base = (uint32_t)p;
+        }
+        heap_size += pages * PAGE_SIZE;
+        for(uint32_t i = 0; i < pages; i++)
+        {
+            page_span[first + i] = first;
+        }
+        s = &spans[first];
+        s->pages = pages;
+    }
+    s->free = NULL;
+    s->inuse = 0;
+    s->carved = 0;
+    s->cls = cls;
+    list_push(&partial[cls], s, SPAN_PARTIAL);
+    return s;
+}
+
+/*
+    Give the oldest MALLOC_RELEASE_SPANS kept spans of a length back to the kernel, with one munmap() per run of
+    adjacent spans. They stay part of the heap and come back as zero pages when span_new() hands them out again.
+*/
+static void release_spans(uint32_t pages)
+{
+    uint32_t first[MALLOC_RELEASE_SPANS];
+    uint32_t n = 0;
+    while(n < MALLOC_RELEASE_SPANS && kept[pages].tail)
+    {
+        struct span *s = kept[pages].tail;
+        list_remove(&kept[pages], s);
+        list_push(&released[pages], s, SPAN_RELEASED);
+        //insertion sort by address
+        uint32_t i = n++;
+        for(; i > 0 && first[i - 1] > (uint32_t)(s - spans); i--)
+        {
+            first[i] = first[i - 1];
+        }
+        first[i] = s - spans;
+    }
+    for(uint32_t i = 0; i < n; )
+    {
+        uint32_t run = 1;
+        while(i + run < n && first[i + run] == first[i] + run * pages)
+        {
+            run++;
+        }
+        munmap((void *)(heap_base + first[i] * PAGE_SIZE), run * pages * PAGE_SIZE);
+        i += run;
+    }
+    released_pages += n * pages;
+    stats.released_spans += n;
+}
+
+//fill an empty thread cache list from the spans of its class and return the first object, NULL if out of memory
+static void *refill(struct tcache_bin *bin, uint32_t cls)
+{
+    uint32_t want = class_max[cls] / 2;
+    uint32_t size = class_size[cls];
+    void *head = NULL;
+    uint32_t n = 0;
+    while(n < want)
+    {
+        struct span *s = partial[cls].head ? partial[cls].head : span_new(cls);
+        if(!s)
+        {
+            break;
+        }
+        while(n < want && (s->free || s->carved < class_objs[cls]))
+        {
+            void *o = s->free;
+            if(o)
+            {
+                s->free = *(void **)o;
+            }
+            else
+            {
+                o = (void *)(span_addr(s) + s->carved++ * size);
+            }
+            *(void **)o = head;
+            head = o;
+            s->inuse++;
+            n++;
+        }
+        if(!s->free && s->carved == class_objs[cls])
+        {
+            list_remove(&partial[cls], s);     // full, free() puts it back
+        }
+    }
+    stats.refills++;
+    if(!head)
+    {
+        return NULL;
+    }
+    bin->head = *(void **)head;
+    bin->count = n - 1;
+    return head;
+}
+
+//move half of an overfull thread cache list back to the spans, releasing spans once enough are free
+static void flush(struct tcache_bin *bin, uint32_t cls)
+{
+    for(uint32_t n = class_max[cls] / 2; n > 0; n--)
+    {
+        void *o = bin->head;
+        bin->head = *(void **)o;
+        bin->count--;
+        struct span *s = span_of(o);
+        *(void **)o = s->free;
+        s->free = o;
+        if(s->list == SPAN_NONE)
+        {
+            list_push(&partial[cls], s, SPAN_PARTIAL);
+        }
+        if(--s->inuse == 0)
+        {
+            list_remove(&partial[cls], s);
+            list_push(&kept[s->pages], s, SPAN_KEPT);
+        }
+    }
+    stats.flushes++;
+    uint32_t pages = class_pages[cls];
+    if(kept[pages].count >= MALLOC_KEEP_SPANS + MALLOC_RELEASE_SPANS)
+    {
+        release_spans(pages);
+    }
+}
+
+static void *large_alloc(size_t size)
+{
+    if(size > 0x7fffffff - PAGE_SIZE)
+    {
+        return NULL;
+    }
+    uint32_t len = align_up(size + sizeof(struct large_header), PAGE_SIZE);
+    struct large_header *h = mmap(MAP_ANON, 0, len, PROT_READ | PROT_WRITE);
+    if(!h)
+    {
+        return NULL;
+    }
+    h->len = len;
+    stats.large_bytes += len;
+    stats.large_count++;
+    return h + 1;
+}
+
+static void large_free(void *ptr)
+{
+    struct large_header *h = (struct large_header *)ptr - 1;
+    stats.large_bytes -= h->len;
+    stats.large_count--;
+    munmap(h, h->len);
+}
+
+/*
+    Allocate size bytes, 8-byte aligned.
+    returns:
+        void *: the memory, NULL if there is none left
+*/
+void *malloc(size_t size)
+{
+    if(size > MALLOC_SMALL_MAX)
+    {
+        return large_alloc(size);
+    }
+    if(!ready)
+    {
+        malloc_init();
+    }
+    uint32_t cls = size_class[(size + 7) >> 3];
+    struct tcache_bin *bin = &tcache.bins[cls];
+    void *o = bin->head;
+    if(!o)
+    {
+        return refill(bin, cls);
+    }
+    bin->head = *(void **)o;
+    bin->count--;
+    return o;
+}
+
+//free memory from malloc(), NULL is ignored
+void free(void *ptr)
+{
+    uint32_t off = (uint32_t)ptr - heap_base;
+    if(off >= heap_size)
+    {
+        if(ptr)
+        {
+            large_free(ptr);
+        }
+        return;
+    }
+    uint32_t cls = span_of(ptr)->cls;
+    struct tcache_bin *bin = &tcache.bins[cls];
+    *(void **)ptr = bin->head;
+    bin->head = ptr;
+    if(++bin->count > class_max[cls])
+    {
+        flush(bin, cls);
+    }
+}
+
+//fill *s with the current state of the allocator
+void malloc_stats(struct malloc_stats *s)
+{
+    *s = stats;
+    s->heap_bytes = heap_size;
+    s->resident_bytes = heap_size - released_pages * PAGE_SIZE;
+    for(uint32_t i = 0; i < heap_size / PAGE_SIZE; i += spans[i].pages)
+    {
+        s->in_use_bytes += spans[i].inuse * class_size[spans[i].cls];
+    }
+    for(uint32_t cls = 0; cls < MALLOC_CLASSES; cls++)
+    {
+        s->cached_bytes += tcache.bins[cls].count * class_size[cls];
+    }
+    s->in_use_bytes -= s->cached_bytes;
+}
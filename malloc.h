@@ -0,0 +1,41 @@
+#pragma once
+#include "common.h"
+
+/*
+    User heap allocator, on top of sbrk() and mmap(MAP_ANON). Requests up to MALLOC_SMALL_MAX bytes are rounded up to
+    one of MALLOC_CLASSES size classes, spaced at most 25% apart, and carved out of spans: runs of 1 to
+    MALLOC_SPAN_PAGES pages of the sbrk heap, sized per class so the tail left over wastes at most 1/8 of the span.
+    In front of the spans sits a cache per thread with a LIFO free list per class, so malloc() and free() are a
+    list pop and push; only an empty or overfull list moves a batch of objects from or to the spans. A span whose
+    objects are all free again is kept for reuse by a class of the same span length; once MALLOC_KEEP_SPANS +
+    MALLOC_RELEASE_SPANS of a length are, the MALLOC_RELEASE_SPANS oldest go back to the kernel with one munmap()
+    per contiguous run. The heap keeps the range and the pages come back zeroed when the span is used again.
+    Larger requests get a mapping of their own that free() unmaps.
+    Processes have a single thread, so there is one thread cache and the spans need no lock; a second thread
+    would bring its own struct malloc_tcache and a lock around the span level.
+*/
+#define MALLOC_CLASSES          36
+#define MALLOC_SMALL_MAX        8192
+#define MALLOC_SPAN_PAGES       8       // longest span
+#define MALLOC_MAX_PAGES        32768   // 128MB of sbrk heap
+#define MALLOC_TCACHE_BYTES     8192    // a thread cache list holds up to this much, 4 to 128 objects
+#define MALLOC_KEEP_SPANS       4       // free spans of each length that stay mapped for reuse
+#define MALLOC_RELEASE_SPANS    8       // free spans given back to the kernel at once
+
+//allocator state for malloc_stats()
+struct malloc_stats
+{
+    uint32_t heap_bytes;        // sbrk heap, mapped or not
+    uint32_t resident_bytes;    // sbrk heap spans that hold pages (in use, or free but kept)
+    uint32_t in_use_bytes;      // small objects handed out, at their class size
+    uint32_t cached_bytes;      // small objects in the thread cache
+    uint32_t large_bytes;       // mappings of large objects
+    uint32_t large_count;
+    uint32_t released_spans;    // spans given back to the kernel since the start
+    uint32_t refills;           // batches moved from the spans to the thread cache
+    uint32_t flushes;           // batches moved back
+};
+
+void *malloc(size_t size);
+void free(void *ptr);
+void malloc_stats(struct malloc_stats *s);
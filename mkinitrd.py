@@ -0,0 +1,42 @@
+#!/usr/bin/env python3
+# Build the initrd: a ustar archive of a directory in which every file starts on a page boundary,
+# so the kernel can mmap file contents straight out of the initrd.
+# usage: mkinitrd.py <output.tar> <directory> [<path in initrd>=<file> ...]
+import io
+import os
+import sys
+import tarfile
+
+PAGE_SIZE = 4096
+BLOCK = 512
+PAD_NAME = ".pad"   # skipped by the kernel (RAMFS_PAD_NAME)
+
+
+def add_aligned(tar, f, path, arcname):
+    # the file header goes at pos and its data at pos + BLOCK; if that is not page aligned,
+    # insert a padding member whose header and data push the next header to a page boundary - BLOCK
+    pos = f.tell()
+    if (pos + BLOCK) % PAGE_SIZE:
+        pad = (-(pos + 2 * BLOCK)) % PAGE_SIZE
+        info = tarfile.TarInfo(PAD_NAME)
+        info.size = pad
+        tar.addfile(info, io.BytesIO(bytes(pad)))
+    tar.add(path, arcname=arcname, recursive=False)
+
+
+def main():
+    out, root = sys.argv[1], sys.argv[2]
+    with open(out, "wb") as f, tarfile.open(fileobj=f, mode="w", format=tarfile.USTAR_FORMAT) as tar:
+        for dirpath, dirnames, filenames in os.walk(root):
+            dirnames.sort()
+            for name in sorted(filenames):
+                path = os.path.join(dirpath, name)
+                add_aligned(tar, f, path, os.path.relpath(path, root))
+        # build outputs such as the user programs
+        for extra in sys.argv[3:]:
+            arcname, path = extra.split("=", 1)
+            add_aligned(tar, f, path, arcname)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,152 @@
+#include "pcache.h"
+
+page_meta *alloc_block(uint32_t n);
+void free_block(page_meta *block);
+
+//cached blocks of one size
+struct magazine
+{
+    uint32_t count;
+    page_meta *blocks[PCACHE_HIGH + 1];     // one above the high watermark until the drain
+};
+
+//page caches of one hart, on its own cache lines
+struct pcache
+{
+    struct magazine mags[PCACHE_ORDERS];
+    uint32_t hits;                      // allocations served from a magazine
+    uint32_t refills;                   // batches taken from the block list
+    uint32_t drains;                    // batches given back to the block list
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct pcache pcaches[HARTS_MAX];
+
+//magazine of blocks of n pages, -1 if n is not a cached size
+static int order_of(uint32_t n)
+{
+    for(int order = 0; order < PCACHE_ORDERS; order++)
+    {
+        if(n == 1u << order)
+        {
+            return order;
+        }
+    }
+    return -1;
+}
+
+//give blocks back to the block list until keep are left
+static uint32_t drain(struct magazine *m, uint32_t keep)
+{
+    uint32_t pages = 0;
+    while(m->count > keep)
+    {
+        page_meta *block = m->blocks[--m->count];
+        pages += block->size / PAGE_SIZE;
+        free_block(block);
+    }
+    return pages;
+}
+
+/*
+    Take a block of n pages from this hart's magazine, refilling it from the block list if it is empty.
+    returns:
+        page_meta *: the block, marked allocated; NULL if n is not a cached size or memory is exhausted
+*/
+page_meta *pcache_alloc(uint32_t n)
+{
+    int order = order_of(n);
+    if(order < 0)
+    {
+        return NULL;
+    }
+
+    uint32_t sie = irq_save();
+    struct pcache *pc = &pcaches[this_hart()];
+    struct magazine *m = &pc->mags[order];
+    if(m->count)
+    {
+        pc->hits++;
+    }
+    else
+    {
+        //the block list serves at least n pages per block, a larger block stays that size when it comes back
+        pc->refills++;
+        while(m->count < (PCACHE_LOW >> order))
+        {
+            page_meta *block = alloc_block(n);
+            if(!block)
+            {
+                break;
+            }
+            block->free = PAGE_META_CACHED;
+            m->blocks[m->count++] = block;
+        }
+    }
+
+    page_meta *block = m->count ? m->blocks[--m->count] : NULL;
+    if(block)
+    {
+        block->free = 0;
+    }
+    irq_restore(sie);
+    return block;
+}
+
+/*
+    Keep a freed block in this hart's magazine. Past the high watermark the magazine is drained to the low one.
+    returns:
+        bool: false if the block is not of a cached size and has to go back to the block list
+*/
+bool pcache_free(page_meta *block)
+{
+    int order = order_of(block->size / PAGE_SIZE);
+    if(order < 0)
+    {
+        return false;
+    }
+
+    uint32_t sie = irq_save();
+    struct pcache *pc = &pcaches[this_hart()];
+    struct magazine *m = &pc->mags[order];
+    block->free = PAGE_META_CACHED;
+    m->blocks[m->count++] = block;
+    if(m->count > (PCACHE_HIGH >> order))
+    {
+        pc->drains++;
+        drain(m, PCACHE_LOW >> order);
+    }
+    irq_restore(sie);
+    return true;
+}
+
+/*
+    Memory pressure: return the blocks cached on every hart to the block list. The magazines of other harts are
+    emptied from here, which is safe because allocation runs under the kernel lock.
+    returns:
+        uint32_t: pages given back
+*/
+uint32_t pcache_drain_all(void)
+{
+    uint32_t pages = 0;
+    uint32_t sie = irq_save();
+    for(uint32_t hart = 0; hart < nr_cpus; hart++)
+    {
+        for(int order = 0; order < PCACHE_ORDERS; order++)
+        {
+            pages += drain(&pcaches[hart].mags[order], 0);
+        }
+    }
+    irq_restore(sie);
+    return pages;
+}
+
+//print the magazine sizes and hit counts of every hart
+void pcache_dump(void)
+{
+    for(uint32_t hart = 0; hart < nr_cpus; hart++)
+    {
+        struct pcache *pc = &pcaches[hart];
+        printf("pcache: cpu %d: %d/%d/%d blocks of 1/2/4 pages, %d hits, %d refills, %d drains\n", hart,
+            pc->mags[0].count, pc->mags[1].count, pc->mags[2].count, pc->hits, pc->refills, pc->drains);
+    }
+}
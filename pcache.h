@@ -0,0 +1,20 @@
+#pragma once
+#include "kernel.h"
+
+/*
+    Per-hart page caches ("magazines") in front of the global block list of alloc_pages()/free().
+    Each hart keeps the blocks of 1, 2 and 4 pages it freed in a small stack per size and hands them out again
+    without looking at the block list. An empty magazine is refilled with PCACHE_LOW blocks at once, one that grows
+    past PCACHE_HIGH gives back all but PCACHE_LOW, so the global allocator is only entered once per batch.
+    A hart only touches its own magazines, with interrupts masked, so they are safe to use from interrupt handlers.
+    Blocks in a magazine are marked PAGE_META_CACHED in the block list; pcache_drain_all() returns them all when
+    alloc_pages() runs out of memory.
+*/
+#define PCACHE_ORDERS       3           // blocks of 1 << 0 .. 1 << (PCACHE_ORDERS - 1) pages are cached
+#define PCACHE_HIGH         32u         // single pages a magazine may hold, halved for every order above
+#define PCACHE_LOW          8u          // single pages after a refill or a drain, halved for every order above
+
+page_meta *pcache_alloc(uint32_t n);
+bool pcache_free(page_meta *block);
+uint32_t pcache_drain_all(void);
+void pcache_dump(void);
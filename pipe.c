@@ -0,0 +1,418 @@
+#include "pipe.h"
+#include "bcache.h"
+#include "ramfs.h"
+#include "epoll.h"
+
+static struct pipe pipes[PIPE_MAX];
+static uint32_t bcache_refs;       // PIPE_BUF_BCACHE buffers in all pipes, at most PIPE_BCACHE_REFS
+
+static uint32_t min_u32(uint32_t a, uint32_t b)
+{
+    return a < b ? a : b;
+}
+
+//wake the sleepers of the pipe and queue the epoll items watching it
+static void pipe_wake(struct pipe *p)
+{
+    wait_queue_wake_all(&p->wq);
+    epoll_notify(p->watchers);
+}
+
+//blocks of the disk behind /dev/blk
+static uint32_t disk_blocks(void)
+{
+    return (uint32_t)(blk_capacity() / BCACHE_SECTORS);
+}
+
+static struct pipe *get_pipe(void)
+{
+    for(int i = 0; i < PIPE_MAX; i++)
+    {
+        if(!pipes[i].used)
+        {
+            memset(&pipes[i], 0, sizeof(pipes[i]));
+            pipes[i].used = true;
+            return &pipes[i];
+        }
+    }
+    return NULL;
+}
+
+//a new anonymous pipe with one read and one write end open, NULL if all pipes are taken
+struct pipe *pipe_alloc(void)
+{
+    struct pipe *p = get_pipe();
+    if(p)
+    {
+        p->readers = p->writers = 1;
+        p->had_reader = p->had_writer = true;
+    }
+    return p;
+}
+
+/*
+    Open one end of the FIFO called name, creating it if it does not exist yet.
+    returns:
+        struct pipe *: the FIFO, NULL if the name is too long or all pipes are taken
+*/
+struct pipe *fifo_open(const char *name, bool writer)
+{
+    if(!name[0] || strlen(name) >= PIPE_NAME_MAX)
+    {
+        return NULL;
+    }
+    struct pipe *p = NULL;
+    for(int i = 0; i < PIPE_MAX && !p; i++)
+    {
+        if(pipes[i].used && !strcmp(pipes[i].name, name))
+        {
+            p = &pipes[i];
+        }
+    }
+    if(!p)
+    {
+        p = get_pipe();
+        if(!p)
+        {
+            return NULL;
+        }
+        strcpy(p->name, name);
+    }
+    if(writer)
+    {
+        p->writers++;
+        p->had_writer = true;
+    }
+    else
+    {
+        p->readers++;
+        p->had_reader = true;
+    }
+    return p;
+}
+
+static void buf_release(struct pipe_buf *b)
+{
+    if(b->kind == PIPE_BUF_PAGE)
+    {
+        free(b->page);      // NULL once the page was handed to the buffer cache
+    }
+    else if(b->kind == PIPE_BUF_BCACHE)
+    {
+        brelse(b->page);
+        bcache_refs--;
+    }
+}
+
+//take n bytes off the oldest buffer, dropping it once it is empty
+static void consume(struct pipe *p, uint32_t n)
+{
+    struct pipe_buf *b = &p->bufs[p->head];
+    b->data += n;
+    b->len -= n;
+    if(!b->len)
+    {
+        buf_release(b);
+        p->head = (p->head + 1) % PIPE_BUFS;
+        p->count--;
+    }
+}
+
+//the newest buffer, NULL if the pipe is empty
+static struct pipe_buf *tail(struct pipe *p)
+{
+    return p->count ? &p->bufs[(p->head + p->count - 1) % PIPE_BUFS] : NULL;
+}
+
+//claim the next free buffer; the caller made sure there is one
+static struct pipe_buf *push(struct pipe *p)
+{
+    struct pipe_buf *b = &p->bufs[(p->head + p->count) % PIPE_BUFS];
+    p->count++;
+    return b;
+}
+
+//sleep until the pipe holds data or never will again; false at end of file
+static bool wait_data(struct pipe *p)
+{
+    uint32_t sie = irq_save();
+    while(!p->count && (p->writers || !p->had_writer))
+    {
+        wait_queue_sleep(&p->wq);
+    }
+    irq_restore(sie);
+    return p->count != 0;
+}
+
+//sleep until a buffer is free; false if every reader has gone
+static bool wait_room(struct pipe *p)
+{
+    uint32_t sie = irq_save();
+    while(p->count == PIPE_BUFS && (p->readers || !p->had_reader))
+    {
+        wait_queue_sleep(&p->wq);
+    }
+    irq_restore(sie);
+    return p->readers || !p->had_reader;
+}
+
+//drop one end; the last one frees the pipe and whatever it still holds
+void pipe_close(struct pipe *p, bool writer)
+{
+    if(writer)
+    {
+        p->writers--;
+    }
+    else
+    {
+        p->readers--;
+    }
+    pipe_wake(p);                   // end of file for readers, a broken pipe for writers
+    if(p->readers || p->writers)
+    {
+        return;
+    }
+    while(p->count)
+    {
+        consume(p, p->bufs[p->head].len);
+    }
+    p->used = false;
+}
+
+//EPOLL* events that hold for the read end of the pipe, or the write end
+uint32_t pipe_poll(struct pipe *p, bool writer)
+{
+    if(!writer)
+    {
+        if(p->count)
+        {
+            return EPOLLIN;
+        }
+        return p->had_writer && !p->writers ? EPOLLIN | EPOLLHUP : 0;
+    }
+    if(p->had_reader && !p->readers)
+    {
+        return EPOLLERR;
+    }
+    struct pipe_buf *t = tail(p);
+    bool room = p->count < PIPE_BUFS || (t->kind == PIPE_BUF_PAGE && t->data + t->len < (uint8_t *)t->page + PAGE_SIZE);
+    return room ? EPOLLOUT : 0;
+}
+
+/*
+    Read up to len bytes, sleeping only while the pipe is empty.
+    returns:
+        int: bytes read, 0 at end of file
+*/
+int pipe_read(struct pipe *p, void *buf, uint32_t len)
+{
+    if(!len || !wait_data(p))
+    {
+        return 0;
+    }
+    uint32_t done = 0;
+    while(done < len && p->count)
+    {
+        struct pipe_buf *b = &p->bufs[p->head];
+        uint32_t n = min_u32(b->len, len - done);
+        memcpy((uint8_t *)buf + done, b->data, n);
+        consume(p, n);
+        done += n;
+    }
+    pipe_wake(p);
+    return done;
+}
+
+/*
+    Write len bytes, filling up the newest page before starting another and sleeping while all buffers are in use.
+    returns:
+        int: bytes written, -1 if every reader has gone before anything was written
+*/
+int pipe_write(struct pipe *p, const void *buf, uint32_t len)
+{
+    uint32_t done = 0;
+    while(done < len)
+    {
+        struct pipe_buf *t = tail(p);
+        uint32_t room = t && t->kind == PIPE_BUF_PAGE ? (uint8_t *)t->page + PAGE_SIZE - (t->data + t->len) : 0;
+        if(!room)
+        {
+            if(!wait_room(p))
+            {
+                break;
+            }
+            t = push(p);
+            t->kind = PIPE_BUF_PAGE;
+            t->page = alloc_pages(1);
+            t->data = t->page;
+            t->len = 0;
+            room = PAGE_SIZE;
+        }
+        else if(p->had_reader && !p->readers)
+        {
+            break;
+        }
+        uint32_t n = min_u32(room, len - done);
+        memcpy(t->data + t->len, (const uint8_t *)buf + done, n);
+        t->len += n;
+        done += n;
+        pipe_wake(p);
+    }
+    return done || !len ? (int)done : -1;
+}
+
+//file or disk blocks into the pipe as page references, sleeping while it is full; like write(), all of len
+static int splice_in(struct open_file *in, struct pipe *p, uint32_t len)
+{
+    uint32_t done = 0;
+    while(done < len)
+    {
+        //the source first: bread() may sleep, and the pipe has to be looked at after that
+        uint8_t *data;
+        uint32_t n;
+        struct buf *cb = NULL;
+        if(in->type == FD_FILE)
+        {
+            uint32_t left = in->file->size - in->offset;
+            if(!left)
+            {
+                break;
+            }
+            data = (uint8_t *)in->file->data + in->offset;
+            n = min_u32(min_u32(left, len - done), PAGE_SIZE - ((paddr_t)data & (PAGE_SIZE - 1)));
+        }
+        else
+        {
+            uint32_t blockno = in->offset / BCACHE_BLOCK_SIZE;
+            cb = blockno < disk_blocks() ? bread(0, blockno) : NULL;
+            if(!cb)
+            {
+                break;
+            }
+            uint32_t off = in->offset % BCACHE_BLOCK_SIZE;
+            data = cb->data + off;
+            n = min_u32(len - done, BCACHE_BLOCK_SIZE - off);
+        }
+        if(!wait_room(p))
+        {
+            if(cb)
+            {
+                brelse(cb);
+            }
+            break;
+        }
+        struct pipe_buf *b = push(p);
+        b->data = data;
+        b->len = n;
+        b->kind = cb ? PIPE_BUF_BCACHE : PIPE_BUF_FILE;
+        b->page = cb;
+        if(cb && bcache_refs == PIPE_BCACHE_REFS)
+        {
+            //unread pipes must not pin the buffer cache, past the cap the block is copied
+            b->kind = PIPE_BUF_PAGE;
+            b->page = alloc_pages(1);
+            b->data = memcpy(b->page, data, n);
+            brelse(cb);
+        }
+        else if(cb)
+        {
+            bcache_refs++;
+        }
+        in->offset += n;
+        done += n;
+        pipe_wake(p);
+    }
+    return done || !len ? (int)done : -1;
+}
+
+//move up to max bytes of the oldest buffer to the disk at out->offset; returns bytes moved, -1 on an error
+static int block_put(struct open_file *out, struct pipe *p, uint32_t max)
+{
+    uint32_t blockno = out->offset / BCACHE_BLOCK_SIZE;
+    uint32_t off = out->offset % BCACHE_BLOCK_SIZE;
+    if(blockno >= disk_blocks())
+    {
+        return -1;
+    }
+    //a block written whole is not read first; bget() sleeps only while freeing a buffer, before the pipe is looked at
+    bool whole = !off && max >= BCACHE_BLOCK_SIZE && p->bufs[p->head].len >= BCACHE_BLOCK_SIZE;
+    struct buf *cb = whole ? bget(0, blockno) : bread(0, blockno);
+    if(!cb)
+    {
+        return -1;
+    }
+    if(!p->count)
+    {
+        brelse(cb);     // another reader emptied the pipe while we slept
+        return 0;
+    }
+    struct pipe_buf *b = &p->bufs[p->head];
+    uint32_t n = min_u32(min_u32(b->len, max), BCACHE_BLOCK_SIZE - off);
+    if(whole && n < BCACHE_BLOCK_SIZE)
+    {
+        brelse(cb);     // the pipe changed while we slept, the next call reads the block first
+        return 0;
+    }
+    //a whole page of the pipe's own becomes the block, anything else is copied into it
+    if(n == BCACHE_BLOCK_SIZE && b->kind == PIPE_BUF_PAGE && b->data == b->page && bcache_give_page(cb, b->page))
+    {
+        b->page = NULL;
+    }
+    else
+    {
+        memcpy(cb->data + off, b->data, n);
+        bwrite(cb);
+    }
+    brelse(cb);
+    out->offset += n;
+    consume(p, n);
+    return n;
+}
+
+//the pipe out to the console or the disk; like read(), sleeps only until there is some data
+static int splice_out(struct pipe *p, struct open_file *out, uint32_t len)
+{
+    uint32_t done = 0;
+    while(done < len && (p->count || (!done && wait_data(p))))
+    {
+        struct pipe_buf *b = &p->bufs[p->head];
+        uint32_t n = min_u32(b->len, len - done);
+        if(out->type == FD_CONSOLE)
+        {
+            console_write(b->data, n);
+            consume(p, n);
+        }
+        else
+        {
+            int moved = block_put(out, p, n);
+            if(moved < 0)
+            {
+                return done ? (int)done : -1;
+            }
+            n = moved;
+        }
+        done += n;
+    }
+    pipe_wake(p);
+    return done;
+}
+
+/*
+    Move len bytes between a pipe and another descriptor without copying where the data allows it:
+    a file or /dev/blk into a pipe, or a pipe out to /dev/console or /dev/blk. The offsets of files and the
+    disk move along.
+    returns:
+        int: bytes moved, 0 at end of file, -1 if the descriptors are not such a pair
+*/
+int pipe_splice(struct open_file *in, struct open_file *out, uint32_t len)
+{
+    if(out->type == FD_PIPE_WRITE && (in->type == FD_FILE || in->type == FD_BLOCK))
+    {
+        return splice_in(in, out->pipe, len);
+    }
+    if(in->type == FD_PIPE_READ && (out->type == FD_CONSOLE || out->type == FD_BLOCK))
+    {
+        return splice_out(in->pipe, out, len);
+    }
+    return -1;
+}
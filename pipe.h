@@ -0,0 +1,57 @@
+#pragma once
+#include "kernel.h"
+
+/*
+    Pipes. A pipe is a ring of PIPE_BUFS buffers, each at most one page: a page of its own that write() copies into,
+    or a reference to a page that splice() put there without copying (initrd file data, or a buffer cache block
+    held with a reference, up to PIPE_BCACHE_REFS of them over all pipes so unread pipes cannot pin the whole
+    cache). Readers and writers sleep on the pipe's wait queue while it is empty or full, so a pipe never holds
+    more than PIPE_BUFS pages. splice() moves data between a pipe and another descriptor page by
+    page: a file or disk blocks into the pipe as references, the pipe out to the console with one SBI call per
+    buffer, or to the disk by handing whole pages over to the buffer cache.
+    Anonymous pipes come from pipe(); a FIFO is opened by name under PIPE_FIFO_PREFIX and lives while either end
+    is open. Reading returns 0 once every writer that ever opened the pipe has closed it, writing fails once every
+    reader has. An epoll (see epoll.h) watching either end is told whenever the pipe wakes its sleepers.
+*/
+#define PIPE_BUFS           16          // buffers per pipe, so at most 64KB of data in flight
+#define PIPE_MAX            128         // pipes in the system
+#define PIPE_NAME_MAX       32          // FIFO name, including the NUL
+#define PIPE_FIFO_PREFIX    "/fifo/"
+#define PIPE_BCACHE_REFS    64          // buffer cache blocks all pipes may hold, spliced blocks are copied beyond
+
+#define PIPE_BUF_PAGE       0           // the pipe's own page, freed once consumed
+#define PIPE_BUF_FILE       1           // initrd data, never freed
+#define PIPE_BUF_BCACHE     2           // data of a buffer cache block, released with brelse() once consumed
+
+struct buf;
+
+struct pipe_buf
+{
+    uint8_t *data;                      // first unread byte
+    uint32_t len;                       // unread bytes
+    int kind;                           // PIPE_BUF_*
+    void *page;                         // PIPE_BUF_PAGE: the page; PIPE_BUF_BCACHE: the struct buf
+};
+
+struct pipe
+{
+    char name[PIPE_NAME_MAX];           // FIFO name, empty for an anonymous pipe
+    struct pipe_buf bufs[PIPE_BUFS];
+    uint32_t head;                      // oldest buffer; head and count index bufs modulo PIPE_BUFS
+    uint32_t count;                     // buffers in use
+    uint32_t readers;                   // open read ends
+    uint32_t writers;                   // open write ends
+    bool had_reader;                    // a read end was open at some point
+    bool had_writer;
+    bool used;
+    struct wait_queue wq;               // readers waiting for data, writers waiting for room
+    struct epoll_item *watchers;        // epoll items watching either end, queued whenever wq is woken
+};
+
+struct pipe *pipe_alloc(void);
+struct pipe *fifo_open(const char *name, bool writer);
+void pipe_close(struct pipe *p, bool writer);
+uint32_t pipe_poll(struct pipe *p, bool writer);
+int pipe_read(struct pipe *p, void *buf, uint32_t len);
+int pipe_write(struct pipe *p, const void *buf, uint32_t len);
+int pipe_splice(struct open_file *in, struct open_file *out, uint32_t len);
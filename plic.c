@@ -0,0 +1,59 @@
+#include "plic.h"
+
+//device interrupt handlers, indexed by PLIC interrupt number
+static struct
+{
+    irq_handler_t handler;
+    void *arg;
+} irq_handlers[PLIC_NUM_IRQS];
+
+static int boot_hart;   // hart whose S-mode context receives device interrupts
+
+#define PLIC_REG(addr) (*(volatile uint32_t *)(addr))
+
+//accept every interrupt with a priority above 0 on this hart and enable sie.SEIE
+void plic_init_hart(int hart)
+{
+    boot_hart = hart;
+    PLIC_REG(PLIC_STHRESHOLD(hart)) = 0;
+    __asm__ __volatile__("csrs sie, %0" :: "r"(SIE_SEIE));
+}
+
+/*
+    Route a device interrupt to handler. The handler runs in trap context with interrupts masked
+    and must only acknowledge the device and wake whoever waits for it.
+    Parameters:
+        uint32_t irq: PLIC interrupt number
+        irq_handler_t handler: function called for each claimed interrupt
+        void *arg: passed to handler
+*/
+void plic_register(uint32_t irq, irq_handler_t handler, void *arg)
+{
+    if(irq == 0 || irq >= PLIC_NUM_IRQS || irq > platform.plic_ndev)
+    {
+        PANIC("invalid irq %d", irq);
+    }
+    irq_handlers[irq].handler = handler;
+    irq_handlers[irq].arg = arg;
+
+    PLIC_REG(PLIC_PRIORITY(irq)) = 1;
+    PLIC_REG(PLIC_SENABLE(boot_hart) + 4 * (irq / 32)) |= 1u << (irq % 32);
+}
+
+//Handle the supervisor external interrupt: claim, dispatch and complete until nothing is pending
+void handle_external_trap(void)
+{
+    uint32_t irq;
+    while((irq = PLIC_REG(PLIC_SCLAIM(boot_hart))) != 0)
+    {
+        if(irq < PLIC_NUM_IRQS && irq_handlers[irq].handler)
+        {
+            irq_handlers[irq].handler(irq_handlers[irq].arg);
+        }
+        else
+        {
+            printf("unexpected external interrupt %d\n", irq);
+        }
+        PLIC_REG(PLIC_SCLAIM(boot_hart)) = irq;
+    }
+}
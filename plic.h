@@ -0,0 +1,19 @@
+#pragma once
+#include "kernel.h"
+#include "fdt.h"
+
+//Platform-Level Interrupt Controller, located through the device tree (fdt_probe())
+#define PLIC_BASE           (platform.plic.base)
+#define PLIC_PRIORITY(irq)  (PLIC_BASE + 4 * (irq))                     // priority of an interrupt source
+#define PLIC_SENABLE(hart)  (PLIC_BASE + 0x2000 + 0x80 * (2 * (hart) + 1))     // enable bits of the hart's S-mode context
+#define PLIC_STHRESHOLD(hart) (PLIC_BASE + 0x200000 + 0x1000 * (2 * (hart) + 1))  // priority threshold of the S-mode context
+#define PLIC_SCLAIM(hart)   (PLIC_STHRESHOLD(hart) + 4)                 // claim/complete register of the S-mode context
+#define PLIC_NUM_IRQS       128         // handler table size, the PLIC itself implements platform.plic_ndev
+
+#define SIE_SEIE            (1u << 9)       // supervisor external interrupt enable
+
+typedef void (*irq_handler_t)(void *arg);
+
+void plic_init_hart(int hart);
+void plic_register(uint32_t irq, irq_handler_t handler, void *arg);
+void handle_external_trap(void);
@@ -0,0 +1,221 @@
+#include "pmu.h"
+
+static const char *const event_names[PMU_NR_EVENTS] = {
+    "cycles", "instret", "cache-miss", "misalign-ld", "misalign-st", "tlbflush-tx", "tlbflush-rx",
+};
+
+static const uint32_t event_idx[PMU_NR_EVENTS] = {
+    SBI_PMU_HW_EVENT(SBI_PMU_HW_CPU_CYCLES),
+    SBI_PMU_HW_EVENT(SBI_PMU_HW_INSTRUCTIONS),
+    SBI_PMU_HW_EVENT(SBI_PMU_HW_CACHE_MISSES),
+    SBI_PMU_FW_EVENT(SBI_PMU_FW_MISALIGNED_LOAD),
+    SBI_PMU_FW_EVENT(SBI_PMU_FW_MISALIGNED_STORE),
+    SBI_PMU_FW_EVENT(SBI_PMU_FW_SFENCE_VMA_SENT),
+    SBI_PMU_FW_EVENT(SBI_PMU_FW_SFENCE_VMA_RCVD),
+};
+
+//counters of one hart; every hart configures its own, SBI may hand out different counters on each
+struct pmu_cpu
+{
+    int counter[PMU_NR_EVENTS];             // SBI counter index of each event, -1 if it is not counted
+    uint32_t counter_csr[PMU_NR_EVENTS];    // CSR of a hardware counter, 0 for a firmware counter
+    uint64_t last[PMU_NR_EVENTS];           // counter values at the last context switch on this hart
+};
+
+static struct pmu_cpu pmu_cpus[HARTS_MAX];
+
+static struct pmu_cpu *this_pmu(void)
+{
+    return &pmu_cpus[this_hart()];
+}
+
+//read a 64-bit counter CSR pair, re-reading if the upper half changed meanwhile
+#define COUNTER_CASE(lo_csr, hi_csr)                                    \
+    case lo_csr:                                                        \
+        do                                                              \
+        {                                                               \
+            hi = READ_CSR(hi_csr);                                      \
+            lo = READ_CSR(lo_csr);                                      \
+        } while(hi != READ_CSR(hi_csr));                                \
+        break
+
+//the CSR number has to be an immediate, so every counter CSR gets its own csrr
+static uint64_t read_counter_csr(uint32_t csr)
+{
+    uint32_t hi = 0, lo = 0;
+    switch(csr)
+    {
+        COUNTER_CASE(0xc00, 0xc80);
+        COUNTER_CASE(0xc02, 0xc82);
+        COUNTER_CASE(0xc03, 0xc83);
+        COUNTER_CASE(0xc04, 0xc84);
+        COUNTER_CASE(0xc05, 0xc85);
+        COUNTER_CASE(0xc06, 0xc86);
+        COUNTER_CASE(0xc07, 0xc87);
+        COUNTER_CASE(0xc08, 0xc88);
+        COUNTER_CASE(0xc09, 0xc89);
+        COUNTER_CASE(0xc0a, 0xc8a);
+        COUNTER_CASE(0xc0b, 0xc8b);
+        COUNTER_CASE(0xc0c, 0xc8c);
+        COUNTER_CASE(0xc0d, 0xc8d);
+        COUNTER_CASE(0xc0e, 0xc8e);
+        COUNTER_CASE(0xc0f, 0xc8f);
+        COUNTER_CASE(0xc10, 0xc90);
+        COUNTER_CASE(0xc11, 0xc91);
+        COUNTER_CASE(0xc12, 0xc92);
+        COUNTER_CASE(0xc13, 0xc93);
+        COUNTER_CASE(0xc14, 0xc94);
+        COUNTER_CASE(0xc15, 0xc95);
+        COUNTER_CASE(0xc16, 0xc96);
+        COUNTER_CASE(0xc17, 0xc97);
+        COUNTER_CASE(0xc18, 0xc98);
+        COUNTER_CASE(0xc19, 0xc99);
+        COUNTER_CASE(0xc1a, 0xc9a);
+        COUNTER_CASE(0xc1b, 0xc9b);
+        COUNTER_CASE(0xc1c, 0xc9c);
+        COUNTER_CASE(0xc1d, 0xc9d);
+        COUNTER_CASE(0xc1e, 0xc9e);
+        COUNTER_CASE(0xc1f, 0xc9f);
+    }
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static uint64_t read_event(struct pmu_cpu *p, int event)
+{
+    if(p->counter_csr[event])
+    {
+        return read_counter_csr(p->counter_csr[event]);
+    }
+    //firmware counters are 32 bits wide here (no fw_read_hi before SBI 2.0), deltas are taken modulo 2^32
+    return (uint32_t)sbi_call(p->counter[event], 0, 0, 0, 0, 0, SBI_PMU_COUNTER_FW_READ, SBI_EXT_PMU).value;
+}
+
+//counts of event on this hart since the last switch
+static uint64_t event_delta(struct pmu_cpu *p, int event, uint64_t now)
+{
+    uint64_t delta = now - p->last[event];
+    if(!p->counter_csr[event])
+    {
+        delta = (uint32_t)delta;
+    }
+    p->last[event] = now;
+    return delta;
+}
+
+//configure a counter on this hart for every event the platform supports and start them. Run by every hart.
+void pmu_init(void)
+{
+    struct pmu_cpu *p = this_pmu();
+    struct sbiret ret = sbi_call(0, 0, 0, 0, 0, 0, SBI_PMU_NUM_COUNTERS, SBI_EXT_PMU);
+    uint32_t ncounters = ret.error ? 0 : ret.value;
+    uint32_t mask = ncounters >= 32 ? 0xffffffff : (1u << ncounters) - 1;
+
+    int available = 0;
+    for(int event = 0; event < PMU_NR_EVENTS; event++)
+    {
+        p->counter[event] = -1;
+        p->counter_csr[event] = 0;
+        if(!ncounters)
+        {
+            continue;
+        }
+
+        //the SBI implementation picks a free counter that can count the event, cleared and started
+        ret = sbi_call(0, mask, SBI_PMU_CFG_CLEAR_VALUE | SBI_PMU_CFG_AUTO_START, event_idx[event], 0, 0,
+            SBI_PMU_COUNTER_CFG_MATCH, SBI_EXT_PMU);
+        if(ret.error)
+        {
+            continue;
+        }
+        p->counter[event] = ret.value;
+
+        ret = sbi_call(p->counter[event], 0, 0, 0, 0, 0, SBI_PMU_COUNTER_GET_INFO, SBI_EXT_PMU);
+        if(!ret.error && !(ret.value & SBI_PMU_INFO_FIRMWARE))
+        {
+            p->counter_csr[event] = ret.value & 0xfff;
+        }
+        p->last[event] = read_event(p, event);
+        available++;
+    }
+    printf("pmu: cpu %d: %d counters, %d of %d events counted\n", this_hart(), ncounters, available, PMU_NR_EVENTS);
+}
+
+/*
+    Charge the events on this hart since the last switch to prev. Called by yield() right before the context switch.
+    Hardware counters cost a CSR read each; firmware counters an SBI call each.
+*/
+void pmu_switch(struct process *prev)
+{
+    struct pmu_cpu *p = this_pmu();
+    for(int event = 0; event < PMU_NR_EVENTS; event++)
+    {
+        if(p->counter[event] >= 0)
+        {
+            prev->pmu[event] += event_delta(p, event, read_event(p, event));
+        }
+    }
+}
+
+/*
+    Report what a process has used so far.
+    Parameters:
+        struct process *proc: process to report on, the current process includes its running slice
+        struct pmu_report *r: filled in
+*/
+void pmu_report(struct process *proc, struct pmu_report *r)
+{
+    uint32_t sie = irq_save();
+    if(proc == current_proc)
+    {
+        pmu_switch(proc);
+    }
+
+    r->cpu_time_us = scaled_div(proc->sum_exec_runtime, ticks_per_us());
+
+    for(int event = 0; event < PMU_NR_EVENTS; event++)
+    {
+        r->valid[event] = this_pmu()->counter[event] >= 0;
+        r->count[event] = proc->pmu[event];
+    }
+
+    r->ipc_x100 = r->valid[PMU_CYCLES] ? scaled_div(proc->pmu[PMU_INSTRET] * 100, proc->pmu[PMU_CYCLES]) : 0;
+    irq_restore(sie);
+}
+
+//print CPU time, IPC and the event counts of every process (hardware event counts in units of 1024)
+void pmu_dump(void)
+{
+    printf("pid  cpu(us)     ipc");
+    for(int event = 0; event < PMU_NR_EVENTS; event++)
+    {
+        printf(" %s", event_names[event]);
+    }
+    printf("\n");
+
+    for(int i = 0; i < nr_procs; i++)
+    {
+        if(procs[i].state == PROC_UNUSED)
+        {
+            continue;
+        }
+        struct pmu_report r;
+        pmu_report(&procs[i], &r);
+        printf("%d    %d    %d.%d%d", procs[i].pid, r.cpu_time_us, r.ipc_x100 / 100, r.ipc_x100 / 10 % 10, r.ipc_x100 % 10);
+        for(int event = 0; event < PMU_NR_EVENTS; event++)
+        {
+            if(!r.valid[event])
+            {
+                printf(" -");
+            }
+            else if(event <= PMU_CACHE_MISSES)
+            {
+                printf(" %dk", (uint32_t)(r.count[event] >> 10));
+            }
+            else
+            {
+                printf(" %d", (uint32_t)r.count[event]);
+            }
+        }
+        printf("\n");
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include "kernel.h"
+
+/*
+    Per-process event counting through the SBI PMU extension. Counters are configured by every hart as it comes up and run
+    continuously; at every context switch the counts since the previous switch are added to the outgoing
+    process, so each process accumulates its own cycles, instructions and firmware events.
+    Hardware counters are read directly from their CSRs, firmware counters (traps emulated by OpenSBI,
+    remote fences) with an SBI call.
+*/
+#define SBI_EXT_PMU                 0x504d55
+#define SBI_PMU_NUM_COUNTERS        0
+#define SBI_PMU_COUNTER_GET_INFO    1
+#define SBI_PMU_COUNTER_CFG_MATCH   2
+#define SBI_PMU_COUNTER_START       3
+#define SBI_PMU_COUNTER_STOP        4
+#define SBI_PMU_COUNTER_FW_READ     5
+
+#define SBI_PMU_CFG_CLEAR_VALUE     (1 << 1)
+#define SBI_PMU_CFG_AUTO_START      (1 << 2)
+#define SBI_PMU_INFO_FIRMWARE       (1u << 31)  // counter_info type bit
+
+//event_idx = type << 16 | code
+#define SBI_PMU_HW_EVENT(code)      (code)
+#define SBI_PMU_FW_EVENT(code)      (0xf << 16 | (code))
+#define SBI_PMU_HW_CPU_CYCLES       1
+#define SBI_PMU_HW_INSTRUCTIONS     2
+#define SBI_PMU_HW_CACHE_MISSES     4
+#define SBI_PMU_FW_MISALIGNED_LOAD  0
+#define SBI_PMU_FW_MISALIGNED_STORE 1
+#define SBI_PMU_FW_SFENCE_VMA_SENT  10
+#define SBI_PMU_FW_SFENCE_VMA_RCVD  11
+
+//slots of process->pmu[]
+#define PMU_CYCLES                  0
+#define PMU_INSTRET                 1
+#define PMU_CACHE_MISSES            2
+#define PMU_MISALIGNED_LOAD         3
+#define PMU_MISALIGNED_STORE        4
+#define PMU_TLB_FLUSH_SENT          5   // remote sfence.vma requests sent through SBI
+#define PMU_TLB_FLUSH_RCVD          6   // remote sfence.vma requests executed on this hart
+
+//what a process used, as reported by pmu_report()
+struct pmu_report
+{
+    uint32_t cpu_time_us;       // time the process ran, from the scheduler's accounting
+    uint64_t count[PMU_NR_EVENTS];
+    bool valid[PMU_NR_EVENTS];  // false if the platform has no counter for the event
+    uint32_t ipc_x100;          // instructions per cycle * 100, 0 if cycles are not counted
+};
+
+void pmu_init(void);
+void pmu_switch(struct process *prev);
+void pmu_report(struct process *proc, struct pmu_report *r);
+void pmu_dump(void);
@@ -0,0 +1,203 @@
+#include "prof.h"
+
+static struct prof_cpu prof_cpus[HARTS_MAX];
+static bool prof_running = false;
+static uint32_t prof_hz;
+static uint32_t prof_period;            // time CSR ticks between samples
+static uint64_t prof_started_at;
+static uint64_t prof_stopped_at;
+
+//the hart taking the sample
+static struct prof_cpu *this_prof(void)
+{
+    return &prof_cpus[this_hart()];
+}
+
+/*
+    Start sampling hz times per second, discarding the samples of a previous run.
+    returns:
+        int: 0 on success, -1 if hz is 0 or faster than the time CSR
+*/
+int prof_start(uint32_t hz)
+{
+    if(hz == 0 || hz > timebase_freq)
+    {
+        return -1;
+    }
+
+    uint32_t sie = irq_save();
+    prof_hz = hz;
+    prof_period = timebase_freq / hz;
+    prof_started_at = read_time();
+    for(uint32_t hart = 0; hart < nr_cpus; hart++)
+    {
+        struct prof_cpu *pc = &prof_cpus[hart];
+        if(!pc->hist)
+        {
+            pc->hist = alloc_pages(align_up(PROF_HIST_SIZE * sizeof(struct prof_hist_entry), PAGE_SIZE) / PAGE_SIZE);
+            pc->stacks = alloc_pages(align_up(PROF_STACK_SAMPLES * sizeof(struct prof_stack), PAGE_SIZE) / PAGE_SIZE);
+        }
+        memset(pc->hist, 0, PROF_HIST_SIZE * sizeof(struct prof_hist_entry));
+        pc->nstacks = 0;
+        pc->samples = 0;
+        pc->dropped = 0;
+        pc->overhead = 0;
+        pc->next_sample = prof_started_at + prof_period;
+    }
+    prof_running = true;
+    //stimecmp is re-armed by the scheduler at the next tick, which is at most one time slice away
+    irq_restore(sie);
+    return 0;
+}
+
+void prof_stop(void)
+{
+    uint32_t sie = irq_save();
+    prof_running = false;
+    prof_stopped_at = read_time();
+    irq_restore(sie);
+}
+
+//time of the next sample, for the scheduler to fold into stimecmp. ~0 when the profiler is off.
+uint64_t prof_next_sample(void)
+{
+    return prof_running && this_prof()->hist ? this_prof()->next_sample : ~0ull;
+}
+
+static bool on_stack(uint32_t fp, uint32_t lo, uint32_t hi)
+{
+    return fp >= lo + 8 && fp <= hi && is_aligned(fp, 4);
+}
+
+//walk the frame pointer chain of interrupted kernel code: the return address is at fp - 4, the caller's fp at fp - 8
+static uint8_t walk_frames(struct trap_frame *f, uint32_t *pcs)
+{
+    uint32_t lo = (uint32_t)current_proc->stack;
+    uint32_t hi = lo + sizeof(current_proc->stack);
+    uint32_t fp = f->s0;
+    if(!on_stack(fp, lo, hi))
+    {
+        //the idle process runs on the stack its hart booted on
+        hi = this_cpu()->stack_top;
+        lo = hi - this_cpu()->stack_size;
+    }
+
+    uint8_t depth = 1;
+    while(depth < PROF_MAX_DEPTH && on_stack(fp, lo, hi))
+    {
+        uint32_t ra = ((uint32_t *)fp)[-1];
+        uint32_t prev = ((uint32_t *)fp)[-2];
+        if(!ra)
+        {
+            break;
+        }
+        pcs[depth++] = ra;
+        if(prev <= fp)
+        {
+            break;  // frames grow towards higher addresses, anything else is not a frame pointer
+        }
+        fp = prev;
+    }
+    return depth;
+}
+
+/*
+    Take a sample if one is due. Called first thing by the timer interrupt handler.
+    returns:
+        int: 1 if a sample was taken
+*/
+int prof_tick(struct trap_frame *f)
+{
+    struct prof_cpu *pc = this_prof();
+    if(!prof_running || !pc->hist)
+    {
+        return 0;       // also a hart that came up after prof_start()
+    }
+    uint64_t now = read_time();
+    if(now < pc->next_sample)
+    {
+        return 0;
+    }
+    //a late tick is not made up for, that would sample the same spot several times
+    pc->next_sample = now + prof_period;
+    pc->samples++;
+
+    uint32_t pid = current_proc->pid;
+    uint32_t h = ((f->sepc >> 2) ^ (pid * 0x9e3779b1u)) & (PROF_HIST_SIZE - 1);
+    int i;
+    for(i = 0; i < PROF_HIST_PROBES; i++)
+    {
+        struct prof_hist_entry *e = &pc->hist[(h + i) & (PROF_HIST_SIZE - 1)];
+        if(e->count == 0)
+        {
+            e->pc = f->sepc;
+            e->pid = pid;
+        }
+        if(e->pc == f->sepc && e->pid == pid)
+        {
+            e->count++;
+            break;
+        }
+    }
+    if(i == PROF_HIST_PROBES)
+    {
+        pc->dropped++;
+    }
+
+    if(pc->nstacks < PROF_STACK_SAMPLES)
+    {
+        struct prof_stack *s = &pc->stacks[pc->nstacks++];
+        s->pid = pid;
+        s->user = !(f->sstatus & SSTATUS_SPP);
+        s->pc[0] = f->sepc;
+        //user stacks are not trusted and may not be populated yet, only kernel code is unwound
+        s->depth = s->user ? 1 : walk_frames(f, s->pc);
+    }
+
+    pc->overhead += read_time() - now;
+    return 1;
+}
+
+/*
+    Print the samples of every hart for profsym.py:
+        H <pid> <pc> <count>            one line per histogram slot
+        S <pid> <k|u> <pc> <pc> ...     one line per call stack, innermost frame first
+    Also prints the time spent taking samples relative to the profiled time.
+*/
+void prof_dump(void)
+{
+    uint64_t end = prof_running ? read_time() : prof_stopped_at;
+    printf("prof: begin hz=%d\n", prof_hz);
+    for(int hart = 0; hart < HARTS_MAX; hart++)
+    {
+        struct prof_cpu *pc = &prof_cpus[hart];
+        if(!pc->hist)
+        {
+            continue;
+        }
+
+        //overhead in tenths of a percent
+        uint32_t permille = scaled_div(pc->overhead * 1000, end - prof_started_at);
+        printf("prof: hart %d samples %d dropped %d overhead %d.%d%%\n", hart, pc->samples, pc->dropped,
+            permille / 10, permille % 10);
+
+        for(int i = 0; i < PROF_HIST_SIZE; i++)
+        {
+            if(pc->hist[i].count)
+            {
+                printf("H %d %x %d\n", pc->hist[i].pid, pc->hist[i].pc, pc->hist[i].count);
+            }
+        }
+        for(uint32_t i = 0; i < pc->nstacks; i++)
+        {
+            struct prof_stack *s = &pc->stacks[i];
+            printf("S %d %s", s->pid, s->user ? "u" : "k");
+            for(int d = 0; d < s->depth; d++)
+            {
+                printf(" %x", s->pc[d]);
+            }
+            printf("\n");
+        }
+    }
+    printf("prof: end\n");
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include "kernel.h"
+
+/*
+    Statistical profiler. While running, the timer interrupt also fires every prof period; each such tick records
+    the interrupted pc and pid in a histogram and, for kernel code, the call stack found by walking frame pointers
+    (build with ./run.sh prof, which adds -fno-omit-frame-pointer). prof_dump() prints the samples as text that
+    profsym.py symbolizes against kernel.elf and collapses into flame graph input.
+*/
+#define PROF_DEFAULT_HZ     1000        // samples per second
+#define PROF_HIST_SIZE      4096        // (pc, pid) histogram slots per hart, power of 2
+#define PROF_HIST_PROBES    8           // linear probes before a sample is counted as dropped
+#define PROF_STACK_SAMPLES  2048        // call stacks kept per hart
+#define PROF_MAX_DEPTH      12          // frames per call stack, the interrupted pc included
+
+struct prof_hist_entry
+{
+    uint32_t pc;
+    uint32_t pid;
+    uint32_t count;                     // 0 = free slot
+};
+
+struct prof_stack
+{
+    uint16_t pid;
+    uint8_t depth;
+    uint8_t user;                       // sampled in user mode, pc[0] is a user address
+    uint32_t pc[PROF_MAX_DEPTH];        // innermost frame first
+};
+
+//profiling state of one hart, indexed by this_hart()
+struct prof_cpu
+{
+    uint64_t next_sample;               // time CSR value of the next sample
+    struct prof_hist_entry *hist;
+    struct prof_stack *stacks;
+    uint32_t nstacks;
+    uint32_t samples;
+    uint32_t dropped;                   // samples that found no free histogram slot
+    uint64_t overhead;                  // time CSR ticks spent in prof_tick()
+};
+
+int prof_start(uint32_t hz);
+void prof_stop(void);
+uint64_t prof_next_sample(void);
+int prof_tick(struct trap_frame *f);
+void prof_dump(void);
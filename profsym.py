@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+# Symbolize the output of prof_dump() against kernel.elf.
+# usage: profsym.py <kernel.elf> <console log> [--flat]
+#   default: collapsed stacks ("pid 3;outer;...;inner <count>"), the input format of flamegraph.pl / speedscope
+#   --flat:  samples per function from the pc histogram, hottest first
+import bisect
+import subprocess
+import sys
+from collections import Counter
+
+
+def load_symbols(elf):
+    # llvm-nm comes with the llvm package the kernel is built with
+    out = subprocess.run(["llvm-nm", "-n", "--defined-only", elf], capture_output=True, text=True, check=True).stdout
+    addrs, names = [], []
+    for line in out.splitlines():
+        parts = line.split()
+        if len(parts) == 3 and parts[1] in "tTwW":
+            addrs.append(int(parts[0], 16))
+            names.append(parts[2])
+    return addrs, names
+
+
+def symbolize(addrs, names, pc):
+    if pc < 0x80000000:
+        return "[user]"     # user programs are linked separately, see the hello.map etc.
+    i = bisect.bisect_right(addrs, pc) - 1
+    return names[i] if i >= 0 else "0x%08x" % pc
+
+
+def main():
+    elf, log = sys.argv[1], sys.argv[2]
+    flat = "--flat" in sys.argv[3:]
+    addrs, names = load_symbols(elf)
+
+    hist = Counter()
+    stacks = Counter()
+    inside = False
+    for line in open(log, errors="replace"):
+        line = line.strip()
+        if line.startswith("prof: begin"):
+            inside = True
+            continue
+        if line.startswith("prof: end"):
+            inside = False
+            continue
+        if not inside:
+            continue
+        if line.startswith("prof:"):
+            print(line, file=sys.stderr)
+            continue
+        parts = line.split()
+        if parts[0] == "H" and len(parts) == 4:
+            pid, pc, count = int(parts[1]), int(parts[2], 16), int(parts[3])
+            hist[(pid, symbolize(addrs, names, pc))] += count
+        elif parts[0] == "S" and len(parts) >= 4:
+            pid, mode = int(parts[1]), parts[2]
+            pcs = [int(p, 16) for p in parts[3:]]
+            if mode == "u":
+                frames = ["[user]"]
+            else:
+                # return addresses point after the call, step back into it
+                frames = [symbolize(addrs, names, pcs[0])] + [symbolize(addrs, names, pc - 4) for pc in pcs[1:]]
+            stacks[";".join(["pid %d" % pid] + frames[::-1])] += 1
+
+    if flat:
+        total = sum(hist.values()) or 1
+        for (pid, fn), count in hist.most_common():
+            print("%6.2f%% %6d  pid %-3d %s" % (100.0 * count / total, count, pid, fn))
+    else:
+        for stack, count in stacks.items():
+            print(stack, count)
+
+
+if __name__ == "__main__":
+    main()
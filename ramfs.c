@@ -0,0 +1,565 @@
+#include "ramfs.h"
+#include "fdt.h"
+#include "vm.h"
+#include "pipe.h"
+#include "bcache.h"
+#include "epoll.h"
+
+static paddr_t initrd_start = 0;    // physical range of the initrd, 0 if QEMU was started without -initrd
+static paddr_t initrd_end = 0;
+static struct ramfs_file *hash_table[RAMFS_HASH_SIZE];
+static struct ramfs_file *free_nodes = NULL;    // unused nodes of the last page carved up
+static uint32_t nfiles = 0;
+
+//FNV-1a hash of a path
+static uint32_t path_hash(const char *path)
+{
+    uint32_t h = 2166136261u;
+    while(*path)
+    {
+        h = (h ^ (uint8_t)*path++) * 16777619u;
+    }
+    return h & (RAMFS_HASH_SIZE - 1);
+}
+
+//parse an octal ASCII field of a tar header
+static uint32_t parse_octal(const char *s, uint32_t len)
+{
+    uint32_t v = 0;
+    for(uint32_t i = 0; i < len && s[i] >= '0' && s[i] <= '7'; i++)
+    {
+        v = v * 8 + (s[i] - '0');
+    }
+    return v;
+}
+
+/*
+    Append the path component string s (at most len bytes) to the absolute path in dst, dropping "./" prefixes
+    and duplicate or trailing slashes.
+    returns:
+        uint32_t: new length of dst, or RAMFS_NAME_MAX if the path does not fit
+*/
+static uint32_t append_path(char *dst, uint32_t n, const char *s, uint32_t len)
+{
+    uint32_t i = 0;
+    while(i < len && s[i])
+    {
+        //skip separators and "." components
+        if(s[i] == '/')
+        {
+            i++;
+            continue;
+        }
+        if(s[i] == '.' && (i + 1 == len || s[i + 1] == '/' || s[i + 1] == '\0'))
+        {
+            i++;
+            continue;
+        }
+
+        if(n + 1 >= RAMFS_NAME_MAX)
+        {
+            return RAMFS_NAME_MAX;
+        }
+        dst[n++] = '/';
+        while(i < len && s[i] && s[i] != '/')
+        {
+            if(n + 1 >= RAMFS_NAME_MAX)
+            {
+                return RAMFS_NAME_MAX;
+            }
+            dst[n++] = s[i++];
+        }
+    }
+    dst[n] = '\0';
+    return n;
+}
+
+static struct ramfs_file *alloc_node(void)
+{
+    if(!free_nodes)
+    {
+        struct ramfs_file *page = alloc_pages(1);
+        for(uint32_t i = 0; i < PAGE_SIZE / sizeof(struct ramfs_file); i++)
+        {
+            page[i].hash_next = free_nodes;
+            free_nodes = &page[i];
+        }
+    }
+    struct ramfs_file *f = free_nodes;
+    free_nodes = f->hash_next;
+    return f;
+}
+
+/*
+    Find the initrd through /chosen in the device tree and keep the allocator away from it.
+    Must run before the first alloc_pages(): QEMU may load the initrd inside the kernel's free RAM.
+*/
+void ramfs_reserve(void)
+{
+    uint32_t len_start, len_end;
+    const void *start = fdt_getprop("/chosen", "linux,initrd-start", &len_start);
+    const void *end = fdt_getprop("/chosen", "linux,initrd-end", &len_end);
+    if(!start || !end)
+    {
+        return;
+    }
+
+    initrd_start = (paddr_t)fdt_read_cells(start, len_start / 4);
+    initrd_end = (paddr_t)fdt_read_cells(end, len_end / 4);
+    reserve_pages(initrd_start, initrd_end);
+}
+
+//map the initrd and index the files in the archive
+void ramfs_init(void)
+{
+    if(!initrd_start)
+    {
+        printf("ramfs: no initrd\n");
+        return;
+    }
+
+    vm_map_kernel_range(initrd_start, initrd_end, PAGE_R);
+
+    uint32_t total = 0;
+    paddr_t p = initrd_start;
+    while(p + TAR_BLOCK_SIZE <= initrd_end)
+    {
+        const struct ustar_header *hdr = (const struct ustar_header *)p;
+        if(hdr->name[0] == '\0')
+        {
+            break;  // two zero blocks end the archive
+        }
+        if(memcmp(hdr->magic, "ustar", 5) != 0)
+        {
+            printf("ramfs: bad tar header at offset %x\n", p - initrd_start);
+            break;
+        }
+
+        uint32_t size = parse_octal(hdr->size, sizeof(hdr->size));
+        const uint8_t *data = (const uint8_t *)(p + TAR_BLOCK_SIZE);
+        p += TAR_BLOCK_SIZE + align_up(size, TAR_BLOCK_SIZE);
+        if((paddr_t)data + size > initrd_end)
+        {
+            printf("ramfs: truncated initrd\n");
+            break;
+        }
+        if(hdr->typeflag != '0' && hdr->typeflag != '\0')
+        {
+            continue;   // directories are implied by the paths, links are not supported
+        }
+
+        char name[RAMFS_NAME_MAX];
+        uint32_t n = append_path(name, 0, hdr->prefix, sizeof(hdr->prefix));
+        if(n < RAMFS_NAME_MAX)
+        {
+            n = append_path(name, n, hdr->name, sizeof(hdr->name));
+        }
+        if(n == 0 || n >= RAMFS_NAME_MAX || strcmp(name, RAMFS_PAD_NAME) == 0)
+        {
+            continue;
+        }
+
+        struct ramfs_file *f = alloc_node();
+        strcpy(f->name, name);
+        f->data = data;
+        f->size = size;
+        uint32_t h = path_hash(name);
+        f->hash_next = hash_table[h];
+        hash_table[h] = f;
+        nfiles++;
+        total += size;
+    }
+
+    printf("ramfs: %d files, %d bytes\n", nfiles, total);
+}
+
+/*
+    Look up a file by path. A missing leading slash is accepted.
+    returns:
+        struct ramfs_file *: the file, NULL if it does not exist
+*/
+struct ramfs_file *ramfs_lookup(const char *path)
+{
+    char name[RAMFS_NAME_MAX];
+    uint32_t n = append_path(name, 0, path, RAMFS_NAME_MAX);
+    if(n == 0 || n >= RAMFS_NAME_MAX)
+    {
+        return NULL;
+    }
+
+    for(struct ramfs_file *f = hash_table[path_hash(name)]; f; f = f->hash_next)
+    {
+        if(strcmp(f->name, name) == 0)
+        {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+//open descriptor of the calling process, NULL for a bad one
+static struct open_file *get_file(int fd)
+{
+    if(fd < 0 || fd >= PROC_NOFILE || current_proc->files[fd].type == FD_NONE)
+    {
+        return NULL;
+    }
+    return &current_proc->files[fd];
+}
+
+//a free descriptor of the calling process, -1 if there is none
+static int alloc_fd(void)
+{
+    for(int fd = 0; fd < PROC_NOFILE; fd++)
+    {
+        if(current_proc->files[fd].type == FD_NONE)
+        {
+            return fd;
+        }
+    }
+    return -1;
+}
+
+static int install_fd(int type, struct ramfs_file *file, struct pipe *pipe)
+{
+    int fd = alloc_fd();
+    if(fd >= 0)
+    {
+        struct open_file *of = &current_proc->files[fd];
+        of->type = type;
+        of->file = file;
+        of->pipe = pipe;
+        of->epoll = NULL;
+        of->offset = 0;
+    }
+    return fd;
+}
+
+/*
+    Open a file, a device (FS_CONSOLE_PATH, FS_BLOCK_PATH) or one end of a FIFO (under PIPE_FIFO_PREFIX).
+    Parameters:
+        const char *path: absolute path
+        int flags: O_RDONLY, or O_WRONLY for the console and the write end of a FIFO; the disk is read and written
+    returns:
+        int: file descriptor, -1 if there is no such file or the process has no free descriptor
+*/
+int fs_open(const char *path, int flags)
+{
+    if(alloc_fd() < 0)
+    {
+        return -1;
+    }
+    if(!strcmp(path, FS_CONSOLE_PATH))
+    {
+        return flags == O_WRONLY ? install_fd(FD_CONSOLE, NULL, NULL) : -1;
+    }
+    if(!strcmp(path, FS_BLOCK_PATH))
+    {
+        return install_fd(FD_BLOCK, NULL, NULL);
+    }
+    uint32_t prefix = strlen(PIPE_FIFO_PREFIX);
+    if(!memcmp(path, PIPE_FIFO_PREFIX, prefix))
+    {
+        struct pipe *p = fifo_open(path + prefix, flags == O_WRONLY);
+        return p ? install_fd(flags == O_WRONLY ? FD_PIPE_WRITE : FD_PIPE_READ, NULL, p) : -1;
+    }
+    struct ramfs_file *f = ramfs_lookup(path);
+    return f && flags == O_RDONLY ? install_fd(FD_FILE, f, NULL) : -1;
+}
+
+/*
+    SYS_PIPE: create a pipe.
+    Parameters:
+        int *fds: receives the read end in fds[0] and the write end in fds[1]
+    returns:
+        int: 0, -1 if the process has fewer than two free descriptors or all pipes are taken
+*/
+int fs_pipe(int *fds)
+{
+    int rd = alloc_fd();
+    if(rd < 0)
+    {
+        return -1;
+    }
+    current_proc->files[rd].type = FD_PIPE_READ;    // taken, so alloc_fd() finds another one
+    int wr = alloc_fd();
+    struct pipe *p = wr >= 0 ? pipe_alloc() : NULL;
+    if(!p)
+    {
+        current_proc->files[rd].type = FD_NONE;
+        return -1;
+    }
+    current_proc->files[rd].pipe = p;
+    install_fd(FD_PIPE_WRITE, NULL, p);
+    fds[0] = rd;
+    fds[1] = wr;
+    return 0;
+}
+
+//copy between buf and the disk at the descriptor's offset through the buffer cache, block by block
+static int block_rw(struct open_file *of, void *buf, uint32_t len, bool write)
+{
+    uint32_t blocks = (uint32_t)(blk_capacity() / BCACHE_SECTORS);
+    uint32_t done = 0;
+    while(done < len && of->offset / BCACHE_BLOCK_SIZE < blocks)
+    {
+        struct buf *b = bread(0, of->offset / BCACHE_BLOCK_SIZE);
+        if(!b)
+        {
+            return done ? (int)done : -1;
+        }
+        uint32_t off = of->offset % BCACHE_BLOCK_SIZE;
+        uint32_t n = BCACHE_BLOCK_SIZE - off < len - done ? BCACHE_BLOCK_SIZE - off : len - done;
+        if(write)
+        {
+            memcpy(b->data + off, (const uint8_t *)buf + done, n);
+            bwrite(b);
+        }
+        else
+        {
+            memcpy((uint8_t *)buf + done, b->data + off, n);
+        }
+        brelse(b);
+        of->offset += n;
+        done += n;
+    }
+    return done;
+}
+
+/*
+    Read up to len bytes from a file, the read end of a pipe or the disk.
+    returns:
+        int: bytes read, 0 at end of file, -1 for a bad descriptor
+*/
+int fs_read(int fd, void *buf, uint32_t len)
+{
+    struct open_file *of = get_file(fd);
+    if(!of)
+    {
+        return -1;
+    }
+    if(of->type == FD_PIPE_READ)
+    {
+        return pipe_read(of->pipe, buf, len);
+    }
+    if(of->type == FD_BLOCK)
+    {
+        return block_rw(of, buf, len, false);
+    }
+    if(of->type != FD_FILE)
+    {
+        return -1;
+    }
+    uint32_t left = of->file->size - of->offset;
+    if(len > left)
+    {
+        len = left;
+    }
+    memcpy(buf, of->file->data + of->offset, len);
+    of->offset += len;
+    return len;
+}
+
+/*
+    Write len bytes to the write end of a pipe, the console or the disk.
+    returns:
+        int: bytes written, -1 for a bad descriptor or a pipe without readers
+*/
+int fs_write(int fd, const void *buf, uint32_t len)
+{
+    struct open_file *of = get_file(fd);
+    if(!of)
+    {
+        return -1;
+    }
+    if(of->type == FD_PIPE_WRITE)
+    {
+        return pipe_write(of->pipe, buf, len);
+    }
+    if(of->type == FD_BLOCK)
+    {
+        return block_rw(of, (void *)buf, len, true);
+    }
+    if(of->type != FD_CONSOLE)
+    {
+        return -1;
+    }
+    //buf is a user address, the firmware wants a physical one
+    uint8_t chunk[128];
+    for(uint32_t done = 0; done < len; )
+    {
+        uint32_t n = len - done < sizeof(chunk) ? len - done : sizeof(chunk);
+        memcpy(chunk, (const uint8_t *)buf + done, n);
+        console_write(chunk, n);
+        done += n;
+    }
+    return len;
+}
+
+//SYS_SPLICE: move len bytes between a pipe and a file or device, see pipe_splice()
+int fs_splice(int fd_in, int fd_out, uint32_t len)
+{
+    struct open_file *in = get_file(fd_in);
+    struct open_file *out = get_file(fd_out);
+    return in && out ? pipe_splice(in, out, len) : -1;
+}
+
+/*
+    EPOLL* events that hold for an open descriptor. Files and devices never block; the console is write only and
+    an epoll cannot be watched itself.
+*/
+uint32_t fs_poll(struct open_file *of)
+{
+    switch(of->type)
+    {
+        case FD_FILE:
+            return EPOLLIN;
+        case FD_BLOCK:
+            return EPOLLIN | EPOLLOUT;
+        case FD_CONSOLE:
+            return EPOLLOUT;
+        case FD_PIPE_READ:
+        case FD_PIPE_WRITE:
+            return pipe_poll(of->pipe, of->type == FD_PIPE_WRITE);
+        default:
+            return 0;
+    }
+}
+
+//SYS_EPOLL_CREATE: a new epoll descriptor, -1 if the process has no free descriptor or all epolls are taken
+int fs_epoll_create(void)
+{
+    int fd = alloc_fd();
+    struct epoll *ep = fd >= 0 ? epoll_alloc() : NULL;
+    if(!ep)
+    {
+        return -1;
+    }
+    install_fd(FD_EPOLL, NULL, NULL);
+    current_proc->files[fd].epoll = ep;
+    return fd;
+}
+
+//SYS_EPOLL_CTL: see epoll_modify(), ev is NULL for EPOLL_CTL_DEL
+int fs_epoll_ctl(int epfd, int op, int fd, const struct epoll_event *ev)
+{
+    struct open_file *ep = get_file(epfd);
+    struct open_file *of = get_file(fd);
+    if(!ep || ep->type != FD_EPOLL || !of)
+    {
+        return -1;
+    }
+    struct epoll_event kev = {0, 0};
+    if(op != EPOLL_CTL_DEL)
+    {
+        kev = *ev;
+    }
+    return epoll_modify(ep->epoll, op, of, &kev);
+}
+
+//SYS_EPOLL_WAIT: see epoll_collect()
+int fs_epoll_wait(int epfd, struct epoll_event *events, int max, int flags)
+{
+    struct open_file *ep = get_file(epfd);
+    return ep && ep->type == FD_EPOLL ? epoll_collect(ep->epoll, events, max, flags) : -1;
+}
+
+static void close_file(struct open_file *of)
+{
+    epoll_forget(of);
+    if(of->type == FD_PIPE_READ || of->type == FD_PIPE_WRITE)
+    {
+        pipe_close(of->pipe, of->type == FD_PIPE_WRITE);
+    }
+    else if(of->type == FD_EPOLL)
+    {
+        epoll_release(of->epoll);
+    }
+    of->type = FD_NONE;
+    of->file = NULL;
+    of->pipe = NULL;
+    of->epoll = NULL;
+}
+
+int fs_close(int fd)
+{
+    struct open_file *of = get_file(fd);
+    if(!of)
+    {
+        return -1;
+    }
+    close_file(of);
+    return 0;
+}
+
+//size of an open file in bytes, -1 for a bad descriptor
+int fs_size(int fd)
+{
+    struct open_file *of = get_file(fd);
+    return of && of->type == FD_FILE ? (int)of->file->size : -1;
+}
+
+/*
+    Map len bytes of an open file, starting at the page aligned offset, into the calling process.
+    Read-only mappings of whole pages point straight at the initrd. The page holding the end of the file is
+    copied so the bytes after EOF read as zero, and PROT_WRITE mappings get private copies of every page.
+    returns:
+        void *: user address of the mapping, NULL on a bad descriptor, offset or length
+*/
+void *fs_mmap(int fd, uint32_t offset, uint32_t len, int prot)
+{
+    struct open_file *of = get_file(fd);
+    if(!of || of->type != FD_FILE || len == 0 || !is_aligned(offset, PAGE_SIZE) || offset >= of->file->size)
+    {
+        return NULL;
+    }
+    if(len > of->file->size - offset)
+    {
+        len = of->file->size - offset;
+    }
+
+    vaddr_t va = vm_reserve(current_proc, len);
+    if(!va)
+    {
+        return NULL;
+    }
+
+    uint32_t *table = vm_table_of(current_proc);
+    uint32_t flags = PAGE_U | PAGE_R;
+    flags |= (prot & PROT_WRITE) ? PAGE_W : 0;
+    flags |= (prot & PROT_EXEC) ? PAGE_X : 0;
+
+    const uint8_t *src = of->file->data + offset;
+    for(uint32_t done = 0; done < len; done += PAGE_SIZE)
+    {
+        uint32_t chunk = len - done < PAGE_SIZE ? len - done : PAGE_SIZE;
+        paddr_t pa = (paddr_t)(src + done);
+        if(!(prot & PROT_WRITE) && chunk == PAGE_SIZE && is_aligned(pa, PAGE_SIZE))
+        {
+            map_page(table, va + done, pa, flags);
+            continue;
+        }
+
+        //private page: partial last page, writable mapping, or an archive that was not built by mkinitrd.py
+        uint8_t *page = alloc_pages(1);
+        memcpy(page, src + done, chunk);
+        memset(page + chunk, 0, PAGE_SIZE - chunk);
+        map_page(table, va + done, (paddr_t)page, flags | PAGE_OWNED);
+    }
+    return (void *)va;
+}
+
+//remove a mapping made by fs_mmap()
+void fs_munmap(void *addr, uint32_t len)
+{
+    vm_unmap(current_proc, (vaddr_t)addr, len);
+}
+
+//close every descriptor of an exiting process
+void fs_close_all(struct process *proc)
+{
+    for(int fd = 0; fd < PROC_NOFILE; fd++)
+    {
+        close_file(&proc->files[fd]);
+    }
+}
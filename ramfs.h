@@ -0,0 +1,63 @@
+#pragma once
+#include "kernel.h"
+#include "epoll.h"
+
+/*
+    Read-only RAM filesystem backed by the initrd QEMU loads with -initrd. The initrd is a ustar archive;
+    file contents are used in place, so read() copies straight out of the initrd and mmap() maps its pages.
+    mkinitrd.py pads the archive so every file starts on a page boundary, which is what makes mmap zero-copy.
+*/
+#define TAR_BLOCK_SIZE      512
+#define RAMFS_NAME_MAX      100         // longest absolute path, including the NUL
+#define RAMFS_HASH_SIZE     64          // path hash buckets, power of 2
+#define RAMFS_PAD_NAME      "/.pad"     // alignment entries written by mkinitrd.py
+#define FS_CONSOLE_PATH     "/dev/console"
+#define FS_BLOCK_PATH       "/dev/blk"  // the virtio-blk disk, read and written through the buffer cache
+
+//ustar header, one TAR_BLOCK_SIZE block in front of every member. Numbers are octal ASCII.
+struct ustar_header
+{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;              // '0' or '\0' regular file, '5' directory
+    char linkname[100];
+    char magic[6];              // "ustar"
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];           // directory part of long paths
+    char pad[12];
+} __attribute__((packed));
+
+struct ramfs_file
+{
+    char name[RAMFS_NAME_MAX];  // absolute path, e.g. "/data/words.txt"
+    const uint8_t *data;        // contents inside the initrd
+    uint32_t size;
+    struct ramfs_file *hash_next;
+};
+
+void ramfs_reserve(void);
+void ramfs_init(void);
+struct ramfs_file *ramfs_lookup(const char *path);
+int fs_open(const char *path, int flags);
+int fs_pipe(int *fds);
+int fs_read(int fd, void *buf, uint32_t len);
+int fs_write(int fd, const void *buf, uint32_t len);
+int fs_splice(int fd_in, int fd_out, uint32_t len);
+int fs_close(int fd);
+uint32_t fs_poll(struct open_file *of);
+int fs_epoll_create(void);
+int fs_epoll_ctl(int epfd, int op, int fd, const struct epoll_event *ev);
+int fs_epoll_wait(int epfd, struct epoll_event *events, int max, int flags);
+int fs_size(int fd);
+void *fs_mmap(int fd, uint32_t offset, uint32_t len, int prot);
+void fs_munmap(void *addr, uint32_t len);
+void fs_close_all(struct process *proc);
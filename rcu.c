@@ -0,0 +1,137 @@
+#include "rcu.h"
+
+/*
+    Grace periods are tracked per hart, without a global state: the callbacks queued on a hart wait together for
+    one grace period that starts with a snapshot of every hart's quiescent state counter. It is over once each
+    other hart's counter has moved on or shows the hart idle; the hart itself is quiescent when it takes the
+    snapshot, as that happens in rcu_note_qs().
+*/
+struct rcu_cpu
+{
+    uint32_t qs;                        // +2 per quiescent state, odd while the hart idles; read by every hart
+    struct rcu_head *next;              // callbacks waiting for the next grace period
+    struct rcu_head *wait;              // callbacks waiting for the grace period in progress
+    uint32_t snap[HARTS_MAX];           // qs of every hart when that grace period started
+    uint64_t gp_start;
+    uint32_t gps;                       // grace periods completed
+    uint32_t callbacks;                 // callbacks run
+    uint32_t max_gp;                    // time CSR ticks of the longest grace period
+    uint64_t total_gp;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct rcu_cpu rcu_cpus[HARTS_MAX];
+
+/*
+    Run fn(head) once no hart can hold a reference that it found before this call, i.e. after the next grace
+    period. head must stay valid until then. Callable with interrupts masked and from interrupt handlers.
+*/
+void call_rcu(struct rcu_head *head, void (*fn)(struct rcu_head *head))
+{
+    uint32_t sie = irq_save();
+    struct rcu_cpu *c = &rcu_cpus[this_hart()];
+    head->fn = fn;
+    head->next = c->next;
+    c->next = head;
+    irq_restore(sie);
+}
+
+//every other hart passed a quiescent state or idles since c took its snapshot
+static bool gp_elapsed(struct rcu_cpu *c)
+{
+    for(uint32_t hart = 0; hart < nr_cpus; hart++)
+    {
+        if(hart == this_hart())
+        {
+            continue;
+        }
+        //acquire: the hart's reads before its quiescent state happen before we reclaim
+        uint32_t qs = __atomic_load_n(&rcu_cpus[hart].qs, __ATOMIC_ACQUIRE);
+        if(qs == c->snap[hart] && !(qs & 1))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//run the callbacks whose grace period is over and start one for the callbacks queued since
+static void rcu_advance(struct rcu_cpu *c)
+{
+    if(c->wait && gp_elapsed(c))
+    {
+        uint32_t gp = (uint32_t)(read_time() - c->gp_start);
+        c->gps++;
+        c->total_gp += gp;
+        if(gp > c->max_gp)
+        {
+            c->max_gp = gp;
+        }
+        struct rcu_head *head = c->wait;
+        c->wait = NULL;
+        while(head)
+        {
+            struct rcu_head *next = head->next;
+            head->fn(head);
+            c->callbacks++;
+            head = next;
+        }
+    }
+    if(!c->wait && c->next)
+    {
+        c->wait = c->next;
+        c->next = NULL;
+        for(uint32_t hart = 0; hart < nr_cpus; hart++)
+        {
+            c->snap[hart] = __atomic_load_n(&rcu_cpus[hart].qs, __ATOMIC_ACQUIRE);
+        }
+        c->gp_start = read_time();
+    }
+}
+
+//this hart holds no references found by earlier readers; called by yield() and on timer ticks from user mode
+void rcu_note_qs(void)
+{
+    if(this_cpu()->rcu_nesting)
+    {
+        PANIC("quiescent state inside an RCU read-side critical section");
+    }
+    uint32_t sie = irq_save();
+    struct rcu_cpu *c = &rcu_cpus[this_hart()];
+    __atomic_store_n(&c->qs, c->qs + 2, __ATOMIC_RELEASE);
+    rcu_advance(c);
+    irq_restore(sie);
+}
+
+//the hart goes to sleep in cpu_idle(); other harts need not wait for it until rcu_idle_exit()
+void rcu_idle_enter(void)
+{
+    struct rcu_cpu *c = &rcu_cpus[this_hart()];
+    __atomic_store_n(&c->qs, c->qs + 1, __ATOMIC_RELEASE);
+}
+
+void rcu_idle_exit(void)
+{
+    struct rcu_cpu *c = &rcu_cpus[this_hart()];
+    __atomic_store_n(&c->qs, c->qs + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);    // visible before the hart reads anything published meanwhile
+}
+
+//the timer wanted to preempt a reader, do it now that the last read-side critical section ended
+void rcu_preempt_deferred(void)
+{
+    this_cpu()->rcu_resched = false;
+    yield();
+}
+
+//print the grace period counts and lengths of every hart
+void rcu_dump(void)
+{
+    uint32_t div = ticks_per_us();
+    for(uint32_t hart = 0; hart < nr_cpus; hart++)
+    {
+        struct rcu_cpu *c = &rcu_cpus[hart];
+        uint32_t avg = scaled_div(c->total_gp, c->gps) / div;
+        printf("rcu: cpu %d: %d grace periods, %d callbacks, length avg %d us max %d us\n", hart, c->gps,
+            c->callbacks, avg, c->max_gp / div);
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include "kernel.h"
+
+/*
+    Read-copy-update for read-mostly data, the process table first of all. Readers take no lock and write no
+    shared memory: rcu_read_lock() only keeps the timer from preempting them. Updaters (serialized by the kernel
+    lock) publish new pointers with rcu_assign_pointer() and hand what they unlinked to call_rcu(), which runs
+    the callback once every hart has passed through a quiescent state: a context switch in yield(), a timer tick
+    that interrupted user mode, or idling in cpu_idle(). Code that runs with interrupts masked cannot reach a
+    quiescent state and reads safely without rcu_read_lock().
+*/
+#define rcu_dereference(p)          __atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define rcu_assign_pointer(p, v)    __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+void rcu_preempt_deferred(void);
+
+//start a read-side critical section, they nest
+static inline void rcu_read_lock(void)
+{
+    this_cpu()->rcu_nesting++;
+    __asm__ __volatile__("" ::: "memory");
+}
+
+//end a read-side critical section; a preemption held back by it happens now
+static inline void rcu_read_unlock(void)
+{
+    __asm__ __volatile__("" ::: "memory");
+    struct cpu *c = this_cpu();
+    if(--c->rcu_nesting == 0 && c->rcu_resched)
+    {
+        rcu_preempt_deferred();
+    }
+}
+
+void call_rcu(struct rcu_head *head, void (*fn)(struct rcu_head *head));
+void rcu_note_qs(void);
+void rcu_idle_enter(void);
+void rcu_idle_exit(void);
+void rcu_dump(void);
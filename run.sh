@@ -8,10 +8,45 @@ QEMU=qemu-system-riscv32
 CC=clang  # Ubuntu users: use CC=clang
 CFLAGS="-std=c11 -O2 -g3 -Wall -Wextra --target=riscv32-unknown-elf -fuse-ld=lld -fno-stack-protector -ffreestanding -nostdlib"
 
+# Benchmark build: ./run.sh bench
+if [ "${1:-}" = "bench" ]; then
+    CFLAGS="$CFLAGS -DBENCHMARK"
+fi
+
+# Profiling build: ./run.sh prof | tee prof.txt, then python3 profsym.py kernel.elf prof.txt > prof.folded
+if [ "${1:-}" = "prof" ]; then
+    CFLAGS="$CFLAGS -DPROFILE -fno-omit-frame-pointer"
+fi
+
+# Allocator debug build: ./run.sh heapdebug, heap_dump() then lists live pages per alloc_pages() call site
+if [ "${1:-}" = "heapdebug" ]; then
+    CFLAGS="$CFLAGS -DHEAP_DEBUG"
+fi
+
+# Latency test build: ./run.sh latency, prints wakeup latencies of periodic tasks under load after 10 seconds
+if [ "${1:-}" = "latency" ]; then
+    CFLAGS="$CFLAGS -DLATENCY_TEST"
+fi
+
 # Build the kernel
 $CC $CFLAGS -Wl,-Tkernel.ld -Wl,-Map=kernel.map -o kernel.elf \
-    kernel.c common.c
+    kernel.c common.c fiber.c sched.c plic.c virtio.c bcache.c fdt.c vm.c ramfs.c elf.c prof.c pmu.c boot.c heap.c softirq.c uring.c smp.c pcache.c ipi.c tlb.c rcu.c vdso.c latency.c zram.c pipe.c epoll.c
+
+# Build the user programs, installed in the initrd as /bin/<name>
+$CC $CFLAGS -Wl,-Tuser.ld -Wl,-Map=hello.map -o hello.elf hello.c user.c malloc.c common.c
+
+# Test disk image backing the virtio-blk device
+if [ ! -f disk.img ]; then
+    dd if=/dev/urandom of=disk.img bs=1M count=16
+fi
+
+# Initrd with the contents of initrd/, file data page aligned for zero-copy mmap
+python3 mkinitrd.py initrd.tar initrd bin/hello=hello.elf
 
-# Start QEMU
-$QEMU -machine virt -bios default -nographic -serial mon:stdio --no-reboot \
-    -kernel kernel.elf
\ No newline at end of file
+# Start QEMU, SMP=4 ./run.sh for four harts
+$QEMU -machine virt -smp "${SMP:-1}" -bios default -nographic -serial mon:stdio --no-reboot \
+    -global virtio-mmio.force-legacy=false \
+    -drive id=drive0,file=disk.img,format=raw,if=none \
+    -device virtio-blk-device,drive=drive0,bus=virtio-mmio-bus.0 \
+    -initrd initrd.tar \
+    -kernel kernel.elf
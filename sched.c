@@ -0,0 +1,820 @@
+#include "sched.h"
+#include "prof.h"
+#include "smp.h"
+#include "ipi.h"
+#include "rcu.h"
+#include "vdso.h"
+#include "uring.h"
+
+static uint32_t edf_total_density;  // sum of the densities of all admitted EDF processes (16.16)
+
+/*
+    Run queue of one hart. Best-effort processes stay on the hart that last ran them; an idle hart steals from
+    the busiest one and every hart periodically pulls work from a busier one (see balance()).
+    All queues are only touched under the kernel lock, so they need no lock of their own.
+*/
+struct rq
+{
+    struct process *fair[PROCS_MAX];    // min-heap of runnable SCHED_NORMAL processes ordered by vruntime, the running one is not in it
+    int nr;
+    uint64_t min_vruntime;              // monotonic lower bound of the vruntimes in the run queue
+    uint64_t slice_end;                 // end of the time slice of the process running on the hart
+    uint64_t next_balance;              // time of the next periodic load balancing
+    uint32_t pulled;                    // processes this hart took from other harts
+};
+
+static struct rq rqs[HARTS_MAX];
+
+static struct rq *this_rq(void)
+{
+    return &rqs[this_hart()];
+}
+
+//process running on the hart of rq, NULL before the hart is up
+static struct process *rq_curr(struct rq *rq)
+{
+    return cpus[rq - rqs].proc;
+}
+
+/*
+    Load weight of each nice level (-20..19). Every nice step changes the CPU share by about 10%,
+    nice 0 has a weight of NICE_0_WEIGHT.
+*/
+static const uint32_t nice_to_weight[40] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548,  7620,  6100,  4904,  3906,
+    3121,  2501,  1991,  1586,  1277,
+    1024,  820,   655,   526,   423,
+    335,   272,   215,   172,   137,
+    110,   87,    70,    56,    45,
+    36,    29,    23,    18,    15,
+};
+
+//2^32 / nice_to_weight[], so that scaling a runtime by a weight is a multiply and a shift
+static const uint32_t nice_to_inv_weight[40] = {
+    48388,     59856,     76040,     92818,     118348,
+    147320,    184698,    229616,    287308,    360437,
+    449829,    563644,    704093,    875809,    1099582,
+    1376151,   1717300,   2157191,   2708050,   3363326,
+    4194304,   5237765,   6557202,   8165337,   10153587,
+    12820798,  15790321,  19976592,  24970740,  31350126,
+    39045157,  49367440,  61356676,  76695844,  95443717,
+    119304647, 148102320, 186737708, 238609294, 286331153,
+};
+
+/*
+    budget / span in 16.16 fixed point, rounded up so admission control stays conservative.
+    RV32 has no 64-bit divide without libgcc, so both operands are scaled down to keep the shift in 32 bits: budget
+    rounds up and span down on the way, which can only overestimate the quotient. budget <= span, so the true density
+    never exceeds one and the result is capped there, which also keeps budget << 16 from overflowing.
+*/
+static uint32_t edf_density(uint32_t budget, uint32_t span)
+{
+    while(span >= (1u << 16))
+    {
+        budget = (budget >> 1) + (budget & 1);
+        span >>= 1;
+    }
+    if(budget >= span)
+    {
+        return EDF_DENSITY_ONE;
+    }
+    return ((budget << 16) + span - 1) / span;
+}
+
+static bool rq_before(struct process *a, struct process *b)
+{
+    return a->vruntime < b->vruntime || (a->vruntime == b->vruntime && a->pid < b->pid);
+}
+
+static void rq_set(struct rq *rq, int i, struct process *proc)
+{
+    rq->fair[i] = proc;
+    proc->rq_index = i;
+}
+
+static void rq_sift_up(struct rq *rq, int i)
+{
+    struct process *proc = rq->fair[i];
+    while(i > 0 && rq_before(proc, rq->fair[(i - 1) / 2]))
+    {
+        rq_set(rq, i, rq->fair[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    rq_set(rq, i, proc);
+}
+
+static void rq_sift_down(struct rq *rq, int i)
+{
+    struct process *proc = rq->fair[i];
+    while(2 * i + 1 < rq->nr)
+    {
+        int child = 2 * i + 1;
+        if(child + 1 < rq->nr && rq_before(rq->fair[child + 1], rq->fair[child]))
+        {
+            child++;
+        }
+        if(!rq_before(rq->fair[child], proc))
+        {
+            break;
+        }
+        rq_set(rq, i, rq->fair[child]);
+        i = child;
+    }
+    rq_set(rq, i, proc);
+}
+
+static void rq_insert(struct rq *rq, struct process *proc)
+{
+    proc->on_rq = true;
+    proc->cpu = rq - rqs;
+    rq->fair[rq->nr] = proc;
+    rq->nr++;
+    rq_sift_up(rq, rq->nr - 1);
+}
+
+static void rq_remove(struct rq *rq, struct process *proc)
+{
+    int i = proc->rq_index;
+    proc->on_rq = false;
+    rq->nr--;
+    if(i != rq->nr)
+    {
+        rq_set(rq, i, rq->fair[rq->nr]);
+        rq_sift_down(rq, i);
+        rq_sift_up(rq, rq->fair[i]->rq_index);
+    }
+}
+
+//a runnable best-effort process; idle processes have pid 0
+static bool fair_runnable(struct process *proc)
+{
+    return proc->pid > 0 && proc->sched_class == SCHED_NORMAL && proc->state == PROC_RUNNABLE;
+}
+
+//a process belongs in a fair run queue if it is a runnable best-effort process that is not queued yet
+static bool fair_queueable(struct process *proc)
+{
+    return !proc->on_rq && fair_runnable(proc);
+}
+
+//the process may run on cpus[hart] and that hart is up
+static bool hart_allowed(struct process *proc, int hart)
+{
+    return (proc->affinity >> hart) & 1 && cpus[hart].online;
+}
+
+//the hart whose run queue a process goes to: the one that last ran it if allowed, for a warm cache
+static int select_hart(struct process *proc)
+{
+    if(hart_allowed(proc, proc->cpu))
+    {
+        return proc->cpu;
+    }
+    for(uint32_t i = 0; i < nr_cpus; i++)
+    {
+        if(hart_allowed(proc, i))
+        {
+            return i;
+        }
+    }
+    return this_hart();     // sched_set_affinity() does not accept a mask without an online hart
+}
+
+/*
+    Move a process that is not queued to the run queue of another hart. Its vruntime is carried over
+    relative to the min_vruntime of both queues, so it neither jumps ahead nor falls behind the processes there.
+*/
+static void migrate(struct process *proc, int hart)
+{
+    if(proc->cpu == hart)
+    {
+        return;
+    }
+    uint64_t v = proc->vruntime + rqs[hart].min_vruntime;
+    uint64_t src = rqs[proc->cpu].min_vruntime;
+    proc->vruntime = v > src ? v - src : 0;
+    proc->cpu = hart;
+}
+
+//advance min_vruntime to the smallest vruntime among the running and the queued fair processes of a hart
+static void update_min_vruntime(struct rq *rq)
+{
+    uint64_t v = rq->min_vruntime;
+    bool found = false;
+    struct process *curr = rq_curr(rq);
+    if(curr && fair_runnable(curr))
+    {
+        v = curr->vruntime;
+        found = true;
+    }
+    if(rq->nr > 0 && (!found || rq->fair[0]->vruntime < v))
+    {
+        v = rq->fair[0]->vruntime;
+        found = true;
+    }
+    if(found && v > rq->min_vruntime)
+    {
+        rq->min_vruntime = v;
+    }
+}
+
+//charge a process for the time it ran since it was last charged
+static void charge(struct process *proc, uint64_t now)
+{
+    uint32_t delta = (uint32_t)(now - proc->exec_start);
+    proc->exec_start = now;
+    proc->sum_exec_runtime += delta;
+
+    if(proc->sched_class == SCHED_EDF && proc->edf.job_active)
+    {
+        proc->edf.budget_left = delta < proc->edf.budget_left ? proc->edf.budget_left - delta : 0;
+    }
+    else if(proc->sched_class == SCHED_NORMAL && proc->pid > 0)
+    {
+        //vruntime advances by delta * NICE_0_WEIGHT / weight; NICE_0_WEIGHT * inv_weight == 2^32 * 2^10 / weight
+        proc->vruntime += ((uint64_t)delta * proc->inv_weight) >> (32 - NICE_0_SHIFT);
+        update_min_vruntime(&rqs[proc->cpu]);
+    }
+}
+
+//number of runnable fair processes of a hart, including the running one
+static int fair_nr_running(struct rq *rq)
+{
+    int n = rq->nr;
+    struct process *curr = rq_curr(rq);
+    if(curr && fair_runnable(curr))
+    {
+        n++;
+    }
+    return n;
+}
+
+//time slice of a fair process: the scheduling latency shared by all runnable fair processes of the hart
+static uint32_t fair_slice(struct rq *rq)
+{
+    int n = fair_nr_running(rq);
+    uint32_t slice = n > 1 ? SCHED_LATENCY / n : SCHED_LATENCY;
+    return slice < SCHED_MIN_GRANULARITY ? SCHED_MIN_GRANULARITY : slice;
+}
+
+static bool hart_idle(int hart)
+{
+    return cpus[hart].online && cpus[hart].proc == cpus[hart].idle;
+}
+
+/*
+    Get a newly queued process running soon: an idle hart it was queued on is interrupted right away instead of
+    at its next balancing tick; if that hart is busy, an idle hart the process may run on is woken to steal it.
+*/
+static void kick(struct process *proc)
+{
+    int self = this_hart();
+    if(hart_idle(proc->cpu))
+    {
+        if(proc->cpu != self)
+        {
+            ipi_resched(proc->cpu);
+        }
+        return;
+    }
+    for(uint32_t i = 0; i < nr_cpus; i++)
+    {
+        if((int)i != self && hart_idle(i) && hart_allowed(proc, i))
+        {
+            ipi_resched(i);
+            return;
+        }
+    }
+}
+
+/*
+    Make a runnable SCHED_NORMAL process eligible to be picked, on the hart that last ran it if its affinity
+    allows. Processes that slept keep their vruntime but are placed no further back than half a scheduling
+    latency behind min_vruntime, so a long sleep does not let them monopolize the CPU afterwards.
+    Called with interrupts masked.
+*/
+void sched_enqueue(struct process *proc)
+{
+    if(proc->on_cpu || !fair_queueable(proc))
+    {
+        return;
+    }
+
+    migrate(proc, select_hart(proc));
+    struct rq *rq = &rqs[proc->cpu];
+    uint64_t floor = rq->min_vruntime > SCHED_LATENCY / 2 ? rq->min_vruntime - SCHED_LATENCY / 2 : 0;
+    if(proc->vruntime < floor)
+    {
+        proc->vruntime = floor;
+    }
+    rq_insert(rq, proc);
+    kick(proc);
+}
+
+//set up the scheduling state of a newly created process: best-effort, nice 0, any hart, starting at min_vruntime
+void sched_init_process(struct process *proc)
+{
+    proc->sched_class = SCHED_NORMAL;
+    proc->nice = 0;
+    proc->weight = nice_to_weight[20];
+    proc->inv_weight = nice_to_inv_weight[20];
+    proc->cpu = this_hart();
+    proc->affinity = AFFINITY_ALL;
+    proc->vruntime = this_rq()->min_vruntime;
+    proc->sum_exec_runtime = 0;
+    proc->on_rq = false;
+    proc->on_cpu = false;
+    sched_enqueue(proc);
+}
+
+//an EDF process can run if its current job still has budget
+static bool edf_runnable(struct process *proc)
+{
+    return proc->sched_class == SCHED_EDF && proc->state == PROC_RUNNABLE
+        && proc->edf.job_active && proc->edf.budget_left > 0;
+}
+
+/*
+    Start a new job for every EDF process whose next period has begun.
+    A job still active at the next release missed its deadline; it carries over into the new period
+    with a fresh budget. Processes sleeping in edf_wait_next_period() are woken up.
+    returns:
+        int: 1 if at least one job was released
+*/
+static int edf_release_jobs(uint64_t now)
+{
+    int released = 0;
+    for_each_process(proc)
+    {
+        struct edf_task *e = &proc->edf;
+        if(proc->sched_class != SCHED_EDF)
+        {
+            continue;
+        }
+
+        bool new_job = false;
+        while(now >= e->release + e->period)
+        {
+            if(e->job_active)
+            {
+                e->misses++;
+            }
+            e->release += e->period;
+            e->abs_deadline = e->release + e->deadline;
+            e->budget_left = e->budget;
+            e->job_active = true;
+            new_job = true;
+        }
+
+        if(new_job)
+        {
+            released = 1;
+            if(e->waiting)
+            {
+                e->waiting = false;
+                wake_process(proc);
+            }
+        }
+    }
+    return released;
+}
+
+/*
+    Program stimecmp for the next scheduling event: the end of the time slice, the budget exhaustion of an EDF
+    job, the next EDF job release, the next profiler sample or the next uring timeout, whichever comes first.
+*/
+static void arm_timer(struct rq *rq, struct process *next, uint64_t now)
+{
+    uint64_t expires = rq->slice_end;
+    if(next->sched_class == SCHED_EDF && next->edf.job_active && next->edf.budget_left > 0
+        && now + next->edf.budget_left < expires)
+    {
+        expires = now + next->edf.budget_left;
+    }
+
+    for_each_process(proc)
+    {
+        if(proc->sched_class == SCHED_EDF && proc->edf.release + proc->edf.period < expires)
+        {
+            expires = proc->edf.release + proc->edf.period;
+        }
+    }
+
+    //the profiler shares the timer, its sampling tick must not be pushed back by the scheduler
+    uint64_t sample = prof_next_sample();
+    if(sample < expires)
+    {
+        expires = sample;
+    }
+    //so do uring timeouts, whose waiters sleep until uring_timer_tick() completes them
+    uint64_t timeout = uring_next_timeout();
+    if(timeout < expires)
+    {
+        expires = timeout;
+    }
+
+    write_to_stimecmp(expires);
+}
+
+//smallest vruntime first. Entries whose process changed class or state since it was queued are dropped here.
+static struct process *fair_pop(struct rq *rq)
+{
+    while(rq->nr > 0)
+    {
+        struct process *next = rq->fair[0];
+        rq_remove(rq, next);
+        if(fair_runnable(next))
+        {
+            return next;
+        }
+    }
+    return NULL;
+}
+
+/*
+    Take a queued process that may run on hart from the hart with the most queued processes.
+    Like the thief of a work-stealing deque it takes from the far end: the last heap slot is a leaf with a large
+    vruntime, the process that would wait longest where it is and whose cache footprint is most likely gone.
+    returns:
+        struct process *: the process, already moved to hart but not queued, NULL if there is nothing to take
+*/
+static struct process *steal(int hart)
+{
+    struct rq *busiest = NULL;
+    struct process *victim = NULL;
+    for(uint32_t i = 0; i < nr_cpus; i++)
+    {
+        struct rq *rq = &rqs[i];
+        if((int)i == hart || (busiest && rq->nr <= busiest->nr))
+        {
+            continue;
+        }
+        for(int j = rq->nr - 1; j >= 0; j--)
+        {
+            if(fair_runnable(rq->fair[j]) && hart_allowed(rq->fair[j], hart))
+            {
+                busiest = rq;
+                victim = rq->fair[j];
+                break;
+            }
+        }
+    }
+    if(!victim)
+    {
+        return NULL;
+    }
+
+    rq_remove(busiest, victim);
+    migrate(victim, hart);
+    rqs[hart].pulled++;
+    return victim;
+}
+
+/*
+    Periodic load balancing: pull one process from the busiest hart if it has at least two more runnable
+    best-effort processes than this one. Idle harts do not wait for this, they steal when they pick.
+*/
+static void balance(int hart)
+{
+    struct rq *rq = &rqs[hart];
+    int busiest = 0;
+    for(uint32_t i = 0; i < nr_cpus; i++)
+    {
+        int n = fair_nr_running(&rqs[i]);
+        if((int)i != hart && n > busiest)
+        {
+            busiest = n;
+        }
+    }
+    if(busiest - fair_nr_running(rq) < 2)
+    {
+        return;
+    }
+    struct process *proc = steal(hart);
+    if(proc)
+    {
+        rq_insert(rq, proc);
+    }
+}
+
+/*
+    Choose the process to run next on this hart: the EDF job with the earliest absolute deadline, otherwise
+    the best-effort process with the smallest vruntime on this hart, otherwise one stolen from another hart,
+    otherwise the idle process. The current process is charged and, if it is still runnable, put back in a
+    fair run queue: this hart's, or an allowed one if its affinity changed.
+    Called with interrupts masked.
+*/
+struct process *sched_pick_next(void)
+{
+    int hart = this_hart();
+    struct rq *rq = &rqs[hart];
+    struct process *curr = current_proc;
+    charge(curr, read_time());
+    if(fair_queueable(curr))
+    {
+        migrate(curr, select_hart(curr));
+        rq_insert(&rqs[curr->cpu], curr);
+    }
+
+    //an EDF process running on another hart is not a candidate, neither is one pinned elsewhere
+    struct process *next = NULL;
+    for_each_process(proc)
+    {
+        if(edf_runnable(proc) && (!proc->on_cpu || proc == curr) && hart_allowed(proc, hart)
+            && (!next || proc->edf.abs_deadline < next->edf.abs_deadline))
+        {
+            next = proc;
+        }
+    }
+    if(next)
+    {
+        return next;
+    }
+
+    next = fair_pop(rq);
+    if(!next)
+    {
+        next = steal(hart);
+    }
+    return next ? next : idle_proc;
+}
+
+/*
+    Account the runtime of prev and arm the timer for next. Called by yield() right before the
+    context switch, also when prev keeps running (next == prev). The idle process gets a slice of one
+    balancing interval, so an idle hart looks for work to steal that often.
+*/
+void sched_switch(struct process *prev, struct process *next)
+{
+    struct rq *rq = this_rq();
+    uint64_t now = read_time();
+    charge(prev, now);
+
+    if(next != prev)
+    {
+        //prev may be picked by another hart once the kernel lock is released, after the switch is complete
+        prev->on_cpu = false;
+        next->on_cpu = true;
+        next->cpu = this_hart();
+    }
+    if(next != prev || now >= rq->slice_end)
+    {
+        next->exec_start = now;
+        rq->slice_end = now + (next == idle_proc ? SCHED_BALANCE_INTERVAL : fair_slice(rq));
+    }
+    arm_timer(rq, next, now);
+    vdso_update(next, now, rq->slice_end, next != prev ? VDSO_EV_SWITCH : VDSO_EV_NONE);
+}
+
+/*
+    Timer interrupt bookkeeping: charge the current process, release due EDF jobs, balance the load
+    between harts and decide whether the current process must give up the CPU. If it keeps running,
+    the timer is re-armed here.
+    returns:
+        int: 1 if the caller should yield()
+*/
+int sched_tick(void)
+{
+    struct rq *rq = this_rq();
+    uint64_t now = read_time();
+    charge(current_proc, now);
+
+    int resched = edf_release_jobs(now);
+    if(current_proc == idle_proc || now >= rq->slice_end)
+    {
+        resched = 1;
+    }
+    if(current_proc->sched_class == SCHED_EDF && current_proc->edf.budget_left == 0)
+    {
+        resched = 1;    // budget exhausted: throttled until the next release
+    }
+    if(!hart_allowed(current_proc, this_hart()) && current_proc != idle_proc)
+    {
+        resched = 1;    // the affinity changed while it ran, sched_pick_next() moves it
+    }
+    if(now >= rq->next_balance)
+    {
+        rq->next_balance = now + SCHED_BALANCE_INTERVAL;
+        balance(this_hart());
+    }
+
+    if(!resched)
+    {
+        arm_timer(rq, current_proc, now);
+    }
+    vdso_update(current_proc, now, rq->slice_end, VDSO_EV_TICK);
+    return resched;
+}
+
+/*
+    Move a process to the EDF class. The first job is released immediately.
+    Parameters:
+        struct process *proc: process to configure
+        uint32_t period: job release period in time CSR ticks
+        uint32_t budget: CPU time per job in ticks, enforced with stimecmp
+        uint32_t deadline: deadline relative to each release, 0 means the end of the period
+    returns:
+        int: 0 on success, -1 if the parameters are invalid or the task set would exceed a utilization of 1
+*/
+int sched_set_edf(struct process *proc, uint32_t period, uint32_t budget, uint32_t deadline)
+{
+    if(deadline == 0)
+    {
+        deadline = period;
+    }
+    if(budget == 0 || deadline > period || budget > deadline)
+    {
+        return -1;
+    }
+
+    //density = budget / min(deadline, period); a sum <= 1 is sufficient for EDF schedulability
+    uint32_t density = edf_density(budget, deadline);
+
+    uint32_t sie = irq_save();
+    uint32_t total = edf_total_density;
+    if(proc->sched_class == SCHED_EDF)
+    {
+        total -= proc->edf.density;
+    }
+    if(total + density > EDF_DENSITY_ONE)
+    {
+        irq_restore(sie);
+        return -1;
+    }
+    edf_total_density = total + density;
+
+    uint64_t now = read_time();
+    charge(proc, now);
+    if(proc->on_rq)
+    {
+        rq_remove(&rqs[proc->cpu], proc);   // EDF processes are picked from procs[] on any allowed hart
+    }
+    struct edf_task *e = &proc->edf;
+    e->period = period;
+    e->budget = budget;
+    e->deadline = deadline;
+    e->density = density;
+    e->release = now;
+    e->abs_deadline = now + deadline;
+    e->budget_left = budget;
+    e->job_active = true;
+    e->waiting = false;
+    e->misses = 0;
+    proc->sched_class = SCHED_EDF;
+    irq_restore(sie);
+    return 0;
+}
+
+//move a process back to the best-effort class and release its EDF utilization
+void sched_set_normal(struct process *proc)
+{
+    uint32_t sie = irq_save();
+    if(proc->sched_class == SCHED_EDF)
+    {
+        edf_total_density -= proc->edf.density;
+        proc->sched_class = SCHED_NORMAL;
+        proc->vruntime = rqs[proc->cpu].min_vruntime;
+        if(proc->edf.waiting)
+        {
+            proc->edf.waiting = false;
+            wake_process(proc);
+        }
+        else
+        {
+            sched_enqueue(proc);
+        }
+    }
+    irq_restore(sie);
+}
+
+/*
+    Set the nice level of a best-effort process, which sets its CPU share relative to the other ones:
+    each step is worth about 10% of CPU time.
+    Parameters:
+        struct process *proc: process to configure
+        int nice: -20 (largest share) to 19 (smallest share)
+    returns:
+        int: 0 on success, -1 if nice is out of range
+*/
+int sched_set_nice(struct process *proc, int nice)
+{
+    if(nice < -20 || nice > 19)
+    {
+        return -1;
+    }
+
+    uint32_t sie = irq_save();
+    if(proc == current_proc)
+    {
+        charge(proc, read_time());  // runtime so far is charged at the old weight
+    }
+    proc->nice = nice;
+    proc->weight = nice_to_weight[nice + 20];
+    proc->inv_weight = nice_to_inv_weight[nice + 20];
+    irq_restore(sie);
+    return 0;
+}
+
+/*
+    Restrict the harts a process may run on. A queued process moves to an allowed hart right away,
+    a running one right away: the caller yields, another hart is sent a reschedule IPI.
+    Parameters:
+        struct process *proc: process to configure
+        uint32_t mask: bit i allows cpus[i], AFFINITY_ALL for any hart
+    returns:
+        int: 0 on success, -1 if the mask allows no hart that is up
+*/
+int sched_set_affinity(struct process *proc, uint32_t mask)
+{
+    uint32_t sie = irq_save();
+    if(!(mask & cpu_online_mask()))
+    {
+        irq_restore(sie);
+        return -1;
+    }
+    proc->affinity = mask;
+    if(proc->on_rq && !hart_allowed(proc, proc->cpu))
+    {
+        rq_remove(&rqs[proc->cpu], proc);
+        sched_enqueue(proc);
+    }
+    irq_restore(sie);
+
+    if(proc == current_proc && !hart_allowed(proc, this_hart()))
+    {
+        yield();
+    }
+    else if(proc->on_cpu && !hart_allowed(proc, proc->cpu))
+    {
+        ipi_resched(proc->cpu);     // running elsewhere, move it off that hart now
+    }
+    return 0;
+}
+
+//print the CPU time and vruntime of every best-effort process, in time CSR ticks, and the load of every hart
+void sched_dump_fair(void)
+{
+    for(uint32_t i = 0; i < nr_cpus; i++)
+    {
+        struct rq *rq = &rqs[i];
+        struct process *curr = rq_curr(rq);
+        printf("fair: cpu %d: %d runnable, slice=%d, running pid %d, pulled %d\n", i, fair_nr_running(rq),
+            fair_slice(rq), curr ? curr->pid : -1, rq->pulled);
+    }
+    rcu_read_lock();
+    for_each_process(proc)
+    {
+        if(proc->state != PROC_EXITED && proc->pid > 0 && proc->sched_class == SCHED_NORMAL)
+        {
+            printf("  pid %d: cpu=%d affinity=%x nice=%d weight=%d runtime=%x%x vruntime=%x%x\n", proc->pid,
+                proc->cpu, proc->affinity, proc->nice, proc->weight,
+                (uint32_t)(proc->sum_exec_runtime >> 32), (uint32_t)proc->sum_exec_runtime,
+                (uint32_t)(proc->vruntime >> 32), (uint32_t)proc->vruntime);
+        }
+    }
+    rcu_read_unlock();
+}
+
+/*
+    Called by an EDF process when its current job is done: sleep until the next release.
+    A job that completes after its absolute deadline counts as a deadline miss.
+*/
+void edf_wait_next_period(void)
+{
+    struct process *proc = current_proc;
+    uint32_t sie = irq_save();
+    charge(proc, read_time());
+    if(proc->edf.job_active && proc->exec_start > proc->edf.abs_deadline)
+    {
+        proc->edf.misses++;
+    }
+    proc->edf.job_active = false;
+    proc->edf.waiting = true;
+    proc->state = PROC_BLOCKED;
+    yield();
+    irq_restore(sie);
+}
+
+//number of deadline misses of an EDF process since it was admitted
+uint32_t sched_edf_misses(struct process *proc)
+{
+    return proc->edf.misses;
+}
+
+//print the EDF task set with its deadline misses
+void sched_dump_edf(void)
+{
+    printf("EDF utilization: %d/1000\n", (int)(((uint64_t)edf_total_density * 1000) >> 16));
+    rcu_read_lock();
+    for_each_process(proc)
+    {
+        if(proc->sched_class == SCHED_EDF)
+        {
+            printf("  pid %d: period=%d budget=%d deadline=%d misses=%d\n", proc->pid,
+                proc->edf.period, proc->edf.budget, proc->edf.deadline, proc->edf.misses);
+        }
+    }
+    rcu_read_unlock();
+}
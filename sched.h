@@ -0,0 +1,38 @@
+#pragma once
+#include "kernel.h"
+
+/*
+    Scheduling classes. SCHED_EDF processes always run ahead of SCHED_NORMAL (best-effort) processes.
+    Among EDF processes the one whose current job has the earliest absolute deadline runs first.
+    Best-effort processes are charged their measured runtime scaled by their nice weight (vruntime),
+    and the one with the smallest vruntime runs next, so CPU time follows the configured weights.
+    Every hart has its own fair run queue; a process stays on the hart that last ran it unless its affinity
+    mask says otherwise or an idle or less loaded hart takes it over.
+*/
+#define SCHED_NORMAL        0           // best-effort
+#define SCHED_EDF           1           // periodic real-time, earliest deadline first
+
+#define SCHED_LATENCY_MS    400         // period in which every runnable best-effort process runs once
+#define SCHED_MIN_GRANULARITY_MS 50     // shortest time slice of a best-effort process
+#define SCHED_LATENCY       (timebase_freq / 1000 * SCHED_LATENCY_MS)           // in time CSR ticks
+#define SCHED_MIN_GRANULARITY (timebase_freq / 1000 * SCHED_MIN_GRANULARITY_MS)
+#define SCHED_BALANCE_MS    20          // period of the load balancing between harts, also how often an idle hart looks for work
+#define SCHED_BALANCE_INTERVAL (timebase_freq / 1000 * SCHED_BALANCE_MS)
+#define AFFINITY_ALL        0xffffffffu // affinity mask allowing every hart
+#define NICE_0_SHIFT        10          // nice 0 has a weight of 1 << NICE_0_SHIFT
+#define EDF_DENSITY_ONE     (1u << 16)  // total EDF density allowed by admission control (utilization 1.0)
+
+void sched_init_process(struct process *proc);
+void sched_enqueue(struct process *proc);
+struct process *sched_pick_next(void);
+void sched_switch(struct process *prev, struct process *next);
+int sched_tick(void);
+
+int sched_set_edf(struct process *proc, uint32_t period, uint32_t budget, uint32_t deadline);
+void sched_set_normal(struct process *proc);
+int sched_set_nice(struct process *proc, int nice);
+int sched_set_affinity(struct process *proc, uint32_t mask);
+void sched_dump_fair(void);
+void edf_wait_next_period(void);
+uint32_t sched_edf_misses(struct process *proc);
+void sched_dump_edf(void);
@@ -0,0 +1,177 @@
+#include "smp.h"
+#include "fdt.h"
+#include "sched.h"
+#include "vm.h"
+#include "pmu.h"
+#include "softirq.h"
+#include "ipi.h"
+#include "rcu.h"
+#include "vdso.h"
+
+struct cpu cpus[HARTS_MAX];
+uint32_t nr_cpus;
+
+static uint32_t kernel_lock_word;   // 1 while a hart holds the kernel lock
+
+_Static_assert(offsetof(struct cpu, kernel_sp) == 0, "CPU_KERNEL_SP");
+_Static_assert(offsetof(struct cpu, trap_sp) == 4, "CPU_TRAP_SP");
+_Static_assert(offsetof(struct cpu, stack_top) == 8, "CPU_STACK_TOP");
+
+/*
+    Take the kernel lock, spinning while another hart holds it.
+    returns:
+        int: 1 if this call took the lock, 0 if the hart held it already
+*/
+int kernel_lock(void)
+{
+    //masked so a trap cannot see the lock taken but not yet recorded as ours
+    uint32_t sie = irq_save();
+    struct cpu *c = this_cpu();
+    if(c->kernel_locked)
+    {
+        irq_restore(sie);
+        return 0;
+    }
+    while(__atomic_exchange_n(&kernel_lock_word, 1, __ATOMIC_ACQUIRE))
+    {
+        while(__atomic_load_n(&kernel_lock_word, __ATOMIC_RELAXED))
+        {
+            __asm__ __volatile__("nop");
+        }
+    }
+    c->kernel_locked = true;
+    irq_restore(sie);
+    return 1;
+}
+
+//drop the kernel lock if this hart holds it
+void kernel_unlock(void)
+{
+    uint32_t sie = irq_save();
+    struct cpu *c = this_cpu();
+    if(c->kernel_locked)
+    {
+        c->kernel_locked = false;
+        __atomic_store_n(&kernel_lock_word, 0, __ATOMIC_RELEASE);
+    }
+    irq_restore(sie);
+}
+
+//called by every trap handler right before the registers are restored: drop the lock if the trap took it
+void trap_return(struct trap_frame *f)
+{
+    if(f->locked)
+    {
+        kernel_unlock();
+    }
+}
+
+//wait for an interrupt without the kernel lock, so other harts can enter the kernel meanwhile
+void cpu_idle(void)
+{
+    //wfi also wakes up on an interrupt that is masked, it is taken after the lock is back
+    uint32_t sie = irq_save();
+    kernel_unlock();
+    rcu_idle_enter();
+    __asm__ __volatile__("wfi");
+    rcu_idle_exit();
+    kernel_lock();
+    irq_restore(sie);
+}
+
+//harts the scheduler can place processes on, bit i = cpus[i]
+uint32_t cpu_online_mask(void)
+{
+    uint32_t mask = 0;
+    for(uint32_t i = 0; i < nr_cpus; i++)
+    {
+        if(cpus[i].online)
+        {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+}
+
+//register the boot hart as cpus[0] and take the kernel lock for the rest of the boot. tp already points to cpus[0].
+void smp_init(uint32_t hartid)
+{
+    extern char __stack_top[];
+    struct cpu *c = &cpus[0];
+    c->index = 0;
+    c->hartid = hartid;
+    c->stack_top = (vaddr_t)__stack_top;
+    c->stack_size = 128 * 1024;     // see kernel.ld
+    c->online = true;
+    nr_cpus = 1;
+    kernel_lock();
+}
+
+//first code of a secondary hart, entered with the MMU off, a0 = hart ID and a1 = its struct cpu
+__attribute__((naked)) void secondary_entry(void)
+{
+    __asm__ __volatile__(
+        "mv tp, a1\n"
+        "lw sp, " CPU_STACK_TOP "(tp)\n"
+        "j secondary_main\n"
+    );
+}
+
+//bring a secondary hart into the scheduler, then idle until there is work for it
+void secondary_main(uint32_t hartid)
+{
+    kernel_lock();
+    WRITE_CSR(sscratch, 0);
+    configure_trap_handling(true);
+    idle_init();
+    vm_switch(idle_proc);
+    pmu_init();
+    vdso_init_hart();
+    this_cpu()->online = true;
+    softirq_init();
+    printf("smp: hart %d online as cpu %d\n", hartid, this_hart());
+
+    write_to_stimecmp(read_time() + SCHED_BALANCE_INTERVAL);
+    enable_timer_interrupt();
+    ipi_init_hart();
+    enable_supervisor_interrupt();
+    idle_loop();
+}
+
+/*
+    Start every other hart in the device tree, up to HARTS_MAX in total. The harts spin on the kernel lock
+    until the boot hart lets go of it.
+*/
+void smp_boot(void)
+{
+    for(uint32_t i = 0; i < platform.nr_harts && nr_cpus < HARTS_MAX; i++)
+    {
+        uint32_t hartid = platform.harts[i].hartid;
+        if(hartid == cpus[0].hartid)
+        {
+            continue;
+        }
+
+        struct cpu *c = &cpus[nr_cpus];
+        void *stack = alloc_pages(SMP_STACK_PAGES);
+        if(!stack)
+        {
+            printf("smp: no stack for hart %d\n", hartid);
+            break;
+        }
+        c->index = nr_cpus;
+        c->hartid = hartid;
+        c->stack_size = SMP_STACK_PAGES * PAGE_SIZE;
+        c->stack_top = (vaddr_t)stack + c->stack_size;
+
+        struct sbiret ret = sbi_call(hartid, (uint32_t)secondary_entry, (uint32_t)c, 0, 0, 0,
+            SBI_HSM_HART_START, SBI_EXT_HSM);
+        if(ret.error)
+        {
+            printf("smp: hart %d did not start (%d)\n", hartid, ret.error);
+            free(stack);
+            continue;
+        }
+        nr_cpus++;
+    }
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include "kernel.h"
+
+/*
+    Multiprocessor support. The boot hart starts the other harts listed in the device tree through the SBI hart
+    state management (HSM) extension; each one sets up its trap vector, idle process and kworker and then schedules
+    from its own run queue (see sched.c).
+    Kernel code runs under one kernel lock: a trap takes it on entry unless the hart holds it already and drops it
+    again on the way out, and a hart holds it while it runs kernel processes. User code, idle harts and busy waits
+    run without it, so user processes run in parallel on all harts while the kernel itself stays single threaded.
+*/
+#define SBI_EXT_HSM             0x48534d
+#define SBI_HSM_HART_START      0
+#define SMP_STACK_PAGES         4       // boot and idle stack of a secondary hart
+
+void smp_init(uint32_t hartid);
+void smp_boot(void);
+void cpu_idle(void);
+void trap_return(struct trap_frame *f);
+uint32_t cpu_online_mask(void);
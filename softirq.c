@@ -0,0 +1,165 @@
+#include "softirq.h"
+#include "sched.h"
+
+//deferred work of one hart
+struct softirq_cpu
+{
+    struct work *raised;                // bottom halves for the next trap exit, newest first
+    struct work *scheduled;             // items for the kworker process, newest first
+    bool active;                        // running bottom halves, nested traps leave them to the outer one
+    bool need_resched;                  // the timer asked for a reschedule while bottom halves were running
+    struct wait_queue kworker_wq;       // the kworker process sleeps here while it has nothing to do
+    struct work kick;                   // wakes kworker_wq, raised by work_schedule() on this hart
+};
+
+static struct softirq_cpu softirq_cpus[HARTS_MAX];
+
+static struct softirq_cpu *this_softirq(void)
+{
+    return &softirq_cpus[this_hart()];
+}
+
+void work_init(struct work *w, void (*fn)(struct work *w))
+{
+    w->next = NULL;
+    w->fn = fn;
+    w->pending = 0;
+}
+
+//push w onto a list with compare-and-swap, safe against interrupts and other harts
+static bool push(struct work **list, struct work *w)
+{
+    if(__atomic_exchange_n(&w->pending, 1, __ATOMIC_ACQUIRE))
+    {
+        return false;   // already queued, the pending run will see the new state too
+    }
+    struct work *head = __atomic_load_n(list, __ATOMIC_RELAXED);
+    do
+    {
+        w->next = head;
+    } while(!__atomic_compare_exchange_n(list, &head, w, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return true;
+}
+
+//take the whole list and run it in the order it was queued
+static void run_list(struct work **list)
+{
+    struct work *w = __atomic_exchange_n(list, NULL, __ATOMIC_ACQUIRE);
+    struct work *fifo = NULL;
+    while(w)
+    {
+        struct work *next = w->next;
+        w->next = fifo;
+        fifo = w;
+        w = next;
+    }
+    while(fifo)
+    {
+        struct work *next = fifo->next;
+        //cleared before the call so the item can be queued again while it runs
+        __atomic_store_n(&fifo->pending, 0, __ATOMIC_RELEASE);
+        fifo->fn(fifo);
+        fifo = next;
+    }
+}
+
+/*
+    Queue w to run as a bottom half on this hart's next trap exit. Callable from interrupt handlers.
+    returns:
+        bool: false if w was already queued
+*/
+bool softirq_raise(struct work *w)
+{
+    return push(&this_softirq()->raised, w);
+}
+
+//wakes the kworker process, raised by work_schedule() on the hart it is queued for, so this_softirq() is that hart
+static void kworker_kick(struct work *w)
+{
+    (void)w;
+    wait_queue_wake_all(&this_softirq()->kworker_wq);
+}
+
+/*
+    Queue w to run in the kworker process of this hart, where it may sleep. Callable from interrupt handlers:
+    the wakeup itself is left to a bottom half.
+    returns:
+        bool: false if w was already queued
+*/
+bool work_schedule(struct work *w)
+{
+    struct softirq_cpu *c = this_softirq();
+    if(!push(&c->scheduled, w))
+    {
+        return false;
+    }
+    //a kick of its own per hart: a shared one still pending for another hart would swallow this one
+    softirq_raise(&c->kick);
+    return true;
+}
+
+//true while bottom halves run on this hart; the timer handler then leaves the reschedule to softirq_exit()
+bool softirq_active(void)
+{
+    return this_softirq()->active;
+}
+
+void softirq_request_resched(void)
+{
+    this_softirq()->need_resched = true;
+}
+
+/*
+    Called by every trap handler on its way out. Runs the raised bottom halves with interrupts enabled,
+    unless the trap interrupted code that had interrupts masked or bottom halves are already running.
+    Parameters:
+        struct trap_frame *f: the frame of the trap being left
+*/
+void softirq_exit(struct trap_frame *f)
+{
+    struct softirq_cpu *c = this_softirq();
+    if(!c->raised || c->active || !(f->sstatus & SSTATUS_SPIE))
+    {
+        return;
+    }
+
+    //checked with interrupts masked, so nothing raised by a top half is left behind until the next trap
+    c->active = true;
+    while(__atomic_load_n(&c->raised, __ATOMIC_RELAXED))
+    {
+        __asm__ __volatile__("csrsi sstatus, 2" ::: "memory");
+        run_list(&c->raised);
+        __asm__ __volatile__("csrci sstatus, 2" ::: "memory");
+    }
+    c->active = false;
+
+    if(c->need_resched)
+    {
+        c->need_resched = false;
+        yield();
+    }
+}
+
+//kernel worker: runs the items queued with work_schedule(), sleeps when there are none. Pinned to its hart.
+static void kworker_entry(void)
+{
+    struct softirq_cpu *c = this_softirq();
+    while(1)
+    {
+        uint32_t sie = irq_save();
+        if(!__atomic_load_n(&c->scheduled, __ATOMIC_RELAXED))
+        {
+            wait_queue_sleep(&c->kworker_wq);
+        }
+        irq_restore(sie);
+        run_list(&c->scheduled);
+    }
+}
+
+//start the kworker process of this hart
+void softirq_init(void)
+{
+    work_init(&this_softirq()->kick, kworker_kick);
+    struct process *kworker = create_process(kworker_entry);
+    sched_set_affinity(kworker, 1u << this_hart());
+}
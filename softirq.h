@@ -0,0 +1,27 @@
+#pragma once
+#include "kernel.h"
+
+/*
+    Deferred work. Interrupt handlers (top halves) only acknowledge the hardware and queue a struct work; the
+    rest of the handling runs later with interrupts enabled:
+        softirq_raise()     runs the item on trap exit (bottom half), before returning to the interrupted code.
+                            Bottom halves must not sleep; they are not preempted, a reschedule waits until they finish.
+        work_schedule()     runs the item in the kworker process, where it may sleep.
+    Each hart has its own lock-free lists, so queueing never masks interrupts.
+*/
+struct work
+{
+    struct work *next;
+    void (*fn)(struct work *w);
+    uint32_t pending;                   // queued and not started yet; queueing a pending item does nothing
+};
+
+#define WORK_INIT(func)     { NULL, (func), 0 }
+
+void work_init(struct work *w, void (*fn)(struct work *w));
+bool softirq_raise(struct work *w);
+bool work_schedule(struct work *w);
+bool softirq_active(void);
+void softirq_request_resched(void);
+void softirq_exit(struct trap_frame *f);
+void softirq_init(void);
@@ -0,0 +1,295 @@
+#include "tlb.h"
+
+//harts whose TLB may hold entries of an ASID; kept per ASID because a procs[] slot keeps its ASID across reuse
+struct tlb_space
+{
+    uint32_t harts;                     // bit i: cpus[i] loaded the ASID since its last flush of it
+    uint32_t stale;                     // bit i: cpus[i] must flush the ASID before it loads it again
+};
+
+//shootdown statistics of one hart, counted by the hart that flushes
+struct tlb_cpu
+{
+    uint32_t batches;                   // flushed batches
+    uint32_t pages;                     // pages unmapped by them
+    uint32_t full;                      // batches that flushed the whole ASID
+    uint32_t rfences;                   // SBI remote_sfence_vma_asid calls
+    uint32_t lazy;                      // remote harts marked stale instead of interrupted
+    uint32_t stale_flushes;             // ASID flushes on loading a stale address space
+    uint32_t max_cost;                  // time CSR ticks of the slowest remote flush
+    uint64_t total_cost;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct tlb_space spaces[PROCS_MAX + 1];
+static struct tlb_cpu tlb_cpus[HARTS_MAX];
+static uint32_t asid_max;               // largest ASID satp takes, 0 if ASIDs are not implemented
+
+static void sfence_vma_asid(uint32_t asid)
+{
+    __asm__ __volatile__("sfence.vma zero, %0" :: "r"(asid) : "memory");
+}
+
+static void sfence_vma_page_asid(vaddr_t va, uint32_t asid)
+{
+    __asm__ __volatile__("sfence.vma %0, %1" :: "r"(va), "r"(asid) : "memory");
+}
+
+//find the implemented ASID bits by writing all ones to satp.ASID, called once paging is on
+void tlb_init(void)
+{
+    uint32_t satp = READ_CSR(satp);
+    WRITE_CSR(satp, satp | SATP_ASID_MASK);
+    uint32_t max = (READ_CSR(satp) & SATP_ASID_MASK) >> SATP_ASID_SHIFT;
+    WRITE_CSR(satp, satp);
+    //too few ASIDs for every slot: everything runs as ASID 0 and satp switches flush the TLB as before
+    asid_max = max >= PROCS_MAX ? max : 0;
+    printf("tlb: %d ASIDs%s\n", max + 1, asid_max ? "" : ", flushing on every switch");
+}
+
+/*
+    ASID of the address space of proc.
+    returns:
+        uint32_t: procs[] slot + 1 for a private root table, 0 for the kernel table or without ASID support
+*/
+uint32_t tlb_asid(struct process *proc)
+{
+    if(!asid_max || !proc->page_table)
+    {
+        return 0;
+    }
+    return (uint32_t)(proc - procs) + 1;
+}
+
+/*
+    Load satp for next, called by vm_switch() when satp changes. Flushes the ASID first if a shootdown skipped
+    this hart since it last ran the address space.
+*/
+void tlb_switch(struct process *next, uint32_t satp)
+{
+    uint32_t asid = tlb_asid(next);
+    uint32_t bit = 1u << this_hart();
+    struct tlb_space *s = &spaces[asid];
+    if(!asid_max)
+    {
+        __asm__ __volatile__("sfence.vma" ::: "memory");
+        WRITE_CSR(satp, satp);
+        __asm__ __volatile__("sfence.vma" ::: "memory");
+        s->stale &= ~bit;
+    }
+    else
+    {
+        if(s->stale & bit)
+        {
+            s->stale &= ~bit;
+            sfence_vma_asid(asid);
+            tlb_cpus[this_hart()].stale_flushes++;
+        }
+        WRITE_CSR(satp, satp);
+    }
+    if(next->page_table)
+    {
+        s->harts |= bit;
+    }
+}
+
+//drop a cached translation of va in the address space of proc on this hart, e.g. after mapping the page
+void tlb_flush_local(struct process *proc, vaddr_t va)
+{
+    sfence_vma_page_asid(va, tlb_asid(proc));
+}
+
+/*
+    Run sfence.vma for asid on the harts in mask through SBI, which returns once all of them are done.
+    hart_mask counts SBI hart IDs from hart_mask_base rather than cpus[] indexes, so harts whose IDs lie more than
+    31 apart need separate calls.
+    Parameters:
+        uint32_t mask: bit i set: flush on cpus[i]
+        vaddr_t start: first address to flush
+        uint32_t size: bytes to flush, (uint32_t)-1 for the whole ASID
+        uint32_t asid: address space to flush
+*/
+static void rfence(uint32_t mask, vaddr_t start, uint32_t size, uint32_t asid)
+{
+    struct tlb_cpu *c = &tlb_cpus[this_hart()];
+    uint64_t t0 = read_time();
+    while(mask)
+    {
+        uint32_t base = (uint32_t)-1;
+        for(uint32_t hart = 0; hart < nr_cpus; hart++)
+        {
+            if((mask & (1u << hart)) && cpus[hart].hartid < base)
+            {
+                base = cpus[hart].hartid;
+            }
+        }
+        uint32_t hart_mask = 0;
+        for(uint32_t hart = 0; hart < nr_cpus; hart++)
+        {
+            if((mask & (1u << hart)) && cpus[hart].hartid - base < 32)
+            {
+                hart_mask |= 1u << (cpus[hart].hartid - base);
+                mask &= ~(1u << hart);
+            }
+        }
+        struct sbiret ret = sbi_call(hart_mask, base, start, size, asid, 0, SBI_RFENCE_SFENCE_VMA_ASID, SBI_EXT_RFENCE);
+        if(ret.error)
+        {
+            PANIC("sbi remote_sfence_vma_asid failed: %d", ret.error);
+        }
+        c->rfences++;
+    }
+    uint32_t cost = (uint32_t)(read_time() - t0);
+    c->total_cost += cost;
+    if(cost > c->max_cost)
+    {
+        c->max_cost = cost;
+    }
+}
+
+/*
+    Split the harts that may hold asid into those running proc right now, which must flush before the caller goes
+    on, and the rest, which are marked stale and flush when they next load the ASID. Runs under the kernel lock, so
+    no hart can switch to proc meanwhile.
+    returns:
+        uint32_t: the remote harts to interrupt
+*/
+static uint32_t shootdown_targets(struct process *proc, uint32_t asid)
+{
+    struct tlb_space *s = &spaces[asid];
+    uint32_t self = 1u << this_hart();
+    uint32_t mask = 0;
+    for(uint32_t hart = 0; hart < nr_cpus; hart++)
+    {
+        uint32_t bit = 1u << hart;
+        if(bit == self || !(s->harts & bit))
+        {
+            continue;
+        }
+        if(cpus[hart].proc == proc)
+        {
+            mask |= bit;
+        }
+        else
+        {
+            s->harts &= ~bit;
+            s->stale |= bit;
+            tlb_cpus[this_hart()].lazy++;
+        }
+    }
+    return mask;
+}
+
+//start an empty batch of invalidations for the address space of proc
+void tlb_batch_init(struct tlb_batch *b, struct process *proc)
+{
+    b->proc = proc;
+    b->start = b->end = 0;
+    b->npages = 0;
+    b->nr_frames = 0;
+}
+
+/*
+    Record that the mapping of the page at va was removed. frame, if not NULL, is the frame it pointed to; it is
+    freed once no TLB holds the mapping, which may mean flushing the batch early when it holds too many frames.
+*/
+void tlb_batch_add(struct tlb_batch *b, vaddr_t va, void *frame)
+{
+    if(frame && b->nr_frames == TLB_BATCH_FRAMES)
+    {
+        tlb_batch_flush(b);
+    }
+    va &= ~(PAGE_SIZE - 1);
+    if(b->start == b->end)
+    {
+        b->start = va;
+        b->end = va + PAGE_SIZE;
+    }
+    else if(va < b->start)
+    {
+        b->start = va;
+    }
+    else if(va + PAGE_SIZE > b->end)
+    {
+        b->end = va + PAGE_SIZE;
+    }
+    b->npages++;
+    if(frame)
+    {
+        b->frames[b->nr_frames++] = frame;
+    }
+}
+
+//invalidate the pages of the batch on every hart that may cache them, then free their frames
+void tlb_batch_flush(struct tlb_batch *b)
+{
+    if(b->start == b->end)
+    {
+        return;
+    }
+    struct process *proc = b->proc;
+    uint32_t asid = tlb_asid(proc);
+    uint32_t span = (b->end - b->start) / PAGE_SIZE;
+    bool full = span > TLB_FLUSH_RANGE_MAX;
+    struct tlb_cpu *c = &tlb_cpus[this_hart()];
+
+    if(spaces[asid].harts & (1u << this_hart()))
+    {
+        if(full)
+        {
+            sfence_vma_asid(asid);
+        }
+        else
+        {
+            for(vaddr_t va = b->start; va < b->end; va += PAGE_SIZE)
+            {
+                sfence_vma_page_asid(va, asid);
+            }
+        }
+    }
+    uint32_t mask = shootdown_targets(proc, asid);
+    if(mask)
+    {
+        rfence(mask, full ? 0 : b->start, full ? (uint32_t)-1 : b->end - b->start, asid);
+    }
+
+    c->batches++;
+    c->pages += b->npages;
+    c->full += full;
+    for(uint32_t i = 0; i < b->nr_frames; i++)
+    {
+        free(b->frames[i]);
+    }
+    tlb_batch_init(b, proc);
+}
+
+/*
+    The address space of proc is being torn down and its ASID will be handed out again: harts running proc
+    elsewhere flush it now, all others (this one included) before they load it next. Called before the root table
+    is freed.
+*/
+void tlb_release(struct process *proc)
+{
+    uint32_t asid = tlb_asid(proc);
+    struct tlb_space *s = &spaces[asid];
+    uint32_t mask = shootdown_targets(proc, asid);
+    if(mask)
+    {
+        rfence(mask, 0, (uint32_t)-1, asid);
+    }
+    s->stale |= s->harts;
+    s->harts = 0;
+}
+
+//print the shootdown counts and the cost of remote flushes of every hart
+void tlb_dump(void)
+{
+    uint32_t div = ticks_per_us();
+    for(uint32_t hart = 0; hart < nr_cpus; hart++)
+    {
+        struct tlb_cpu *c = &tlb_cpus[hart];
+        uint32_t avg = scaled_div(c->total_cost, c->rfences) / div;
+        printf("tlb: cpu %d: %d batches, %d pages, %d full, %d rfences, %d lazy, %d stale flushes, "
+            "rfence avg %d us max %d us\n", hart, c->batches, c->pages, c->full, c->rfences, c->lazy,
+            c->stale_flushes, avg, c->max_cost / div);
+    }
+}
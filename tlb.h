@@ -0,0 +1,40 @@
+#pragma once
+#include "kernel.h"
+
+/*
+    TLB shootdowns. Every address space with a private root table has its own ASID (procs[] slot + 1, 0 is the
+    kernel table), so switching satp no longer flushes the TLB and a hart may keep translations of a process that
+    last ran there; tlb.c records those harts per ASID.
+    Unmapping collects the pages in a tlb_batch and invalidates them in one go: the range from the lowest to the
+    highest page, or the whole ASID once it spans more than TLB_FLUSH_RANGE_MAX pages. A hart that is running the
+    process right now is sent one SBI RFENCE remote_sfence_vma_asid for the batch; any other hart that may hold the
+    ASID is only marked stale and flushes the ASID itself the next time it loads it (tlb_switch()). The frames are
+    freed after the flush, when no hart can reach them any more.
+*/
+#define SBI_EXT_RFENCE              0x52464e43
+#define SBI_RFENCE_SFENCE_VMA_ASID  2
+#define SATP_ASID_SHIFT             22
+#define SATP_ASID_MASK              (0x1ffu << SATP_ASID_SHIFT)
+#define TLB_FLUSH_RANGE_MAX         16      // pages, a larger range flushes the whole ASID
+#define TLB_BATCH_FRAMES            32      // frames a batch holds back until its flush
+
+//invalidations of one address space waiting to be flushed
+struct tlb_batch
+{
+    struct process *proc;
+    vaddr_t start;                      // pages [start, end) must be invalidated, empty if start == end
+    vaddr_t end;
+    uint32_t npages;                    // pages added since the last flush
+    uint32_t nr_frames;
+    void *frames[TLB_BATCH_FRAMES];     // freed once the batch is flushed
+};
+
+void tlb_init(void);
+uint32_t tlb_asid(struct process *proc);
+void tlb_switch(struct process *next, uint32_t satp);
+void tlb_flush_local(struct process *proc, vaddr_t va);
+void tlb_batch_init(struct tlb_batch *b, struct process *proc);
+void tlb_batch_add(struct tlb_batch *b, vaddr_t va, void *frame);
+void tlb_batch_flush(struct tlb_batch *b);
+void tlb_release(struct process *proc);
+void tlb_dump(void);
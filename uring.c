@@ -0,0 +1,458 @@
+#include "kernel.h"
+#include "uring.h"
+#include "vm.h"
+#include "ramfs.h"
+#include "virtio.h"
+
+#define URING_MAX_BLK       16          // block requests in flight per ring
+#define URING_MAX_TIMEOUTS  8           // timeouts pending per ring
+
+struct uring;
+
+//a block request issued for a submission
+struct uring_blk
+{
+    struct blk_request req;
+    struct uring *ring;
+    uint32_t user_data;
+    vaddr_t addr;                       // user buffer the device accesses, pinned while busy
+    uint32_t len;
+    bool busy;                          // being prepared or in flight
+};
+
+struct uring_timeout
+{
+    uint64_t deadline;                  // time CSR value
+    uint32_t user_data;
+    bool busy;
+};
+
+//kernel side of a ring, one per process
+struct uring
+{
+    struct uring_shared *shared;        // kernel address of the shared page
+    vaddr_t user_addr;                  // where the process sees it
+    uint32_t inflight;                  // submissions that will complete later (block requests, timeouts)
+    uint32_t ntimeouts;
+    struct uring *timer_next;           // next ring with pending timeouts
+    uint32_t pinned;                    // block requests holding physical addresses of user pages, prepared or in flight
+    struct wait_queue wq;               // uring_sys_enter() waiting for completions
+    struct uring_blk blk[URING_MAX_BLK];
+    struct uring_timeout timeouts[URING_MAX_TIMEOUTS];
+};
+
+static struct uring *timer_rings;       // rings with pending timeouts, the timer tick expires them
+static uint64_t next_deadline = ~0ull;  // earliest deadline of those timeouts, armed by every hart
+
+/*
+    Append a completion. Submissions are only taken while the completion queue has room for them and for
+    everything in flight, so it cannot overflow.
+*/
+static void post_cqe(struct uring *ring, uint32_t user_data, int res)
+{
+    uint32_t sie = irq_save();
+    struct uring_shared *s = ring->shared;
+    struct uring_cqe *cqe = &s->cq[s->cq_tail & (URING_CQ_ENTRIES - 1)];
+    cqe->user_data = user_data;
+    cqe->res = res;
+    __atomic_store_n(&s->cq_tail, s->cq_tail + 1, __ATOMIC_RELEASE);
+    irq_restore(sie);
+    wait_queue_wake_all(&ring->wq);
+}
+
+//completions the process has not reaped yet
+static uint32_t cq_ready(struct uring *ring)
+{
+    return ring->shared->cq_tail - __atomic_load_n(&ring->shared->cq_head, __ATOMIC_ACQUIRE);
+}
+
+/*
+    Create the rings of the calling process and map them into it.
+    returns:
+        vaddr_t: user address of the struct uring_shared page, 0 on failure or if the process has rings already
+*/
+vaddr_t uring_sys_setup(uint32_t flags)
+{
+    if(current_proc->uring || (flags & ~URING_SETUP_POLL))
+    {
+        return 0;
+    }
+    vaddr_t va = vm_reserve(current_proc, PAGE_SIZE);
+    if(!va)
+    {
+        return 0;
+    }
+
+    struct uring *ring = alloc_pages(align_up(sizeof(struct uring), PAGE_SIZE) / PAGE_SIZE);
+    memset(ring, 0, sizeof(*ring));
+    ring->shared = alloc_pages(1);
+    memset(ring->shared, 0, PAGE_SIZE);
+    ring->shared->flags = flags;
+    ring->user_addr = va;
+    for(int i = 0; i < URING_MAX_BLK; i++)
+    {
+        ring->blk[i].ring = ring;
+    }
+
+    //not PAGE_OWNED: the page belongs to the ring and is freed by uring_exit()
+    map_page(vm_table_of(current_proc), va, (paddr_t)ring->shared, PAGE_U | PAGE_R | PAGE_W);
+    current_proc->uring = ring;
+    return va;
+}
+
+//block request completion, runs in a bottom half in whatever process was interrupted
+static void blk_complete(struct blk_request *req)
+{
+    struct uring_blk *b = req->private;
+    struct uring *ring = b->ring;
+    uint32_t sie = irq_save();
+    b->busy = false;
+    ring->inflight--;
+    ring->pinned--;
+    post_cqe(ring, b->user_data, req->status == BLK_OK ? (int)b->len : -1);
+    irq_restore(sie);
+}
+
+/*
+    Turn a block submission into a request on the pages of the user buffer. Called in the owner's context, so
+    touching the buffer faults its pages in (and checks the mapping allows the transfer) before the device sees them.
+    returns:
+        struct blk_request *: the request to submit, NULL if the submission is invalid or no request slot is free
+*/
+static struct blk_request *prepare_blk(struct uring *ring, const struct uring_sqe *sqe)
+{
+    //user_range_ok() keeps the touches below off the device megapages
+    if(!sqe->len || sqe->len % SECTOR_SIZE || sqe->addr % SECTOR_SIZE || !user_range_ok((void *)sqe->addr, sqe->len))
+    {
+        return NULL;
+    }
+    struct uring_blk *b = NULL;
+    for(int i = 0; i < URING_MAX_BLK && !b; i++)
+    {
+        if(!ring->blk[i].busy)
+        {
+            b = &ring->blk[i];
+        }
+    }
+    if(!b)
+    {
+        return NULL;
+    }
+
+    struct blk_request *req = &b->req;
+    memset(req, 0, sizeof(*req));
+    //from here on zram must not swap out the pages already added, faulting in the next one may reclaim,
+    //and munmap() or sbrk() must not free them (see uring_wait_unpinned())
+    b->addr = sqe->addr;
+    b->len = sqe->len;
+    b->busy = true;
+    ring->pinned++;
+    req->type = sqe->opcode == URING_OP_BLK_READ ? BLK_READ : BLK_WRITE;
+    req->sector = sqe->off;
+    vaddr_t va = sqe->addr;
+    while(va < sqe->addr + sqe->len)
+    {
+        uint32_t chunk = PAGE_SIZE - (va & (PAGE_SIZE - 1));
+        if(chunk > sqe->addr + sqe->len - va)
+        {
+            chunk = sqe->addr + sqe->len - va;
+        }
+        if(req->nsg == BLK_MAX_SG)
+        {
+            break;
+        }
+
+        //the device writes memory it reads into, so a read needs a writable page
+        volatile uint8_t *p = (volatile uint8_t *)va;
+        if(req->type == BLK_READ)
+        {
+            *p = *p;
+        }
+        else
+        {
+            (void)*p;
+        }
+        uint32_t *pte = vm_walk(vm_table_of(current_proc), va, false);
+        if(!pte || !(*pte & PAGE_V))
+        {
+            break;
+        }
+        req->sg[req->nsg].addr = (void *)(PTE_PADDR(*pte) + (va & (PAGE_SIZE - 1)));
+        req->sg[req->nsg].len = chunk;
+        req->nsg++;
+        va += chunk;
+    }
+    if(va < sqe->addr + sqe->len)
+    {
+        b->busy = false;
+        ring->pinned--;
+        wait_queue_wake_all(&ring->wq);     // uring_wait_unpinned() may be waiting for the range
+        return NULL;
+    }
+    req->complete = blk_complete;
+    req->private = b;
+    b->user_data = sqe->user_data;
+    ring->inflight++;
+    return req;
+}
+
+//recompute next_deadline after timeouts were added or removed; interrupts are off
+static void update_deadline(void)
+{
+    next_deadline = ~0ull;
+    for(struct uring *ring = timer_rings; ring; ring = ring->timer_next)
+    {
+        for(int i = 0; i < URING_MAX_TIMEOUTS; i++)
+        {
+            struct uring_timeout *t = &ring->timeouts[i];
+            if(t->busy && t->deadline < next_deadline)
+            {
+                next_deadline = t->deadline;
+            }
+        }
+    }
+}
+
+//take a ring whose last timeout went away off timer_rings; interrupts are off
+static void timer_unlink(struct uring *ring)
+{
+    struct uring **pp = &timer_rings;
+    while(*pp != ring)
+    {
+        pp = &(*pp)->timer_next;
+    }
+    *pp = ring->timer_next;
+    ring->timer_next = NULL;
+}
+
+//complete the timeouts that are due; interrupts are off
+static void expire_timeouts(struct uring *ring, uint64_t now)
+{
+    for(int i = 0; i < URING_MAX_TIMEOUTS && ring->ntimeouts; i++)
+    {
+        struct uring_timeout *t = &ring->timeouts[i];
+        if(t->busy && now >= t->deadline)
+        {
+            t->busy = false;
+            ring->inflight--;
+            if(!--ring->ntimeouts)
+            {
+                timer_unlink(ring);
+            }
+            post_cqe(ring, t->user_data, 0);
+        }
+    }
+}
+
+//the earliest pending timeout of any ring in time CSR ticks, ~0 if there is none; arm_timer() programs it
+uint64_t uring_next_timeout(void)
+{
+    return next_deadline;
+}
+
+//timer interrupt: complete the timeouts that are due, which wakes the processes waiting for them in uring_enter()
+void uring_timer_tick(void)
+{
+    uint64_t now = read_time();
+    if(now < next_deadline)
+    {
+        return;
+    }
+    uint32_t sie = irq_save();
+    struct uring *ring = timer_rings;
+    while(ring)
+    {
+        struct uring *next = ring->timer_next;  // expiring the last timeout unlinks the ring
+        expire_timeouts(ring, now);
+        ring = next;
+    }
+    update_deadline();
+    irq_restore(sie);
+}
+
+static bool add_timeout(struct uring *ring, const struct uring_sqe *sqe)
+{
+    for(int i = 0; i < URING_MAX_TIMEOUTS; i++)
+    {
+        struct uring_timeout *t = &ring->timeouts[i];
+        if(!t->busy)
+        {
+            uint32_t sie = irq_save();
+            t->deadline = read_time() + (uint64_t)sqe->off * ticks_per_us();
+            t->user_data = sqe->user_data;
+            t->busy = true;
+            if(!ring->ntimeouts++)
+            {
+                ring->timer_next = timer_rings;
+                timer_rings = ring;
+            }
+            ring->inflight++;
+            if(t->deadline < next_deadline)
+            {
+                next_deadline = t->deadline;    // programmed the next time this hart arms its timer
+            }
+            irq_restore(sie);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+    Consume up to max submissions. Synchronous operations complete right away; block requests are collected
+    and handed to the device as one batch, with a single doorbell write.
+    returns:
+        int: submissions consumed
+*/
+static int submit(struct uring *ring, uint32_t max)
+{
+    struct uring_shared *s = ring->shared;
+    struct blk_request *batch[URING_MAX_BLK];
+    int nbatch = 0;
+    uint32_t n = 0;
+
+    while(n < max && s->sq_head != __atomic_load_n(&s->sq_tail, __ATOMIC_ACQUIRE)
+        && cq_ready(ring) + ring->inflight < URING_CQ_ENTRIES)
+    {
+        //copied first, the process may rewrite the slot as soon as sq_head moves
+        struct uring_sqe sqe = s->sq[s->sq_head & (URING_SQ_ENTRIES - 1)];
+        __atomic_store_n(&s->sq_head, s->sq_head + 1, __ATOMIC_RELEASE);
+        n++;
+
+        switch(sqe.opcode)
+        {
+            case URING_OP_NOP:
+                post_cqe(ring, sqe.user_data, 0);
+                break;
+            case URING_OP_READ:
+                post_cqe(ring, sqe.user_data, user_range_ok((void *)sqe.addr, sqe.len)
+                    ? fs_read(sqe.fd, (void *)sqe.addr, sqe.len) : -1);
+                break;
+            case URING_OP_BLK_READ:
+            case URING_OP_BLK_WRITE:
+            {
+                struct blk_request *req = prepare_blk(ring, &sqe);
+                if(req)
+                {
+                    batch[nbatch++] = req;
+                }
+                else
+                {
+                    post_cqe(ring, sqe.user_data, -1);
+                }
+                break;
+            }
+            case URING_OP_TIMEOUT:
+                if(!add_timeout(ring, &sqe))
+                {
+                    post_cqe(ring, sqe.user_data, -1);
+                }
+                break;
+            default:
+                post_cqe(ring, sqe.user_data, -1);
+                break;
+        }
+    }
+
+    if(nbatch)
+    {
+        blk_submit(batch, nbatch);
+    }
+    uring_timer_tick();     // timeouts of 0 complete right away
+    return n;
+}
+
+/*
+    SYS_URING_ENTER: consume up to to_submit submissions, then wait until at least min_complete completions are
+    ready to be reaped. Does not wait for completions that can never come.
+    returns:
+        int: submissions consumed, -1 if the process has no rings
+*/
+int uring_sys_enter(uint32_t to_submit, uint32_t min_complete)
+{
+    struct uring *ring = current_proc->uring;
+    if(!ring)
+    {
+        return -1;
+    }
+    int n = submit(ring, to_submit);
+
+    uint32_t sie = irq_save();
+    while(cq_ready(ring) < min_complete && ring->inflight)
+    {
+        wait_queue_sleep(&ring->wq);    // block completions and uring_timer_tick() wake us
+    }
+    irq_restore(sie);
+    return n;
+}
+
+//pick up the submissions of a URING_SETUP_POLL ring, called when its process is interrupted in user mode
+void uring_poll(struct process *proc)
+{
+    struct uring *ring = proc->uring;
+    if(!ring || !(ring->shared->flags & URING_SETUP_POLL))
+    {
+        return;
+    }
+    //like a system call: the trap frame holds sepc and sstatus, submitting may sleep for descriptors
+    __asm__ __volatile__("csrsi sstatus, 2");
+    submit(ring, URING_SQ_ENTRIES);
+}
+
+//true while the device may access pages of proc by physical address
+bool uring_pins_pages(struct process *proc)
+{
+    return proc->uring && proc->uring->pinned;
+}
+
+//sleep until no block request of proc accesses [va, va + len), so the frames can be freed
+void uring_wait_unpinned(struct process *proc, vaddr_t va, uint32_t len)
+{
+    struct uring *ring = proc->uring;
+    if(!ring)
+    {
+        return;
+    }
+    uint32_t sie = irq_save();
+    for(int i = 0; i < URING_MAX_BLK; )
+    {
+        struct uring_blk *b = &ring->blk[i];
+        if(b->busy && b->addr < va + len && va < b->addr + b->len)
+        {
+            wait_queue_sleep(&ring->wq);    // every completion wakes it, then look again from the start
+            i = 0;
+        }
+        else
+        {
+            i++;
+        }
+    }
+    irq_restore(sie);
+}
+
+//free the rings of proc once the device is done with its buffers, on exit and exec
+void uring_exit(struct process *proc)
+{
+    struct uring *ring = proc->uring;
+    if(!ring)
+    {
+        return;
+    }
+    //every block request posts a completion, which wakes ring->wq
+    uint32_t sie = irq_save();
+    while(ring->inflight > ring->ntimeouts)
+    {
+        wait_queue_sleep(&ring->wq);
+    }
+    //timeouts still pending are dropped with the ring
+    if(ring->ntimeouts)
+    {
+        timer_unlink(ring);
+        update_deadline();
+    }
+    irq_restore(sie);
+    vm_unmap(proc, ring->user_addr, PAGE_SIZE);
+    free(ring->shared);
+    free(ring);
+    proc->uring = NULL;
+}
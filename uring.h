@@ -0,0 +1,98 @@
+#pragma once
+#include "common.h"
+
+/*
+    Submission/completion rings shared by a process and the kernel (SYS_URING_SETUP / SYS_URING_ENTER).
+    The rings live in one page that is mapped into the process and accessed by the kernel through its physical
+    address. The process fills submission queue entries and moves sq_tail; the kernel consumes them from sq_head and
+    appends a completion for each to the completion queue, which the process reaps by moving cq_head, without a
+    system call. Indices run freely and are masked on access.
+    Submissions are picked up by uring_enter(), or, for a ring created with URING_SETUP_POLL, whenever the kernel
+    interrupts the process in user mode (timer ticks, page faults, any system call).
+*/
+#define URING_SQ_ENTRIES    64          // power of 2
+#define URING_CQ_ENTRIES    128         // power of 2, room for every submission and every request in flight
+
+#define URING_SETUP_POLL    (1 << 0)    // the kernel picks up submissions without uring_enter()
+
+#define URING_OP_NOP        0
+#define URING_OP_READ       1           // fs read: fd, addr, len
+#define URING_OP_BLK_READ   2           // block device read: off = first sector, addr (sector aligned), len
+#define URING_OP_BLK_WRITE  3
+#define URING_OP_TIMEOUT    4           // completes off microseconds after it was picked up
+
+//submission queue entry
+struct uring_sqe
+{
+    uint8_t opcode;
+    uint8_t reserved[3];
+    int fd;
+    uint32_t off;
+    uint32_t addr;
+    uint32_t len;
+    uint32_t user_data;                 // copied into the completion
+};
+
+//completion queue entry
+struct uring_cqe
+{
+    uint32_t user_data;
+    int res;                            // bytes transferred or 0 on success, -1 on error
+};
+
+//the shared page
+struct uring_shared
+{
+    uint32_t sq_head;                   // written by the kernel
+    uint32_t sq_tail;                   // written by the process
+    uint32_t cq_head;                   // written by the process
+    uint32_t cq_tail;                   // written by the kernel
+    uint32_t flags;                     // URING_SETUP_*
+    uint32_t reserved[3];
+    struct uring_sqe sq[URING_SQ_ENTRIES];
+    struct uring_cqe cq[URING_CQ_ENTRIES];
+};
+
+//next free submission entry, NULL if the queue is full. Nothing is visible to the kernel before uring_sq_push().
+static inline struct uring_sqe *uring_sqe_next(struct uring_shared *r, uint32_t queued)
+{
+    uint32_t tail = r->sq_tail + queued;
+    if(tail - __atomic_load_n(&r->sq_head, __ATOMIC_ACQUIRE) >= URING_SQ_ENTRIES)
+    {
+        return NULL;
+    }
+    return &r->sq[tail & (URING_SQ_ENTRIES - 1)];
+}
+
+//publish n entries filled in through uring_sqe_next()
+static inline void uring_sq_push(struct uring_shared *r, uint32_t n)
+{
+    __atomic_store_n(&r->sq_tail, r->sq_tail + n, __ATOMIC_RELEASE);
+}
+
+//oldest completion not reaped yet, NULL if there is none
+static inline struct uring_cqe *uring_cqe_peek(struct uring_shared *r)
+{
+    if(r->cq_head == __atomic_load_n(&r->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    return &r->cq[r->cq_head & (URING_CQ_ENTRIES - 1)];
+}
+
+//release the completion returned by uring_cqe_peek()
+static inline void uring_cq_advance(struct uring_shared *r)
+{
+    __atomic_store_n(&r->cq_head, r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+//kernel side, uring.c
+struct process;
+vaddr_t uring_sys_setup(uint32_t flags);
+int uring_sys_enter(uint32_t to_submit, uint32_t min_complete);
+void uring_poll(struct process *proc);
+bool uring_pins_pages(struct process *proc);
+void uring_wait_unpinned(struct process *proc, vaddr_t va, uint32_t len);
+void uring_exit(struct process *proc);
+uint64_t uring_next_timeout(void);
+void uring_timer_tick(void);
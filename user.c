@@ -0,0 +1,179 @@
+#include "user.h"
+
+int main(void);
+
+//a7 = system call number, a0..a3 = arguments, the result comes back in a0
+int syscall(int sysno, int arg0, int arg1, int arg2, int arg3)
+{
+    register int a0 __asm__("a0") = arg0;
+    register int a1 __asm__("a1") = arg1;
+    register int a2 __asm__("a2") = arg2;
+    register int a3 __asm__("a3") = arg3;
+    register int a7 __asm__("a7") = sysno;
+
+    __asm__ __volatile__("ecall"
+                         : "=r"(a0)
+                         : "r"(a0), "r"(a1), "r"(a2), "r"(a3), "r"(a7)
+                         : "memory");
+    return a0;
+}
+
+void putchar(char ch)
+{
+    syscall(SYS_PUTCHAR, ch, 0, 0, 0);
+}
+
+__attribute__((noreturn)) void exit(void)
+{
+    syscall(SYS_EXIT, 0, 0, 0, 0);
+    for(;;);
+}
+
+void yield(void)
+{
+    syscall(SYS_YIELD, 0, 0, 0, 0);
+}
+
+//read from the vDSO page, no system call
+int getpid(void)
+{
+    return vdso_page->pid;
+}
+
+//flags is O_RDONLY or O_WRONLY
+int open(const char *path, int flags)
+{
+    return syscall(SYS_OPEN, (int)path, flags, 0, 0);
+}
+
+int read(int fd, void *buf, uint32_t len)
+{
+    return syscall(SYS_READ, fd, (int)buf, len, 0);
+}
+
+int write(int fd, const void *buf, uint32_t len)
+{
+    return syscall(SYS_WRITE, fd, (int)buf, len, 0);
+}
+
+//fds[0] is the read end, fds[1] the write end
+int pipe(int fds[2])
+{
+    return syscall(SYS_PIPE, (int)fds, 0, 0, 0);
+}
+
+//move len bytes between a pipe and another descriptor without copying them through user space
+int splice(int fd_in, int fd_out, uint32_t len)
+{
+    return syscall(SYS_SPLICE, fd_in, fd_out, len, 0);
+}
+
+//a new epoll descriptor, see epoll.h
+int epoll_create(void)
+{
+    return syscall(SYS_EPOLL_CREATE, 0, 0, 0, 0);
+}
+
+//op is EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL; ev may be NULL for EPOLL_CTL_DEL
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *ev)
+{
+    return syscall(SYS_EPOLL_CTL, epfd, op, fd, (int)ev);
+}
+
+//sleep until a watched descriptor is ready (or not at all with EPOLL_NOWAIT), returns the number of events
+int epoll_wait(int epfd, struct epoll_event *events, int max, int flags)
+{
+    return syscall(SYS_EPOLL_WAIT, epfd, (int)events, max, flags);
+}
+
+int close(int fd)
+{
+    return syscall(SYS_CLOSE, fd, 0, 0, 0);
+}
+
+void *mmap(int fd, uint32_t offset, uint32_t len, int prot)
+{
+    return (void *)syscall(SYS_MMAP, fd, offset, len, prot);
+}
+
+void munmap(void *addr, uint32_t len)
+{
+    syscall(SYS_MUNMAP, (int)addr, len, 0, 0);
+}
+
+//scheduler state of process pid, -1 if there is no such process
+int proc_stat(int pid, struct proc_stat *st)
+{
+    return syscall(SYS_PROC_STAT, pid, (int)st, 0, 0);
+}
+
+//move the end of the heap by incr bytes (whole pages), returns the old end or NULL
+void *sbrk(int incr)
+{
+    return (void *)syscall(SYS_SBRK, incr, 0, 0, 0);
+}
+
+//map the submission and completion rings, NULL on failure
+struct uring_shared *uring_setup(uint32_t flags)
+{
+    return (struct uring_shared *)syscall(SYS_URING_SETUP, flags, 0, 0, 0);
+}
+
+//submit up to to_submit queued entries and wait for min_complete completions
+int uring_enter(uint32_t to_submit, uint32_t min_complete)
+{
+    return syscall(SYS_URING_ENTER, to_submit, min_complete, 0, 0);
+}
+
+//n / d without a 64-bit division, which the freestanding build has no runtime support for
+static uint64_t div64_32(uint64_t n, uint32_t d)
+{
+    uint32_t hi = (uint32_t)(n >> 32);
+    uint32_t lo = (uint32_t)n;
+    uint32_t q_hi = hi / d;
+    uint32_t r = hi % d;
+    uint32_t q_lo = 0;
+    for(int bit = 31; bit >= 0; bit--)
+    {
+        uint32_t carry = r >> 31;
+        r = (r << 1) | ((lo >> bit) & 1);
+        q_lo <<= 1;
+        if(carry || r >= d)
+        {
+            r -= d;
+            q_lo |= 1;
+        }
+    }
+    return ((uint64_t)q_hi << 32) | q_lo;
+}
+
+//microseconds since the kernel started, without a system call
+uint64_t uptime_us(void)
+{
+    return div64_32(vdso_time() - vdso_page->boot_time, vdso_page->ticks_per_us);
+}
+
+//CPU time of the calling process in microseconds, without a system call
+uint64_t cpu_time_us(void)
+{
+    uint64_t now = vdso_time();
+    uint32_t seq;
+    uint64_t ticks;
+    do
+    {
+        seq = vdso_read_begin(vdso_page);
+        ticks = vdso_page->runtime + (now > vdso_page->exec_start ? now - vdso_page->exec_start : 0);
+    } while(vdso_read_retry(vdso_page, seq));
+    return div64_32(ticks, vdso_page->ticks_per_us);
+}
+
+//entry point, the kernel starts us with sp at the top of the user stack
+__attribute__((section(".text.start")))
+__attribute__((naked))
+void start(void)
+{
+    __asm__ __volatile__(
+        "call main\n"
+        "call exit\n"
+    );
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include "common.h"
+#include "uring.h"
+#include "vdso.h"
+#include "malloc.h"
+#include "epoll.h"
+
+/*
+    User library: system call wrappers for programs loaded from the initrd by exec().
+    Programs define main(); start() in user.c calls it and exits with its return value ignored.
+*/
+void putchar(char ch);
+__attribute__((noreturn)) void exit(void);
+void yield(void);
+int getpid(void);
+int proc_stat(int pid, struct proc_stat *st);
+int open(const char *path, int flags);
+int read(int fd, void *buf, uint32_t len);
+int write(int fd, const void *buf, uint32_t len);
+int pipe(int fds[2]);
+int splice(int fd_in, int fd_out, uint32_t len);
+int epoll_create(void);
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *ev);
+int epoll_wait(int epfd, struct epoll_event *events, int max, int flags);
+int close(int fd);
+void *mmap(int fd, uint32_t offset, uint32_t len, int prot);
+void munmap(void *addr, uint32_t len);
+void *sbrk(int incr);
+struct uring_shared *uring_setup(uint32_t flags);
+int uring_enter(uint32_t to_submit, uint32_t min_complete);
+uint64_t uptime_us(void);
+uint64_t cpu_time_us(void);
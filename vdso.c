@@ -0,0 +1,81 @@
+#include "vdso.h"
+#include "kernel.h"
+#include "vm.h"
+
+#define SCOUNTEREN_TM       (1u << 1)   // user mode may read the time CSR
+
+static uint64_t boot_time64;            // time CSR value when boot() ran
+static uint32_t vdso_flags;
+
+//let user mode read the time CSR on this hart; OpenSBI has already opened it to S-mode
+void vdso_init_hart(void)
+{
+    __asm__ __volatile__("csrs scounteren, %0" :: "r"(SCOUNTEREN_TM));
+}
+
+/*
+    Record the clock calibration for the pages of all processes. Called on the boot hart once the timebase is known.
+    Parameters:
+        uint32_t boot_time: low half of the time CSR when boot() ran
+*/
+void vdso_init(uint32_t boot_time)
+{
+    uint64_t now = read_time();
+    boot_time64 = now - (uint32_t)((uint32_t)now - boot_time);
+    vdso_init_hart();
+    //scounteren.TM is WARL, it stays 0 where the time CSR cannot be exposed
+    if(READ_CSR(scounteren) & SCOUNTEREN_TM)
+    {
+        vdso_flags |= VDSO_TIME_CSR;
+    }
+}
+
+/*
+    Give proc its data page, mapped read-only at VDSO_ADDR. The mapping does not own the frame: munmap() of
+    VDSO_ADDR only takes the page away from the process, vdso_update() keeps writing it and vm_free() frees it.
+    Parameters:
+        struct process *proc: process whose private root table was just created
+        uint32_t *table: that table
+*/
+void vdso_map(struct process *proc, uint32_t *table)
+{
+    struct vdso_data *v = alloc_pages(1);
+    memset(v, 0, PAGE_SIZE);
+    v->flags = vdso_flags;
+    v->timebase_freq = timebase_freq;
+    v->ticks_per_us = ticks_per_us();
+    v->boot_time = boot_time64;
+    v->pid = proc->pid;
+    v->runtime = proc->sum_exec_runtime;
+    v->exec_start = proc->exec_start;
+    v->now = read_time();
+    map_page(table, VDSO_ADDR, (paddr_t)v, PAGE_U | PAGE_R);
+    proc->vdso = v;
+}
+
+/*
+    Rewrite the scheduler's view of proc in its page. Only the hart proc runs on writes it; readers retry around it.
+    Parameters:
+        struct process *proc: process running, or about to run, on this hart
+        uint64_t now: time CSR value proc was last charged at
+        uint64_t slice_end: end of its current time slice
+        uint32_t event: VDSO_EV_SWITCH when proc is switched in, VDSO_EV_TICK on a timer tick, else VDSO_EV_NONE
+*/
+void vdso_update(struct process *proc, uint64_t now, uint64_t slice_end, uint32_t event)
+{
+    struct vdso_data *v = proc->vdso;
+    if(!v)
+    {
+        return;     // no address space of its own
+    }
+    __atomic_store_n(&v->seq, v->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);    // the odd count is visible before any field changes
+    v->now = now;
+    v->slice_end = slice_end;
+    v->runtime = proc->sum_exec_runtime;
+    v->exec_start = proc->exec_start;
+    v->cpu = this_hart();
+    v->switches += event == VDSO_EV_SWITCH;
+    v->ticks += event == VDSO_EV_TICK;
+    __atomic_store_n(&v->seq, v->seq + 1, __ATOMIC_RELEASE);
+}
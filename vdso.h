@@ -0,0 +1,102 @@
+#pragma once
+#include "common.h"
+
+/*
+    Kernel data page, mapped read-only at VDSO_ADDR into every process with an address space of its own.
+    It holds the clock calibration and what the scheduler knows about the process, so a program can read the
+    time, its pid and its CPU time without a system call. Each process has its own page; the kernel rewrites it
+    when it switches the process in and on every timer tick while it runs, bracketed by a sequence counter:
+    seq is odd during an update, and a reader retries when seq changed under it (vdso_read_begin/retry()).
+    The time itself comes from the time CSR when the kernel lets user mode read it (VDSO_TIME_CSR), otherwise
+    from the page, as of the last update.
+*/
+#define VDSO_ADDR           0x7ffef000  // USER_STACK_TOP - USER_STACK_SIZE - PAGE_SIZE, between mmap area and stack
+#define VDSO_TIME_CSR       (1 << 0)    // rdtime works in user mode
+
+//the shared page
+struct vdso_data
+{
+    uint32_t seq;                       // odd while the kernel updates the page
+    uint32_t flags;                     // VDSO_*
+    uint32_t timebase_freq;             // time CSR ticks per second
+    uint32_t ticks_per_us;              // timebase_freq / 1000000, at least 1
+    uint64_t boot_time;                 // time CSR value when the kernel was entered
+    uint64_t now;                       // time CSR value at the last update
+    uint64_t slice_end;                 // time CSR value at which the current time slice ends
+    uint64_t runtime;                   // CPU time of the process up to exec_start, in time CSR ticks
+    uint64_t exec_start;                // time CSR value since which the process runs uncharged
+    int pid;
+    uint32_t cpu;                       // hart the process runs on
+    uint32_t switches;                  // times the process was switched in
+    uint32_t ticks;                     // timer interrupts taken while it ran
+};
+
+#define vdso_page           ((const struct vdso_data *)VDSO_ADDR)
+
+//start reading the page; returns the sequence number to hand to vdso_read_retry()
+static inline uint32_t vdso_read_begin(const struct vdso_data *v)
+{
+    uint32_t seq;
+    while((seq = __atomic_load_n(&v->seq, __ATOMIC_ACQUIRE)) & 1)
+    {
+    }
+    return seq;
+}
+
+//true if the page changed since vdso_read_begin() and what was read must be read again
+static inline bool vdso_read_retry(const struct vdso_data *v, uint32_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&v->seq, __ATOMIC_RELAXED) != seq;
+}
+
+//consistent copy of the whole page
+static inline void vdso_snapshot(struct vdso_data *out)
+{
+    uint32_t seq;
+    do
+    {
+        seq = vdso_read_begin(vdso_page);
+        *out = *vdso_page;
+    } while(vdso_read_retry(vdso_page, seq));
+}
+
+//the time CSR, the high half read twice so a carry between the two reads is not missed
+static inline uint64_t vdso_rdtime(void)
+{
+    uint32_t hi, lo, hi2;
+    do
+    {
+        __asm__ __volatile__("rdtimeh %0" : "=r"(hi));
+        __asm__ __volatile__("rdtime %0" : "=r"(lo));
+        __asm__ __volatile__("rdtimeh %0" : "=r"(hi2));
+    } while(hi != hi2);
+    return ((uint64_t)hi << 32) | lo;
+}
+
+//current time in time CSR ticks, as of the last kernel update if user mode cannot read the time CSR
+static inline uint64_t vdso_time(void)
+{
+    if(vdso_page->flags & VDSO_TIME_CSR)
+    {
+        return vdso_rdtime();
+    }
+    uint32_t seq;
+    uint64_t now;
+    do
+    {
+        seq = vdso_read_begin(vdso_page);
+        now = vdso_page->now;
+    } while(vdso_read_retry(vdso_page, seq));
+    return now;
+}
+
+//kernel side, vdso.c
+#define VDSO_EV_NONE        0           // vdso_update() events, counted in the page
+#define VDSO_EV_SWITCH      1
+#define VDSO_EV_TICK        2
+struct process;
+void vdso_init(uint32_t boot_time);
+void vdso_init_hart(void);
+void vdso_map(struct process *proc, uint32_t *table);
+void vdso_update(struct process *proc, uint64_t now, uint64_t slice_end, uint32_t event);
@@ -0,0 +1,399 @@
+#include "virtio.h"
+#include "plic.h"
+#include "softirq.h"
+
+static paddr_t blk_base = 0;        // MMIO base of the virtio-blk device, 0 if there is no disk
+static struct virtq_desc *desc;     // descriptor table
+static struct virtq_avail *avail;   // driver -> device ring
+static struct virtq_used *used;     // device -> driver ring
+static uint16_t free_head;          // first descriptor of the free list (chained through next)
+static int num_free;                // descriptors on the free list
+static uint16_t last_used;          // next used ring entry to reap
+static struct blk_request *inflight[VIRTQ_SIZE];   // request owning each chain, indexed by head descriptor
+static struct wait_queue desc_wq;   // submitters waiting for free descriptors
+static uint64_t capacity;           // disk size in sectors
+static struct blk_stats stats;
+
+static uint32_t virtio_reg_read(uint32_t offset)
+{
+    return *((volatile uint32_t *)(blk_base + offset));
+}
+
+static void virtio_reg_write(uint32_t offset, uint32_t value)
+{
+    *((volatile uint32_t *)(blk_base + offset)) = value;
+}
+
+static uint16_t alloc_desc(void)
+{
+    uint16_t d = free_head;
+    free_head = desc[d].next;
+    num_free--;
+    return d;
+}
+
+//return a whole descriptor chain to the free list
+static void free_chain(uint16_t head)
+{
+    uint16_t d = head;
+    while(1)
+    {
+        uint16_t flags = desc[d].flags;
+        uint16_t next = desc[d].next;
+        desc[d].next = free_head;
+        free_head = d;
+        num_free++;
+        if(!(flags & VIRTQ_DESC_F_NEXT))
+        {
+            break;
+        }
+        d = next;
+    }
+}
+
+//make the chains queued up to idx visible to the device and ring the doorbell once for all of them
+static void publish(uint16_t idx)
+{
+    __sync_synchronize();   // descriptors and ring entries before the index
+    avail->idx = idx;
+    __sync_synchronize();   // index before the notify
+    if(!(*(volatile uint16_t *)&used->flags & VIRTQ_USED_F_NO_NOTIFY))
+    {
+        virtio_reg_write(VIRTIO_REG_QUEUE_NOTIFY, 0);
+        stats.notifies++;
+    }
+}
+
+//bottom half of the completion interrupt: reap the used ring, free the descriptors and complete the requests
+static void virtio_blk_complete(struct work *w)
+{
+    (void)w;
+    //submitters take the ring with interrupts masked; bottom halves are never preempted, so nobody else is inside
+    bool freed = false;
+    while(last_used != *(volatile uint16_t *)&used->idx)
+    {
+        __sync_synchronize();   // read the entry only after seeing the index
+        struct virtq_used_elem *e = &used->ring[last_used % VIRTQ_SIZE];
+        struct blk_request *req = inflight[e->id];
+        inflight[e->id] = NULL;
+        free_chain(e->id);
+        last_used++;
+        freed = true;
+
+        stats.completions++;
+        req->done = true;
+        if(req->complete)
+        {
+            req->complete(req);
+        }
+        else
+        {
+            wait_queue_wake_all(&req->wq);
+        }
+    }
+
+    if(freed)
+    {
+        wait_queue_wake_all(&desc_wq);
+    }
+}
+
+static struct work complete_work = WORK_INIT(virtio_blk_complete);
+
+//completion interrupt: acknowledge it and leave the ring to the bottom half
+static void virtio_blk_irq(void *arg)
+{
+    (void)arg;
+    virtio_reg_write(VIRTIO_REG_INTERRUPT_ACK, virtio_reg_read(VIRTIO_REG_INTERRUPT_STATUS) & 3);
+    stats.interrupts++;
+    softirq_raise(&complete_work);
+}
+
+/*
+    Find the virtio-blk device among the virtio-mmio slots, negotiate features and set up its request queue.
+    returns:
+        int: 0 on success, -1 if there is no usable block device
+*/
+int virtio_blk_init(void)
+{
+    uint32_t slot;
+    for(slot = 0; slot < platform.nr_virtio; slot++)
+    {
+        blk_base = platform.virtio[slot].base;
+        if(virtio_reg_read(VIRTIO_REG_MAGIC) == VIRTIO_MAGIC && virtio_reg_read(VIRTIO_REG_VERSION) == 2
+            && virtio_reg_read(VIRTIO_REG_DEVICE_ID) == VIRTIO_DEVICE_BLK)
+        {
+            break;
+        }
+    }
+    if(slot == platform.nr_virtio)
+    {
+        blk_base = 0;
+        printf("virtio-blk: no device\n");
+        return -1;
+    }
+
+    //reset, then acknowledge the device and tell it we have a driver
+    uint32_t status = 0;
+    virtio_reg_write(VIRTIO_REG_STATUS, status);
+    status |= VIRTIO_STATUS_ACK;
+    virtio_reg_write(VIRTIO_REG_STATUS, status);
+    status |= VIRTIO_STATUS_DRIVER;
+    virtio_reg_write(VIRTIO_REG_STATUS, status);
+
+    //only VIRTIO_F_VERSION_1 is needed: requests are plain header + data segments + status
+    virtio_reg_write(VIRTIO_REG_DEVICE_FEATURES_SEL, 1);
+    if(!(virtio_reg_read(VIRTIO_REG_DEVICE_FEATURES) & VIRTIO_F_VERSION_1))
+    {
+        virtio_reg_write(VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+        blk_base = 0;
+        return -1;
+    }
+    virtio_reg_write(VIRTIO_REG_DRIVER_FEATURES_SEL, 0);
+    virtio_reg_write(VIRTIO_REG_DRIVER_FEATURES, 0);
+    virtio_reg_write(VIRTIO_REG_DRIVER_FEATURES_SEL, 1);
+    virtio_reg_write(VIRTIO_REG_DRIVER_FEATURES, VIRTIO_F_VERSION_1);
+    status |= VIRTIO_STATUS_FEATURES_OK;
+    virtio_reg_write(VIRTIO_REG_STATUS, status);
+    if(!(virtio_reg_read(VIRTIO_REG_STATUS) & VIRTIO_STATUS_FEATURES_OK))
+    {
+        virtio_reg_write(VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+        blk_base = 0;
+        return -1;
+    }
+
+    //queue 0: descriptor table, available ring and used ring share one page
+    virtio_reg_write(VIRTIO_REG_QUEUE_SEL, 0);
+    if(virtio_reg_read(VIRTIO_REG_QUEUE_NUM_MAX) < VIRTQ_SIZE)
+    {
+        PANIC("virtio-blk: queue too small");
+    }
+    virtio_reg_write(VIRTIO_REG_QUEUE_NUM, VIRTQ_SIZE);
+
+    uint8_t *page = alloc_pages(1);
+    memset(page, 0, PAGE_SIZE);
+    desc = (struct virtq_desc *)page;
+    avail = (struct virtq_avail *)(page + sizeof(struct virtq_desc) * VIRTQ_SIZE);
+    used = (struct virtq_used *)(page + PAGE_SIZE / 2);
+    virtio_reg_write(VIRTIO_REG_QUEUE_DESC_LOW, (uint32_t)desc);
+    virtio_reg_write(VIRTIO_REG_QUEUE_DESC_HIGH, 0);
+    virtio_reg_write(VIRTIO_REG_QUEUE_AVAIL_LOW, (uint32_t)avail);
+    virtio_reg_write(VIRTIO_REG_QUEUE_AVAIL_HIGH, 0);
+    virtio_reg_write(VIRTIO_REG_QUEUE_USED_LOW, (uint32_t)used);
+    virtio_reg_write(VIRTIO_REG_QUEUE_USED_HIGH, 0);
+
+    for(int i = 0; i < VIRTQ_SIZE; i++)
+    {
+        desc[i].next = i + 1;
+    }
+    free_head = 0;
+    num_free = VIRTQ_SIZE;
+    last_used = 0;
+    virtio_reg_write(VIRTIO_REG_QUEUE_READY, 1);
+
+    capacity = virtio_reg_read(VIRTIO_REG_CONFIG) | ((uint64_t)virtio_reg_read(VIRTIO_REG_CONFIG + 4) << 32);
+
+    plic_register(platform.virtio[slot].irq, virtio_blk_irq, NULL);
+
+    status |= VIRTIO_STATUS_DRIVER_OK;
+    virtio_reg_write(VIRTIO_REG_STATUS, status);
+    printf("virtio-blk: %x irq %d, %d sectors\n", blk_base, platform.virtio[slot].irq, (uint32_t)capacity);
+    return 0;
+}
+
+//disk size in sectors, 0 if there is no disk
+uint64_t blk_capacity(void)
+{
+    return blk_base ? capacity : 0;
+}
+
+/*
+    Queue a batch of requests and notify the device once for the whole batch. Each request becomes a
+    descriptor chain: header, one descriptor per data segment, status byte.
+    If the ring is full, what has been queued so far is published and the caller sleeps until
+    completions free enough descriptors. Completion is signalled through blk_wait() or req->complete.
+    Parameters:
+        struct blk_request **reqs: requests to submit
+        int n: number of requests
+*/
+void blk_submit(struct blk_request **reqs, int n)
+{
+    uint32_t sie = irq_save();
+    uint16_t idx = blk_base ? avail->idx : 0;
+    int queued = 0;
+
+    for(int i = 0; i < n; i++)
+    {
+        struct blk_request *req = reqs[i];
+        req->done = false;
+        req->status = BLK_PENDING;
+        if(!blk_base || req->nsg < 1 || req->nsg > BLK_MAX_SG)
+        {
+            req->status = BLK_IOERR;
+            req->done = true;
+            if(req->complete)
+            {
+                req->complete(req);
+            }
+            continue;
+        }
+
+        while(num_free < req->nsg + 2)
+        {
+            if(queued)
+            {
+                //let the device work on what we have while we wait for descriptors
+                publish(idx);
+                queued = 0;
+            }
+            wait_queue_sleep(&desc_wq);
+            idx = avail->idx;
+        }
+
+        req->hdr.type = req->type;
+        req->hdr.reserved = 0;
+        req->hdr.sector = req->sector;
+
+        uint16_t head = alloc_desc();
+        uint16_t d = head;
+        desc[d].addr = (uint32_t)&req->hdr;
+        desc[d].len = sizeof(req->hdr);
+        desc[d].flags = VIRTQ_DESC_F_NEXT;
+
+        for(int s = 0; s < req->nsg; s++)
+        {
+            uint16_t next = alloc_desc();
+            desc[d].next = next;
+            d = next;
+            desc[d].addr = (uint32_t)req->sg[s].addr;
+            desc[d].len = req->sg[s].len;
+            desc[d].flags = VIRTQ_DESC_F_NEXT | (req->type == BLK_READ ? VIRTQ_DESC_F_WRITE : 0);
+        }
+
+        uint16_t next = alloc_desc();
+        desc[d].next = next;
+        d = next;
+        desc[d].addr = (uint32_t)&req->status;
+        desc[d].len = 1;
+        desc[d].flags = VIRTQ_DESC_F_WRITE;
+
+        inflight[head] = req;
+        avail->ring[idx % VIRTQ_SIZE] = head;
+        idx++;
+        queued++;
+        stats.requests++;
+    }
+
+    if(queued)
+    {
+        publish(idx);
+    }
+    irq_restore(sie);
+}
+
+//sleep until a submitted request has completed
+void blk_wait(struct blk_request *req)
+{
+    uint32_t sie = irq_save();
+    while(!req->done)
+    {
+        wait_queue_sleep(&req->wq);
+    }
+    irq_restore(sie);
+}
+
+/*
+    Synchronous read or write of a contiguous buffer.
+    Parameters:
+        uint32_t type: BLK_READ or BLK_WRITE
+        uint64_t sector: first sector
+        void *buf: data buffer
+        uint32_t len: bytes to transfer, a multiple of SECTOR_SIZE
+    returns:
+        int: 0 on success, -1 on an I/O error
+*/
+int blk_rw(uint32_t type, uint64_t sector, void *buf, uint32_t len)
+{
+    struct blk_request req;
+    memset(&req, 0, sizeof(req));
+    req.type = type;
+    req.sector = sector;
+    req.sg[0].addr = buf;
+    req.sg[0].len = len;
+    req.nsg = 1;
+
+    struct blk_request *reqs[1] = { &req };
+    blk_submit(reqs, 1);
+    blk_wait(&req);
+    return req.status == BLK_OK ? 0 : -1;
+}
+
+void blk_get_stats(struct blk_stats *out)
+{
+    uint32_t sie = irq_save();
+    *out = stats;
+    irq_restore(sie);
+}
+
+#ifdef BENCHMARK
+#define BENCH_BATCH     8       // requests per doorbell
+#define BENCH_SEGMENTS  4       // one page per scatter-gather segment
+
+//sequential read throughput of the whole disk image, BENCH_BATCH requests of BENCH_SEGMENTS pages per notify
+void virtio_blk_bench(void)
+{
+    static struct blk_request reqs[BENCH_BATCH];
+    struct blk_request *batch[BENCH_BATCH];
+    uint8_t *buf = alloc_pages(BENCH_BATCH * BENCH_SEGMENTS);
+    uint32_t sectors_per_req = BENCH_SEGMENTS * PAGE_SIZE / SECTOR_SIZE;
+    uint64_t total = blk_capacity();
+    if(!total)
+    {
+        printf("blk bench: no disk\n");
+        return;
+    }
+
+    struct blk_stats before;
+    blk_get_stats(&before);
+    uint64_t start = read_time();
+    uint64_t sector = 0;
+    uint32_t kib = 0;
+    while(sector + sectors_per_req <= total)
+    {
+        int n = 0;
+        for(; n < BENCH_BATCH && sector + sectors_per_req <= total; n++)
+        {
+            struct blk_request *req = &reqs[n];
+            memset(req, 0, sizeof(*req));
+            req->type = BLK_READ;
+            req->sector = sector;
+            for(int s = 0; s < BENCH_SEGMENTS; s++)
+            {
+                req->sg[s].addr = buf + (n * BENCH_SEGMENTS + s) * PAGE_SIZE;
+                req->sg[s].len = PAGE_SIZE;
+            }
+            req->nsg = BENCH_SEGMENTS;
+            batch[n] = req;
+            sector += sectors_per_req;
+        }
+
+        blk_submit(batch, n);
+        for(int i = 0; i < n; i++)
+        {
+            blk_wait(batch[i]);
+            if(batch[i]->status != BLK_OK)
+            {
+                PANIC("blk bench: read error at sector %d", (uint32_t)batch[i]->sector);
+            }
+        }
+        kib += n * BENCH_SEGMENTS * PAGE_SIZE / 1024;
+    }
+
+    uint32_t ms = (uint32_t)(read_time() - start) / (timebase_freq / 1000);
+    struct blk_stats after;
+    blk_get_stats(&after);
+    printf("blk bench: %d KiB in %d ms, %d KiB/s\n", kib, ms, ms ? kib * 1000 / ms : 0);
+    printf("blk bench: %d requests, %d notifies, %d interrupts\n", after.requests - before.requests,
+        after.notifies - before.notifies, after.interrupts - before.interrupts);
+}
+#endif
@@ -0,0 +1,130 @@
+#pragma once
+#include "kernel.h"
+
+//virtio-mmio transport (virtio 1.x "modern" register layout, QEMU needs -global virtio-mmio.force-legacy=false)
+//The transports and their interrupts are listed in platform.virtio[] by fdt_probe().
+#define VIRTIO_REG_MAGIC            0x000   // "virt"
+#define VIRTIO_REG_VERSION          0x004   // 2 for the modern interface
+#define VIRTIO_REG_DEVICE_ID        0x008   // 2 = block device
+#define VIRTIO_REG_DEVICE_FEATURES  0x010
+#define VIRTIO_REG_DEVICE_FEATURES_SEL 0x014
+#define VIRTIO_REG_DRIVER_FEATURES  0x020
+#define VIRTIO_REG_DRIVER_FEATURES_SEL 0x024
+#define VIRTIO_REG_QUEUE_SEL        0x030
+#define VIRTIO_REG_QUEUE_NUM_MAX    0x034
+#define VIRTIO_REG_QUEUE_NUM        0x038
+#define VIRTIO_REG_QUEUE_READY      0x044
+#define VIRTIO_REG_QUEUE_NOTIFY     0x050
+#define VIRTIO_REG_INTERRUPT_STATUS 0x060
+#define VIRTIO_REG_INTERRUPT_ACK    0x064
+#define VIRTIO_REG_STATUS           0x070
+#define VIRTIO_REG_QUEUE_DESC_LOW   0x080
+#define VIRTIO_REG_QUEUE_DESC_HIGH  0x084
+#define VIRTIO_REG_QUEUE_AVAIL_LOW  0x090
+#define VIRTIO_REG_QUEUE_AVAIL_HIGH 0x094
+#define VIRTIO_REG_QUEUE_USED_LOW   0x0a0
+#define VIRTIO_REG_QUEUE_USED_HIGH  0x0a4
+#define VIRTIO_REG_CONFIG           0x100   // device specific configuration (virtio-blk: capacity in sectors)
+
+#define VIRTIO_MAGIC                0x74726976
+#define VIRTIO_DEVICE_BLK           2
+
+#define VIRTIO_STATUS_ACK           1
+#define VIRTIO_STATUS_DRIVER        2
+#define VIRTIO_STATUS_DRIVER_OK     4
+#define VIRTIO_STATUS_FEATURES_OK   8
+#define VIRTIO_STATUS_FAILED        128
+
+#define VIRTIO_F_VERSION_1          (1u << 0)   // feature bit 32, i.e. bit 0 of feature word 1
+
+#define VIRTQ_DESC_F_NEXT           1       // the buffer continues in the descriptor in next
+#define VIRTQ_DESC_F_WRITE          2       // the device writes to this buffer
+#define VIRTQ_USED_F_NO_NOTIFY      1       // the device does not need a notify for new buffers
+#define VIRTQ_SIZE                  64      // descriptors in the request queue
+
+struct virtq_desc
+{
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed));
+
+struct virtq_avail
+{
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[VIRTQ_SIZE];
+} __attribute__((packed));
+
+struct virtq_used_elem
+{
+    uint32_t id;    // head descriptor of the completed chain
+    uint32_t len;
+} __attribute__((packed));
+
+struct virtq_used
+{
+    uint16_t flags;
+    uint16_t idx;
+    struct virtq_used_elem ring[VIRTQ_SIZE];
+} __attribute__((packed));
+
+//virtio-blk request header, read by the device
+struct virtio_blk_outhdr
+{
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} __attribute__((packed));
+
+#define SECTOR_SIZE                 512
+#define BLK_READ                    0       // VIRTIO_BLK_T_IN
+#define BLK_WRITE                   1       // VIRTIO_BLK_T_OUT
+#define BLK_MAX_SG                  8       // data segments per request
+#define BLK_OK                      0
+#define BLK_IOERR                   1
+#define BLK_PENDING                 0xff    // status while the request is in flight
+
+struct blk_sg
+{
+    void *addr;
+    uint32_t len;           // multiple of SECTOR_SIZE
+};
+
+/*
+    One block I/O request. The caller fills type, sector and the scatter-gather list, submits it with
+    blk_submit() and either sleeps in blk_wait() or sets complete to be called from the interrupt handler.
+*/
+struct blk_request
+{
+    uint32_t type;              // BLK_READ or BLK_WRITE
+    uint64_t sector;            // first sector on the disk
+    struct blk_sg sg[BLK_MAX_SG];
+    int nsg;
+    void (*complete)(struct blk_request *req);  // called in interrupt context when done, NULL to wake waiters instead
+    void *private;              // owner data for complete
+    volatile bool done;
+    volatile uint8_t status;    // BLK_OK or a virtio-blk error status, written by the device
+    struct wait_queue wq;       // tasks in blk_wait()
+    struct virtio_blk_outhdr hdr;   // driver private: header read by the device
+};
+
+//counters of the block driver
+struct blk_stats
+{
+    uint32_t requests;          // requests submitted
+    uint32_t notifies;          // doorbell writes (one per submitted batch)
+    uint32_t interrupts;        // completion interrupts taken
+    uint32_t completions;       // requests completed
+};
+
+int virtio_blk_init(void);
+uint64_t blk_capacity(void);
+void blk_submit(struct blk_request **reqs, int n);
+void blk_wait(struct blk_request *req);
+int blk_rw(uint32_t type, uint64_t sector, void *buf, uint32_t len);
+void blk_get_stats(struct blk_stats *stats);
+#ifdef BENCHMARK
+void virtio_blk_bench(void);
+#endif
@@ -0,0 +1,470 @@
+#include "vm.h"
+#include "fdt.h"
+#include "tlb.h"
+#include "zram.h"
+#include "uring.h"
+#include "heap.h"
+
+
+uint32_t *kernel_page_table = NULL;    // root table shared by every process without mappings of its own
+
+//root table that translates for a process
+static uint32_t *table_of(struct process *proc)
+{
+    return proc->page_table ? proc->page_table : kernel_page_table;
+}
+
+static void sfence_vma_all(void)
+{
+    __asm__ __volatile__("sfence.vma" ::: "memory");
+}
+
+/*
+    Identity map [start, end) into the kernel page table with global megapages.
+    All kernel mappings must exist before the first process gets a private root table, which copies them.
+*/
+void vm_map_kernel_range(paddr_t start, paddr_t end, uint32_t flags)
+{
+    if(!kernel_page_table)
+    {
+        kernel_page_table = alloc_pages(1);
+        memset(kernel_page_table, 0, PAGE_SIZE);
+    }
+
+    for(paddr_t pa = start & ~(MEGAPAGE_SIZE - 1); pa < end; pa += MEGAPAGE_SIZE)
+    {
+        //a megapage that is already mapped keeps its permissions (e.g. an initrd inside the kernel RAM)
+        if(!(kernel_page_table[VPN1(pa)] & PAGE_V))
+        {
+            kernel_page_table[VPN1(pa)] = ((pa / PAGE_SIZE) << PTE_PPN_SHIFT) | flags | PAGE_G | PAGE_A | PAGE_D | PAGE_V;
+        }
+        if(pa + MEGAPAGE_SIZE < pa)
+        {
+            break;  // the range ends at the top of the address space
+        }
+    }
+    sfence_vma_all();
+}
+
+//build the kernel address space and turn on paging
+void vm_init(void)
+{
+    //devices and RAM as found by fdt_probe()
+    vm_map_kernel_range(platform.plic.base, platform.plic.base + platform.plic.size, PAGE_R | PAGE_W);
+    vm_map_kernel_range(platform.uart.base, platform.uart.base + platform.uart.size, PAGE_R | PAGE_W);
+    for(uint32_t i = 0; i < platform.nr_virtio; i++)
+    {
+        vm_map_kernel_range(platform.virtio[i].base, platform.virtio[i].base + platform.virtio[i].size, PAGE_R | PAGE_W);
+    }
+    for(uint32_t i = 0; i < platform.nr_memory; i++)
+    {
+        vm_map_kernel_range(platform.memory[i].base, platform.memory[i].end, PAGE_R | PAGE_W | PAGE_X);
+    }
+
+    //the kernel reads and writes user mappings (mmap'd files, later user buffers) directly
+    __asm__ __volatile__("csrs sstatus, %0" :: "r"(SSTATUS_SUM));
+    vm_switch(current_proc);
+    tlb_init();
+}
+
+/*
+    Root table of a process, created on first use as a copy of the kernel root table.
+    returns:
+        uint32_t *: the private root table of proc
+*/
+uint32_t *vm_table_of(struct process *proc)
+{
+    if(!proc->page_table)
+    {
+        uint32_t *table = alloc_pages(1);
+        memcpy(table, kernel_page_table, PAGE_SIZE);
+        proc->page_table = table;
+        vdso_map(proc, table);
+        if(proc == current_proc)
+        {
+            vm_switch(proc);
+        }
+    }
+    return proc->page_table;
+}
+
+//va lies in a kernel megapage; the device ranges (PLIC, UART, virtio) are identity mapped inside the user range
+bool vm_kernel_megapage(vaddr_t va)
+{
+    uint32_t l1 = kernel_page_table ? kernel_page_table[VPN1(va)] : 0;
+    return (l1 & PAGE_V) && (l1 & (PAGE_R | PAGE_W | PAGE_X));
+}
+
+/*
+    Find the leaf entry of va, allocating the second level table if alloc is set.
+    returns:
+        uint32_t *: pointer to the level 0 entry, NULL if there is no second level table and alloc is false,
+        or if va lies in a kernel megapage
+*/
+uint32_t *vm_walk(uint32_t *table, vaddr_t va, bool alloc)
+{
+    uint32_t *l1 = &table[VPN1(va)];
+    if(*l1 & (PAGE_R | PAGE_W | PAGE_X))
+    {
+        return NULL;
+    }
+    if(!(*l1 & PAGE_V))
+    {
+        if(!alloc)
+        {
+            return NULL;
+        }
+        uint32_t *pt = alloc_pages(1);
+        memset(pt, 0, PAGE_SIZE);
+        *l1 = (((paddr_t)pt / PAGE_SIZE) << PTE_PPN_SHIFT) | PAGE_V;
+    }
+    return &((uint32_t *)PTE_PADDR(*l1))[VPN0(va)];
+}
+
+//map the page at va to the frame pa
+void map_page(uint32_t *table, vaddr_t va, paddr_t pa, uint32_t flags)
+{
+    if(!is_aligned(va, PAGE_SIZE) || !is_aligned(pa, PAGE_SIZE))
+    {
+        PANIC("unaligned mapping va=%x pa=%x", va, pa);
+    }
+
+    uint32_t *pte = vm_walk(table, va, true);
+    if(!pte)
+    {
+        PANIC("va %x lies in a kernel megapage", va);
+    }
+    if(*pte & PAGE_V)
+    {
+        PANIC("va %x is already mapped", va);
+    }
+    //A and D are set up front, the hardware is not required to update them
+    *pte = ((pa / PAGE_SIZE) << PTE_PPN_SHIFT) | flags | PAGE_A | PAGE_D | PAGE_V;
+}
+
+//remove the mapping of va; b invalidates it and frees the frame if the mapping owns it
+static void unmap_page(struct tlb_batch *b, uint32_t *table, vaddr_t va)
+{
+    uint32_t *pte = vm_walk(table, va, false);
+    if(pte && (*pte & PAGE_SWAPPED))
+    {
+        zram_free(*pte);    // not in any TLB
+        *pte = 0;
+        return;
+    }
+    if(!pte || !(*pte & PAGE_V))
+    {
+        return;
+    }
+    void *frame = (*pte & PAGE_OWNED) ? (void *)PTE_PADDR(*pte) : NULL;
+    *pte = 0;
+    tlb_batch_add(b, va, frame);
+}
+
+//remove the mappings of the pages in [va, va + len) from proc with a single TLB shootdown
+void vm_unmap(struct process *proc, vaddr_t va, uint32_t len)
+{
+    if(!proc->page_table)
+    {
+        return;
+    }
+    uring_wait_unpinned(proc, va, len);    // the device may still be reading or writing the frames
+    struct tlb_batch b;
+    tlb_batch_init(&b, proc);
+    for(uint32_t off = 0; off < len; off += PAGE_SIZE)
+    {
+        unmap_page(&b, proc->page_table, va + off);
+    }
+    tlb_batch_flush(&b);
+}
+
+/*
+    Reserve len bytes of unused address space in proc for a new mapping.
+    returns:
+        vaddr_t: start of the range, 0 if the mmap area is exhausted
+*/
+vaddr_t vm_reserve(struct process *proc, uint32_t len)
+{
+    if(!proc->mmap_next)
+    {
+        proc->mmap_next = MMAP_BASE;
+    }
+    vaddr_t va = proc->mmap_next;
+    len = align_up(len, PAGE_SIZE);
+    if(len > MMAP_END - va)
+    {
+        return 0;
+    }
+    proc->mmap_next = va + len;
+    return va;
+}
+
+/*
+    mmap(MAP_ANON, ...): map len bytes of zeroed private memory. The frames are allocated right away, like the
+    private pages of fs_mmap(), since a region without a vma cannot be populated on demand. So that a large
+    request fails instead of running the allocator dry, the frames and their second level tables must fit into
+    the free memory beyond the low-water share left to the kernel.
+    returns:
+        vaddr_t: start of the mapping, 0 if the mmap area is exhausted or there is not enough free memory
+*/
+vaddr_t vm_mmap_anon(struct process *proc, uint32_t len, int prot)
+{
+    if(!len)
+    {
+        return 0;
+    }
+    struct heap_stats hs;
+    heap_stats(&hs);
+    uint32_t pages = (len - 1) / PAGE_SIZE + 1;
+    uint32_t reserve = hs.total_pages / HEAP_LOW_WATER;
+    if(hs.free_pages < reserve || pages + pages / 1024 + 1 > hs.free_pages - reserve)
+    {
+        return 0;
+    }
+    vaddr_t va = vm_reserve(proc, len);
+    if(!va)
+    {
+        return 0;
+    }
+    uint32_t *table = vm_table_of(proc);
+    uint32_t flags = PAGE_U | PAGE_R | PAGE_OWNED;
+    flags |= (prot & PROT_WRITE) ? PAGE_W : 0;
+    flags |= (prot & PROT_EXEC) ? PAGE_X : 0;
+    for(uint32_t off = 0; off < len; off += PAGE_SIZE)
+    {
+        uint8_t *page = alloc_pages(1);
+        memset(page, 0, PAGE_SIZE);
+        map_page(table, va + off, (paddr_t)page, flags);
+    }
+    return va;
+}
+
+/*
+    SYS_SBRK: move the end of the heap, an anonymous region right above the ELF segments that is populated on
+    demand like the BSS. Shrinking it frees the pages given back. munmap() of pages inside the heap frees their
+    frames but keeps the range, the pages come back zeroed on the next access.
+    Parameters:
+        struct process *proc: calling process
+        int incr: bytes to add, or to remove if negative, rounded up to whole pages
+    returns:
+        vaddr_t: the previous end of the heap, 0 if it cannot grow or shrink that much
+*/
+vaddr_t vm_sbrk(struct process *proc, int incr)
+{
+    struct vm_area *heap = proc->heap;
+    if(!heap)
+    {
+        vaddr_t start = USER_BASE;
+        for(int i = 0; i < PROC_VMAS; i++)
+        {
+            struct vm_area *vma = &proc->vmas[i];
+            if(!vma->start)
+            {
+                heap = heap ? heap : vma;
+            }
+            else if(vma->end <= MMAP_BASE && vma->end > start)
+            {
+                start = vma->end;
+            }
+        }
+        if(!heap)
+        {
+            return 0;
+        }
+        memset(heap, 0, sizeof(*heap));
+        heap->start = heap->end = start;
+        heap->flags = PAGE_R | PAGE_W;
+        proc->heap = heap;
+    }
+
+    vaddr_t old = heap->end;
+    uint32_t len = align_up(incr < 0 ? -(uint32_t)incr : (uint32_t)incr, PAGE_SIZE);
+    if(incr >= 0)
+    {
+        //below the mmap area, and never across a device megapage inside the user range
+        if(len > MMAP_BASE - old || !user_range_ok((void *)old, len))
+        {
+            return 0;
+        }
+        heap->end = old + len;
+    }
+    else
+    {
+        if(len > old - heap->start)
+        {
+            return 0;
+        }
+        heap->end = old - len;
+        vm_unmap(proc, heap->end, len);
+    }
+    return old;
+}
+
+//load the address space of the next process, called by yield() before the context switch
+void vm_switch(struct process *next)
+{
+    if(!kernel_page_table)
+    {
+        return;     // paging is not on yet
+    }
+    uint32_t satp = SATP_SV32 | (tlb_asid(next) << SATP_ASID_SHIFT) | ((paddr_t)table_of(next) / PAGE_SIZE);
+    if(READ_CSR(satp) != satp)
+    {
+        tlb_switch(next, satp);
+    }
+}
+
+//tear down the private address space of an exiting process
+void vm_free(struct process *proc)
+{
+    uint32_t *table = proc->page_table;
+    if(!table)
+    {
+        memset(proc->vmas, 0, sizeof(proc->vmas));
+        return;
+    }
+
+    tlb_release(proc);
+    proc->page_table = NULL;
+    struct vdso_data *vdso = proc->vdso;   // not owned by its mapping, see vdso_map()
+    proc->vdso = NULL;
+    proc->mmap_next = 0;
+    proc->heap = NULL;
+    memset(proc->vmas, 0, sizeof(proc->vmas));
+    if(proc == current_proc)
+    {
+        vm_switch(proc);    // back on the kernel table before the root table is freed
+    }
+
+    for(int i = 0; i < 1024; i++)
+    {
+        uint32_t l1 = table[i];
+        //kernel megapages are leaves, only second level tables belong to the process
+        if(!(l1 & PAGE_V) || (l1 & (PAGE_R | PAGE_W | PAGE_X)))
+        {
+            continue;
+        }
+        uint32_t *pt = (uint32_t *)PTE_PADDR(l1);
+        for(int j = 0; j < 1024; j++)
+        {
+            if((pt[j] & PAGE_V) && (pt[j] & PAGE_OWNED))
+            {
+                free((void *)PTE_PADDR(pt[j]));
+            }
+            else if(pt[j] & PAGE_SWAPPED)
+            {
+                zram_free(pt[j]);
+            }
+        }
+        free(pt);
+    }
+    free(table);
+    free(vdso);
+}
+
+/*
+    Populate the page at va of a lazily loaded region. Whole pages of read-only file data are mapped straight
+    from the initrd; other pages get a fresh frame, with the file bytes copied in and only the rest (the BSS
+    tail, or all of an anonymous page) zeroed. Pages swapped out to zram are brought back, and a page whose
+    accessed bit zram cleared gets it set again.
+    Parameters:
+        struct process *proc: faulting process
+        vaddr_t va: faulting address (stval)
+        uint32_t scause: SCAUSE_*_PAGE_FAULT
+    returns:
+        int: 0 if the page was mapped, -1 if the access is invalid
+*/
+int vm_fault(struct process *proc, vaddr_t va, uint32_t scause)
+{
+    if(vm_kernel_megapage(va))
+    {
+        return -1;  // a device range, never user memory
+    }
+    //entries already there carry their permissions, those of mappings without a vma (fs_mmap()) included
+    vaddr_t page = va & ~(PAGE_SIZE - 1);
+    uint32_t need = scause == SCAUSE_STORE_PAGE_FAULT ? PAGE_W : scause == SCAUSE_INST_PAGE_FAULT ? PAGE_X : PAGE_R;
+    uint32_t *pte = proc->page_table ? vm_walk(proc->page_table, page, false) : NULL;
+    if(pte && (*pte & (PAGE_V | PAGE_SWAPPED)) && !(*pte & need))
+    {
+        return -1;  // protection fault
+    }
+    if(pte && (*pte & PAGE_V))
+    {
+        //zram cleared the accessed bit, or another hart mapped the page after the access
+        *pte |= PAGE_A | (need == PAGE_W ? PAGE_D : 0);
+        tlb_flush_local(proc, page);
+        return 0;
+    }
+    if(pte && (*pte & PAGE_SWAPPED))
+    {
+        zram_swap_in(pte, page);
+        tlb_flush_local(proc, page);
+        return 0;
+    }
+
+    struct vm_area *vma = NULL;
+    for(int i = 0; i < PROC_VMAS; i++)
+    {
+        if(proc->vmas[i].start && proc->vmas[i].start <= va && va < proc->vmas[i].end)
+        {
+            vma = &proc->vmas[i];
+            break;
+        }
+    }
+    if(!vma
+        || (scause == SCAUSE_STORE_PAGE_FAULT && !(vma->flags & PAGE_W))
+        || (scause == SCAUSE_INST_PAGE_FAULT && !(vma->flags & PAGE_X)))
+    {
+        return -1;
+    }
+
+    uint32_t *table = vm_table_of(proc);
+    uint32_t flags = vma->flags | PAGE_U;
+    //file backed bytes of this page are [lo, hi)
+    vaddr_t lo = page, hi = page;
+    if(vma->file_data)
+    {
+        vaddr_t file_end = vma->file_start + vma->file_size;
+        lo = page > vma->file_start ? page : vma->file_start;
+        hi = page + PAGE_SIZE < file_end ? page + PAGE_SIZE : file_end;
+        if(hi < lo)
+        {
+            hi = lo;
+        }
+    }
+    const uint8_t *src = vma->file_data + (lo - vma->file_start);
+
+    if(lo == page && hi == page + PAGE_SIZE && !(flags & PAGE_W) && is_aligned((paddr_t)src, PAGE_SIZE))
+    {
+        map_page(table, page, (paddr_t)src, flags);
+    }
+    else
+    {
+        uint8_t *frame = alloc_pages(1);
+        memset(frame, 0, lo - page);
+        memcpy(frame + (lo - page), src, hi - lo);
+        memset(frame + (hi - page), 0, page + PAGE_SIZE - hi);
+        map_page(table, page, (paddr_t)frame, flags | PAGE_OWNED);
+    }
+    tlb_flush_local(proc, page);
+    return 0;
+}
+
+//a user buffer must lie entirely below the kernel and outside the device megapages in the user range;
+//the pages themselves are faulted in on access
+bool user_range_ok(const void *ptr, uint32_t len)
+{
+    vaddr_t va = (vaddr_t)ptr;
+    if(va < USER_BASE || va > USER_END || len > USER_END - va)
+    {
+        return false;
+    }
+    for(vaddr_t mp = va & ~(MEGAPAGE_SIZE - 1); mp < va + len; mp += MEGAPAGE_SIZE)
+    {
+        if(vm_kernel_megapage(mp))
+        {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include "kernel.h"
+#include "vdso.h"
+
+/*
+    Sv32 virtual memory. The kernel is identity mapped (VA == PA) with 4MB megapages, so pointers handed out by
+    alloc_pages() stay valid with paging on. A process runs on the kernel page table until it maps something
+    of its own, then it gets a private root table that starts as a copy of the kernel entries.
+*/
+#define PAGE_G              (1 << 5)    // global mapping, present in every address space
+#define PAGE_A              (1 << 6)    // accessed
+#define PAGE_D              (1 << 7)    // dirty
+#define PAGE_OWNED          (1 << 8)    // software bit: the frame was allocated for this mapping and is freed on unmap
+#define PAGE_SWAPPED        (1 << 9)    // software bit, PAGE_V clear: the page is in zram, the PPN field is its slot
+#define SSTATUS_SUM         (1u << 18)  // supervisor may access PAGE_U pages
+
+#define MEGAPAGE_SIZE       (4 * 1024 * 1024)
+#define PTE_PPN_SHIFT       10
+#define VPN1(va)            (((va) >> 22) & 0x3ff)
+#define VPN0(va)            (((va) >> 12) & 0x3ff)
+#define PTE_PADDR(pte)      (((pte) >> PTE_PPN_SHIFT) * PAGE_SIZE)
+
+#define USER_BASE           0x00001000  // page 0 stays unmapped to catch NULL pointers
+#define USER_END            0x80000000  // RAM starts here and is kernel only
+#define USER_STACK_SIZE     (64 * 1024) // populated on demand like the ELF segments
+#define USER_STACK_TOP      USER_END
+#define MMAP_BASE           0x40000000  // first address handed out by mmap, ELF segments must end below it
+#define MMAP_END            VDSO_ADDR   // the vDSO data page sits between the mmap area and the user stack
+
+extern uint32_t *kernel_page_table;
+
+void vm_map_kernel_range(paddr_t start, paddr_t end, uint32_t flags);
+void vm_init(void);
+uint32_t *vm_table_of(struct process *proc);
+bool vm_kernel_megapage(vaddr_t va);
+uint32_t *vm_walk(uint32_t *table, vaddr_t va, bool alloc);
+void map_page(uint32_t *table, vaddr_t va, paddr_t pa, uint32_t flags);
+void vm_unmap(struct process *proc, vaddr_t va, uint32_t len);
+vaddr_t vm_reserve(struct process *proc, uint32_t len);
+vaddr_t vm_mmap_anon(struct process *proc, uint32_t len, int prot);
+vaddr_t vm_sbrk(struct process *proc, int incr);
+void vm_switch(struct process *next);
+void vm_free(struct process *proc);
+int vm_fault(struct process *proc, vaddr_t va, uint32_t scause);
+bool user_range_ok(const void *ptr, uint32_t len);
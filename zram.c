@@ -0,0 +1,541 @@
+#include "zram.h"
+#include "vm.h"
+#include "tlb.h"
+#include "uring.h"
+
+//a swapped out page, found through the slot number in its page table entry
+struct zram_slot
+{
+    uint32_t value;                     // same-filled: the word; compressed: pool page << 8 | first chunk
+    uint16_t size;                      // compressed bytes, 0 for a same-filled page
+    uint16_t next_free;                 // free slots: next free slot + 1, 0 ends the list
+};
+
+//a page of the compressed pool
+struct zram_pool_page
+{
+    uint8_t *data;                      // NULL while the descriptor is unused
+    uint32_t map[ZRAM_CHUNKS / 32];     // bit set: chunk in use
+    uint32_t free_chunks;
+};
+
+//what zram_dump() prints
+struct zram_stats
+{
+    uint32_t stored;                    // pages swapped out right now
+    uint32_t same;                      // of which same-filled
+    uint32_t bytes;                     // compressed bytes of the others
+    uint32_t pool_pages;
+    uint32_t swap_outs;
+    uint32_t swap_ins;
+    uint32_t rejected;                  // pages that did not compress well enough
+    uint32_t aged;                      // accessed bits cleared
+};
+
+//Not cleared at boot: slots and pool descriptors below the high-water marks have been initialised
+__attribute__((section(".noinit"))) static struct zram_slot slots[ZRAM_SLOTS];
+__attribute__((section(".noinit"))) static struct zram_pool_page pool[ZRAM_POOL_PAGES];
+static uint32_t nr_slots;
+static uint32_t free_slots;             // first free slot + 1, 0 if the list is empty
+static uint32_t nr_pool;
+static struct zram_stats stats;
+
+//compressor state; no need to clear it per page, a candidate match is always verified against the data
+static uint16_t lz_table[1 << ZRAM_LZ_HASH_BITS];
+static uint8_t zbuf[ZRAM_MAX_OBJECT];
+
+//clock hand of the reclaim sweep
+static int hand_proc;
+static vaddr_t hand_va = USER_BASE;
+
+static uint32_t load32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+//append the continuation of a length: 255 while at least that much is left, then the rest
+static bool put_len(uint8_t *dst, uint32_t *op, uint32_t cap, uint32_t len)
+{
+    while(*op < cap)
+    {
+        uint8_t b = len >= 255 ? 255 : len;
+        dst[(*op)++] = b;
+        if(b < 255)
+        {
+            return true;
+        }
+        len -= 255;
+    }
+    return false;
+}
+
+/*
+    Append one sequence: a token (literal count << 4 | match length - 4, 15 = continued), the literals, then the
+    2-byte match offset. The last sequence of a page has no match (mlen = 0) and ends the stream.
+    returns:
+        bool: false if dst is full
+*/
+static bool put_seq(uint8_t *dst, uint32_t *op, uint32_t cap, const uint8_t *lit, uint32_t nlit, uint32_t offset,
+    uint32_t mlen)
+{
+    uint32_t m = mlen ? mlen - 4 : 0;
+    if(*op >= cap)
+    {
+        return false;
+    }
+    dst[(*op)++] = (nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15);
+    if(nlit >= 15 && !put_len(dst, op, cap, nlit - 15))
+    {
+        return false;
+    }
+    if(nlit > cap - *op)
+    {
+        return false;
+    }
+    memcpy(dst + *op, lit, nlit);
+    *op += nlit;
+    if(!mlen)
+    {
+        return true;
+    }
+    if(cap - *op < 2)
+    {
+        return false;
+    }
+    dst[(*op)++] = offset;
+    dst[(*op)++] = offset >> 8;
+    return m < 15 || put_len(dst, op, cap, m - 15);
+}
+
+/*
+    LZ77 compression of one page, greedy, with a hash table of 4-byte sequences.
+    returns:
+        uint32_t: compressed size, 0 if it does not fit into cap bytes
+*/
+static uint32_t lz_compress(const uint8_t *src, uint8_t *dst, uint32_t cap)
+{
+    uint32_t ip = 0, anchor = 0, op = 0;
+    while(ip + 4 <= PAGE_SIZE)
+    {
+        uint32_t seq = load32(src + ip);
+        uint32_t h = (seq * 2654435761u) >> (32 - ZRAM_LZ_HASH_BITS);
+        uint32_t ref = lz_table[h];
+        lz_table[h] = ip;
+        if(ref >= ip || load32(src + ref) != seq)
+        {
+            ip++;
+            continue;
+        }
+        uint32_t len = 4;
+        while(ip + len < PAGE_SIZE && src[ref + len] == src[ip + len])
+        {
+            len++;
+        }
+        if(!put_seq(dst, &op, cap, src + anchor, ip - anchor, ip - ref, len))
+        {
+            return 0;
+        }
+        ip += len;
+        anchor = ip;
+    }
+    return put_seq(dst, &op, cap, src + anchor, PAGE_SIZE - anchor, 0, 0) ? op : 0;
+}
+
+//read the continuation of a length
+static uint32_t get_len(const uint8_t *src, uint32_t *ip, uint32_t n)
+{
+    uint32_t len = 0;
+    uint8_t b = 255;
+    while(b == 255 && *ip < n)
+    {
+        b = src[(*ip)++];
+        len += b;
+    }
+    return len;
+}
+
+//inverse of lz_compress(); panics on a stream that does not decode to exactly one page
+static void lz_decompress(const uint8_t *src, uint32_t n, uint8_t *dst)
+{
+    uint32_t ip = 0, op = 0;
+    while(ip < n)
+    {
+        uint8_t token = src[ip++];
+        uint32_t nlit = token >> 4;
+        if(nlit == 15)
+        {
+            nlit += get_len(src, &ip, n);
+        }
+        if(nlit > n - ip || nlit > PAGE_SIZE - op)
+        {
+            break;
+        }
+        memcpy(dst + op, src + ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if(ip == n)
+        {
+            break;      // the last sequence has no match
+        }
+        if(n - ip < 2)
+        {
+            break;
+        }
+        uint32_t offset = src[ip] | src[ip + 1] << 8;
+        ip += 2;
+        uint32_t mlen = (token & 15) + 4;
+        if((token & 15) == 15)
+        {
+            mlen += get_len(src, &ip, n);
+        }
+        if(!offset || offset > op || mlen > PAGE_SIZE - op)
+        {
+            break;
+        }
+        //byte by byte: the match may overlap the bytes it produces
+        for(uint32_t i = 0; i < mlen; i++, op++)
+        {
+            dst[op] = dst[op - offset];
+        }
+    }
+    if(ip != n || op != PAGE_SIZE)
+    {
+        PANIC("zram: corrupt compressed page");
+    }
+}
+
+//the word the whole page is filled with, through *value; false if the page holds anything else
+static bool same_filled(const uint32_t *page, uint32_t *value)
+{
+    for(uint32_t i = 1; i < PAGE_SIZE / 4; i++)
+    {
+        if(page[i] != page[0])
+        {
+            return false;
+        }
+    }
+    *value = page[0];
+    return true;
+}
+
+//mark k chunks of a pool page used or free
+static void pool_mark(struct zram_pool_page *p, uint32_t first, uint32_t k, bool used)
+{
+    for(uint32_t c = first; c < first + k; c++)
+    {
+        if(used)
+        {
+            p->map[c / 32] |= 1u << (c % 32);
+        }
+        else
+        {
+            p->map[c / 32] &= ~(1u << (c % 32));
+        }
+    }
+    p->free_chunks = used ? p->free_chunks - k : p->free_chunks + k;
+}
+
+//first run of k free chunks in p, -1 if there is none
+static int pool_find(struct zram_pool_page *p, uint32_t k)
+{
+    uint32_t run = 0;
+    for(uint32_t c = 0; c < ZRAM_CHUNKS; c++)
+    {
+        run = (p->map[c / 32] & (1u << (c % 32))) ? 0 : run + 1;
+        if(run == k)
+        {
+            return c + 1 - k;
+        }
+    }
+    return -1;
+}
+
+/*
+    Find room for size bytes in the pool, first fit. A new pool page is made out of *spare, the frame just
+    swapped out, which is then no longer the caller's to free; so the pool never allocates under memory pressure.
+    returns:
+        bool: true with the handle (pool page << 8 | first chunk) in *handle, false if the pool is full
+*/
+static bool pool_alloc(uint32_t size, void **spare, uint32_t *handle)
+{
+    uint32_t k = (size + ZRAM_CHUNK_SIZE - 1) >> ZRAM_CHUNK_SHIFT;
+    uint32_t unused = nr_pool;
+    for(uint32_t i = 0; i < nr_pool; i++)
+    {
+        struct zram_pool_page *p = &pool[i];
+        if(!p->data)
+        {
+            unused = unused < nr_pool ? unused : i;
+            continue;
+        }
+        int first = p->free_chunks >= k ? pool_find(p, k) : -1;
+        if(first >= 0)
+        {
+            pool_mark(p, first, k, true);
+            *handle = i << 8 | first;
+            return true;
+        }
+    }
+    if(!*spare || unused == ZRAM_POOL_PAGES)
+    {
+        return false;
+    }
+    if(unused == nr_pool)
+    {
+        nr_pool++;
+    }
+    struct zram_pool_page *p = &pool[unused];
+    p->data = *spare;
+    *spare = NULL;
+    memset(p->map, 0, sizeof(p->map));
+    p->free_chunks = ZRAM_CHUNKS;
+    pool_mark(p, 0, k, true);
+    stats.pool_pages++;
+    *handle = unused << 8;
+    return true;
+}
+
+//give the chunks of a compressed page back, and the pool page once it is empty
+static void pool_release(uint32_t handle, uint32_t size)
+{
+    struct zram_pool_page *p = &pool[handle >> 8];
+    pool_mark(p, handle & 0xff, (size + ZRAM_CHUNK_SIZE - 1) >> ZRAM_CHUNK_SHIFT, false);
+    if(p->free_chunks == ZRAM_CHUNKS)
+    {
+        free(p->data);
+        p->data = NULL;
+        stats.pool_pages--;
+    }
+}
+
+//a free slot number, ZRAM_SLOTS if all are taken
+static uint32_t slot_alloc(void)
+{
+    if(free_slots)
+    {
+        uint32_t s = free_slots - 1;
+        free_slots = slots[s].next_free;
+        return s;
+    }
+    return nr_slots < ZRAM_SLOTS ? nr_slots++ : ZRAM_SLOTS;
+}
+
+static void slot_free(uint32_t s)
+{
+    slots[s].next_free = free_slots;
+    free_slots = s + 1;
+}
+
+/*
+    Store the page in frame, whose mapping has been removed and flushed from every TLB.
+    Parameters:
+        void *frame: the page
+        uint32_t *slot: receives the slot number
+        void **spare: the frame itself, set to NULL if the pool took it as a pool page
+    returns:
+        bool: false if the page is not worth storing or zram is full
+*/
+static bool store(void *frame, uint32_t *slot, void **spare)
+{
+    uint32_t s = slot_alloc();
+    if(s == ZRAM_SLOTS)
+    {
+        return false;
+    }
+    struct zram_slot *z = &slots[s];
+    if(same_filled(frame, &z->value))
+    {
+        z->size = 0;
+        stats.same++;
+    }
+    else
+    {
+        uint32_t size = lz_compress(frame, zbuf, ZRAM_MAX_OBJECT);
+        if(!size)
+        {
+            stats.rejected++;
+            slot_free(s);
+            return false;
+        }
+        //copied out of zbuf before the frame may turn into the pool page that receives it
+        if(!pool_alloc(size, spare, &z->value))
+        {
+            slot_free(s);
+            return false;
+        }
+        memcpy(pool[z->value >> 8].data + ((z->value & 0xff) << ZRAM_CHUNK_SHIFT), zbuf, size);
+        z->size = size;
+        stats.bytes += size;
+    }
+    stats.stored++;
+    stats.swap_outs++;
+    *slot = s;
+    return true;
+}
+
+/*
+    Swap out the victims of one process, whose entries were cleared and flushed. A victim that cannot be stored
+    gets its entry back; whoever faulted on it meanwhile is waiting for the kernel lock and finds it mapped.
+    returns:
+        uint32_t: frames freed
+*/
+static uint32_t swap_out(uint32_t **ptes, uint32_t *saved, uint32_t n)
+{
+    uint32_t freed = 0;
+    for(uint32_t i = 0; i < n; i++)
+    {
+        void *frame = (void *)PTE_PADDR(saved[i]);
+        void *spare = frame;
+        uint32_t s;
+        if(!store(frame, &s, &spare))
+        {
+            *ptes[i] = saved[i] | PAGE_A;
+            continue;
+        }
+        *ptes[i] = (s << PTE_PPN_SHIFT) | (saved[i] & (PAGE_R | PAGE_W | PAGE_X | PAGE_U)) | PAGE_SWAPPED;
+        if(spare)
+        {
+            free(spare);
+            freed++;
+        }
+    }
+    return freed;
+}
+
+/*
+    Sweep the anonymous user pages with the clock hand until want frames are free again or two full sweeps found
+    nothing more. Called by alloc_pages() when it runs out of memory.
+    Parameters:
+        uint32_t want: frames the caller needs
+    returns:
+        uint32_t: frames freed, 0 if there was nothing left to swap out
+*/
+uint32_t zram_reclaim(uint32_t want)
+{
+    uint32_t freed = 0;
+    int wraps = 0;
+    want += ZRAM_RECLAIM_BATCH;
+    while(freed < want && wraps < 2)
+    {
+        if(hand_proc >= nr_procs)
+        {
+            hand_proc = 0;
+            hand_va = USER_BASE;
+            wraps++;
+            continue;
+        }
+        struct process *proc = &procs[hand_proc];
+        uint32_t *table = proc->page_table;
+        if((proc->state != PROC_RUNNABLE && proc->state != PROC_BLOCKED) || !table || uring_pins_pages(proc))
+        {
+            hand_proc++;
+            continue;
+        }
+
+        //one batch: accessed bits cleared and victims unmapped, then a single TLB shootdown
+        struct tlb_batch b;
+        tlb_batch_init(&b, proc);
+        uint32_t *ptes[ZRAM_RECLAIM_BATCH];
+        uint32_t saved[ZRAM_RECLAIM_BATCH];
+        uint32_t n = 0;
+        vaddr_t va = hand_va;
+        while(va < USER_END && n < ZRAM_RECLAIM_BATCH)
+        {
+            uint32_t l1 = table[VPN1(va)];
+            if(!(l1 & PAGE_V) || (l1 & (PAGE_R | PAGE_W | PAGE_X)))
+            {
+                va = (va & ~(MEGAPAGE_SIZE - 1)) + MEGAPAGE_SIZE;
+                continue;
+            }
+            uint32_t *pte = vm_walk(table, va, false);
+            if((*pte & PAGE_V) && (*pte & PAGE_OWNED) && (*pte & PAGE_U))
+            {
+                if(*pte & PAGE_A)
+                {
+                    *pte &= ~PAGE_A;    // second chance
+                    stats.aged++;
+                }
+                else
+                {
+                    ptes[n] = pte;
+                    saved[n++] = *pte;
+                    *pte = 0;
+                }
+                tlb_batch_add(&b, va, NULL);
+            }
+            va += PAGE_SIZE;
+        }
+        tlb_batch_flush(&b);
+        freed += swap_out(ptes, saved, n);
+
+        hand_va = va;
+        if(va >= USER_END)
+        {
+            hand_proc++;
+            hand_va = USER_BASE;
+        }
+    }
+    return freed;
+}
+
+/*
+    Bring a swapped out page back into a new frame and map it again. The caller flushes the TLB entry.
+    Parameters:
+        uint32_t *pte: the PAGE_SWAPPED entry
+        vaddr_t va: the page
+*/
+void zram_swap_in(uint32_t *pte, vaddr_t va)
+{
+    uint32_t e = *pte;
+    uint32_t *frame = alloc_pages(1);
+    struct zram_slot *z = &slots[e >> PTE_PPN_SHIFT];
+    if(*pte != e)
+    {
+        PANIC("zram: entry of %x changed while swapping in", va);   // alloc_pages() may reclaim, but not this page
+    }
+    if(!z->size)
+    {
+        for(uint32_t i = 0; i < PAGE_SIZE / 4; i++)
+        {
+            frame[i] = z->value;
+        }
+    }
+    else
+    {
+        lz_decompress(pool[z->value >> 8].data + ((z->value & 0xff) << ZRAM_CHUNK_SHIFT), z->size, (uint8_t *)frame);
+    }
+    zram_free(e);
+    stats.swap_ins++;
+    *pte = (((paddr_t)frame / PAGE_SIZE) << PTE_PPN_SHIFT) | (e & (PAGE_R | PAGE_W | PAGE_X | PAGE_U))
+        | PAGE_OWNED | PAGE_A | PAGE_D | PAGE_V;
+}
+
+//drop the copy behind a PAGE_SWAPPED entry, e.g. when the page is unmapped or its process exits
+void zram_free(uint32_t pte)
+{
+    uint32_t s = pte >> PTE_PPN_SHIFT;
+    struct zram_slot *z = &slots[s];
+    if(z->size)
+    {
+        pool_release(z->value, z->size);
+        stats.bytes -= z->size;
+    }
+    else
+    {
+        stats.same--;
+    }
+    stats.stored--;
+    slot_free(s);
+}
+
+//print how many pages are swapped out and what they cost
+void zram_dump(void)
+{
+    uint32_t compressed = stats.stored - stats.same;
+    printf("zram: %d pages stored (%d same-filled, %d compressed into %d bytes) in %d pool pages\n", stats.stored,
+        stats.same, compressed, stats.bytes, stats.pool_pages);
+    //pages stored per page of RAM they take, in tenths
+    uint32_t ratio = stats.pool_pages ? stats.stored * 10 / stats.pool_pages : 0;
+    printf("zram: %d.%d pages per pool page, %d swapped out, %d swapped in, %d incompressible, %d accessed bits cleared\n",
+        ratio / 10, ratio % 10, stats.swap_outs, stats.swap_ins, stats.rejected, stats.aged);
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "kernel.h"
+
+/*
+    Compressed swap in RAM. When alloc_pages() runs dry, zram_reclaim() sweeps the anonymous pages of user
+    processes (frames owned by their mapping) with a clock hand: a page whose accessed bit is set gets it cleared
+    and a second chance, a page still unaccessed since the last sweep is cold and swapped out. Pages filled with
+    one repeated word are kept as that word alone; the others are compressed with a small LZ77 codec into a pool
+    of 32-byte chunks carved out of pool pages. The page table entry keeps the permission bits, loses PAGE_V and
+    gets PAGE_SWAPPED with the slot number in the PPN field; the next access faults and vm_fault() brings the page
+    back through zram_swap_in(). Pages that do not compress to ZRAM_MAX_OBJECT bytes stay where they are.
+    Everything here runs under the kernel lock.
+*/
+#define ZRAM_SLOTS          32768       // pages that can be swapped out at once
+#define ZRAM_POOL_PAGES     4096        // pool pages, i.e. at most 16MB of compressed data
+#define ZRAM_CHUNK_SHIFT    5
+#define ZRAM_CHUNK_SIZE     (1 << ZRAM_CHUNK_SHIFT)             // pool allocation unit
+#define ZRAM_CHUNKS         (PAGE_SIZE / ZRAM_CHUNK_SIZE)       // chunks per pool page
+#define ZRAM_MAX_OBJECT     (PAGE_SIZE * 3 / 4) // larger compressed pages are not worth swapping
+#define ZRAM_RECLAIM_BATCH  32          // pages a reclaim pass tries to free beyond the request
+#define ZRAM_LZ_HASH_BITS   12
+
+uint32_t zram_reclaim(uint32_t want);
+void zram_swap_in(uint32_t *pte, vaddr_t va);
+void zram_free(uint32_t pte);
+void zram_dump(void);